@@ -1,5 +1,6 @@
 #include <arm-env.h>
 #include <arm-cpu.h>
+#include <decode.h>
 #include <devices/coco.h>
 #include <devices/debug-coprocessor.h>
 
@@ -39,10 +40,44 @@ bool arm_environment::prepare_boot_cpu(CPU* core)
 	arm_core->reg_offsets.RB[2]  = 0x100;	// Device Tree / ATAGs
 	arm_core->reg_offsets.RB[12] = core->cpu_data().entrypoint;		// Kernel Entry Point
 	arm_core->reg_offsets.RB[15] = 0;		// Start Address
+
+	// Calls leave their return address in the link register.
+	core->tagged_registers().LR = &arm_core->reg_offsets.RB[14];
 	
 	return true;
 }
 
+bool arm_environment::is_call_instruction(uint8_t isa, const Decode *insn) const
+{
+	if (isa == 0) {
+		uint32_t ir = *(uint32_t *)(0x100000000ULL | insn->pc);
+
+		// BLX <label>, in the unconditional space
+		if ((ir & 0xfe000000) == 0xfa000000) return true;
+
+		// BL <label>
+		if ((ir >> 28) != 0xf && ((ir >> 24) & 0xf) == 0xb) return true;
+
+		// BLX <Rm>
+		return (ir & 0x0ffffff0) == 0x012fff30;
+	} else {
+		uint16_t hw1 = *(uint16_t *)(0x100000000ULL | insn->pc);
+
+		if (insn->length == 4) {
+			uint16_t hw2 = *(uint16_t *)(0x100000000ULL | (insn->pc + 2));
+
+			// BL <label> and BLX <label>
+			return (hw1 & 0xf800) == 0xf000 && ((hw2 & 0xd000) == 0xd000 || (hw2 & 0xd000) == 0xc000);
+		}
+
+		// The second half of a Thumb-1 BL or BLX <label> pair
+		if ((hw1 & 0xf800) == 0xf800 || (hw1 & 0xf800) == 0xe800) return true;
+
+		// BLX <Rm>
+		return (hw1 & 0xff87) == 0x4780;
+	}
+}
+
 bool arm_environment::prepare_bootloader()
 {
 	volatile uint32_t *mem = (volatile uint32_t *)0;
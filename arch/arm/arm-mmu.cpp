@@ -73,6 +73,15 @@ bool arm_mmu::disable()
 	return true;
 }
 
+void arm_mmu::context_switched(uint32_t context_id)
+{
+	// The ASID is the bottom byte of CONTEXTIDR.  TTBR0 may be written
+	// either side of it (Linux writes it after), so it can't be part of the
+	// key, but the shadow mappings are faulted in from the live translation
+	// table anyway.
+	switch_address_space(context_id & 0xff);
+}
+
 arm_mmu_v5::arm_mmu_v5(arm_cpu& cpu) : arm_mmu(cpu)
 {
 
@@ -1,6 +1,6 @@
 #include <devices/coco.h>
 #include <arm-cpu.h>
-#include <mmu.h>
+#include <arm-mmu.h>
 #include <printf.h>
 
 using namespace captive::arch::arm;
@@ -75,7 +75,12 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 	}
 	
 	case 7:
-		cpu.mmu().invalidate_virtual_mappings();
+		// Guest memory is always coherent, and writes to translated code are
+		// caught by write protection, so only the operations that invalidate
+		// the I$ need to do anything: they drop what the CPU has cached about
+		// the translations of the whole address space, or of the page that
+		// holds the line.  Set/way operations can't be tied to an address,
+		// so they drop everything.
 		switch (rm) {
 		case 0:
 			switch (op2) {
@@ -89,8 +94,10 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 			switch (op1) {
 			case 0:
 				switch (op2) {
-				case 0:
-				case 6:
+				case 0:		// Invalidate entire I$	(Inner Shareable)
+					cpu.invalidate_virtual_mappings();
+					return true;
+				case 6:		// Flush BT$	(Inner Shareable)
 					return true;
 				}
 				break;
@@ -100,12 +107,15 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 		case 5:
 			switch (op2) {
 			case 0:		// Invalidate entire I$
+				cpu.invalidate_virtual_mappings();
 				return true;
 
 			case 1:		// Invalidate I$ LINE	(MVA)
+				cpu.invalidate_virtual_mapping(data);
 				return true;
 
 			case 2:		// Invalidate I$ LINE	(SET/WAY)
+				cpu.invalidate_virtual_mappings();
 				return true;
 
 			case 4:		// Flush prefetch buffer
@@ -133,10 +143,13 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 		case 7:
 			switch (op2) {
 			case 0:		// Invalidate unified $
+				cpu.invalidate_virtual_mappings();
 				return true;
 			case 1:		// Invalidate unified $ line	(MVA)
+				cpu.invalidate_virtual_mapping(data);
 				return true;
 			case 2:		// Invalidate unified $ line	(SET/WAY)
+				cpu.invalidate_virtual_mappings();
 				return true;
 			}
 			break;
@@ -192,10 +205,13 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 		case 15:
 			switch (op2) {
 			case 0:		// Clean and Invalidate entire unified $
+				cpu.invalidate_virtual_mappings();
 				return true;
 			case 1:		// Clean and Invalidate unified $ line	(MVA)
+				cpu.invalidate_virtual_mapping(data);
 				return true;
 			case 2:		// Clean and Invalidate unified $ line	(SET/WAY)
+				cpu.invalidate_virtual_mappings();
 				return true;
 			}
 			break;
@@ -204,11 +220,25 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 		
 	case 8:
 		switch (rm) {
-		case 5:
-		case 6:
-		case 7:
-			cpu.mmu().invalidate_virtual_mappings();
-			return true;
+		case 3:		// Inner shareable TLB
+		case 5:		// I-TLB
+		case 6:		// D-TLB
+		case 7:		// Unified TLB
+			switch (op2) {
+			case 0:		// Invalidate entire TLB
+				cpu.mmu().invalidate_virtual_mappings();
+				return true;
+
+			case 1:		// Invalidate TLB entry	(MVA)
+			case 3:		// Invalidate TLB entry	(MVA, all ASIDs)
+				cpu.mmu().invalidate_virtual_mapping(data & ~0xfffU);
+				return true;
+
+			case 2:		// Invalidate TLB entries	(ASID)
+				cpu.mmu().invalidate_address_space(data & 0xff);
+				return true;
+			}
+			break;
 		}
 		break;
 		
@@ -269,6 +299,7 @@ bool CoCo::mcr(CPU& cpu, uint32_t op1, uint32_t op2, uint32_t rn, uint32_t rm, u
 				switch (op2) {
 				case 1:
 					CONTEXT_ID = data;
+					((arm_mmu&)cpu.mmu()).context_switched(data);
 					return true;
 				case 4:
 					TPID = data;
@@ -27,6 +27,7 @@ namespace captive {
 				virtual ~arm_environment();
 
 				CPU *create_cpu() override;
+				bool is_call_instruction(uint8_t isa, const Decode *insn) const override;
 				
 				inline arm_variant variant() const { return _variant; }
 
@@ -35,6 +35,13 @@ namespace captive {
 				}
 				
 				static MMU *create(arm_cpu& cpu);
+
+				/**
+				 * Called when the guest writes CONTEXTIDR, which ends a context
+				 * switch, to make the shadow page tables of the new context
+				 * active.
+				 */
+				void context_switched(uint32_t context_id);
 				
 			protected:
 				devices::CoCo& _coco;
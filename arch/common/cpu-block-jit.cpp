@@ -1,10 +1,12 @@
 #include <cpu.h>
 #include <decode.h>
 #include <disasm.h>
+#include <env.h>
 #include <jit.h>
 #include <safepoint.h>
 #include <jit/translation-context.h>
 #include <jit/block-compiler.h>
+#include <jit/block-interpreter.h>
 #include <shared-jit.h>
 
 #include <profile/image.h>
@@ -38,6 +40,11 @@ bool CPU::run_block_jit()
 	if (rc > 0) {
 		// Make sure interrupts are enabled.
 		__local_irq_enable();
+
+		// The path being recorded was cut short by the fault.
+		if (recording_superblock) {
+			end_superblock_recording();
+		}
 	}
 
 	return run_block_jit_safepoint();
@@ -59,14 +66,22 @@ bool CPU::run_block_jit_safepoint()
 			if (handle_irq(cpu_data().isr)) {
 				jit_state.exit_chain = 0;
 				cpu_data().interrupts_taken++;
+
+				if (unlikely(recording_superblock)) {
+					end_superblock_recording();
+				}
 			}
 		}
 
 		// Check to see if there are any pending actions coming in from
 		// the hypervisor.
 		if (unlikely(cpu_data().async_action)) {
-			if (handle_pending_action(cpu_data().async_action)) {
-				cpu_data().async_action = 0;
+			// Take the action atomically, so that one posted while this one is
+			// being handled is not cleared along with it.  An action we don't
+			// understand is left pending, unless it has been superseded.
+			uint32_t action = __atomic_exchange_n(&cpu_data().async_action, 0, __ATOMIC_SEQ_CST);
+			if (!handle_pending_action(action)) {
+				__sync_bool_compare_and_swap(&cpu_data().async_action, 0, action);
 			}
 		}
 		
@@ -81,6 +96,10 @@ bool CPU::run_block_jit_safepoint()
 
 			// If there was a fault, then switch back to the safe-point.
 			if (unlikely(fault)) {
+				if (unlikely(recording_superblock)) {
+					end_superblock_recording();
+				}
+
 				if (!handle_mmu_fault(fault)) return false;
 				continue;
 			}
@@ -89,24 +108,86 @@ bool CPU::run_block_jit_safepoint()
 			should_mark = true;
 
 			rgn = image->get_region(phys_pc);
+			rgn->note_virt_page(PAGE_ADDRESS_OF(virt_pc));
 			region_virt_base = PAGE_ADDRESS_OF(virt_pc);
 			region_phys_base = phys_pc & 0xfffff000;
 		}
+
+		// The page has been written to since its code was translated, so
+		// throw away any translations of code that was modified.
+		if (unlikely(rgn->dirty)) {
+			verify_region(rgn, region_phys_base);
+		}
 		
+		// An interpreted block has become warm, or a baseline translation has
+		// become hot, so compile it with the next tier.  It must be decoded in
+		// the same way it was first translated, so wait until the ISA matches
+		// again.
+		if (unlikely(jit_state.tier_up_request) && jit_state.tier_up_isa == *tagged_registers().ISA) {
+			jit_state.tier_up_request = 0;
+			tier_up_block(jit_state.tier_up_pa);
+		}
+
+		// A block has become hot, so record the path taken from here, by
+		// running each block with chaining disabled.
+		if (unlikely(jit_state.superblock_request)) {
+			jit_state.superblock_request = 0;
+			recording_superblock = true;
+		}
+
+		if (unlikely(recording_superblock)) {
+			record_superblock_member(virt_pc, PAGE_ADDRESS_OF(phys_pc) | PAGE_OFFSET_OF(virt_pc));
+		}
+
 		Block *blk = rgn->get_block(PAGE_OFFSET_OF(virt_pc));
-		if (blk->txln) {
-			auto ptr = block_txln_cache->entry_ptr(virt_pc >> 2);
+
+		// Enter the superblock headed by this block, if there is one, unless
+		// a path is being recorded.
+		captive::shared::block_txln_fn txln = blk->txln;
+		if (blk->superblock_txln && !recording_superblock) {
+			txln = blk->superblock_txln;
+		}
+
+		if (txln) {
+			int result;
+			auto ptr = block_txln_cache->insert(virt_pc >> 2, virt_pc, result);
+			if (result != block_txln_cache_t::HIT) {
+				cpu_data().chain_cache_misses++;
+
+				if (result == block_txln_cache_t::EVICTION) {
+					cpu_data().chain_cache_evictions++;
+				}
+			}
+
 			ptr->tag = virt_pc;
-			ptr->fn = (void *)blk->txln;
-			
-			step_ok = block_trampoline(&jit_state, (void*)blk->txln) == 0;	
+			ptr->fn = (void *)txln;
 		} else {
+			if (unlikely(malloc::code_alloc.needs_flush())) {
+				flush_code_cache();
+			}
+
 			blk->loop_header = true;
-			blk->txln = compile_block(blk, PAGE_ADDRESS_OF(phys_pc) | PAGE_OFFSET_OF(virt_pc), MODE_BLOCK);
+			blk->txln = compile_block(blk, PAGE_ADDRESS_OF(phys_pc) | PAGE_OFFSET_OF(virt_pc), BLOCK_INTERPRET_THRESHOLD ? MODE_BLOCK_INTERPRETED : (BLOCK_TIER_UP_THRESHOLD ? MODE_BLOCK_BASELINE : MODE_BLOCK));
 			mmu().disable_writes();
 
-			step_ok = block_trampoline(&jit_state, (void*)blk->txln) == 0;
+			txln = blk->txln;
 		}
+
+		// If we got here through the exit stub of a direct jump, link one of
+		// its slots so that next time it jumps straight to this block.
+		if (unlikely(jit_state.chain_exit_slots != NULL)) {
+			if (jit_state.chain_exit_pc == virt_pc) {
+				link_block_exit(rgn, virt_pc, txln, jit_state.chain_exit_links);
+			}
+
+			jit_state.chain_exit_slots = NULL;
+		}
+
+		if (unlikely(recording_superblock)) {
+			jit_state.exit_chain = 1;
+		}
+
+		step_ok = block_trampoline(&jit_state, (void*)txln) == 0;
 		
 		if (should_mark) {
 			should_mark = false;
@@ -118,46 +199,244 @@ bool CPU::run_block_jit_safepoint()
 	return true;
 }
 
+/**
+ * Records how much space the IR of a translation takes per guest instruction,
+ * as it is held during compilation and once it has been packed.  Every guest
+ * instruction starts with a barrier.
+ */
+static void record_ir_size(captive::shared::CompileStats *stats, const TranslationContext& ctx)
+{
+	for (uint32_t ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		if (ctx.at(ir_idx)->type == captive::shared::IRInstruction::BARRIER) stats->guest_insns++;
+	}
+
+	stats->ir_bytes += sizeof(captive::shared::IRInstruction) * ctx.count();
+	stats->packed_ir_bytes += ctx.packed_size();
+}
+
 captive::shared::block_txln_fn CPU::compile_block(Block *blk, gpa_t pa, block_compilation_mode mode)
 {
-	TranslationContext ctx(malloc::data_alloc);
-	if (!translate_block(ctx, pa)) {
+	Region *rgn = image->get_region(pa);
+
+	// An earlier run may already have translated this code, with the full
+	// optimisation pipeline.
+	captive::shared::block_txln_fn fn = load_stored_block(rgn, blk, pa, mode == MODE_BLOCK_BASELINE || mode == MODE_BLOCK_INTERPRETED ? MODE_BLOCK : mode, 0);
+	if (fn) {
+		blk->baseline = false;
+		blk->interpreted = false;
+		return fn;
+	}
+
+	captive::shared::CompileStats *stats = cpu_data().compile_stats;
+	uint64_t compile_start = stats ? __rdtsc() : 0;
+
+	// The IR is only needed until the translation has been compiled, and
+	// region translations keep a packed copy of theirs.
+	TranslationContext ctx(malloc::compile_alloc);
+	uint64_t code_granules = 0;
+	if (!translate_block(ctx, pa, code_granules)) {
 		fatal("jit: block translation failed\n");
 	}
 
-	bool emit_interrupt_check = mode == MODE_BLOCK;
-	bool emit_chaining_logic = mode == MODE_BLOCK;
+	if (stats) stats->record_phase(captive::shared::CompileStats::TRANSLATE, __rdtsc() - compile_start);
+
+	record_code_granules(rgn, blk, pa, code_granules);
+
+	if (mode == MODE_BLOCK_INTERPRETED) {
+		uint64_t predecode_start = stats ? __rdtsc() : 0;
+
+		void *data;
+		fn = BlockInterpreter::create(ctx, pa, *tagged_registers().ISA, &blk->exec_count, data);
+		if (fn) {
+			if (stats) {
+				stats->record_phase(captive::shared::CompileStats::PREDECODE, __rdtsc() - predecode_start);
+				stats->interpreted_blocks++;
+			}
+
+			if (blk->interpreter_data) BlockInterpreter::release(blk->interpreter_data);
+
+			blk->baseline = false;
+			blk->interpreted = true;
+			blk->dispatches = false;
+			blk->interpreter_data = data;
+
+			malloc::compile_alloc.reset();
+			return fn;
+		}
+
+		// The interpreter doesn't handle some of the IR, so compile it
+		// straight away.
+		mode = BLOCK_TIER_UP_THRESHOLD ? MODE_BLOCK_BASELINE : MODE_BLOCK;
+	}
+
+	bool block_mode = mode == MODE_BLOCK || mode == MODE_BLOCK_BASELINE;
+	bool emit_interrupt_check = block_mode;
+	bool emit_chaining_logic = block_mode;
 	
-	BlockCompiler compiler(ctx, pa, tagged_registers(), emit_interrupt_check, emit_chaining_logic);
-	captive::shared::block_txln_fn fn;
-	if (!compiler.compile(fn)) {
-		fatal("jit: block compilation failed\n");
+	// Block translations count their executions, so that baseline
+	// translations can be recompiled, and hot paths can be turned into
+	// superblocks.
+	uint32_t *exec_counter = block_mode ? &blk->exec_count : NULL;
+
+	BlockCompiler compiler(ctx, pa, tagged_registers(), emit_interrupt_check, emit_chaining_logic, exec_counter, &blk->outgoing_links);
+	compiler.record_stats(stats);
+
+	{
+		// Anything the compiler passes allocate is only needed until the
+		// translation has been stored.
+		malloc::ArenaScope scope(malloc::compile_alloc);
+
+		if (mode == MODE_BLOCK_BASELINE) {
+			if (!compiler.compile_baseline(fn)) {
+				fatal("jit: baseline block compilation failed\n");
+			}
+		} else if (!compiler.compile(fn)) {
+			fatal("jit: block compilation failed\n");
+		}
 	}
 
-	if (mode == MODE_BLOCK) {
-		malloc::data_alloc.free((void *)ctx.get_ir_buffer());
-	} else {
-		blk->ir_count = ctx.count();
-		blk->ir = ctx.get_ir_buffer();
+	if (stats) {
+		stats->record_latency(__rdtsc() - compile_start);
+		record_ir_size(stats, ctx);
+	}
+
+	blk->baseline = mode == MODE_BLOCK_BASELINE;
+	blk->interpreted = false;
+	blk->dispatches = captive::shared::StoredRelocation::any_direct_jumps(&compiler.relocations()[0], compiler.relocations().size());
+
+	if (!block_mode) {
+		if (blk->ir) malloc::data_alloc.free((void *)blk->ir);
+		blk->ir_size = ctx.pack(malloc::data_alloc, blk->ir);
 	}
 
+	// Baseline translations are short-lived, so only store the optimised
+	// translation that replaces them.
+	if (cpu_data().translation_store_enabled && mode != MODE_BLOCK_BASELINE) {
+		store_block(rgn, pa, mode, code_granules, compiler, fn, blk);
+	}
+
+	malloc::compile_alloc.reset();
+
 	return fn;
 }
 
-bool CPU::translate_block(TranslationContext& ctx, gpa_t pa)
+void CPU::tier_up_block(gpa_t pa)
 {
-	using namespace captive::shared;
+	Region *rgn = image->get_region(pa);
+	Block *blk = rgn->get_block(PAGE_OFFSET_OF(pa));
+
+	// The translation may have been thrown away since it asked to be
+	// recompiled.
+	if (!blk->txln || !(blk->baseline || blk->interpreted)) return;
+
+	// Recompilation is an optimisation, so don't flush the code cache for it.
+	if (malloc::code_alloc.needs_flush()) return;
+
+	// Interpreted blocks go on to the baseline compiler.
+	block_compilation_mode mode = blk->interpreted && BLOCK_TIER_UP_THRESHOLD ? MODE_BLOCK_BASELINE : MODE_BLOCK;
+
+	uint8_t *old_entry = (uint8_t *)blk->txln;
+	bool was_interpreted = blk->interpreted;
 
+	// The exits of the old translation are no longer linked, so that nothing
+	// refers to them once it has been retired.
+	Region::drop_outgoing_links(blk->outgoing_links);
+
+	captive::shared::block_txln_fn fn = compile_block(blk, pa, mode);
+
+	int64_t distance = (int64_t)fn - (int64_t)(old_entry + 5);
+	if (distance != (int32_t)distance || !blk->retire_entry(old_entry)) {
+		// The old translation can't jump to the new one, so reset the links
+		// and chain cache entries that refer to it.  Direct jumps from other
+		// translations carry on into the old code, which is still valid.
+		rgn->unlink_all();
+		block_txln_cache->invalidate_dirty();
+	} else {
+		// Patch the entry of the old translation with a jump to the
+		// new one.  This retargets the chain links, chain cache entries and
+		// direct jumps of other translations that still refer to it, without
+		// having to find them.
+		*(int32_t *)(old_entry + 1) = (int32_t)distance;
+		*old_entry = 0xe9;
+
+		// Nothing reaches the program of an interpreted block past its
+		// patched entry.
+		if (was_interpreted) {
+			BlockInterpreter::release(blk->interpreter_data);
+			blk->interpreter_data = NULL;
+		}
+	}
+
+	blk->txln = fn;
+}
+
+void CPU::record_code_granules(Region *rgn, Block *blk, gpa_t pa, uint64_t code_granules)
+{
+	// Record which parts of the page this translation depends on.
+	for (int granule = 0; granule < CODE_GRANULE_COUNT; granule++) {
+		if (!(code_granules & (1ULL << granule))) continue;
+
+		const void *data = (const void *)(0x100000000ULL | (PAGE_ADDRESS_OF(pa) + (granule << CODE_GRANULE_SHIFT)));
+		memcpy(rgn->code_snapshot[granule], data, CODE_GRANULE_SIZE);
+	}
+
+	blk->code_granules = code_granules;
+	rgn->code_granules |= code_granules;
+}
+
+bool CPU::translate_block(TranslationContext& ctx, gpa_t pa, uint64_t& code_granules)
+{
 	// We MUST begin in block zero.
 	assert(ctx.current_block() == 0);
 
+	Decode *insn;
+	if (!translate_instructions(ctx, pa, code_granules, insn)) {
+		return false;
+	}
+
+	translate_block_exit(ctx, pa, insn);
+	return true;
+}
+
+Decode *CPU::decode_instruction_cached(uint8_t isa, gpa_t pa)
+{
+	Decode *insn = decode_cache->lookup(pa, isa);
+	if (insn) {
+		cpu_data().decode_cache_hits++;
+		return insn;
+	}
+
+	cpu_data().decode_cache_misses++;
+
+	insn = decode_cache->fill(pa, isa);
+	if (!decode_instruction_phys(isa, pa, insn)) {
+		decode_cache->invalidate(pa);
+		return NULL;
+	}
+
+	return insn;
+}
+
+JumpInfo CPU::decode_jump_info(uint8_t isa, Decode *insn)
+{
+	JumpInfo ji = get_instruction_jump_info(insn);
+
+	// A return can only be predicted if the return address can be found.
+	ji.is_call = ji.type != JumpInfo::NONE && tagged_registers().LR && (ji.is_call || env().is_call_instruction(isa, insn));
+	return ji;
+}
+
+bool CPU::translate_instructions(TranslationContext& ctx, gpa_t pa, uint64_t& code_granules, Decode *& last_insn)
+{
+	using namespace captive::shared;
+
 #ifdef DEBUG_TRANSLATION
 	printf("jit: translating block %x\n", pa);
 #endif
 	
 	std::set<uint32_t> seen_pcs;
 	seen_pcs.insert(pa);
-	Decode *insn = get_decode(0);
+	Decode *insn = NULL;
 
 	int insn_count = 0;
 
@@ -167,8 +446,9 @@ bool CPU::translate_block(TranslationContext& ctx, gpa_t pa)
 	gpa_t page = PAGE_ADDRESS_OF(pc);
 	do {
 		// Attempt to decode the current instruction.
-		if (!decode_instruction_phys(isa, pc, insn)) {
-			printf("jit: unhandled decode fault @ isa=%d %08x (%08x)\n", isa, pc, *(uint32_t *)(0x100000000ULL | insn->pc));
+		insn = decode_instruction_cached(isa, pc);
+		if (!insn) {
+			printf("jit: unhandled decode fault @ isa=%d %08x (%08x)\n", isa, pc, *(uint32_t *)(0x100000000ULL | pc));
 			return false;
 		}
 
@@ -196,12 +476,14 @@ bool CPU::translate_block(TranslationContext& ctx, gpa_t pa)
 			ctx.add_instruction(IRInstruction::trace_end());
 		}
 
+		code_granules |= Region::code_granule_mask(insn->pc, insn->length);
+
 		pc += insn->length;
 		insn_count++;
 
 		if(insn->end_of_block) {
-			JumpInfo ji = get_instruction_jump_info(insn);
-			if(!insn->is_predicated && ji.type == JumpInfo::DIRECT && !seen_pcs.count(ji.target)) {
+			JumpInfo ji = decode_jump_info(isa, insn);
+			if(!insn->is_predicated && ji.type == JumpInfo::DIRECT && !ji.is_call && !seen_pcs.count(ji.target)) {
 				pc = ji.target;
 				seen_pcs.insert(ji.target);
 				continue;
@@ -211,12 +493,22 @@ bool CPU::translate_block(TranslationContext& ctx, gpa_t pa)
 		}
 	} while (PAGE_ADDRESS_OF(pc) == page && insn_count < 200);
 
+	last_insn = insn;
+	return true;
+}
+
+void CPU::translate_block_exit(TranslationContext& ctx, gpa_t pa, Decode *insn)
+{
+	using namespace captive::shared;
+
+	gpa_t page = PAGE_ADDRESS_OF(pa);
+
 	// Branch optimisation log
-	bool can_dispatch = false;
-	uint32_t target_pc = 0, fallthrough_pc = 0;
+	bool can_dispatch = false, is_call = false;
+	uint32_t target_pc = 0, fallthrough_pc = 0, return_pc = 0;
 
 	if (insn->end_of_block) {
-		JumpInfo ji = get_instruction_jump_info(insn);
+		JumpInfo ji = decode_jump_info(*tagged_registers().ISA, insn);
 		
 		if (ji.type == JumpInfo::DIRECT) {
 			//~ if (insn->is_predicated) {
@@ -236,30 +528,116 @@ bool CPU::translate_block(TranslationContext& ctx, gpa_t pa)
 				if(!insn->is_predicated) {
 					if((target_page == page)) can_dispatch = true;
 					fallthrough_pc = 0;
+
+					// Unconditional calls always leave through an exit stub,
+					// which records where the callee should return to.
+					if (ji.is_call) {
+						is_call = true;
+						can_dispatch = false;
+						return_pc = insn->pc + insn->length;
+					}
 				}
+		} else if (ji.type == JumpInfo::INDIRECT && ji.is_call && !insn->is_predicated) {
+			is_call = true;
+			return_pc = insn->pc + insn->length;
 		}
 	}
+
+	// The return block is referenced by its translation slot, so the
+	// prediction picks up the translation whenever it is compiled.  The
+	// slot can only be found when the return address is on this page.
+	const captive::shared::block_txln_fn *return_txln = NULL;
+	if (is_call && PAGE_ADDRESS_OF(return_pc) == page) {
+		return_txln = &image->get_region(page)->get_block(PAGE_OFFSET_OF(return_pc))->txln;
+	}
 	
-	if(can_dispatch) {
+	if(can_dispatch || target_pc) {
 		Region *rgn = image->get_region(page);
 		
 		void *target_block = NULL, *ft_block = NULL;
 		
-		if(target_pc) {
+		// Only targets on this page are in this region, so don't create
+		// blocks for the others.
+		if(target_pc && PAGE_ADDRESS_OF(target_pc) == page) {
 			target_block = (void*)rgn->get_block(PAGE_OFFSET_OF(target_pc))->txln;
 		}
-		if(fallthrough_pc) {
+		if(fallthrough_pc && PAGE_ADDRESS_OF(fallthrough_pc) == page) {
 			ft_block = (void*)rgn->get_block(PAGE_OFFSET_OF(fallthrough_pc))->txln;
 		}
 		
-		if(target_block) {
+		if(can_dispatch && target_block) {
 			ctx.add_instruction(IRInstruction::dispatch(IROperand::const32(target_pc & 0xfff), IROperand::const32(fallthrough_pc & 0xfff), IROperand::const64((uint64_t)target_block), IROperand::const64((uint64_t)ft_block)));
+		} else if(return_txln) {
+			ctx.add_instruction(IRInstruction::ret_call(IROperand::const32(target_pc), IROperand::const32(return_pc), IROperand::const64((uint64_t)return_txln)));
 		} else {
-			ctx.add_instruction(IRInstruction::ret());
+			// Leave through patchable exit stubs, which are linked to their
+			// targets once those have been compiled.
+			ctx.add_instruction(IRInstruction::ret_direct(IROperand::const32(target_pc), IROperand::const32(fallthrough_pc)));
 		}
+	} else if(return_txln) {
+		ctx.add_instruction(IRInstruction::ret_indirect_call(IROperand::const32(return_pc), IROperand::const64((uint64_t)return_txln)));
 	} else {
 		ctx.add_instruction(IRInstruction::ret());
 	}
+}
 
-	return true;
+void CPU::link_block_exit(Region *rgn, gva_t target_pc, captive::shared::block_txln_fn target_fn, std::vector<OutgoingLink> *source_links)
+{
+	// Each exit slot is laid out as
+	// 0	cmp $guard, %eax
+	// 5	jne <next slot>
+	// 7	jmp <target>
+	for (uint32_t i = 0; i < jit_state.chain_exit_slot_count; i++) {
+		uint8_t *slot = jit_state.chain_exit_slots + (i * CHAIN_SLOT_SIZE);
+		uint32_t *guard = (uint32_t *)(slot + 1);
+		int32_t *rel = (int32_t *)(slot + 8);
+
+		if (*guard != CHAIN_SLOT_FREE) continue;
+
+		int64_t distance = (int64_t)target_fn - (int64_t)(slot + CHAIN_SLOT_SIZE);
+		if (distance != (int32_t)distance) return;
+
+		// Arm the guard last, so the slot never jumps to a stale target.
+		*rel = (int32_t)distance;
+		*guard = target_pc;
+
+		ChainLink link;
+		link.guard = guard;
+		link.target_pc = target_pc;
+
+		rgn->incoming_links.push_back(link);
+		linked_regions.insert(rgn);
+
+		// The slot may have been linked before, and unlinked by its old
+		// target, which does not tell the source.
+		for (auto& outgoing : *source_links) {
+			if (outgoing.guard == guard) {
+				outgoing.target = rgn;
+				return;
+			}
+		}
+
+		OutgoingLink outgoing;
+		outgoing.guard = guard;
+		outgoing.target = rgn;
+
+		source_links->push_back(outgoing);
+		return;
+	}
+}
+
+void CPU::unlink_blocks()
+{
+	for (auto rgn : linked_regions) {
+		rgn->unlink_all();
+	}
+
+	linked_regions.clear();
+}
+
+void CPU::unlink_blocks(gva_t virt_page)
+{
+	for (auto rgn : linked_regions) {
+		rgn->unlink_page(virt_page);
+	}
 }
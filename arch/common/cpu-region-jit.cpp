@@ -14,7 +14,7 @@
 #include <set>
 #include <map>
 #include <list>
-#include <bitset>
+#include <vector>
 
 //#define REG_STATE_PROTECTION
 //#define DEBUG_TRANSLATION
@@ -58,7 +58,7 @@ bool CPU::run_region_jit()
 	return run_region_jit_safepoint();
 }
 
-static std::bitset<0x100000> hot_regions;
+static std::vector<Region *> hot_regions;
 
 bool CPU::run_region_jit_safepoint()
 {
@@ -82,8 +82,12 @@ bool CPU::run_region_jit_safepoint()
 		// Check to see if there are any pending actions coming in from
 		// the hypervisor.
 		if (unlikely(cpu_data().async_action)) {
-			if (handle_pending_action(cpu_data().async_action)) {
-				cpu_data().async_action = 0;
+			// Take the action atomically, so that one posted while this one is
+			// being handled is not cleared along with it.  An action we don't
+			// understand is left pending, unless it has been superseded.
+			uint32_t action = __atomic_exchange_n(&cpu_data().async_action, 0, __ATOMIC_SEQ_CST);
+			if (!handle_pending_action(action)) {
+				__sync_bool_compare_and_swap(&cpu_data().async_action, 0, action);
 			}
 		}
 
@@ -117,6 +121,12 @@ bool CPU::run_region_jit_safepoint()
 		}
 
 		Region *rgn = image->get_region(phys_pc);
+		rgn->note_virt_page(PAGE_ADDRESS_OF(virt_pc));
+
+		if (unlikely(rgn->dirty)) {
+			verify_region(rgn, PAGE_ADDRESS_OF(phys_pc));
+		}
+
 		Block *blk = rgn->get_block(PAGE_OFFSET_OF(virt_pc));
 
 		if (unlikely(reset_trace) || PAGE_INDEX_OF(last_phys_pc) != PAGE_INDEX_OF(phys_pc)) {
@@ -144,8 +154,10 @@ bool CPU::run_region_jit_safepoint()
 		if (rgn->rwu == NULL) {
 			blk->exec_count++;
 
-			if (rgn->heat > 20)
-				hot_regions.set(phys_pc >> 12, true);
+			if (rgn->heat > 20 && !rgn->hot) {
+				rgn->hot = true;
+				hot_regions.push_back(rgn);
+			}
 		}
 
 		if (blk->txln) {
@@ -158,6 +170,10 @@ bool CPU::run_region_jit_safepoint()
 				rgn->heat++;
 			}
 
+			if (unlikely(malloc::code_alloc.needs_flush())) {
+				flush_code_cache();
+			}
+
 			blk->txln = compile_block(blk, phys_pc, MODE_REGION);
 			mmu().disable_writes();
 
@@ -172,17 +188,16 @@ bool CPU::run_region_jit_safepoint()
 
 void CPU::analyse_blocks()
 {
-	for (int ri = 0; ri < 0x100000; ri++) {
-		if (!hot_regions[ri]) continue;
+	register_compiled_regions();
 
-		Region *rgn = image->regions[ri];
-		if (!rgn) continue;
+	for (auto rgn : hot_regions) {
+		rgn->hot = false;
 		if (rgn->rwu) continue;
 
-		compile_region(rgn, ri);
+		compile_region(rgn, rgn->index);
 	}
 
-	hot_regions.reset();
+	hot_regions.clear();
 }
 
 void CPU::compile_region(Region *rgn, uint32_t region_index)
@@ -191,16 +206,23 @@ void CPU::compile_region(Region *rgn, uint32_t region_index)
 
 	rgn->rwu = (shared::RegionWorkUnit *)malloc::shmem_alloc.alloc(sizeof(shared::RegionWorkUnit));
 	rgn->rwu->region_index = region_index;
+	rgn->rwu->generation = rgn->generation;
 	rgn->rwu->valid = 1;
 	rgn->rwu->block_count = 0;
 	rgn->rwu->blocks = NULL;
+	rgn->rwu->fn_ptr = NULL;
+	rgn->rwu->next = NULL;
 
-	//printf("compiling region %p %08x\n", rgn, region_index << 12);
+	rgn->rwu->reg_offsets.pc = (uint64_t)tagged_registers().PC - (uint64_t)tagged_registers().base;
+	rgn->rwu->reg_offsets.isa = (uint64_t)tagged_registers().ISA - (uint64_t)tagged_registers().base;
+	rgn->rwu->reg_offsets.c = (uint64_t)tagged_registers().C - (uint64_t)tagged_registers().base;
+	rgn->rwu->reg_offsets.z = (uint64_t)tagged_registers().Z - (uint64_t)tagged_registers().base;
+	rgn->rwu->reg_offsets.n = (uint64_t)tagged_registers().N - (uint64_t)tagged_registers().base;
+	rgn->rwu->reg_offsets.v = (uint64_t)tagged_registers().V - (uint64_t)tagged_registers().base;
 
-	for (int bi = 0; bi < 0x1000; bi++) {
-		Block *blk = rgn->blocks[bi];
-		if (!blk) continue;
+	//printf("compiling region %p %08x\n", rgn, region_index << 12);
 
+	for (auto blk : rgn->blocks) {
 		blk->exec_count = 0;
 
 		if (!blk->ir) continue;
@@ -209,13 +231,13 @@ void CPU::compile_region(Region *rgn, uint32_t region_index)
 		rgn->rwu->blocks = (shared::BlockWorkUnit *)malloc::shmem_alloc.realloc(rgn->rwu->blocks, sizeof(shared::BlockWorkUnit) * rgn->rwu->block_count);
 
 		shared::BlockWorkUnit *bwu = &rgn->rwu->blocks[rgn->rwu->block_count - 1];
-		bwu->offset = bi;
+		bwu->offset = blk->offset;
 		bwu->interrupt_check = blk->loop_header || blk->entry;
 		bwu->entry_block = blk->entry;
 
-		bwu->ir_count = blk->ir_count;
-		bwu->ir = (const shared::IRInstruction *)malloc::shmem_alloc.alloc(sizeof(shared::IRInstruction) * bwu->ir_count);
-		memcpy((void *)bwu->ir, (const void *)blk->ir, sizeof(shared::IRInstruction) * bwu->ir_count);
+		bwu->ir_size = blk->ir_size;
+		bwu->ir = (const uint8_t *)malloc::shmem_alloc.alloc(bwu->ir_size);
+		memcpy((void *)bwu->ir, (const void *)blk->ir, bwu->ir_size);
 	}
 
 	if (!rgn->rwu->block_count) {
@@ -230,16 +252,21 @@ void CPU::compile_region(Region *rgn, uint32_t region_index)
 void CPU::register_region(shared::RegionWorkUnit* rwu)
 {
 	Region *rgn = image->get_region_from_index(rwu->region_index);
-	assert(rgn->rwu == rwu);
-	rgn->rwu = NULL;
+
+	// A stale work unit may come back after a newer one has been submitted
+	// for the same region, in which case the region still belongs to the
+	// newer one.
+	if (rgn->rwu == rwu) {
+		rgn->rwu = NULL;
+	}
 
 	//printf("registering region %p %08x\n", rgn, rwu->region_index << 12);
-	if (rwu->valid) {
+	if (rwu->valid && rwu->generation == rgn->generation && rwu->fn_ptr) {
 		if (rgn->txln)
 			malloc::shmem_alloc.free((void *)rgn->txln);
 
 		rgn->txln = (shared::region_txln_fn)rwu->fn_ptr;
-	} else {
+	} else if (rwu->fn_ptr) {
 		malloc::shmem_alloc.free(rwu->fn_ptr);
 	}
 
@@ -252,3 +279,17 @@ void CPU::register_region(shared::RegionWorkUnit* rwu)
 
 	mmu().disable_writes();
 }
+
+void CPU::register_compiled_regions()
+{
+	lock::spinlock_acquire(&cpu_data().region_lock);
+	shared::RegionWorkUnit *rwu = cpu_data().compiled_regions;
+	cpu_data().compiled_regions = NULL;
+	lock::spinlock_release(&cpu_data().region_lock);
+
+	while (rwu) {
+		shared::RegionWorkUnit *next = rwu->next;
+		register_region(rwu);
+		rwu = next;
+	}
+}
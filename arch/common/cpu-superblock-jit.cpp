@@ -0,0 +1,239 @@
+#include <cpu.h>
+#include <decode.h>
+#include <jit.h>
+#include <jit/translation-context.h>
+#include <jit/block-compiler.h>
+#include <shared-jit.h>
+
+#include <profile/image.h>
+#include <profile/region.h>
+#include <profile/block.h>
+#include <profile/superblock.h>
+
+//#define DEBUG_SUPERBLOCKS
+
+using namespace captive::arch;
+using namespace captive::arch::jit;
+using namespace captive::arch::profile;
+using namespace captive::shared;
+
+void CPU::record_superblock_member(gva_t virt_pc, gpa_t phys_pc)
+{
+	if (superblock_members.empty()) {
+		superblock_isa = *tagged_registers().ISA;
+	} else if (*tagged_registers().ISA != superblock_isa) {
+		// The members must all be decoded in the same way.
+		end_superblock_recording();
+		return;
+	}
+
+	// The path is complete once it loops back to its head, or once it
+	// reaches a block it has already been through.
+	bool complete = superblock_members.size() == SUPERBLOCK_MAX_BLOCKS;
+	for (const auto& member : superblock_members) {
+		if (member.virt_pc == virt_pc) {
+			complete = true;
+			break;
+		}
+	}
+
+	if (complete) {
+		compile_superblock();
+		end_superblock_recording();
+		return;
+	}
+
+	superblock_member member;
+	member.virt_pc = virt_pc;
+	member.phys_pc = phys_pc;
+
+	superblock_members.push_back(member);
+}
+
+void CPU::end_superblock_recording()
+{
+	recording_superblock = false;
+	superblock_members.clear();
+
+	// Chaining was disabled while the path was recorded, but must stay
+	// disabled if there is an interrupt to take.
+	jit_state.exit_chain = cpu_data().isr != 0;
+}
+
+void CPU::compile_superblock()
+{
+	if (superblock_members.size() < 2) return;
+
+	// Superblocks are an optimisation, so don't flush the code cache for one.
+	if (malloc::code_alloc.needs_flush()) return;
+
+	const superblock_member& head_member = superblock_members.front();
+
+	Region *head_region = image->get_region(head_member.phys_pc);
+	Block *head = head_region->get_block(PAGE_OFFSET_OF(head_member.phys_pc));
+	if (head->superblock_txln || !head->txln) return;
+
+#ifdef DEBUG_SUPERBLOCKS
+	printf("jit: compiling superblock @ %08x with %u members\n", head_member.virt_pc, superblock_members.size());
+#endif
+
+	Superblock *sb = new Superblock();
+	sb->head = head;
+	sb->head_region = head_region;
+	sb->head_pc = head_member.virt_pc;
+
+	TranslationContext ctx(malloc::compile_alloc);
+	uint32_t pc_offset = (uint64_t)tagged_registers().PC - (uint64_t)tagged_registers().base;
+
+	for (uint32_t i = 0; i < superblock_members.size(); i++) {
+		const superblock_member& member = superblock_members[i];
+
+		if (i > 0) {
+			// Only carry on into this member if the previous one branched to
+			// it, otherwise leave through a side exit.
+			IROperand pc = IROperand::vreg(ctx.alloc_reg(4), 4);
+			IROperand on_path = IROperand::vreg(ctx.alloc_reg(1), 1);
+
+			ctx.add_instruction(IRInstruction::ldreg(IROperand::const32(pc_offset), pc));
+			ctx.add_instruction(IRInstruction::cmpeq(pc, IROperand::const32(member.virt_pc), on_path));
+
+			IRBlockId next_block = ctx.alloc_block();
+			IRBlockId side_exit_block = ctx.alloc_block();
+			ctx.add_instruction(IRInstruction::branch(on_path, IROperand::block(next_block), IROperand::block(side_exit_block)));
+
+			ctx.current_block(side_exit_block);
+			ctx.add_instruction(IRInstruction::ret());
+
+			ctx.current_block(next_block);
+		}
+
+		Region *rgn = image->get_region(member.phys_pc);
+		Block *blk = rgn->get_block(PAGE_OFFSET_OF(member.phys_pc));
+
+		// The granules of the members are already recorded by their own
+		// translations, which are dropped along with the superblock if
+		// they are modified.
+		uint64_t code_granules = 0;
+		Decode *insn;
+		if (!blk->txln || !translate_instructions(ctx, member.phys_pc, code_granules, insn)) {
+			malloc::compile_alloc.reset();
+			delete sb;
+			return;
+		}
+
+		if (i == superblock_members.size() - 1) {
+			translate_block_exit(ctx, member.phys_pc, insn);
+		}
+
+		if (!sb->depends_on(rgn)) {
+			sb->regions.push_back(rgn);
+		}
+
+		if (!sb->depends_on((gva_t)PAGE_ADDRESS_OF(member.virt_pc))) {
+			sb->virt_pages.push_back(PAGE_ADDRESS_OF(member.virt_pc));
+		}
+	}
+
+	BlockCompiler compiler(ctx, head_member.phys_pc, tagged_registers(), true, true, NULL, &sb->outgoing_links);
+	compiler.record_stats(cpu_data().compile_stats);
+
+	bool compiled;
+	{
+		malloc::ArenaScope scope(malloc::compile_alloc);
+		compiled = compiler.compile(sb->txln);
+	}
+
+	malloc::compile_alloc.reset();
+
+	if (!compiled) {
+		delete sb;
+		return;
+	}
+
+	// Anything already linked to the head block goes through the dispatch
+	// loop once more, and picks up the superblock there.
+	head->superblock_txln = sb->txln;
+	unlink_superblock_head(sb);
+
+	superblocks.push_back(sb);
+}
+
+void CPU::unlink_superblock_head(Superblock *sb)
+{
+	sb->head_region->unlink_all();
+
+	if (block_txln_cache) {
+		if (sb->head_region->aliased) {
+			block_txln_cache->invalidate_dirty();
+		} else {
+			block_txln_cache->invalidate_entry(sb->head_pc >> 2);
+		}
+	}
+}
+
+void CPU::drop_superblock(Superblock *sb)
+{
+	// The code itself is reclaimed when the code cache is flushed.
+	sb->head->superblock_txln = NULL;
+	unlink_superblock_head(sb);
+	drop_superblock_links(sb);
+
+	delete sb;
+}
+
+void CPU::drop_superblock_links(Superblock *sb)
+{
+	Region::drop_outgoing_links(sb->outgoing_links);
+
+	// Don't link an exit slot of the superblock after it has gone.
+	if (jit_state.chain_exit_links == &sb->outgoing_links) {
+		jit_state.chain_exit_slots = NULL;
+	}
+}
+
+void CPU::invalidate_superblocks()
+{
+	if (recording_superblock) {
+		end_superblock_recording();
+	}
+
+	for (auto sb : superblocks) {
+		sb->head->superblock_txln = NULL;
+		drop_superblock_links(sb);
+		delete sb;
+	}
+
+	superblocks.clear();
+}
+
+void CPU::invalidate_superblocks(Region *rgn)
+{
+	if (recording_superblock) {
+		end_superblock_recording();
+	}
+
+	for (auto sb = superblocks.begin(); sb != superblocks.end(); ) {
+		if ((*sb)->depends_on(rgn)) {
+			drop_superblock(*sb);
+			sb = superblocks.erase(sb);
+		} else {
+			++sb;
+		}
+	}
+}
+
+void CPU::invalidate_superblocks(gva_t virt_page)
+{
+	if (recording_superblock) {
+		end_superblock_recording();
+	}
+
+	for (auto sb = superblocks.begin(); sb != superblocks.end(); ) {
+		if ((*sb)->depends_on(virt_page)) {
+			drop_superblock(*sb);
+			sb = superblocks.erase(sb);
+		} else {
+			++sb;
+		}
+	}
+}
@@ -0,0 +1,169 @@
+#include <cpu.h>
+#include <jit.h>
+#include <jit/translation-context.h>
+#include <jit/block-compiler.h>
+#include <shared-jit.h>
+
+#include <profile/image.h>
+#include <profile/region.h>
+#include <profile/block.h>
+
+#include <vector>
+
+// How far to follow the blocks a stored translation jumps to, when they have
+// to be loaded first.
+#define MAX_STORED_LOAD_DEPTH	8
+
+using namespace captive::arch;
+using namespace captive::arch::jit;
+using namespace captive::arch::profile;
+using namespace captive::shared;
+
+StoredPage *CPU::fetch_stored_page(Region *rgn, gpa_t pa)
+{
+	if (!rgn->stored_page_fetched) {
+		rgn->stored_page_checksum = mmu().page_checksum(VA_OF_GPA(PAGE_ADDRESS_OF(pa)));
+
+		uint64_t addr;
+		asm volatile ("out %2, $0xff" : "=a"(addr) : "D"(rgn->stored_page_checksum), "a"(17));
+
+		rgn->stored_page = (StoredPage *)addr;
+		rgn->stored_page_fetched = true;
+	}
+
+	return rgn->stored_page;
+}
+
+block_txln_fn CPU::load_stored_block(Region *rgn, Block *blk, gpa_t pa, block_compilation_mode mode, int depth)
+{
+	if (!cpu_data().translation_store_enabled) return NULL;
+
+	// Stored translations do not count or trace instructions.
+	if (unlikely(cpu_data().verbose_enabled || jit().trace())) return NULL;
+
+	StoredPage *page = fetch_stored_page(rgn, pa);
+	if (!page) return NULL;
+
+	// Pages with the same checksum need not have the same content.
+	if (memcmp(page->content, (const void *)VA_OF_GPA(PAGE_ADDRESS_OF(pa)), STORED_PAGE_SIZE)) return NULL;
+
+	uint8_t isa = *tagged_registers().ISA;
+
+	StoredTranslation *record = page->first();
+	for (uint32_t i = 0; i < page->record_count; i++, record = page->next(record)) {
+		if (record->offset != PAGE_OFFSET_OF(pa) || record->isa != isa || record->mode != mode) continue;
+
+		StoredRelocation *relocations = record->relocations();
+
+		// The blocks this translation jumps straight to must have been
+		// translated, so load them first if necessary.
+		for (uint32_t r = 0; r < record->relocation_count; r++) {
+			if (relocations[r].type != StoredRelocation::REL32_TXLN) continue;
+
+			Block *target = rgn->get_block(relocations[r].target_offset);
+			if (target->txln) continue;
+
+			if (depth >= MAX_STORED_LOAD_DEPTH) return NULL;
+
+			target->txln = load_stored_block(rgn, target, PAGE_ADDRESS_OF(pa) | relocations[r].target_offset, MODE_BLOCK, depth + 1);
+			if (!target->txln) return NULL;
+		}
+
+		uint8_t *code = (uint8_t *)malloc::code_alloc.alloc(record->code_size);
+		memcpy(code, record->code(), record->code_size);
+
+		for (uint32_t r = 0; r < record->relocation_count; r++) {
+			Block *target = rgn->get_block(relocations[r].target_offset);
+			uint8_t *site = code + relocations[r].code_offset;
+
+			switch (relocations[r].type) {
+			case StoredRelocation::REL32_TXLN:
+				*(int32_t *)site = (int32_t)((int64_t)target->txln - (int64_t)(site + 4));
+				break;
+
+			case StoredRelocation::ABS64_TXLN_SLOT:
+				*(uint64_t *)site = (uint64_t)&target->txln;
+				break;
+
+			case StoredRelocation::ABS64_EXEC_COUNT:
+				*(uint64_t *)site = (uint64_t)&target->exec_count;
+				break;
+
+			case StoredRelocation::ABS64_CHAIN_LINKS:
+				*(uint64_t *)site = (uint64_t)&target->outgoing_links;
+				break;
+			}
+		}
+
+		// The region compiler never reads the translation operands of the
+		// exits, so the IR can be used as it is.
+		if (mode == MODE_REGION) {
+			uint8_t *ir = (uint8_t *)malloc::data_alloc.alloc(record->ir_size);
+			memcpy(ir, record->ir(), record->ir_size);
+
+			if (blk->ir) malloc::data_alloc.free((void *)blk->ir);
+
+			blk->ir_size = record->ir_size;
+			blk->ir = ir;
+		}
+
+		record_code_granules(rgn, blk, pa, record->code_granules);
+		blk->dispatches = StoredRelocation::any_direct_jumps(relocations, record->relocation_count);
+		return (block_txln_fn)code;
+	}
+
+	return NULL;
+}
+
+void CPU::store_block(Region *rgn, gpa_t pa, block_compilation_mode mode, uint64_t code_granules, BlockCompiler& compiler, block_txln_fn fn, const Block *blk)
+{
+	if (unlikely(cpu_data().verbose_enabled || jit().trace())) return;
+
+	fetch_stored_page(rgn, pa);
+
+	const std::vector<StoredRelocation>& relocations = compiler.relocations();
+	uint32_t code_size = compiler.code_size();
+	uint32_t ir_size = mode == MODE_REGION ? blk->ir_size : 0;
+	uint32_t size = StoredTranslation::record_size(code_size, relocations.size(), ir_size);
+
+	StoredTranslation *record = (StoredTranslation *)malloc::shmem_alloc.alloc(size);
+	if (!record) return;
+
+	// The host keeps the content of the page with its records.
+	uint8_t *content = (uint8_t *)malloc::shmem_alloc.alloc(STORED_PAGE_SIZE);
+	if (!content) {
+		malloc::shmem_alloc.free(record);
+		return;
+	}
+
+	memcpy(content, (const void *)VA_OF_GPA(PAGE_ADDRESS_OF(pa)), STORED_PAGE_SIZE);
+
+	record->page_checksum = rgn->stored_page_checksum;
+	record->code_granules = code_granules;
+	record->offset = PAGE_OFFSET_OF(pa);
+	record->isa = *tagged_registers().ISA;
+	record->mode = mode;
+	record->size = size;
+	record->code_size = code_size;
+	record->relocation_count = relocations.size();
+	record->ir_size = ir_size;
+	record->padding = 0;
+
+	// The exit slots of a new translation are never linked, so the code can
+	// be stored as it is.
+	memcpy(record->code(), (const void *)fn, code_size);
+
+	for (uint32_t r = 0; r < record->relocation_count; r++) {
+		record->relocations()[r] = relocations[r];
+	}
+
+	if (ir_size) {
+		memcpy(record->ir(), blk->ir, ir_size);
+	}
+
+	// The host copies the record and the page before returning.
+	asm volatile ("out %0, $0xff" :: "a"(16), "D"(record), "S"(content));
+
+	malloc::shmem_alloc.free(content);
+	malloc::shmem_alloc.free(record);
+}
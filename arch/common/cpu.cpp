@@ -25,14 +25,16 @@ CPU::CPU(Environment& env, PerCPUData *per_cpu_data)
 	_per_cpu_data(per_cpu_data),
 	_exec_txl(false),
 	region_txln_cache(new region_txln_cache_t()),
-	block_txln_cache(new block_txln_cache_t())
+	block_txln_cache(new block_txln_cache_t()),
+	recording_superblock(false),
+	superblock_isa(0)
 {
 	// Zero out the local state.
 	bzero(&local_state, sizeof(local_state));
 	bzero(&tagged_reg_offsets, sizeof(tagged_reg_offsets));
 
-	// Initialise the decode cache
-	memset(decode_cache, 0xff, sizeof(decode_cache));
+	// The host chooses the size of the decode cache for each guest CPU.
+	decode_cache = new DecodeCache(per_cpu_data->decode_cache_sets, per_cpu_data->decode_cache_ways);
 
 	// Initialise the profiling image
 	image = new profile::Image();
@@ -49,6 +51,14 @@ CPU::CPU(Environment& env, PerCPUData *per_cpu_data)
 	
 	jit_state.insn_counter = &(per_cpu_data->insns_executed);
 	jit_state.exit_chain = 0;
+	jit_state.superblock_request = 0;
+	jit_state.tier_up_request = 0;
+	jit_state.chain_exit_slots = NULL;
+	jit_state.chain_exit_pc = 0;
+	jit_state.chain_exit_slot_count = 0;
+	jit_state.chain_exit_links = NULL;
+	jit_state.return_stack = return_stack;
+	jit_state.return_stack_top = 0;
 	
 	// Populate the FS register with the address of the JIT state structure.
 	__wrmsr(0xc0000100, (uint64_t)&jit_state);
@@ -67,10 +77,14 @@ CPU::~CPU()
 
 	if (block_txln_cache)
 		delete block_txln_cache;
+
+	delete decode_cache;
 }
 
 bool CPU::handle_pending_action(uint32_t action)
 {
+	bool handled = true;
+
 	switch (action) {
 	case 2:
 	{
@@ -79,19 +93,29 @@ bool CPU::handle_pending_action(uint32_t action)
 		//printf("used: %d\nfree: %d\n", mi.uordblks, mi.fordblks);
 
 		dump_state();
-		return true;
+		break;
 	}
 
 	case 3:
 		trace().enable();
-		return true;
+		break;
 
 	case 4:
 		asm volatile("out %0, $0xff\n" :: "a"(4));
-		return true;
+		break;
+
+	case 5:
+		break;
+
+	default:
+		handled = false;
+		break;
 	}
 
-	return false;
+	// The region JIT only raises action 5 if no other action is pending, so
+	// compiled regions may be waiting behind whichever action we were given.
+	register_compiled_regions();
+	return handled;
 }
 
 
@@ -128,8 +152,24 @@ bool CPU::run_test()
 
 void CPU::invalidate_translations()
 {
+	invalidate_superblocks();
 	image->invalidate();
 	invalidate_virtual_mappings();
+
+	// Writes to the pages are no longer tracked, so their decodes can't be
+	// trusted either.
+	decode_cache->invalidate_all();
+}
+
+void CPU::flush_code_cache()
+{
+	// Everything that points into the code cache has to go before the
+	// memory is reused, including a pending exit slot to be linked.
+	invalidate_translations();
+	jit_state.chain_exit_slots = NULL;
+
+	malloc::code_alloc.reset();
+	cpu_data().code_cache_flushes++;
 }
 
 void CPU::invalidate_translation(pa_t phys_addr, va_t virt_addr)
@@ -141,12 +181,77 @@ void CPU::invalidate_translation(pa_t phys_addr, va_t virt_addr)
 	if (rgn) {
 		rgn->invalidate();
 	}
+
+	decode_cache->invalidate_granules((gpa_t)(uint64_t)phys_addr, ~0ULL);
 	
 	invalidate_virtual_mappings();
 }
 
+void CPU::mark_translation_dirty(pa_t phys_addr, va_t virt_addr)
+{
+	if (virt_addr >= (va_t)0x100000000) return;
+
+	Region *rgn = image->get_region((uint32_t)(uint64_t)phys_addr);
+	if (!rgn->code_granules) return;
+
+	// The written bytes are not known, as the page stays writable from now
+	// on, so just make sure nothing can run code from the page until it has
+	// been checked.  The region-level translation covers the whole page, so
+	// it is dropped straight away.
+	rgn->dirty = true;
+	rgn->unlink_all();
+	rgn->invalidate_region_txln();
+	invalidate_superblocks(rgn);
+
+	if (rgn->aliased) {
+		invalidate_virtual_mappings();
+	} else {
+		invalidate_virtual_mapping(rgn->virt_page);
+	}
+}
+
+void CPU::verify_region(Region *rgn, gpa_t phys_page)
+{
+	uint64_t modified_granules = 0;
+
+	for (int granule = 0; granule < CODE_GRANULE_COUNT; granule++) {
+		if (!(rgn->code_granules & (1ULL << granule))) continue;
+
+		const void *data = (const void *)(0x100000000ULL | (PAGE_ADDRESS_OF(phys_page) + (granule << CODE_GRANULE_SHIFT)));
+		if (memcmp(data, rgn->code_snapshot[granule], CODE_GRANULE_SIZE)) {
+			modified_granules |= 1ULL << granule;
+		}
+	}
+
+	// Granules that no longer hold translated code stop being tracked, so
+	// their decodes must go along with the modified ones.
+	uint64_t tracked_granules = rgn->code_granules;
+	rgn->invalidate_granules(modified_granules);
+	decode_cache->invalidate_granules(phys_page, modified_granules | (tracked_granules & ~rgn->code_granules));
+	rgn->dirty = false;
+
+	// Even if no code was modified, the page no longer has the content its
+	// stored translations were looked up by.
+	rgn->release_stored_page();
+
+	// Trap the next write to the page again.
+	mmu().set_page_executed(VA_OF_GPA(PAGE_ADDRESS_OF(phys_page)));
+	mmu().disable_writes();
+}
+
+void CPU::invalidate_return_stack()
+{
+	for (int i = 0; i < RETURN_STACK_SIZE; i++) {
+		return_stack[i].invalidate();
+	}
+}
+
 void CPU::invalidate_virtual_mappings()
 {
+	invalidate_superblocks();
+	unlink_blocks();
+	invalidate_return_stack();
+
 	if (block_txln_cache) {
 		block_txln_cache->invalidate_dirty();
 	}
@@ -158,8 +263,14 @@ void CPU::invalidate_virtual_mappings()
 
 void CPU::invalidate_virtual_mapping(gva_t va)
 {
+	invalidate_superblocks((gva_t)PAGE_ADDRESS_OF(va));
+	unlink_blocks(PAGE_ADDRESS_OF(va));
+	invalidate_return_stack();
+
 	if (block_txln_cache) {
-		block_txln_cache->invalidate_entry(va >> 2);
+		for (uint32_t offset = 0; offset < 0x1000; offset += 4) {
+			block_txln_cache->invalidate_entry((PAGE_ADDRESS_OF(va) | offset) >> 2);
+		}
 	}
 
 	if(region_txln_cache) {
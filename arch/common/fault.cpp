@@ -43,6 +43,106 @@ static inline uint8_t __in8(uint32_t address)
 	return value;
 }
 
+// Reads a 32-bit general-purpose register from the saved context, if the
+// context holds it.
+static bool read_gpr32(const struct mcontext *mctx, x86::Operand::reg_idx reg, uint32_t& value)
+{
+	switch (reg) {
+	case x86::Operand::R_EAX: value = (uint32_t)mctx->rax; return true;
+	case x86::Operand::R_EBX: value = (uint32_t)mctx->rbx; return true;
+	case x86::Operand::R_ECX: value = (uint32_t)mctx->rcx; return true;
+	case x86::Operand::R_EDX: value = (uint32_t)mctx->rdx; return true;
+	case x86::Operand::R_ESI: value = (uint32_t)mctx->rsi; return true;
+	case x86::Operand::R_EDI: value = (uint32_t)mctx->rdi; return true;
+	case x86::Operand::R_EBP: value = (uint32_t)mctx->rbp; return true;
+	case x86::Operand::R_R8D: value = (uint32_t)mctx->r8; return true;
+	case x86::Operand::R_R9D: value = (uint32_t)mctx->r9; return true;
+	case x86::Operand::R_R10D: value = (uint32_t)mctx->r10; return true;
+	case x86::Operand::R_R11D: value = (uint32_t)mctx->r11; return true;
+	case x86::Operand::R_R12D: value = (uint32_t)mctx->r12; return true;
+	case x86::Operand::R_R13D: value = (uint32_t)mctx->r13; return true;
+	case x86::Operand::R_R14D: value = (uint32_t)mctx->r14; return true;
+	case x86::Operand::R_R15D: value = (uint32_t)mctx->r15; return true;
+	default: return false;
+	}
+}
+
+// Writes a 32-bit general-purpose register in the saved context, clearing the
+// upper half as the hardware would.
+static bool write_gpr32(struct mcontext *mctx, x86::Operand::reg_idx reg, uint32_t value)
+{
+	switch (reg) {
+	case x86::Operand::R_EAX: mctx->rax = value; return true;
+	case x86::Operand::R_EBX: mctx->rbx = value; return true;
+	case x86::Operand::R_ECX: mctx->rcx = value; return true;
+	case x86::Operand::R_EDX: mctx->rdx = value; return true;
+	case x86::Operand::R_ESI: mctx->rsi = value; return true;
+	case x86::Operand::R_EDI: mctx->rdi = value; return true;
+	case x86::Operand::R_EBP: mctx->rbp = value; return true;
+	case x86::Operand::R_R8D: mctx->r8 = value; return true;
+	case x86::Operand::R_R9D: mctx->r9 = value; return true;
+	case x86::Operand::R_R10D: mctx->r10 = value; return true;
+	case x86::Operand::R_R11D: mctx->r11 = value; return true;
+	case x86::Operand::R_R12D: mctx->r12 = value; return true;
+	case x86::Operand::R_R13D: mctx->r13 = value; return true;
+	case x86::Operand::R_R14D: mctx->r14 = value; return true;
+	case x86::Operand::R_R15D: mctx->r15 = value; return true;
+	default: return false;
+	}
+}
+
+// Computes the guest virtual address of a rewritten device access, i.e.
+// disp + base + index * scale, in 32 bits.
+static uint32_t device_access_address(struct mcontext *mctx, const x86::Operand& oper)
+{
+	uint32_t base, index;
+
+	if (!read_gpr32(mctx, oper.mem.base_reg_idx, base))
+		fatal("unhandled base register %s for device access\n", x86::x86_register_names[oper.mem.base_reg_idx]);
+
+	uint32_t va = oper.mem.displacement + base;
+
+	if (oper.mem.index_reg_idx != x86::Operand::R_Z) {
+		if (!read_gpr32(mctx, oper.mem.index_reg_idx, index))
+			fatal("unhandled index register %s for device access\n", x86::x86_register_names[oper.mem.index_reg_idx]);
+
+		va += index * oper.mem.scale;
+	}
+
+	return va;
+}
+
+// Stores a value read from a device into the destination register of the
+// faulting instruction, extending it as the instruction would have done.
+static void complete_device_read(struct mcontext *mctx, const captive::arch::x86::MemoryInstruction& inst, uint64_t value)
+{
+	if (inst.type == x86::MemoryInstruction::I_MOVSX) {
+		switch (inst.data_size) {
+		case 1: value = (uint32_t)(int32_t)(int8_t)value; break;
+		case 2: value = (uint32_t)(int32_t)(int16_t)value; break;
+		}
+	}
+
+	switch (inst.Dest.reg) {
+	case x86::Operand::R_AX: mctx->rax = (mctx->rax & ~0xffffULL) | (uint16_t)value; break;
+	case x86::Operand::R_BX: mctx->rbx = (mctx->rbx & ~0xffffULL) | (uint16_t)value; break;
+	case x86::Operand::R_CX: mctx->rcx = (mctx->rcx & ~0xffffULL) | (uint16_t)value; break;
+	case x86::Operand::R_DX: mctx->rdx = (mctx->rdx & ~0xffffULL) | (uint16_t)value; break;
+	case x86::Operand::R_SI: mctx->rsi = (mctx->rsi & ~0xffffULL) | (uint16_t)value; break;
+	case x86::Operand::R_DI: mctx->rdi = (mctx->rdi & ~0xffffULL) | (uint16_t)value; break;
+
+	case x86::Operand::R_AL: mctx->rax = (mctx->rax & ~0xffULL) | (uint8_t)value; break;
+	case x86::Operand::R_BL: mctx->rbx = (mctx->rbx & ~0xffULL) | (uint8_t)value; break;
+	case x86::Operand::R_CL: mctx->rcx = (mctx->rcx & ~0xffULL) | (uint8_t)value; break;
+	case x86::Operand::R_DL: mctx->rdx = (mctx->rdx & ~0xffULL) | (uint8_t)value; break;
+
+	default:
+		if (!write_gpr32(mctx, inst.Dest.reg, value))
+			fatal("unhandled dest register %s for device read\n", x86::x86_register_names[inst.Dest.reg]);
+		break;
+	}
+}
+
 namespace captive { namespace arch {
 int do_device_read(struct mcontext *mctx)
 {
@@ -52,14 +152,7 @@ int do_device_read(struct mcontext *mctx)
 	
 	assert(inst.Source.type == x86::Operand::TYPE_MEMORY);
 
-	uint32_t va = inst.Source.mem.displacement;
-	switch (inst.Source.mem.base_reg_idx) {
-	case x86::Operand::R_EAX: va += (uint32_t)mctx->rax; break;
-	case x86::Operand::R_EBX: va += (uint32_t)mctx->rbx; break;
-	case x86::Operand::R_ECX: va += (uint32_t)mctx->rcx; break;
-	case x86::Operand::R_EDX: va += (uint32_t)mctx->rdx; break;
-	default: fatal("unhandled base register %s for device read\n", x86::x86_register_names[inst.Source.mem.base_reg_idx]);
-	}
+	uint32_t va = device_access_address(mctx, inst.Source);
 
 	gpa_t pa;
 	MMU::resolution_fault fault;
@@ -84,28 +177,7 @@ int do_device_read(struct mcontext *mctx)
 	
 	//printf("F read  @ %016lx addr=%08x val=%08x\n", mctx->rip - 2, pa, value);
 
-	switch (inst.Dest.reg) {
-	case x86::Operand::R_EAX: mctx->rax = value; break;
-	case x86::Operand::R_EBX: mctx->rbx = value; break;
-	case x86::Operand::R_ECX: mctx->rcx = value; break;
-	case x86::Operand::R_EDX: mctx->rdx = value; break;
-	case x86::Operand::R_ESI: mctx->rsi = value; break;
-	case x86::Operand::R_EDI: mctx->rdi = value; break;
-
-	case x86::Operand::R_AX: mctx->rax = (mctx->rax & ~0xffffULL) | (value & 0xffff); break;
-	case x86::Operand::R_BX: mctx->rbx = (mctx->rbx & ~0xffffULL) | (value & 0xffff); break;
-	case x86::Operand::R_CX: mctx->rcx = (mctx->rcx & ~0xffffULL) | (value & 0xffff); break;
-	case x86::Operand::R_DX: mctx->rdx = (mctx->rdx & ~0xffffULL) | (value & 0xffff); break;
-	case x86::Operand::R_SI: mctx->rsi = (mctx->rsi & ~0xffffULL) | (value & 0xffff); break;
-	case x86::Operand::R_DI: mctx->rdi = (mctx->rdi & ~0xffffULL) | (value & 0xffff); break;
-
-	case x86::Operand::R_AL: mctx->rax = (mctx->rax & ~0xffULL) | (value & 0xff); break;
-	case x86::Operand::R_BL: mctx->rbx = (mctx->rbx & ~0xffULL) | (value & 0xff); break;
-	case x86::Operand::R_CL: mctx->rcx = (mctx->rcx & ~0xffULL) | (value & 0xff); break;
-	case x86::Operand::R_DL: mctx->rdx = (mctx->rdx & ~0xffULL) | (value & 0xff); break;
-
-	default: fatal("unhandled dest register %s for device read\n", x86::x86_register_names[inst.Dest.reg]);
-	}
+	complete_device_read(mctx, inst, value);
 
 	return 0;
 }
@@ -118,14 +190,7 @@ int do_device_write(struct mcontext *mctx)
 
 	assert(inst.Dest.type == x86::Operand::TYPE_MEMORY);
 
-	uint32_t va = inst.Dest.mem.displacement;
-	switch (inst.Dest.mem.base_reg_idx) {
-	case x86::Operand::R_EAX: va += (uint32_t)mctx->rax; break;
-	case x86::Operand::R_EBX: va += (uint32_t)mctx->rbx; break;
-	case x86::Operand::R_ECX: va += (uint32_t)mctx->rcx; break;
-	case x86::Operand::R_EDX: va += (uint32_t)mctx->rdx; break;
-	default: fatal("unhandled base register %s for device write\n", x86::x86_register_names[inst.Dest.mem.base_reg_idx]);
-	}
+	uint32_t va = device_access_address(mctx, inst.Dest);
 
 	gpa_t pa;
 	MMU::resolution_fault fault;
@@ -242,28 +307,7 @@ static void handle_device_fault(captive::arch::CPU *core, struct mcontext *mctx,
 		default: fatal("unhandled data size %d\n", inst.data_size);
 		}
 		
-		switch (inst.Dest.reg) {
-		case x86::Operand::R_EAX: mctx->rax = (uint32_t)value; break;
-		case x86::Operand::R_EBX: mctx->rbx = (uint32_t)value; break;
-		case x86::Operand::R_ECX: mctx->rcx = (uint32_t)value; break;
-		case x86::Operand::R_EDX: mctx->rdx = (uint32_t)value; break;
-		case x86::Operand::R_ESI: mctx->rsi = (uint32_t)value; break;
-		case x86::Operand::R_EDI: mctx->rdi = (uint32_t)value; break;
-		
-		case x86::Operand::R_AX: mctx->rax = (mctx->rax & ~0xffffULL) | (uint16_t)value; break;
-		case x86::Operand::R_BX: mctx->rbx = (mctx->rbx & ~0xffffULL) | (uint16_t)value; break;
-		case x86::Operand::R_CX: mctx->rcx = (mctx->rcx & ~0xffffULL) | (uint16_t)value; break;
-		case x86::Operand::R_DX: mctx->rdx = (mctx->rdx & ~0xffffULL) | (uint16_t)value; break;
-		case x86::Operand::R_SI: mctx->rsi = (mctx->rsi & ~0xffffULL) | (uint16_t)value; break;
-		case x86::Operand::R_DI: mctx->rdi = (mctx->rdi & ~0xffffULL) | (uint16_t)value; break;
-
-		case x86::Operand::R_AL: mctx->rax = (mctx->rax & ~0xffULL) | (uint8_t)value; break;
-		case x86::Operand::R_BL: mctx->rbx = (mctx->rbx & ~0xffULL) | (uint8_t)value; break;
-		case x86::Operand::R_CL: mctx->rcx = (mctx->rcx & ~0xffULL) | (uint8_t)value; break;
-		case x86::Operand::R_DL: mctx->rdx = (mctx->rdx & ~0xffULL) | (uint8_t)value; break;
-		
-		default: fatal("unhandled dest register %s\n", x86::x86_register_names[inst.Dest.reg]);
-		}
+		complete_device_read(mctx, inst, value);
 	} else {
 		fatal("illegal combination of operands for memory instruction\n");
 	}
@@ -16,11 +16,36 @@
 #include <disasm.h>
 #include <shared-jit.h>
 #include <txln-cache.h>
+#include <decode-cache.h>
+#include <list>
 #include <map>
-
-#define DECODE_CACHE_SIZE	8192
-#define DECODE_OBJ_SIZE		128
-#define DECODE_CACHE_ENTRIES	(DECODE_CACHE_SIZE / DECODE_OBJ_SIZE)
+#include <set>
+#include <vector>
+
+// Geometry of the block chaining cache, which is probed inline by generated
+// code.  Each entry is 16 bytes, so each set is (16 * WAYS) bytes.
+#define BLOCK_CHAIN_CACHE_SETS	0x8000
+#define BLOCK_CHAIN_CACHE_WAYS	2
+
+// Number of entries in the return-address stack, which must be a power of two
+// as generated code wraps the top-of-stack index with a mask.
+#define RETURN_STACK_SIZE		16
+
+// The number of times a block must be executed before the engine records the
+// path taken from it, and the longest path it will turn into a superblock.
+// The count starts again each time, so a block asks again if no superblock
+// came of the path, or if the superblock has since been dropped.
+#define SUPERBLOCK_HOT_THRESHOLD	1000
+#define SUPERBLOCK_MAX_BLOCKS		8
+
+// The number of times a block translated by the baseline compiler must be
+// executed before it is recompiled with the full optimisation pipeline.  Set
+// it to zero to always use the full pipeline.
+#define BLOCK_TIER_UP_THRESHOLD		50
+
+// The number of times a block is interpreted before it is compiled.  Set it to
+// zero to compile blocks the first time they run.
+#define BLOCK_INTERPRET_THRESHOLD	10
 
 extern "C" { void tail_call_ret0_only(); }
 
@@ -30,17 +55,21 @@ namespace captive {
 		struct RegionTranslation;
 		struct RegionWorkUnit;
 		struct RegionImage;
+		struct StoredPage;
 	}
 
 	namespace arch {
 		namespace jit {
 			class TranslationContext;
+			class BlockCompiler;
 		}
 
 		namespace profile {
 			struct Image;
 			struct Region;
 			struct Block;
+			struct Superblock;
+			struct OutgoingLink;
 		}
 
 		class Environment;
@@ -55,6 +84,10 @@ namespace captive {
 			struct TaggedRegisters {
 				void *base;
 				uint32_t *PC, *SP;
+
+				// The register that calls leave their return address in, or
+				// NULL if the guest has no such register.
+				uint32_t *LR;
 				uint8_t *C, *Z, *N, *V, *ISA;
 			};
 			
@@ -97,6 +130,17 @@ namespace captive {
 
 			inline bool executing_translation() const { return _exec_txl; }
 
+			// Asks the engine to recompile the block at the given address, as
+			// a hot baseline translation does, once the CPU is in the ISA it
+			// was decoded in.  There is only room for one request, so the
+			// callers count again and ask again if theirs is overwritten.
+			inline void request_tier_up(gpa_t pa, uint8_t isa)
+			{
+				jit_state.tier_up_request = 1;
+				jit_state.tier_up_isa = isa;
+				jit_state.tier_up_pa = pa;
+			}
+
 			static inline CPU *get_active_cpu() {
 				return current_cpu;
 			}
@@ -113,9 +157,12 @@ namespace captive {
 			void invalidate_virtual_mappings();
 			void invalidate_virtual_mapping(gva_t va);
 			void invalidate_translations();
+			void flush_code_cache();
 			void invalidate_translation(pa_t phys_page_base_addr, va_t virt_page_base_addr);
+			void mark_translation_dirty(pa_t phys_page_base_addr, va_t virt_page_base_addr);
 
 			void register_region(shared::RegionWorkUnit *rwu);
+			void register_compiled_regions();
 
 			void handle_irq_raised(uint8_t irq_line);
 			void handle_irq_rescinded(uint8_t irq_line);
@@ -168,6 +215,15 @@ namespace captive {
 				void *fn;
 				
 				inline void invalidate() { tag = 1; }
+				inline bool valid() const { return tag != 1; }
+			} packed;
+
+			struct return_stack_entry {
+				uint32_t pc;
+				uint32_t padding;
+				const captive::shared::block_txln_fn *txln;
+				
+				inline void invalidate() { pc = 1; }
 			} packed;
 
 			struct region_chain_cache_entry {
@@ -184,6 +240,17 @@ namespace captive {
 				const struct block_chain_cache_entry *block_txln_cache;		// 32
 				uint64_t *insn_counter;									// 40
 				uint8_t exit_chain;										// 48
+				uint8_t superblock_request;								// 49
+				uint8_t tier_up_request;								// 50
+				uint8_t tier_up_isa;									// 51
+				uint32_t tier_up_pa;									// 52
+				uint8_t *chain_exit_slots;								// 56
+				uint32_t chain_exit_pc;									// 64
+				uint32_t chain_exit_slot_count;							// 68
+				struct return_stack_entry *return_stack;				// 72
+				uint32_t return_stack_top;								// 80
+				uint32_t padding;										// 84
+				std::vector<profile::OutgoingLink> *chain_exit_links;	// 88
 			} packed jit_state;
 			
 			inline void trap() { dump_stack(); fatal("it's a trap!\n"); }
@@ -215,20 +282,36 @@ namespace captive {
 			PerCPUData *_per_cpu_data;
 
 			typedef Cache<struct region_chain_cache_entry, 0x100000> region_txln_cache_t;
-			typedef Cache<struct block_chain_cache_entry, 0x10000> block_txln_cache_t;
+			typedef AssociativeCache<struct block_chain_cache_entry, BLOCK_CHAIN_CACHE_SETS, BLOCK_CHAIN_CACHE_WAYS> block_txln_cache_t;
 			region_txln_cache_t *region_txln_cache;
 			block_txln_cache_t  *block_txln_cache;
 
 			bool _exec_txl;
 
-			uint8_t decode_cache[DECODE_CACHE_SIZE];
+			DecodeCache *decode_cache;
 
-			inline Decode *get_decode(uint32_t pc) const {
-				return (Decode *)&decode_cache[((pc >> 2) % DECODE_CACHE_ENTRIES) * DECODE_OBJ_SIZE];
-			}
+			// Returns the decode of the instruction at the given physical
+			// address, from the decode cache if possible, or NULL if it
+			// can't be decoded.
+			Decode *decode_instruction_cached(uint8_t isa, gpa_t pa);
+
+			// Returns the jump info of a decoded instruction, with calls
+			// identified by the environment.
+			JumpInfo decode_jump_info(uint8_t isa, Decode *insn);
 
 			profile::Image *image;
 
+			// Regions that currently have direct links into them.
+			std::set<profile::Region *> linked_regions;
+			void link_block_exit(profile::Region *rgn, gva_t target_pc, shared::block_txln_fn target_fn, std::vector<profile::OutgoingLink> *source_links);
+			void unlink_blocks();
+			void unlink_blocks(gva_t virt_page);
+
+			// Predicted (return address, translation) pairs, pushed by
+			// translated calls and popped by translated returns.
+			struct return_stack_entry return_stack[RETURN_STACK_SIZE];
+			void invalidate_return_stack();
+
 			bool run_block_jit();
 			bool run_block_jit_safepoint();
 			bool run_region_jit();
@@ -243,11 +326,50 @@ namespace captive {
 			enum block_compilation_mode
 			{
 				MODE_BLOCK,
+				MODE_BLOCK_BASELINE,
+				MODE_BLOCK_INTERPRETED,
 				MODE_REGION,
 			};
 			
 			captive::shared::block_txln_fn compile_block(profile::Block *blk, gpa_t pa, enum block_compilation_mode mode);
-			bool translate_block(jit::TranslationContext& ctx, gpa_t pa);
+			void tier_up_block(gpa_t pa);
+			bool translate_block(jit::TranslationContext& ctx, gpa_t pa, uint64_t& code_granules);
+			bool translate_instructions(jit::TranslationContext& ctx, gpa_t pa, uint64_t& code_granules, Decode *& last_insn);
+			void translate_block_exit(jit::TranslationContext& ctx, gpa_t pa, Decode *insn);
+			void record_code_granules(profile::Region *rgn, profile::Block *blk, gpa_t pa, uint64_t code_granules);
+
+			// Translations made by earlier runs are fetched by the content of
+			// the page they were made from, and finished translations are
+			// exported to the host so that later runs can do the same.
+			shared::StoredPage *fetch_stored_page(profile::Region *rgn, gpa_t pa);
+			captive::shared::block_txln_fn load_stored_block(profile::Region *rgn, profile::Block *blk, gpa_t pa, enum block_compilation_mode mode, int depth);
+			void store_block(profile::Region *rgn, gpa_t pa, enum block_compilation_mode mode, uint64_t code_granules, jit::BlockCompiler& compiler, captive::shared::block_txln_fn fn, const profile::Block *blk);
+
+			void verify_region(profile::Region *rgn, gpa_t phys_page);
+
+			// Superblocks are formed by recording the path taken through the
+			// dispatch loop, while chaining is disabled, once a block becomes
+			// hot.
+			struct superblock_member
+			{
+				gva_t virt_pc;
+				gpa_t phys_pc;
+			};
+
+			bool recording_superblock;
+			uint8_t superblock_isa;
+			std::vector<superblock_member> superblock_members;
+			std::list<profile::Superblock *> superblocks;
+
+			void record_superblock_member(gva_t virt_pc, gpa_t phys_pc);
+			void end_superblock_recording();
+			void compile_superblock();
+			void unlink_superblock_head(profile::Superblock *sb);
+			void drop_superblock(profile::Superblock *sb);
+			void drop_superblock_links(profile::Superblock *sb);
+			void invalidate_superblocks();
+			void invalidate_superblocks(profile::Region *rgn);
+			void invalidate_superblocks(gva_t virt_page);
 		};
 	}
 }
@@ -0,0 +1,141 @@
+#ifndef DECODE_CACHE_H
+#define DECODE_CACHE_H
+
+#include <define.h>
+#include <profile/region.h>
+
+#define DECODE_OBJ_SIZE		128
+
+namespace captive {
+	namespace arch {
+		class Decode;
+
+		/**
+		 * A set-associative cache of decoded instructions, keyed by the
+		 * physical address of the instruction and the ISA it was decoded in,
+		 * so that entries survive changes to the virtual memory map.  The
+		 * geometry is chosen per guest CPU by the host.
+		 *
+		 * Entries never move once filled, so a decode returned by the cache
+		 * stays valid until the next fill of the same set.  Ways are replaced
+		 * in round-robin order.
+		 */
+		class DecodeCache
+		{
+		public:
+			DecodeCache(uint32_t set_count, uint32_t way_count)
+				: set_count(set_count), way_count(way_count),
+				entries(new Entry[set_count * way_count]), next_victim(new uint32_t[set_count])
+			{
+				invalidate_all();
+			}
+
+			~DecodeCache()
+			{
+				delete[] entries;
+				delete[] next_victim;
+			}
+
+			/**
+			 * Returns the decode of the instruction at the given address, or
+			 * NULL if it is not cached.
+			 */
+			inline Decode *lookup(gpa_t pa, uint8_t isa)
+			{
+				Entry *set = set_ptr(pa);
+
+				for (uint32_t way = 0; way < way_count; way++) {
+					if (set[way].tag == pa && set[way].isa == isa) return set[way].decode();
+				}
+
+				return NULL;
+			}
+
+			/**
+			 * Returns an entry to decode the instruction at the given address
+			 * into, replacing one of the ways of its set.  If the decode
+			 * fails, the entry must be dropped with invalidate().
+			 */
+			inline Decode *fill(gpa_t pa, uint8_t isa)
+			{
+				uint32_t set_idx = index_of(pa);
+				Entry& entry = entries[set_idx * way_count + next_victim[set_idx]];
+
+				if (++next_victim[set_idx] == way_count) next_victim[set_idx] = 0;
+
+				entry.tag = pa;
+				entry.isa = isa;
+				return entry.decode();
+			}
+
+			inline void invalidate(gpa_t pa)
+			{
+				Entry *set = set_ptr(pa);
+
+				for (uint32_t way = 0; way < way_count; way++) {
+					if (set[way].tag == pa) set[way].invalidate();
+				}
+			}
+
+			/**
+			 * Drops the instructions that start in the given code granules of
+			 * a page, whose content has changed.
+			 */
+			void invalidate_granules(gpa_t page, uint64_t granules)
+			{
+				if (!granules) return;
+
+				for (uint32_t i = 0; i < set_count * way_count; i++) {
+					Entry& entry = entries[i];
+					if (!entry.valid() || PAGE_ADDRESS_OF(entry.tag) != PAGE_ADDRESS_OF(page)) continue;
+
+					if (granules & (1ULL << (PAGE_OFFSET_OF(entry.tag) >> CODE_GRANULE_SHIFT))) {
+						entry.invalidate();
+					}
+				}
+			}
+
+			void invalidate_all()
+			{
+				for (uint32_t i = 0; i < set_count * way_count; i++) {
+					entries[i].invalidate();
+				}
+
+				for (uint32_t i = 0; i < set_count; i++) {
+					next_victim[i] = 0;
+				}
+			}
+
+		private:
+			struct Entry
+			{
+				uint32_t tag;
+				uint8_t isa;
+				uint8_t data[DECODE_OBJ_SIZE] __attribute__((aligned(8)));
+
+				inline Decode *decode() { return (Decode *)data; }
+
+				inline void invalidate() { tag = 1; }
+				inline bool valid() const { return tag != 1; }
+			};
+
+			uint32_t set_count, way_count;
+			Entry *entries;
+			uint32_t *next_victim;
+
+			// ARM instructions are word aligned, so Thumb instructions at odd
+			// halfwords are spread over the other half of the sets.
+			inline uint32_t index_of(gpa_t pa) const
+			{
+				uint32_t set_idx = (pa >> 2) & (set_count - 1);
+				if (pa & 2) set_idx ^= set_count >> 1;
+
+				return set_idx;
+			}
+
+			inline Entry *set_ptr(gpa_t pa) { return &entries[index_of(pa) * way_count]; }
+		};
+	}
+}
+
+#endif	/* DECODE_CACHE_H */
@@ -30,6 +30,8 @@ namespace captive {
 		class JumpInfo
 		{
 		public:
+			JumpInfo() : type(NONE), target(0), is_call(false) { }
+
 			enum JumpType
 			{
 				NONE,
@@ -39,6 +41,10 @@ namespace captive {
 
 			JumpType type;
 			uint32_t target;
+
+			// Set by the ISA for jumps that also save a return address (e.g.
+			// branch-and-link), so the JIT can predict the matching return.
+			bool is_call;
 		};
 	}
 }
@@ -0,0 +1,76 @@
+#ifndef DENSE_SET_H
+#define DENSE_SET_H
+
+#include <define.h>
+#include <vector>
+
+/**
+ * A set of small integers, such as virtual register ids, kept as a bitmap.
+ * Each member costs a single bit, so a set per block of a translation is
+ * cheap, and sets can be combined a word at a time.
+ */
+class DenseSet {
+private:
+	std::vector<uint64_t> _words;
+
+public:
+	DenseSet() { }
+	DenseSet(uint32_t size) : _words((size + 63) / 64, 0) { }
+
+	void resize(uint32_t size) { _words.assign((size + 63) / 64, 0); }
+
+	void set(uint32_t i) { _words[i >> 6] |= 1ULL << (i & 63); }
+	void clear(uint32_t i) { _words[i >> 6] &= ~(1ULL << (i & 63)); }
+	bool get(uint32_t i) const { return _words[i >> 6] & (1ULL << (i & 63)); }
+
+	void clear() { for (auto& word : _words) word = 0; }
+	void fill() { for (auto& word : _words) word = ~0ULL; }
+
+	// Adds the members of another set of the same size, and returns whether
+	// any were new.
+	bool merge(const DenseSet& other)
+	{
+		bool changed = false;
+
+		for (uint32_t i = 0; i < _words.size(); i++) {
+			uint64_t merged = _words[i] | other._words[i];
+			changed |= merged != _words[i];
+			_words[i] = merged;
+		}
+
+		return changed;
+	}
+
+	// Makes this set (uses | (outs & ~defs)), the usual liveness equation,
+	// and returns whether it changed.
+	bool assign_live(const DenseSet& uses, const DenseSet& outs, const DenseSet& defs)
+	{
+		bool changed = false;
+
+		for (uint32_t i = 0; i < _words.size(); i++) {
+			uint64_t live = uses._words[i] | (outs._words[i] & ~defs._words[i]);
+			changed |= live != _words[i];
+			_words[i] = live;
+		}
+
+		return changed;
+	}
+
+	// Returns the first member that is at least 'from', or -1 if there is
+	// none.
+	int32_t next(uint32_t from) const
+	{
+		uint32_t word = from >> 6;
+		if (word >= _words.size()) return -1;
+
+		uint64_t bits = _words[word] & (~0ULL << (from & 63));
+		while (!bits) {
+			if (++word == _words.size()) return -1;
+			bits = _words[word];
+		}
+
+		return (word << 6) + __builtin_ctzll(bits);
+	}
+};
+
+#endif
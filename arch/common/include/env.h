@@ -15,6 +15,7 @@ namespace captive {
 	namespace arch {
 		class CPU;
 		class CoreDevice;
+		class Decode;
 
 		class Environment
 		{
@@ -27,6 +28,11 @@ namespace captive {
 
 			virtual CPU *create_cpu() = 0;
 
+			// Returns true if the decoded instruction saves a return address
+			// as it jumps, e.g. a branch-and-link.  The JIT uses this to
+			// predict the matching return.
+			virtual bool is_call_instruction(uint8_t isa, const Decode *insn) const { return false; }
+
 			bool write_core_device(CPU& cpu, uint32_t id, uint32_t reg, uint32_t data);
 			bool read_core_device(CPU& cpu, uint32_t id, uint32_t reg, uint32_t& data);
 
@@ -27,19 +27,51 @@ namespace captive {
 			class BlockCompiler
 			{
 			public:
-				BlockCompiler(TranslationContext& ctx, gpa_t pa, const CPU::TaggedRegisters& tagged_regs, bool emit_interrupt_check = false, bool emit_chaining_logic = false);
+				BlockCompiler(TranslationContext& ctx, gpa_t pa, const CPU::TaggedRegisters& tagged_regs, bool emit_interrupt_check = false, bool emit_chaining_logic = false, uint32_t *exec_counter = NULL, std::vector<profile::OutgoingLink> *chain_links = NULL);
 				bool compile(shared::block_txln_fn& fn);
 
+				// Compiles the block without optimising it, for code that may
+				// only run a handful of times.  The translation asks to be
+				// recompiled once it has run BLOCK_TIER_UP_THRESHOLD times.
+				bool compile_baseline(shared::block_txln_fn& fn);
+
+				inline uint32_t code_size() { return encoder.get_buffer_size(); }
+
+				// Accumulates the time spent in each pass, and the size of
+				// what was compiled, into the given statistics.
+				inline void record_stats(shared::CompileStats *stats) { this->stats = stats; }
+
+				// The places in the generated code that refer to other blocks
+				// of the page, which must be fixed up if the code is moved.
+				inline const std::vector<shared::StoredRelocation>& relocations() const { return _relocations; }
+
 			private:
+				// Drives individual steps of the compiler, for the hosted tests.
+				friend class BlockCompilerTest;
+
 				TranslationContext& ctx;
 				x86::X86Encoder encoder;
 				gpa_t pa;
 				const CPU::TaggedRegisters& tagged_regs;
 				bool emit_interrupt_check;
 				bool emit_chaining_logic;
+				uint32_t *exec_counter;
+				std::vector<profile::OutgoingLink> *chain_links;	// Where the links of the exit slots are recorded
+				bool baseline;
+
+				shared::CompileStats *stats;
+				uint64_t phase_start;
+				uint32_t spill_count;
+
+				void end_phase(shared::CompileStats::CompilePhase phase);
+				void record_totals(uint32_t ir_in);
 
 				PopulatedSet<9> used_phys_regs;
 
+				std::vector<shared::StoredRelocation> _relocations;
+				void add_relocation(uint32_t code_offset, shared::StoredRelocation::StoredRelocationType type, uint32_t target_offset);
+				void emit_exec_count();
+
 				typedef std::map<shared::IRBlockId, std::vector<shared::IRBlockId>> cfg_t;
 				typedef std::vector<shared::IRBlockId> block_list_t;
 
@@ -55,13 +87,14 @@ namespace captive {
 				bool allocate();
 				bool post_allocate_peephole();
 				bool lower(uint32_t max_stack);
-				bool lower_to_interpreter();
-				bool peeplower(uint32_t max_stack);
+				uint32_t peeplower(uint32_t ir_idx);
 				bool lower_stack_to_reg();
 				bool constant_prop();
 				bool reorder_blocks();
 				bool reg_value_reuse();
 				bool value_merging();
+				bool promote_guest_registers();
+				bool eliminate_dead_register_writes();
 
 				void dump_ir();
 
@@ -71,10 +104,12 @@ namespace captive {
 				void encode_operand_function_argument(shared::IROperand *oper, const x86::X86Register& reg, stack_map_t&);
 				void encode_operand_to_reg(shared::IROperand *operand, const x86::X86Register& reg);
 
-				std::map<uint64_t, const x86::X86Register *> register_assignments_1;
-				std::map<uint64_t, const x86::X86Register *> register_assignments_2;
-				std::map<uint64_t, const x86::X86Register *> register_assignments_4;
-				std::map<uint64_t, const x86::X86Register *> register_assignments_8;
+				// The host registers of each width, indexed by the register
+				// numbers handed out by the allocator.
+				const x86::X86Register *register_assignments_1[9];
+				const x86::X86Register *register_assignments_2[9];
+				const x86::X86Register *register_assignments_4[9];
+				const x86::X86Register *register_assignments_8[9];
 
 				inline const x86::X86Register &get_allocable_register(int index, int size)
 				{
@@ -102,10 +137,10 @@ namespace captive {
 					if (!force_width) force_width = oper->size;
 
 					switch (force_width) {
-					case 1:	return *(register_assignments_1.find(oper->alloc_data)->second);
-					case 2:	return *(register_assignments_2.find(oper->alloc_data)->second);
-					case 4:	return *(register_assignments_4.find(oper->alloc_data)->second);
-					case 8:	return *(register_assignments_8.find(oper->alloc_data)->second);
+					case 1:	return *register_assignments_1[oper->alloc_data];
+					case 2:	return *register_assignments_2[oper->alloc_data];
+					case 4:	return *register_assignments_4[oper->alloc_data];
+					case 8:	return *register_assignments_8[oper->alloc_data];
 					default: assert(false);
 					}
 				}
@@ -0,0 +1,36 @@
+/*
+ * File:   block-interpreter.h
+ */
+
+#ifndef BLOCK_INTERPRETER_H
+#define	BLOCK_INTERPRETER_H
+
+#include <define.h>
+#include <shared-jit.h>
+#include <jit/translation-context.h>
+
+namespace captive {
+	namespace arch {
+		namespace jit {
+			class BlockInterpreter
+			{
+			public:
+				/**
+				 * Predecodes the IR of a block, and returns an entry point that
+				 * interprets it, and can be called like a compiled translation.
+				 * Returns NULL if the IR can't be interpreted, in which case the
+				 * block must be compiled instead.  The translation asks to be
+				 * compiled once it has run BLOCK_INTERPRET_THRESHOLD times.
+				 *
+				 * Only the entry point is in the code cache.  The program is
+				 * returned in data, and must be released once nothing can
+				 * enter the translation any more.
+				 */
+				static shared::block_txln_fn create(const TranslationContext& ctx, gpa_t pa, uint8_t isa, uint32_t *exec_counter, void *& data);
+				static void release(void *data);
+			};
+		}
+	}
+}
+
+#endif	/* BLOCK_INTERPRETER_H */
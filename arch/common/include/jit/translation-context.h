@@ -71,6 +71,25 @@ namespace captive {
 				inline shared::IRInstruction *get_ir_buffer() { return _ir_insns; }
 				
 				inline void set_ir_buffer(shared::IRInstruction *new_buffer) { _ir_insns = new_buffer; }
+
+				// Packs the instructions that are still live into a buffer
+				// from the given allocator, for IR that is kept after it has
+				// been compiled, and returns its size.
+				uint32_t packed_size() const;
+				uint32_t pack(malloc::Allocator& allocator, const uint8_t *& ir) const;
+
+				// Replaces the instructions of the context, for passes that
+				// insert instructions rather than rewriting them in place.
+				inline void replace_instructions(const shared::IRInstruction *insns, uint32_t count)
+				{
+					ensure_buffer(count);
+
+					for (uint32_t i = 0; i < count; i++) {
+						_ir_insns[i] = insns[i];
+					}
+
+					_ir_insn_count = count;
+				}
 				
 				// TODO: if !NDEBUG, check that max block is actually the max block number
 				void recount_blocks(uint32_t max_block) { _ir_block_count = max_block; }
@@ -0,0 +1,81 @@
+#ifndef ARENA_ALLOCATOR_H
+#define ARENA_ALLOCATOR_H
+
+#include <malloc/allocator.h>
+
+// How much memory the arena takes from its backing allocator at a time.
+#define ARENA_CHUNK_SIZE		0x40000
+
+namespace captive {
+	namespace arch {
+		namespace malloc {
+			/**
+			 * A bump allocator for memory that is only needed while code is
+			 * being compiled.  Everything is released at once by reset(), and
+			 * the chunks are kept for the next compilation, so once the arena
+			 * has grown to fit the largest compilation it never goes back to
+			 * the backing allocator.  Only the most recent allocation can be
+			 * freed or grown in place.
+			 *
+			 * While the arena is active, the global operator new allocates
+			 * from it, so that the containers used by the compiler passes do
+			 * too.
+			 */
+			class ArenaAllocator : public Allocator
+			{
+			public:
+				ArenaAllocator(Allocator& backing);
+
+				void *alloc(size_t size) override;
+				void *realloc(void *p, size_t new_size) override;
+				void free(void *p) override;
+
+				void reset();
+
+				bool contains(const void *p) const;
+
+				inline bool active() const { return _active; }
+				inline void active(bool active) { _active = active; }
+
+			private:
+				struct Chunk
+				{
+					Chunk *next;
+					uint64_t size;
+				};
+
+				struct AllocationHeader
+				{
+					uint64_t size;
+					uint64_t padding;
+				};
+
+				Allocator& _backing;
+				Chunk *_first, *_current;
+				uint64_t _next;
+				AllocationHeader *_last;
+				bool _active;
+
+				inline uint64_t chunk_base(const Chunk *chunk) const { return (uint64_t)(chunk + 1); }
+				inline uint64_t chunk_end(const Chunk *chunk) const { return chunk_base(chunk) + chunk->size; }
+			};
+
+			/**
+			 * Makes the global operator new allocate from an arena, for as long
+			 * as it is in scope.
+			 */
+			class ArenaScope
+			{
+			public:
+				ArenaScope(ArenaAllocator& arena) : _arena(arena), _was_active(arena.active()) { _arena.active(true); }
+				~ArenaScope() { _arena.active(_was_active); }
+
+			private:
+				ArenaAllocator& _arena;
+				bool _was_active;
+			};
+		}
+	}
+}
+
+#endif /* ARENA_ALLOCATOR_H */
@@ -16,15 +16,51 @@
 
 #include <malloc/allocator.h>
 
+// The code cache is a single contiguous arena, so that every translation is
+// within rel32 range of every other.
+#define CODE_ARENA_PAGES		0x4000
+#define CODE_ARENA_SIZE			(CODE_ARENA_PAGES * 4096ULL)
+
+// When less than this much of the arena is free, the code cache is flushed
+// before the next translation is compiled.
+#define CODE_ARENA_HEADROOM		0x100000
+
 namespace captive {
 	namespace arch {
 		namespace malloc {
+			/**
+			 * A bump allocator for translated code.  Memory is only reclaimed
+			 * when the most recent allocation is freed (e.g. when compilation
+			 * fails), or when the whole arena is reset.  The most recent
+			 * allocation is grown in place, so a translation does not move
+			 * while it is being emitted.
+			 */
 			class CodeMemoryAllocator : public Allocator
 			{
 			public:
+				CodeMemoryAllocator();
+
+				void init(void *arena, size_t arena_size);
+
 				void *alloc(size_t size) override;
 				void *realloc(void *p, size_t new_size) override;
 				void free(void *p) override;
+
+				inline bool needs_flush() const { return (_arena_end - _next) < CODE_ARENA_HEADROOM; }
+				void reset();
+
+				inline bool contains(const void *p) const { return (uint64_t)p >= _arena_base && (uint64_t)p < _arena_end; }
+
+			private:
+				struct AllocationHeader
+				{
+					uint64_t size;
+					uint64_t padding;
+				};
+
+				uint64_t _arena_base, _arena_end;
+				uint64_t _next;
+				AllocationHeader *_last;
 			};
 		}
 	}
@@ -17,6 +17,7 @@
 #include <malloc/code-memory-allocator.h>
 #include <malloc/data-memory-allocator.h>
 #include <malloc/shared-memory-allocator.h>
+#include <malloc/arena-allocator.h>
 
 namespace captive {
 	namespace arch {
@@ -24,6 +25,7 @@ namespace captive {
 			extern DataMemoryAllocator data_alloc;
 			extern CodeMemoryAllocator code_alloc;
 			extern SharedMemoryAllocator shmem_alloc;
+			extern ArenaAllocator compile_alloc;
 		}
 	}
 }
@@ -146,6 +146,7 @@ namespace captive {
 
 			pa_t _next_phys_page;
 			va_t _data_base;
+			pa_t _root;		// The PML4 that CR3 currently points to
 
 			static uint64_t __force_order;
 
@@ -202,8 +203,8 @@ namespace captive {
 				table_idx_t pm_idx, pdp_idx, pd_idx, pt_idx;
 				va_table_indicies(va, pm_idx, pdp_idx, pd_idx, pt_idx);
 
-				// L4 read_cr3()
-				pm = &((page_map_t *)PHYS_TO_VIRT(CR3))->entries[pm_idx];
+				// L4, from the active page tables
+				pm = &((page_map_t *)PHYS_TO_VIRT(mm->_root))->entries[pm_idx];
 				if (pm->base_address() == 0) {
 					auto page = Memory::alloc_page();
 					pm->base_address((uint64_t)page.pa);
@@ -12,6 +12,9 @@
 
 #include "mm.h"
 
+#define ADDRESS_SPACE_COUNT	8
+#define WRITABLE_LOG_SIZE	64
+
 namespace captive {
 	namespace arch {
 		class CPU;
@@ -75,7 +78,7 @@ namespace captive {
 
 			void set_page_dirty(va_t va, bool dirty);
 			bool is_page_dirty(va_t va);
-			uint32_t page_checksum(va_t va);
+			uint64_t page_checksum(va_t va);
 
 			bool handle_fault(gva_t va, gpa_t& out_pa, const access_info& info, resolution_fault& fault, bool emulate_user);
 			virtual bool resolve_gpa(gva_t va, gpa_t& pa, const access_info& info, resolution_fault& fault, bool have_side_effects = true) = 0;
@@ -85,11 +88,54 @@ namespace captive {
 			void invalidate_virtual_mappings();
 			void invalidate_virtual_mapping(gva_t va);
 
+			/**
+			 * Makes the shadow page tables of a guest address space active.
+			 * An address space is identified by the guest's ASID alone, as
+			 * the guest must invalidate its TLB before reusing an ASID for
+			 * another translation table.  It keeps the mappings that were
+			 * faulted in while it was active, so that switching back to it
+			 * does not have to rebuild them.  Where the host supports PCIDs,
+			 * its TLB entries also survive the switch.
+			 */
+			void switch_address_space(uint32_t asid);
+			void invalidate_address_space(uint32_t asid);
+
 			void disable_writes();
 
 		private:
 			CPU& _cpu;
 
+			struct AddressSpace {
+				uint32_t asid;
+				bool valid;		// The address space belongs to a guest context
+				bool stale;		// The TLB may hold out-of-date entries for its PCID
+				uint64_t last_used;
+
+				// The pages made writable while the address space was active,
+				// since its TLB entries were last flushed.  If writes are
+				// disabled while it is inactive, only these are flushed when
+				// it is next loaded.  Once the log overflows, the whole PCID
+				// is flushed instead.
+				va_t writable_pages[WRITABLE_LOG_SIZE];
+				uint32_t writable_count;
+				bool writes_disabled;
+				pa_t root;		// The PML4 of its shadow page tables
+				page_dir_ptr_t *pdp;	// The PDP that holds the guest mappings
+			};
+
+			AddressSpace address_spaces[ADDRESS_SPACE_COUNT];
+			AddressSpace *current_space;
+			uint64_t address_space_clock;
+			bool pcid_enabled;
+
+			void create_address_space(AddressSpace& as);
+			void load_address_space(AddressSpace& as);
+			void invalidate_current_space();
+			void note_writable_page(va_t va);
+
+			static void clear_guest_mappings(page_dir_ptr_t *pdp);
+			static page_table_entry_t *lookup_guest_entry(page_dir_ptr_t *pdp, va_t va);
+
 			inline pa_t gpa_to_hpa(gpa_t gpa) const {
 				return (pa_t)(0x100000000ULL | (uint64_t)gpa);
 			}
@@ -11,32 +11,98 @@
 #include <define.h>
 #include <malloc/malloc.h>
 #include <shared-jit.h>
+#include <jit/block-interpreter.h>
 
 #include <set>
+#include <vector>
 
 namespace captive {
 	namespace arch {
 		namespace profile {
+			struct Region;
+
+			/**
+			 * An exit slot of a translation that has been linked to a block
+			 * of the given region.  The link is recorded on both sides, so
+			 * that it can be dropped when either translation goes.
+			 */
+			struct OutgoingLink
+			{
+				uint32_t *guard;		// The PC compared against by the slot
+				Region *target;
+			};
+
 			struct Block
 			{
-				Block() : exec_count(0), entry(false), loop_header(false), txln(NULL), ir(NULL), ir_count(0) { }
+				Block(uint32_t offset) : offset(offset), exec_count(0), entry(false), loop_header(false), txln(NULL), superblock_txln(NULL), baseline(false), interpreted(false), dispatches(false), retired_entry_count(0), interpreter_data(NULL), ir(NULL), ir_size(0), code_granules(0) { }
 				
+				uint32_t offset;			// The offset of the block in its page
 				uint32_t exec_count;
 				bool entry, loop_header;
 				captive::shared::block_txln_fn txln;
-				const captive::shared::IRInstruction *ir;
-				uint32_t ir_count;
+				captive::shared::block_txln_fn superblock_txln;	// The superblock headed by this block, if any
+				bool baseline;				// The translation is from the baseline compiler
+				bool interpreted;			// The translation runs in the IR interpreter
+				bool dispatches;			// The translation jumps straight into other blocks of the page
+
+				// The entries of translations that were replaced by a higher
+				// tier, which were patched to jump to their replacement.
+				uint8_t *retired_entries[2];
+				uint8_t retired_entry_count;
+
+				void *interpreter_data;		// The program of an interpreted translation
+
+				const uint8_t *ir;			// Packed IR, for region compilation
+				uint32_t ir_size;
+				uint64_t code_granules;		// The code granules of the page that were translated
+
+				// The exit slots of the translation that have been linked.
+				// These are dropped by the region before the block is
+				// invalidated.
+				std::vector<OutgoingLink> outgoing_links;
 				
+				/**
+				 * Records the entry of a translation that is about to be patched
+				 * to jump to the one that replaces it.  Returns false if no more
+				 * entries can be recorded, in which case it must not be patched.
+				 */
+				inline bool retire_entry(uint8_t *entry)
+				{
+					if (retired_entry_count == sizeof(retired_entries) / sizeof(retired_entries[0])) return false;
+
+					retired_entries[retired_entry_count++] = entry;
+					return true;
+				}
+
 				inline void invalidate()
 				{
 					exec_count = 0;
 					entry = false;
 					loop_header = false;
+					code_granules = 0;
 					
-					if (txln) {
-						// TODO: FIXME: XXX
-						//malloc::data_alloc.free((void *)txln);
-						txln = NULL;
+					// The code itself is reclaimed when the code cache is flushed.
+					txln = NULL;
+					superblock_txln = NULL;
+					baseline = false;
+					interpreted = false;
+					dispatches = false;
+
+					// Anything still jumping to a retired entry would be taken
+					// to the dead translation that replaced it, so make the
+					// entry go back to the engine instead, which looks the PC
+					// up again.  This is xor %eax, %eax; ret.
+					for (uint8_t i = 0; i < retired_entry_count; i++) {
+						retired_entries[i][0] = 0x31;
+						retired_entries[i][1] = 0xc0;
+						retired_entries[i][2] = 0xc3;
+					}
+
+					retired_entry_count = 0;
+
+					if (interpreter_data) {
+						captive::arch::jit::BlockInterpreter::release(interpreter_data);
+						interpreter_data = NULL;
 					}
 					
 					if (ir) {
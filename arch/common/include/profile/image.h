@@ -12,41 +12,63 @@
 #include <string.h>
 #include <profile/region.h>
 
+#include <vector>
+
+#define IMAGE_TABLE_BITS	10
+#define IMAGE_TABLE_SIZE	(1 << IMAGE_TABLE_BITS)
+
 namespace captive {
 	namespace arch {
 		namespace profile {
 			struct Region;
 			struct Block;
 			
+			/**
+			 * The regions of the image are kept in a two-level table indexed
+			 * by physical page number, where each second-level table covers
+			 * 4MB of physical memory and is only allocated once it is used.
+			 * Every region is also kept in a flat list, so that walking the
+			 * image only touches regions that exist.
+			 */
 			struct Image
 			{
-				Image() { bzero(regions, sizeof(regions)); }
-				
-				Region *regions[0x100000];
+				Image() { bzero(directory, sizeof(directory)); }
 				
 				inline Region *get_region(uint32_t addr)
 				{
-					Region **region_ptr = &regions[addr >> 12];
-					if (*region_ptr == NULL) *region_ptr = new Region();
-					
-					return *region_ptr;
+					return get_region_from_index(addr >> 12);
 				}
 				
 				inline Region *get_region_from_index(uint32_t idx)
 				{
-					Region **region_ptr = &regions[idx];
-					if (*region_ptr == NULL) *region_ptr = new Region();
+					Region **table = directory[idx >> IMAGE_TABLE_BITS];
+					if (unlikely(table == NULL)) {
+						table = new Region *[IMAGE_TABLE_SIZE];
+						bzero(table, sizeof(Region *) * IMAGE_TABLE_SIZE);
+
+						directory[idx >> IMAGE_TABLE_BITS] = table;
+					}
+
+					Region **region_ptr = &table[idx & (IMAGE_TABLE_SIZE - 1)];
+					if (unlikely(*region_ptr == NULL)) {
+						*region_ptr = new Region(idx);
+						regions.push_back(*region_ptr);
+					}
 					
 					return *region_ptr;
 				}
 				
 				inline void invalidate()
 				{
-					for (int i = 0; i < 0x100000; i++) {
-						if (regions[i])
-							regions[i]->invalidate();
+					for (auto rgn : regions) {
+						rgn->invalidate();
 					}
 				}
+
+				std::vector<Region *> regions;
+
+			private:
+				Region **directory[0x100000 >> IMAGE_TABLE_BITS];
 			};
 		}
 	}
@@ -13,50 +13,250 @@
 #include <profile/block.h>
 #include <malloc/malloc.h>
 
+#include <vector>
+
+// Guard value of an exit slot that is not linked.  No instruction can be
+// fetched from an odd PC, so this never matches.
+#define CHAIN_SLOT_FREE		1
+#define CHAIN_SLOT_SIZE		12
+
+// Code in a page is tracked in 64-byte granules, so that a write only
+// invalidates the translations of the granules it modified.
+#define CODE_GRANULE_SHIFT	6
+#define CODE_GRANULE_SIZE	(1 << CODE_GRANULE_SHIFT)
+#define CODE_GRANULE_COUNT	(0x1000 >> CODE_GRANULE_SHIFT)
+
 namespace captive {
 	namespace shared {
 		struct RegionWorkUnit;
+		struct StoredPage;
 	}
 
 	namespace arch {
 		namespace profile {
 			struct Block;
 
+			/**
+			 * A direct jump from an exit slot of one block translation to the
+			 * entry of another, patched in lazily by the engine.  The slot only
+			 * takes the jump if the PC matches its guard, so unlinking just
+			 * resets the guard.
+			 */
+			struct ChainLink
+			{
+				uint32_t *guard;		// The PC compared against by the slot
+				uint32_t target_pc;		// The virtual PC that was linked to
+
+				inline void unlink() { *guard = CHAIN_SLOT_FREE; }
+			};
+
 			struct Region
 			{
-				Region() : txln(NULL), rwu(NULL), heat(0) { bzero(blocks, sizeof(blocks)); }
+				Region(uint32_t index) : index(index), txln(NULL), rwu(NULL), heat(0), generation(0), hot(false), code_granules(0), dirty(false), virt_page(1), aliased(false), stored_page(NULL), stored_page_checksum(0), stored_page_fetched(false) { }
+
+				uint32_t index;			// The physical page number of the region
+
+				// The blocks that have been seen in this region, in order of
+				// their page offset.
+				std::vector<Block *> blocks;
 
-				Block *blocks[0x1000];
 				captive::shared::region_txln_fn txln;
 				shared::RegionWorkUnit *rwu;
 				uint32_t heat;
+				uint32_t generation;
+				bool hot;				// Queued for region compilation
+
+				// Links from other translations into blocks of this region.
+				std::vector<ChainLink> incoming_links;
+
+				// The granules of the page that contain translated code, and a
+				// copy of each of them taken when it was translated.  Once the
+				// page has been written to, it is marked dirty, and the copies
+				// are compared before any of its code runs again.
+				uint64_t code_granules;
+				uint8_t code_snapshot[CODE_GRANULE_COUNT][CODE_GRANULE_SIZE];
+				bool dirty;
+
+				// The virtual page this region was last entered through, and
+				// whether it has ever been entered through more than one.
+				uint32_t virt_page;
+				bool aliased;
+
+				// Translations of this page made by earlier runs, fetched from
+				// the host the first time a block of the page is compiled.
+				shared::StoredPage *stored_page;
+				uint64_t stored_page_checksum;
+				bool stored_page_fetched;
+
+				static inline uint64_t code_granule_mask(uint32_t offset, uint32_t length)
+				{
+					uint32_t first = (offset & 0xfff) >> CODE_GRANULE_SHIFT;
+					uint32_t last = (((offset & 0xfff) + length - 1) & 0xfff) >> CODE_GRANULE_SHIFT;
+
+					// An instruction that crosses the end of the page only
+					// occupies the last granule of this one.
+					if (last < first) last = CODE_GRANULE_COUNT - 1;
+
+					uint64_t mask = 0;
+					for (uint32_t granule = first; granule <= last; granule++) {
+						mask |= 1ULL << granule;
+					}
+
+					return mask;
+				}
+
+				inline void note_virt_page(uint32_t page)
+				{
+					if (virt_page == 1) {
+						virt_page = page;
+					} else if (virt_page != page) {
+						aliased = true;
+					}
+				}
 
 				inline Block *get_block(uint32_t addr)
 				{
-					Block **block_ptr = &blocks[addr & 0xfff];
-					if (*block_ptr == NULL) {
-						*block_ptr = new Block();
+					uint32_t offset = addr & 0xfff;
+
+					// Binary search for the block, which otherwise belongs at
+					// the position where the search ends.
+					uint32_t lo = 0, hi = blocks.size();
+					while (lo < hi) {
+						uint32_t mid = (lo + hi) >> 1;
+
+						if (blocks[mid]->offset < offset) {
+							lo = mid + 1;
+						} else if (blocks[mid]->offset > offset) {
+							hi = mid;
+						} else {
+							return blocks[mid];
+						}
 					}
 
-					return *block_ptr;
+					Block *blk = new Block(offset);
+					blocks.insert(blocks.begin() + lo, blk);
+
+					return blk;
 				}
 
-				inline void invalidate()
+				inline void unlink_all()
+				{
+					for (auto& link : incoming_links) {
+						link.unlink();
+					}
+
+					incoming_links.clear();
+				}
+
+				/**
+				 * Drops the link from the exit slot with the given guard, if
+				 * it is still linked to a block of this region.
+				 */
+				inline void drop_incoming_link(uint32_t *guard)
 				{
+					for (auto link = incoming_links.begin(); link != incoming_links.end(); ++link) {
+						if (link->guard == guard) {
+							link->unlink();
+							incoming_links.erase(link);
+							return;
+						}
+					}
+				}
+
+				/**
+				 * Unlinks the exit slots of a translation that is going away,
+				 * so that its targets no longer refer to them.
+				 */
+				static inline void drop_outgoing_links(std::vector<OutgoingLink>& links)
+				{
+					for (auto& link : links) {
+						link.target->drop_incoming_link(link.guard);
+					}
+
+					links.clear();
+				}
+
+				inline void unlink_page(uint32_t virt_page)
+				{
+					for (auto link = incoming_links.begin(); link != incoming_links.end(); ) {
+						if ((link->target_pc & ~0xfffU) == virt_page) {
+							link->unlink();
+							link = incoming_links.erase(link);
+						} else {
+							++link;
+						}
+					}
+				}
+
+				inline void invalidate_region_txln()
+				{
+					// Any work unit still owned by the compiler is now stale.  It
+					// is freed when it is handed back, and in the meantime a
+					// newer work unit may be submitted for this region.
 					if (rwu) {
 						rwu->valid = 0;
+						rwu = NULL;
 					}
 
+					generation++;
+
 					if (txln) {
 						malloc::shmem_alloc.free((void *)txln);
 						txln = NULL;
 					}
+				}
 
-					for (int i = 0; i < 0x1000; i++) {
-						if (blocks[i]) {
-							blocks[i]->invalidate();
+				inline void release_stored_page()
+				{
+					if (stored_page) {
+						malloc::shmem_alloc.free(stored_page);
+						stored_page = NULL;
+					}
+
+					stored_page_fetched = false;
+				}
+
+				inline void invalidate()
+				{
+					unlink_all();
+					invalidate_region_txln();
+					release_stored_page();
+
+					for (auto blk : blocks) {
+						drop_outgoing_links(blk->outgoing_links);
+						blk->invalidate();
+					}
+
+					code_granules = 0;
+					dirty = false;
+					virt_page = 1;
+					aliased = false;
+				}
+
+				/**
+				 * Invalidates only the blocks that were translated from any of
+				 * the given granules, and returns true if there were any.
+				 * Blocks that dispatch straight to other blocks of the page are
+				 * invalidated too, as their targets may be among them.
+				 */
+				inline bool invalidate_granules(uint64_t granules)
+				{
+					if (!(code_granules & granules)) return false;
+
+					unlink_all();
+					invalidate_region_txln();
+
+					code_granules = 0;
+					for (auto blk : blocks) {
+						if ((blk->code_granules & granules) || blk->dispatches) {
+							drop_outgoing_links(blk->outgoing_links);
+							blk->invalidate();
+						} else {
+							code_granules |= blk->code_granules;
 						}
 					}
+
+					return true;
 				}
 			};
 		}
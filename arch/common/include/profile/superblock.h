@@ -0,0 +1,68 @@
+/*
+ * File:   superblock.h
+ * Author: s0457958
+ *
+ * Created on 03 September 2015, 11:02
+ */
+
+#ifndef SUPERBLOCK_H
+#define	SUPERBLOCK_H
+
+#include <define.h>
+#include <shared-jit.h>
+#include <profile/block.h>
+
+#include <vector>
+
+namespace captive {
+	namespace arch {
+		namespace profile {
+			struct Region;
+
+			/**
+			 * A single translation of a hot path through several blocks,
+			 * which may span pages.  Between members, the translation checks
+			 * that the path is still being followed, and leaves through a
+			 * side exit if not.  It is entered in place of the translation of
+			 * its head block, and is dropped if any of its pages are written
+			 * to or remapped.
+			 */
+			struct Superblock
+			{
+				Block *head;
+				Region *head_region;
+				gva_t head_pc;
+
+				// The pages the members were translated from, and the
+				// virtual pages they were reached through.
+				std::vector<Region *> regions;
+				std::vector<gva_t> virt_pages;
+
+				captive::shared::block_txln_fn txln;
+
+				// The exit slots of the translation that have been linked.
+				std::vector<OutgoingLink> outgoing_links;
+
+				inline bool depends_on(const Region *rgn) const
+				{
+					for (auto member_rgn : regions) {
+						if (member_rgn == rgn) return true;
+					}
+
+					return false;
+				}
+
+				inline bool depends_on(gva_t virt_page) const
+				{
+					for (auto member_page : virt_pages) {
+						if (member_page == virt_page) return true;
+					}
+
+					return false;
+				}
+			};
+		}
+	}
+}
+
+#endif	/* SUPERBLOCK_H */
@@ -62,6 +62,102 @@ namespace captive {
 
 			inner_type_t *entry_ptr_clean(uint64_t entry_idx) { return &entries[entry_idx % cache_size]; }
 		};
+
+		/**
+		 * A set-associative variant of Cache, for entries that carry a tag.
+		 * The ways of a set are contiguous, so generated code can probe a
+		 * whole set from a single base address.  Way 0 always holds the
+		 * most recently inserted entry, and the last way is the one evicted,
+		 * so a lookup never has to update any replacement state.
+		 */
+		template<typename inner_type_t, uint64_t set_count, uint32_t way_count>
+		class AssociativeCache
+		{
+		public:
+			AssociativeCache()
+			{
+				invalidate_all();
+			}
+
+			inline inner_type_t *ptr() { return entries; }
+
+			/**
+			 * Returns the entry to fill for the given tag.  If the tag is
+			 * already present, its entry is returned.  Otherwise the ways
+			 * of the set are shifted down, and way 0 is returned.  The result
+			 * is MISS if the tag was not present, or EVICTION if a valid
+			 * entry had to be dropped to make room for it.
+			 */
+			template<typename tag_t>
+			inline inner_type_t *insert(uint64_t set_idx, tag_t tag, int& result)
+			{
+				inner_type_t *set = set_ptr_clean(set_idx);
+				dirty_pages.set((set_idx % set_count) >> set_bits);
+
+				for (uint32_t way = 0; way < way_count; way++) {
+					if (set[way].tag == tag) {
+						result = HIT;
+						return &set[way];
+					}
+				}
+
+				result = set[way_count - 1].valid() ? EVICTION : MISS;
+
+				for (uint32_t way = way_count - 1; way > 0; way--) {
+					set[way] = set[way - 1];
+				}
+
+				return &set[0];
+			}
+
+			void invalidate_all()
+			{
+				for (uint64_t i = 0; i < set_count; ++i) {
+					invalidate_entry(i);
+				}
+
+				dirty_pages.reset();
+			}
+
+			void invalidate_dirty()
+			{
+				if (dirty_pages.none()) return;
+
+				for (uint32_t i = 0; i < dirty_pages.size(); ++i) {
+					if (dirty_pages.test(i)) {
+						for (uint64_t set = i * sets_per_page; set < (i+1) * sets_per_page; ++set) {
+							invalidate_entry(set);
+						}
+					}
+				}
+
+				dirty_pages.reset();
+			}
+
+			void invalidate_entry(uint64_t set_idx)
+			{
+				inner_type_t *set = set_ptr_clean(set_idx);
+				for (uint32_t way = 0; way < way_count; way++) {
+					set[way].invalidate();
+				}
+			}
+
+			enum insert_result {
+				HIT,
+				MISS,
+				EVICTION
+			};
+
+		private:
+			static const uint32_t set_bits = 11;
+			static const uint32_t set_page_count = set_count >> set_bits;
+			static const uint32_t sets_per_page = 1 << set_bits;
+
+			inner_type_t entries[set_count * way_count];
+			std::bitset<set_page_count> dirty_pages;
+
+			inner_type_t *set_ptr_clean(uint64_t set_idx) { return &entries[(set_idx % set_count) * way_count]; }
+		};
 	}
 }
 
@@ -24,6 +24,7 @@ namespace captive {
 				enum {
 					I_MOV,
 					I_MOVZX,
+					I_MOVSX,
 				} type;
 
 				struct Operand Source;
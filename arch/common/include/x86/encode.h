@@ -136,9 +136,12 @@ namespace captive {
 				void wbinvd();
 				void invlpg(const X86Memory& addr);
 				void lea(const X86Memory& addr, const X86Register& dst);
+				void lea_rip(uint32_t target_offset, const X86Register& dst);	// Address of an offset in this buffer
 
 				void movzx(const X86Register& src, const X86Register& dst);
 				void movsx(const X86Register& src, const X86Register& dst);
+				void movzx(uint8_t size, const X86Memory& src, const X86Register& dst);
+				void movsx(uint8_t size, const X86Memory& src, const X86Register& dst);
 
 				void movq(const X86Register &src, const X86VectorRegister &dst);
 				void movq(const X86VectorRegister &src, const X86Register &dst);
@@ -241,6 +244,13 @@ namespace captive {
 				void jmp_offset(int32_t off);
 				void jmp_reloc(uint32_t& reloc_offset);
 
+				// A patchable exit slot, laid out as
+				// 0	cmp $guard, %eax
+				// 5	jne <next slot>
+				// 7	jmp <target>
+				// which starts out jumping to the next instruction.
+				void chain_slot(uint32_t guard);
+
 				void jcc_reloc(uint8_t v, uint32_t& reloc_offset);
 
 				inline void jo_reloc(uint32_t& reloc_offset) { jcc_reloc(0, reloc_offset); }
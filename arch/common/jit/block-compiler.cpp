@@ -1,5 +1,6 @@
 #include <jit/block-compiler.h>
 #include <jit/ir-sorter.h>
+#include <profile/region.h>
 
 #include <algorithm>
 #include <set>
@@ -9,9 +10,13 @@
 
 #include <small-set.h>
 #include <maybe-set.h>
+#include <dense-set.h>
 #include <tick-timer.h>
 
-#define NOP_BLOCK 0x7fffffff
+// The most guest registers that are held in host registers for the whole of
+// a translation, and how often one must be accessed to be worth it.
+#define MAX_PROMOTED_GUEST_REGS		4
+#define MIN_PROMOTED_GUEST_REG_USES	3
 
 extern "C" void cpu_set_mode(void *cpu, uint8_t mode);
 extern "C" void cpu_write_device(void *cpu, uint32_t devid, uint32_t reg, uint32_t val);
@@ -19,8 +24,6 @@ extern "C" void cpu_read_device(void *cpu, uint32_t devid, uint32_t reg, uint32_
 extern "C" void jit_rum(void *cpu);
 extern "C" void jit_trace(void *cpu, uint8_t opcode, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4);
 
-extern uint32_t interpret_ir(void *, void *, uint32_t);
-
 using namespace captive::arch::jit;
 using namespace captive::arch::jit::algo;
 using namespace captive::arch::x86;
@@ -49,13 +52,19 @@ static void dump_insn(IRInstruction *insn);
  * FS	Base Pointer to JIT STATE structure
  */
 
-BlockCompiler::BlockCompiler(TranslationContext& ctx, gpa_t pa, const CPU::TaggedRegisters& tagged_regs, bool emit_interrupt_check, bool emit_chaining_logic) 
+BlockCompiler::BlockCompiler(TranslationContext& ctx, gpa_t pa, const CPU::TaggedRegisters& tagged_regs, bool emit_interrupt_check, bool emit_chaining_logic, uint32_t *exec_counter, std::vector<profile::OutgoingLink> *chain_links) 
 	: ctx(ctx),
 		encoder(malloc::code_alloc),
 		pa(pa),
 		tagged_regs(tagged_regs),
 		emit_interrupt_check(emit_interrupt_check),
-		emit_chaining_logic(emit_chaining_logic)
+		emit_chaining_logic(emit_chaining_logic),
+		exec_counter(exec_counter),
+		chain_links(chain_links),
+		baseline(false),
+		stats(NULL),
+		phase_start(0),
+		spill_count(0)
 {
 	int i = 0;
 	assign(i++, REG_RAX, REG_EAX, REG_AX, REG_AL);
@@ -80,9 +89,8 @@ bool BlockCompiler::compile(block_txln_fn& fn)
 	//printf("*** before:\n");
 	//dump_ir();
 	
-	tick_timer timer(0);
-
-	timer.reset();
+	uint32_t ir_in = ctx.count();
+	if (stats) phase_start = __rdtsc();
 	
 #ifdef VERIFY_IR
 	if (!verify()) {
@@ -93,34 +101,45 @@ bool BlockCompiler::compile(block_txln_fn& fn)
 #endif
 	
 	if (!reorder_blocks()) return false;
-	timer.tick("block-reorder");
+	end_phase(CompileStats::REORDER_BLOCKS);
 	
 	if (!thread_jumps()) return false;
-	timer.tick("jump-threading");
+	end_phase(CompileStats::THREAD_JUMPS);
 	
 	if (!dbe()) return false;
-	timer.tick("dead-block-elimination");
+	end_phase(CompileStats::DEAD_BLOCKS);
 	
 	sort_ir();
+	end_phase(CompileStats::SORT);
 	
 	if (!merge_blocks()) return false;
-	timer.tick("block-merging");
+	end_phase(CompileStats::MERGE_BLOCKS);
 
 	if (!constant_prop()) return false;
-	timer.tick("constant-propagation");
+	end_phase(CompileStats::CONSTANT_PROP);
 	
 	if (!peephole()) return false;
-	timer.tick("peepholer");
+	end_phase(CompileStats::PEEPHOLE);
 
-	//sort_ir();
-	//if (!value_merging()) return false;
-	timer.tick("value-merging");
+	if (!sort_ir()) return false;
+	end_phase(CompileStats::SORT);
+
+	if (!reg_value_reuse()) return false;
+	end_phase(CompileStats::REG_VALUE_REUSE);
 
-	//if(!reg_value_reuse()) return false;
-	timer.tick("reg-val-reuse");
+	if (!value_merging()) return false;
+	end_phase(CompileStats::VALUE_MERGING);
 
 	if (!sort_ir()) return false;
-	timer.tick("sort");
+	end_phase(CompileStats::SORT);
+
+	if (!eliminate_dead_register_writes()) return false;
+	end_phase(CompileStats::DEAD_REG_WRITES);
+
+	// Region translations are optimised again by the host, so only block
+	// translations have their guest registers promoted here.
+	if (emit_chaining_logic && !promote_guest_registers()) return false;
+	end_phase(CompileStats::PROMOTE_GUEST_REGS);
 
 #ifdef VERIFY_IR
 	if (!verify()) {
@@ -131,17 +150,18 @@ bool BlockCompiler::compile(block_txln_fn& fn)
 #endif
 	
 	if (!analyse(max_stack)) return false;
-	timer.tick("reg-allocation");
+	end_phase(CompileStats::ALLOCATE);
 	
 #ifndef VERIFY_IR
 	if( !post_allocate_peephole()) return false;
-	timer.tick("post-alloc-peepholer");
+	end_phase(CompileStats::POST_ALLOCATE_PEEPHOLE);
 #endif
 	
 	if( !lower_stack_to_reg()) return false;
-	timer.tick("mem-2-reg");
+	end_phase(CompileStats::STACK_TO_REG);
 	
 	sort_ir();
+	end_phase(CompileStats::SORT);
 	
 	//printf("*** after:\n");
 	//dump_ir();
@@ -159,20 +179,131 @@ bool BlockCompiler::compile(block_txln_fn& fn)
 		return false;
 	}
 	
-	/*if (!lower_to_interpreter()) {
+	end_phase(CompileStats::LOWER);
+	record_totals(ir_in);
+
+	fn = (block_txln_fn)encoder.get_buffer();
+	
+	return encoder.get_buffer_size();
+}
+
+bool BlockCompiler::compile_baseline(block_txln_fn& fn)
+{
+	uint32_t max_stack = 0;
+
+	uint32_t ir_in = ctx.count();
+	if (stats) phase_start = __rdtsc();
+
+	baseline = true;
+
+	// Only the passes needed to produce correct code are run.  The register
+	// allocator is a single backwards pass, and is kept because not every
+	// instruction can be lowered with its operands on the stack.
+	if (!sort_ir()) return false;
+	end_phase(CompileStats::SORT);
+
+	if (!analyse(max_stack)) return false;
+	end_phase(CompileStats::ALLOCATE);
+
+	if (!lower_stack_to_reg()) return false;
+	end_phase(CompileStats::STACK_TO_REG);
+
+	if (!lower(max_stack)) {
 		encoder.destroy_buffer();
 		return false;
-	}*/
-	
-	timer.tick("lower");
+	}
+
+	end_phase(CompileStats::LOWER);
+	record_totals(ir_in);
 
-	timer.dump("compile ");
-	
 	fn = (block_txln_fn)encoder.get_buffer();
-	
+
 	return encoder.get_buffer_size();
 }
 
+void BlockCompiler::end_phase(CompileStats::CompilePhase phase)
+{
+	if (!stats) return;
+
+	uint64_t now = __rdtsc();
+	stats->record_phase(phase, now - phase_start);
+	phase_start = now;
+}
+
+void BlockCompiler::record_totals(uint32_t ir_in)
+{
+	if (!stats) return;
+
+	uint32_t ir_out = 0;
+	for (uint32_t ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		if (ctx.at(ir_idx)->ir_block != NOP_BLOCK) ir_out++;
+	}
+
+	if (baseline) {
+		stats->baseline_translations++;
+	} else {
+		stats->translations++;
+	}
+
+	stats->ir_in += ir_in;
+	stats->ir_out += ir_out;
+	stats->vregs += ctx.reg_count();
+	stats->spills += spill_count;
+	stats->code_bytes += encoder.get_buffer_size();
+}
+
+void BlockCompiler::add_relocation(uint32_t code_offset, StoredRelocation::StoredRelocationType type, uint32_t target_offset)
+{
+	StoredRelocation reloc;
+	reloc.code_offset = code_offset;
+	reloc.type = type;
+	reloc.target_offset = target_offset & 0xfff;
+
+	_relocations.push_back(reloc);
+}
+
+void BlockCompiler::emit_exec_count()
+{
+	if (!exec_counter) return;
+
+	encoder.ensure_extra_buffer(64);
+
+	// Count the executions of the block.  When it becomes hot, leave through
+	// the interrupt check, and ask the engine to recompile it if it is a
+	// baseline translation, or to record the path taken from here if not.
+	// The count then starts again, so the block asks again if the request
+	// is overwritten by another one, or comes to nothing.
+	//
+	// The counter is always a 64-bit immediate, which is the last eight
+	// bytes of the instruction.
+	uint32_t counter_mov_offset = encoder.current_offset();
+	encoder.mov((uint64_t)exec_counter, REG_RCX);
+	assert(encoder.current_offset() - counter_mov_offset == 10);
+	add_relocation(encoder.current_offset() - 8, StoredRelocation::ABS64_EXEC_COUNT, pa);
+
+	encoder.add4(1, X86Memory::get(REG_RCX, 0));
+	encoder.cmp4(baseline ? BLOCK_TIER_UP_THRESHOLD : SUPERBLOCK_HOT_THRESHOLD, X86Memory::get(REG_RCX, 0));
+	uint8_t *not_hot_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset() + 1;
+	encoder.jne((int8_t)0);
+
+	encoder.mov1(1, X86Memory::get(REG_FS, 48));
+
+	if (baseline) {
+		// Baseline translations are never stored, so the physical address
+		// of the block does not need a relocation.
+		encoder.mov1(1, X86Memory::get(REG_FS, 50));
+		encoder.mov1(*tagged_regs.ISA, X86Memory::get(REG_FS, 51));
+		encoder.mov4(pa, X86Memory::get(REG_FS, 52));
+	} else {
+		encoder.mov1(1, X86Memory::get(REG_FS, 49));
+	}
+
+	encoder.mov4(0, X86Memory::get(REG_RCX, 0));
+
+	uint8_t *current_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset();
+	*not_hot_offset = (uint8_t)(uint64_t)(current_offset - not_hot_offset - 1);
+}
+
 bool BlockCompiler::sort_ir()
 {
 	bool not_sorted = false;
@@ -580,256 +711,253 @@ static struct insn_descriptor insn_descriptors[] = {
 	{ .mnemonic = "trace",		.format = "NIIIII", .has_side_effects = true },
 };
 
+/*
+ * Register allocation is done by linear scan over the live intervals of the
+ * vregs, in the (sorted) order of the IR.  Each instruction has two
+ * positions: its inputs are read at the first, and its outputs are written
+ * at the second, so an output may take the register of an input that dies
+ * at the same instruction.  A vreg that is live across blocks gets an
+ * interval that covers every block it is live in, so it can stay in a
+ * register for the whole translation, instead of always living on the stack.
+ */
 bool BlockCompiler::analyse(uint32_t& max_stack)
 {
 	tick_timer timer(0);
 	timer.reset();
-	
-	IRBlockId latest_block_id = INVALID_BLOCK_ID;
 
 	used_phys_regs.clear();
 
-	std::vector<int32_t> allocation (ctx.reg_count());
-	maybe_map<IRRegId, uint32_t, 128> global_allocation (ctx.reg_count());	// global register allocation
+	uint32_t reg_count = ctx.reg_count();
+	uint32_t block_count = ctx.block_count();
 
-	typedef std::set<IRRegId> live_set_t;
-	live_set_t live_ins, live_outs;
-	std::vector<live_set_t::iterator> to_erase;
+	std::vector<int32_t> block_first (block_count, -1), block_last (block_count, -1);
+	std::vector<std::vector<IRBlockId>> block_succs (block_count);
+	std::vector<DenseSet> uses (block_count, DenseSet(reg_count)), defs (block_count, DenseSet(reg_count));
 
-	PopulatedSet<9> avail_regs; // Register indicies that are available for allocation.
-	uint32_t next_global = 0;	// Next stack location for globally allocated register.
+	// Find the extent and successors of each block, and the vregs that each
+	// block reads before writing, and writes.
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
 
-	std::vector<int32_t> vreg_seen_block (ctx.reg_count(), -1);
+		IRBlockId block = insn->ir_block;
+		if (block_first[block] == -1) block_first[block] = ir_idx;
+		block_last[block] = ir_idx;
 
-	timer.tick("Init");
+		if (insn->type == IRInstruction::JMP) {
+			block_succs[block].push_back((IRBlockId)insn->operands[0].value);
+		} else if (insn->type == IRInstruction::BRANCH) {
+			block_succs[block].push_back((IRBlockId)insn->operands[1].value);
+			block_succs[block].push_back((IRBlockId)insn->operands[2].value);
+		}
 
-	// Build up a map of which vregs have been seen in which blocks, to detect spanning vregs.
-	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
-		IRInstruction *insn = ctx.at(ir_idx);
+		const struct insn_descriptor *descr = &insn_descriptors[insn->type];
 
-		if(insn->ir_block == NOP_BLOCK) continue;
-		if(insn->type == IRInstruction::BARRIER) next_global = 0;
+		for (int op_idx = 0; op_idx < 6; op_idx++) {
+			IROperand *oper = &insn->operands[op_idx];
+			if (!oper->is_valid()) break;
+			if (!oper->is_vreg()) continue;
+
+			if (descr->format[op_idx] == 'I' || descr->format[op_idx] == 'B') {
+				if (!defs[block].get(oper->value)) uses[block].set(oper->value);
+			}
+		}
 
 		for (int op_idx = 0; op_idx < 6; op_idx++) {
 			IROperand *oper = &insn->operands[op_idx];
-			if(!oper->is_valid()) break;
-
-			// If the operand is a vreg, and is not already a global...
-			if (oper->is_vreg() && (global_allocation.count(oper->value) == 0)) {
-				auto seen_in_block = vreg_seen_block[oper->value];
-
-				// If we have already seen this operand, and not in the same block, then we
-				// must globally allocate it.
-				if (seen_in_block != -1 && seen_in_block != insn->ir_block) {
-					global_allocation[oper->value] = next_global;
-					next_global += 8;
-					if(next_global > max_stack) max_stack = next_global;
-				}
+			if (!oper->is_valid()) break;
+			if (!oper->is_vreg()) continue;
 
-				vreg_seen_block[oper->value] = insn->ir_block;
+			if (descr->format[op_idx] == 'O' || descr->format[op_idx] == 'B') {
+				defs[block].set(oper->value);
 			}
 		}
 	}
 
-	timer.tick("Globals");
-	
-	for (int ir_idx = ctx.count() - 1; ir_idx >= 0; ir_idx--) {
-		// Grab a pointer to the instruction we're looking at.
-		IRInstruction *insn = ctx.at(ir_idx);
-		if(insn->ir_block == NOP_BLOCK) continue;
+	timer.tick("Blocks");
 
-		// Make sure it has a descriptor.
-		assert(insn->type < ARRAY_SIZE(insn_descriptors));
-		const struct insn_descriptor *descr = &insn_descriptors[insn->type];
+	// Solve for the vregs that are live on entry to and exit from each block.
+	// Successors tend to come later in the IR, so walking the blocks in
+	// reverse converges quickly.
+	std::vector<DenseSet> live_in (block_count, DenseSet(reg_count)), live_out (block_count, DenseSet(reg_count));
 
-		// Detect a change in block
-		if (latest_block_id != insn->ir_block) {
-			// Clear the live-in working set and current allocations.
-			live_ins.clear();
-			allocation.assign(ctx.reg_count(), -1);
+	bool changed;
+	do {
+		changed = false;
 
-			// Reset the available register bitfield
-			avail_regs.fill(0x1ff);
+		for (int32_t block = block_count - 1; block >= 0; block--) {
+			if (block_first[block] == -1) continue;
 
-			// Update the latest block id.
-			latest_block_id = insn->ir_block;
-		}
+			for (auto succ : block_succs[block]) {
+				changed |= live_out[block].merge(live_in[succ]);
+			}
 
-		if(insn->type == IRInstruction::BARRIER) {
-			next_global = 0;
+			changed |= live_in[block].assign_live(uses[block], live_out[block], defs[block]);
 		}
+	} while (changed);
+
+	timer.tick("Liveness");
 
-		// Clear the live-out set, and make every current live-in a live-out.
-		live_outs = live_ins;
+	// Walk each block backwards from its live-out set, removing instructions
+	// whose results are never used, and build the interval of each vreg from
+	// the instructions that remain.
+	std::vector<uint32_t> interval_start (reg_count, 0xffffffff), interval_end (reg_count, 0);
+	DenseSet live (reg_count);
 
-		// Loop over the VREG operands and update the live-in set accordingly.
-		for (int o = 0; o < 6; o++) {
-			if (!insn->operands[o].is_valid()) break;
-			if (insn->operands[o].type != IROperand::VREG) continue;
+	for (uint32_t block = 0; block < block_count; block++) {
+		if (block_first[block] == -1) continue;
 
-			IROperand *oper = &insn->operands[o];
-			IRRegId reg = (IRRegId)oper->value;
+		live = live_out[block];
 
-			if (descr->format[o] == 'I') {
-				// <in>
-				live_ins.insert(reg);
-			} else if (descr->format[o] == 'O') {
-				// <out>
-				live_ins.erase(reg);
-			} else if (descr->format[o] == 'B') {
-				// <in/out>
-				live_ins.insert(reg);
-			}
-		}
+		for (int32_t ir_idx = block_last[block]; ir_idx >= block_first[block]; ir_idx--) {
+			IRInstruction *insn = ctx.at(ir_idx);
+			if (insn->ir_block == NOP_BLOCK) continue;
 
-		//printf("  [%03d] %10s", ir_idx, descr->mnemonic);
+			assert(insn->type < ARRAY_SIZE(insn_descriptors));
+			const struct insn_descriptor *descr = &insn_descriptors[insn->type];
 
-		// Release LIVE-OUTs that are not LIVE-INs
-		for (auto out : live_outs) {
-			if(global_allocation.count(out)) continue;
-			if (!live_ins.count(out)) {
-				assert(allocation[out] != -1);
+			bool dead = !descr->has_side_effects;
+			for (int op_idx = 0; op_idx < 6 && dead; op_idx++) {
+				IROperand *oper = &insn->operands[op_idx];
+				if (!oper->is_valid()) break;
 
-				// Make the released register available again.
-				avail_regs.set(allocation[out]);
+				if (oper->is_vreg() && descr->format[op_idx] != 'I' && live.get(oper->value)) dead = false;
+			}
+
+			if (dead) {
+				make_instruction_nop(insn, true);
+				continue;
 			}
-		}
 
-		// Allocate LIVE-INs
-		for (auto in : live_ins) {
-			// If the live-in is not already allocated, allocate it.
-			if (allocation[in] == -1 && global_allocation.count(in) == 0) {
-				int32_t next_reg = avail_regs.next_avail();
+			for (int op_idx = 0; op_idx < 6; op_idx++) {
+				IROperand *oper = &insn->operands[op_idx];
+				if (!oper->is_valid()) break;
+				if (!oper->is_vreg()) continue;
+
+				uint32_t pos = ir_idx * 2;
+				if (descr->format[op_idx] == 'O') {
+					pos++;
+					live.clear(oper->value);
+				} else if (descr->format[op_idx] == 'B') {
+					interval_end[oper->value] = std::max(interval_end[oper->value], pos + 1);
+				}
 
-				if (next_reg == -1) {
-					global_allocation[in] = next_global;
-					next_global += 8;
-					if(max_stack < next_global) max_stack = next_global;
+				interval_start[oper->value] = std::min(interval_start[oper->value], pos);
+				interval_end[oper->value] = std::max(interval_end[oper->value], pos);
+			}
 
-				} else {
-					allocation[in] = next_reg;
+			for (int op_idx = 0; op_idx < 6; op_idx++) {
+				IROperand *oper = &insn->operands[op_idx];
+				if (!oper->is_valid()) break;
 
-					avail_regs.clear(next_reg);
-					used_phys_regs.set(next_reg);
-				}
+				if (oper->is_vreg() && (descr->format[op_idx] == 'I' || descr->format[op_idx] == 'B')) live.set(oper->value);
 			}
 		}
 
-		// If an instruction has no output or both operands which are live outs then the instruction is dead
-		bool not_dead = false;
-		bool can_be_dead = !descr->has_side_effects;
+		// Values that flow in or out of the block occupy their register for
+		// the whole of it.
+		for (int32_t reg = live.next(0); reg != -1; reg = live.next(reg + 1)) {
+			interval_start[reg] = std::min(interval_start[reg], (uint32_t)block_first[block] * 2);
+		}
 
-		// Loop over operands to update the allocation information on VREG operands.
-		for (int op_idx = 0; op_idx < 6; op_idx++) {
-			IROperand *oper = &insn->operands[op_idx];
-			if(!oper->is_valid()) break;
+		for (int32_t reg = live_out[block].next(0); reg != -1; reg = live_out[block].next(reg + 1)) {
+			interval_end[reg] = std::max(interval_end[reg], (uint32_t)block_last[block] * 2 + 1);
+		}
+	}
 
-			if (oper->is_vreg()) {
-				if (descr->format[op_idx] != 'I' && live_outs.count(oper->value)) not_dead = true;
+	timer.tick("Intervals");
 
-				// If this vreg has been allocated to the stack, then fill in the stack entry location here
-				//auto global_alloc = global_allocation.find(oper->value);
-				if(global_allocation.count(oper->value)) {
-					oper->allocate(IROperand::ALLOCATED_STACK, global_allocation[oper->value]);
-					if(descr->format[op_idx] == 'O' || descr->format[op_idx] == 'B') not_dead = true;
-				} else {
+	std::vector<IRRegId> intervals;
+	intervals.reserve(reg_count);
+	for (IRRegId reg = 0; reg < reg_count; reg++) {
+		if (interval_start[reg] != 0xffffffff) intervals.push_back(reg);
+	}
 
-					// Otherwise, if the value has been locally allocated, fill in the local allocation
-					//auto alloc_reg = allocation.find((IRRegId)oper->value);
+	std::sort(intervals.begin(), intervals.end(), [&](IRRegId a, IRRegId b) { return interval_start[a] < interval_start[b]; });
 
-					if (allocation[oper->value] != -1) {
-						oper->allocate(IROperand::ALLOCATED_REG, allocation[oper->value]);
-					}
+	// Assign registers, and when there are none left, spill whichever of the
+	// competing intervals ends last.
+	std::vector<int32_t> allocation (reg_count, -1), stack_slot (reg_count, -1);
+	std::vector<IRRegId> active, active_spills;
+	std::vector<uint32_t> free_slots;
+	PopulatedSet<9> avail_regs;
+	avail_regs.fill(0x1ff);
+	uint32_t slot_count = 0;
 
-				}
+	for (auto reg : intervals) {
+		uint32_t start = interval_start[reg];
+
+		for (auto i = active.begin(); i != active.end(); ) {
+			if (interval_end[*i] < start) {
+				avail_regs.set(allocation[*i]);
+				i = active.erase(i);
+			} else {
+				++i;
 			}
 		}
 
-		// Remove allocations that are not LIVE-INs
-		for (auto out : live_outs) {
-			if(global_allocation.count(out)) continue;
-			if (!live_ins.count(out)) {
-				assert(allocation[out] != -1);
-
-				allocation[out] = -1;
+		for (auto i = active_spills.begin(); i != active_spills.end(); ) {
+			if (interval_end[*i] < start) {
+				free_slots.push_back(stack_slot[*i]);
+				i = active_spills.erase(i);
+			} else {
+				++i;
 			}
 		}
 
-		// If this instruction is dead, remove any live ins which are not live outs
-		// in order to propagate dead instruction elimination information
-		if(!not_dead && can_be_dead) {
-			make_instruction_nop(insn, true);
+		IRRegId spill = reg;
 
-			to_erase.clear();
-			to_erase.reserve(live_ins.size());
-			for(auto i = live_ins.begin(); i != live_ins.end(); ++i) {
-				const auto &in = *i;
-				if(global_allocation.count(in)) continue;
-				if(live_outs.count(in) == 0) {
-					assert(allocation[in] != -1);
+		int32_t next_reg = avail_regs.next_avail();
+		if (next_reg != -1) {
+			avail_regs.clear(next_reg);
+			allocation[reg] = next_reg;
+			active.push_back(reg);
+			continue;
+		}
 
-					avail_regs.set(allocation[in]);
+		auto victim = std::max_element(active.begin(), active.end(), [&](IRRegId a, IRRegId b) { return interval_end[a] < interval_end[b]; });
+		if (interval_end[*victim] > interval_end[reg]) {
+			spill = *victim;
 
-					allocation[in] = -1;
-					to_erase.push_back(i);
-				}
-			}
-			for(auto e : to_erase)live_ins.erase(e);
+			allocation[reg] = allocation[spill];
+			allocation[spill] = -1;
+			*victim = reg;
 		}
 
-#if 0
+		if (free_slots.empty()) {
+			stack_slot[spill] = slot_count++;
+		} else {
+			stack_slot[spill] = free_slots.back();
+			free_slots.pop_back();
+		}
 
-		printf("  [%03d] %10s ", ir_idx, insn_descriptors[insn->type].mnemonic);
-		for (int op_idx = 0; op_idx < 6; op_idx++) {
-			IROperand *oper = &insn->operands[op_idx];
+		active_spills.push_back(spill);
+		spill_count++;
+	}
 
-			if (descr->format[op_idx] != 'X') {
-				if (descr->format[op_idx] == 'M' && !oper->is_valid()) continue;
-
-				if (op_idx > 0) printf(", ");
-
-				if (oper->is_vreg()) {
-					printf("i%d r%d(%c%d)",
-						oper->size,
-						oper->value,
-						oper->alloc_mode == IROperand::NOT_ALLOCATED ? 'N' : (oper->alloc_mode == IROperand::ALLOCATED_REG ? 'R' : (oper->alloc_mode == IROperand::ALLOCATED_STACK ? 'S' : '?')),
-						oper->alloc_data);
-				} else if (oper->is_constant()) {
-					printf("i%d $0x%x", oper->size, oper->value);
-				} else if (oper->is_pc()) {
-					printf("i4 pc");
-				} else if (oper->is_block()) {
-					printf("b%d", oper->value);
-				} else if (oper->is_func()) {
-					printf("&%x", oper->value);
-				} else {
-					printf("<invalid>");
-				}
-			}
-		}
+	max_stack = slot_count * 8;
 
-		printf(" {");
-		for (auto in : live_ins) {
-			//auto alloc = allocation.find(in);
-			int alloc_reg = allocation[in]; //alloc == allocation.end() ? -1 : alloc->second;
+	timer.tick("Allocation");
 
-			printf(" r%d:%d", in, alloc_reg);
-		}
-		printf(" } {");
-		for (auto out : live_outs) {
-			//auto alloc = allocation.find(out);
-			int alloc_reg = allocation[out]; //alloc == allocation.end() ? -1 : alloc->second;
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		for (int op_idx = 0; op_idx < 6; op_idx++) {
+			IROperand *oper = &insn->operands[op_idx];
+			if (!oper->is_valid()) break;
+			if (!oper->is_vreg()) continue;
 
-			printf(" r%d:%d", out, alloc_reg);
+			if (allocation[oper->value] != -1) {
+				oper->allocate(IROperand::ALLOCATED_REG, allocation[oper->value]);
+				used_phys_regs.set(allocation[oper->value]);
+			} else {
+				oper->allocate(IROperand::ALLOCATED_STACK, stack_slot[oper->value] * 8);
+			}
 		}
-		printf(" }\n");
-#endif
 	}
 
-	//printf("block %08x\n", tb.block_addr);
-//	dump_ir();
-	timer.tick("Allocation");
-	//printf("lol ");
+	timer.tick("Assignment");
 	timer.dump("Analysis");
 	return true;
 }
@@ -844,19 +972,24 @@ bool BlockCompiler::thread_jumps()
 
 	timer.tick("Init");
 
-	// Build up a list of the first instructions in each block.
+	// Build up a list of the first instructions in each block.  Blocks that
+	// reorder_blocks found unreachable have been moved to NOP_BLOCK.
 	IRBlockId current_block_id = INVALID_BLOCK_ID;
+	IRInstruction *previous_insn = NULL;
 	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
 		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
 
 		if (insn->ir_block != current_block_id) {
-			if (ir_idx > 0) {
-				last_instructions[current_block_id] = ctx.at(ir_idx - 1);
+			if (previous_insn) {
+				last_instructions[current_block_id] = previous_insn;
 			}
 
 			current_block_id = insn->ir_block;
 			first_instructions[current_block_id] = insn;
 		}
+
+		previous_insn = insn;
 	}
 	
 	timer.tick("Analysis");
@@ -935,6 +1068,7 @@ bool BlockCompiler::dbe()
 	
 	for(unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
 		IRInstruction *insn = ctx.at(ir_idx);
+		if(insn->ir_block == NOP_BLOCK) continue;
 		
 		switch(insn->type) {
 			case IRInstruction::JMP:
@@ -953,6 +1087,7 @@ bool BlockCompiler::dbe()
 
 	for(unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
 		IRInstruction *insn = ctx.at(ir_idx);
+		if(insn->ir_block == NOP_BLOCK) continue;
 		if(!live_blocks[insn->ir_block]) make_instruction_nop(insn, true);
 	}
 	
@@ -1114,18 +1249,6 @@ bool BlockCompiler::allocate()
 	return true;
 }
 
-bool BlockCompiler::lower_to_interpreter()
-{
-	encoder.mov((uint64_t)&interpret_ir, REG_RAX);
-	load_state_field(0, REG_RDI);
-	encoder.mov((uint64_t)ctx.get_ir_buffer(), REG_RSI);
-	encoder.mov((uint64_t)ctx.count(), REG_RDX);
-	encoder.jmp(REG_RAX);
-	
-	asm volatile("out %0, $0xff\n" :: "a"(15), "D"(encoder.get_buffer()), "S"(encoder.get_buffer_size()), "d"(pa));
-	return true;	
-}
-
 bool BlockCompiler::lower(uint32_t max_stack)
 {
 	bool success = true, dump_this_shit = false;
@@ -1165,6 +1288,14 @@ bool BlockCompiler::lower(uint32_t max_stack)
 			native_block_offsets[current_block_id] = encoder.current_offset();
 		}
 
+		// Try to cover this instruction, and possibly the next few, with a
+		// single lowering pattern.
+		uint32_t covered = peeplower(ir_idx);
+		if (covered) {
+			ir_idx += covered - 1;
+			continue;
+		}
+
 		switch (insn->type) {
 		case IRInstruction::BARRIER:
 		case IRInstruction::NOP:
@@ -1358,9 +1489,13 @@ bool BlockCompiler::lower(uint32_t max_stack)
 					unsigned modify_target_reg = modify_target->alloc_data;
 					unsigned store_source_reg = store_source->alloc_data;
 					
+					// The fused instruction is emitted before the load, so it
+					// can't read the loaded value, as in x = x op x.
+					bool source_is_target = modify_source->is_alloc_reg() && modify_source->alloc_data == my_target_reg;
+
 					// TODO: this is hideous
 					bool fused = false;
-					if(my_target_reg == modify_target_reg && modify_target_reg == store_source_reg) {
+					if(my_target_reg == modify_target_reg && modify_target_reg == store_source_reg && !source_is_target) {
 						switch(mod_insn->type) {
 							case IRInstruction::ADD: 
 								if(modify_source->is_constant()) {
@@ -1489,6 +1624,10 @@ bool BlockCompiler::lower(uint32_t max_stack)
 				encoder.add(max_stack-0x40, REG_RSP);
 			}
 			
+			if (emit_chaining_logic) {
+				emit_exec_count();
+			}
+
 			encoder.ensure_extra_buffer(64);
 			
 			uint8_t *jump_offset = NULL;
@@ -1504,53 +1643,33 @@ bool BlockCompiler::lower(uint32_t max_stack)
 			if(emit_chaining_logic) {
 				assert(emit_interrupt_check);
 				
-				size_t target_offset = insn->operands[2].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
-				size_t fallthrough_offset = insn->operands[3].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
-
-				bool jump_via_offsets = false;
-				if(target_offset < 0x80000000 && (!has_fallthrough || fallthrough_offset < 0x80000000)) jump_via_offsets = true;
-				
-				if(jump_via_offsets) {
-					if(has_fallthrough) {
-
-						//load PC into EAX
-						encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(PC)), REG_EBX);
-						
-						//mask page offset of PC (we already know that both targets land in this page)
-						encoder.andd(0xfff, REG_EBX);
-						
-						encoder.mov(insn->operands[2].value, REG_RCX);
-						encoder.mov(insn->operands[3].value, REG_RDX);
+				// Every translation lives in the code cache, and the code being
+				// emitted is never moved, so the targets are always within
+				// rel32 range.
+				assert(malloc::code_alloc.contains((const void *)insn->operands[2].value));
+				assert(!has_fallthrough || malloc::code_alloc.contains((const void *)insn->operands[3].value));
+
+				if(has_fallthrough) {
+					//load PC into EBX
+					encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(PC)), REG_EBX);
 					
-						encoder.cmp(insn->operands[0].value, REG_EBX);
-						encoder.jne((int8_t)2);
-						encoder.jmp(REG_RCX);
-						encoder.jmp(REG_RDX);
-						
-					} else {
-						encoder.mov(insn->operands[2].value, REG_RCX);
-						encoder.jmp(REG_RCX);
-					}
+					//mask page offset of PC (we already know that both targets land in this page)
+					encoder.andd(0xfff, REG_EBX);
+					encoder.cmp(insn->operands[0].value, REG_EBX);
+					
+					add_relocation(encoder.current_offset() + 2, StoredRelocation::REL32_TXLN, insn->operands[0].value);
+					int64_t target_offset = insn->operands[2].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
+					encoder.je((int32_t)target_offset-6);
 					
+					add_relocation(encoder.current_offset() + 1, StoredRelocation::REL32_TXLN, insn->operands[1].value);
+					int64_t fallthrough_offset = insn->operands[3].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
+					encoder.jmp_offset((int32_t)fallthrough_offset-5);
 				} else {
-					if(has_fallthrough) {
-						//load PC into EAX
-						encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(PC)), REG_EBX);
-						
-						//mask page offset of PC (we already know that both targets land in this page)
-						encoder.andd(0xfff, REG_EBX);
-						encoder.cmp(insn->operands[0].value, REG_EBX);
-						
-						target_offset = insn->operands[2].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
-						encoder.je((int32_t)target_offset-6);
-						
-						fallthrough_offset = insn->operands[3].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
-						encoder.jmp_offset((int32_t)fallthrough_offset-5);
-					} else {
-						target_offset = insn->operands[2].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
-						encoder.jmp_offset((int32_t)target_offset-5);
-					}
+					add_relocation(encoder.current_offset() + 1, StoredRelocation::REL32_TXLN, insn->operands[0].value);
+					int64_t target_offset = insn->operands[2].value - ((size_t)encoder.get_buffer() + (size_t)encoder.current_offset());
+					encoder.jmp_offset((int32_t)target_offset-5);
 				}
+
 				uint8_t *current_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset();
 				*jump_offset = (uint8_t)(uint64_t)(current_offset - jump_offset-1);
 				//printf("Jump offset set to %u\n", *jump_offset);
@@ -1570,35 +1689,153 @@ bool BlockCompiler::lower(uint32_t max_stack)
 			if(max_stack > 0x40)
 				encoder.add(max_stack-0x40, REG_RSP);
 			
+			if (emit_chaining_logic) {
+				emit_exec_count();
+			}
+
+			encoder.ensure_extra_buffer(256);
+
 			// Function Epilogue
+			uint8_t *jump_offset = NULL;
 			if (emit_interrupt_check) {
 				assert(emit_chaining_logic);
 				encoder.mov(X86Memory::get(REG_FS, 48), REG_EAX);
 				encoder.test(REG_EAX, REG_EAX);
-				encoder.jnz((int8_t)34);
+
+				// The exit sequence can be longer than a short jump reaches.
+				jump_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset() + 2;
+				encoder.jnz((int32_t)0);
 			}
 
-			if (emit_chaining_logic) {
+			bool is_call = emit_chaining_logic && insn->type == IRInstruction::RET && insn->operands[3].is_constant();
+			if (is_call) {
+				// Push the return address and the translation slot of the
+				// return block onto the return stack.  The return address is
+				// taken from the link register, which the call has just
+				// written with the virtual address it returns to, less the
+				// interworking bit.  Each entry is 16 bytes, arranged
+				// 0	return PC (4 bytes)
+				// 8	pointer to translation (8 bytes)
+				assert(tagged_regs.LR);
+
+				encoder.mov(X86Memory::get(REG_FS, 80), REG_ECX);
+				encoder.add(1, REG_ECX);
+				encoder.andd(RETURN_STACK_SIZE - 1, REG_ECX);
+				encoder.mov(REG_ECX, X86Memory::get(REG_FS, 80));
+				encoder.shl(4, REG_RCX);
+				encoder.mov(X86Memory::get(REG_FS, 72), REG_RDX);
+				encoder.add(REG_RDX, REG_RCX);
+
+				encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(LR)), REG_EAX);
+				encoder.andd(~1U, REG_EAX);
+				encoder.mov(REG_EAX, X86Memory::get(REG_RCX, 0));
+				// The translation slot is always a 64-bit immediate, which
+				// is the last eight bytes of the instruction.
+				uint32_t slot_mov_offset = encoder.current_offset();
+				encoder.mov(insn->operands[3].value, REG_RDX);
+				assert(encoder.current_offset() - slot_mov_offset == 10);
+				add_relocation(encoder.current_offset() - 8, StoredRelocation::ABS64_TXLN_SLOT, insn->operands[2].value);
+
+				encoder.mov(REG_RDX, X86Memory::get(REG_RCX, 8));
+			}
+
+			if (emit_chaining_logic && insn->type == IRInstruction::RET && insn->operands[0].is_constant()) {
+				// This is a direct exit, so emit a patchable slot for each
+				// possible target.  A slot compares the PC with its guard,
+				// and jumps straight to the linked translation if it matches.
+				// Slots start out unlinked, so the first exit falls through
+				// to the stub, which tells the engine which slots to link.
+				int slot_count = insn->operands[1].value ? 2 : 1;
+
+				encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(PC)), REG_EAX);
+
+				uint32_t slots_offset = encoder.current_offset();
+				for (int slot = 0; slot < slot_count; slot++) {
+					encoder.chain_slot(CHAIN_SLOT_FREE);
+				}
+
+				assert(encoder.current_offset() - slots_offset == (uint32_t)slot_count * CHAIN_SLOT_SIZE);
+
+				encoder.lea_rip(slots_offset, REG_RCX);
+				encoder.mov(REG_RCX, X86Memory::get(REG_FS, 56));
+				encoder.mov(REG_EAX, X86Memory::get(REG_FS, 64));
+				encoder.mov(slot_count, REG_ECX);
+				encoder.mov(REG_ECX, X86Memory::get(REG_FS, 68));
+
+				// Tell the engine where to record the links, so that they
+				// can be dropped along with this translation.  This is
+				// always a 64-bit immediate, which is the last eight bytes
+				// of the instruction.
+				assert(chain_links);
+
+				uint32_t links_mov_offset = encoder.current_offset();
+				encoder.mov((uint64_t)chain_links, REG_RCX);
+				assert(encoder.current_offset() - links_mov_offset == 10);
+				add_relocation(encoder.current_offset() - 8, StoredRelocation::ABS64_CHAIN_LINKS, pa);
+
+				encoder.mov(REG_RCX, X86Memory::get(REG_FS, 88));
+			} else if (emit_chaining_logic) {
+				// Unless this is a call, see if this is a return to the most
+				// recent call.  If so, pop the return stack and tail call the
+				// return block, if it has been compiled.
+				if (!is_call) {
+					encoder.mov(X86Memory::get(REG_FS, 80), REG_ECX);
+					encoder.mov(REG_ECX, REG_EDX);
+					encoder.shl(4, REG_RDX);
+					encoder.mov(X86Memory::get(REG_FS, 72), REG_RBX);
+					encoder.add(REG_RBX, REG_RDX);
+
+					encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(PC)), REG_EAX);
+					encoder.cmp(REG_EAX, X86Memory::get(REG_RDX, 0));
+					uint8_t *ras_miss_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset() + 1;
+					encoder.jne((int8_t)0);
+
+					encoder.sub(1, REG_ECX);
+					encoder.andd(RETURN_STACK_SIZE - 1, REG_ECX);
+					encoder.mov(REG_ECX, X86Memory::get(REG_FS, 80));
+
+					encoder.mov(X86Memory::get(REG_RDX, 8), REG_RDX);
+					encoder.mov(X86Memory::get(REG_RDX, 0), REG_RDX);
+					encoder.test(REG_RDX, REG_RDX);
+					uint8_t *ras_untranslated_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset() + 1;
+					encoder.jz((int8_t)0);
+
+					encoder.jmp(REG_RDX);
+
+					uint8_t *ras_done = (uint8_t*)encoder.get_buffer() + encoder.current_offset();
+					*ras_miss_offset = (uint8_t)(uint64_t)(ras_done - ras_miss_offset - 1);
+					*ras_untranslated_offset = (uint8_t)(uint64_t)(ras_done - ras_untranslated_offset - 1);
+				}
+
 				// Each chaining table entry is 16 bytes, arranged
 				// 0	tag (4 bytes)
 				// 8	pointer (8 bytes)
+				// and the ways of a set are adjacent.  Way 0 holds the most
+				// recently inserted entry, so it is probed first.
 								
 				// Used regs: EAX, EBX, ECX, EDX
 								
 				encoder.mov(X86Memory::get(REGSTATE_REG, REG_OFFSET_OF(PC)), REG_EAX);		// Load the PC
 				encoder.mov(REG_EAX, REG_EBX);
 				encoder.shr(0x2, REG_EAX);
-				encoder.movzx(REG_AX, REG_EDX);									// Shift/Mask the PC
-				encoder.shl(4, REG_RDX);										// Get cache entry offset (multiply by 16)
+				encoder.andd(BLOCK_CHAIN_CACHE_SETS - 1, REG_EAX);				// Shift/Mask the PC
+				encoder.mov(REG_EAX, REG_EDX);
+				encoder.shl(__builtin_ctz(16 * BLOCK_CHAIN_CACHE_WAYS), REG_RDX);	// Get cache set offset
 				encoder.mov(X86Memory::get(REG_FS, 32), REG_RCX);
 				encoder.add(REG_RCX, REG_RDX);									// apply offset
 
-				encoder.cmp(REG_EBX, X86Memory::get(REG_RDX));					// Compare PC with cache entry tag
-				
-				encoder.jne((int8_t)3);											// Tags match?
+				for (int way = 0; way < BLOCK_CHAIN_CACHE_WAYS; way++) {
+					encoder.cmp(REG_EBX, X86Memory::get(REG_RDX, way * 16));	// Compare PC with cache entry tag
 				
-				encoder.jmp(X86Memory::get(REG_RDX, 8));						// Yep, tail call.
+					encoder.jne((int8_t)3);										// Tags match?
 				
+					encoder.jmp(X86Memory::get(REG_RDX, (way * 16) + 8));		// Yep, tail call.
+				}
+			}
+
+			if (jump_offset) {
+				uint8_t *current_offset = (uint8_t*)encoder.get_buffer() + encoder.current_offset();
+				*(int32_t *)jump_offset = (int32_t)(current_offset - jump_offset - 4);
 			}
 
 			// (jnz above should jump to here)
@@ -2956,7 +3193,7 @@ void BlockCompiler::emit_save_reg_state(int num_operands, stack_map_t &stack_map
 	stack_map.clear();
 	
 	//First, count required stack slots
-	for(int i = register_assignments_8.size()-1; i >= 0; i--) {
+	for(int i = ARRAY_SIZE(register_assignments_8)-1; i >= 0; i--) {
 		if(used_phys_regs.get(i)) {
 			stack_offset += 8;
 		}
@@ -2964,7 +3201,7 @@ void BlockCompiler::emit_save_reg_state(int num_operands, stack_map_t &stack_map
 	
 	encoder.mov(REGSTATE_REG, REG_R15);
 	
-	for(int i = register_assignments_8.size()-1; i >= 0; i--) {
+	for(int i = ARRAY_SIZE(register_assignments_8)-1; i >= 0; i--) {
 		if(used_phys_regs.get(i)) {
 			const X86Register &reg = get_allocable_register(i, 8);
 			
@@ -2978,7 +3215,7 @@ void BlockCompiler::emit_save_reg_state(int num_operands, stack_map_t &stack_map
 
 void BlockCompiler::emit_restore_reg_state(int num_operands, stack_map_t &stack_map)
 {
-	for(int i = 0; i < register_assignments_8.size(); ++i) {
+	for(unsigned int i = 0; i < ARRAY_SIZE(register_assignments_8); ++i) {
 		if(used_phys_regs.get(i)) {
 			encoder.pop(get_allocable_register(i, 8));
 		}
@@ -3269,7 +3506,9 @@ bool BlockCompiler::reorder_blocks()
 	timer.tick("Analyse");
 	
 	// Oh god what have I done
-	auto comp = [&max_depth] (IRBlockId a, IRBlockId b) -> bool { return max_depth[a] < max_depth[b]; };
+	// Unreachable blocks have the same depth as the entry block, which must
+	// stay first, so ties are broken by block ID.
+	auto comp = [&max_depth] (IRBlockId a, IRBlockId b) -> bool { return max_depth[a] < max_depth[b] || (max_depth[a] == max_depth[b] && a < b); };
 	
 	std::vector<IRBlockId> queue;
 	queue.insert(queue.begin(), blocks.begin(), blocks.end());
@@ -3334,190 +3573,787 @@ bool BlockCompiler::reorder_blocks()
 #endif
 }
 
+enum guest_register_effect {
+	GUEST_REGS_UNTOUCHED,	// Only reaches the register file through READ_REG and WRITE_REG
+	GUEST_REGS_OBSERVED,	// May fault, and the fault handler sees the register file
+	GUEST_REGS_CLOBBERED,	// May read or change any guest register
+	GUEST_REGS_EXIT,		// Leaves the translation
+};
+
+static guest_register_effect get_guest_register_effect(const IRInstruction *insn)
+{
+	switch (insn->type) {
+	case IRInstruction::NOP:
+	case IRInstruction::BARRIER:
+	case IRInstruction::MOV:
+	case IRInstruction::CMOV:
+	case IRInstruction::LDPC:
+	case IRInstruction::INCPC:
+	case IRInstruction::VECTOR_INSERT:
+	case IRInstruction::VECTOR_EXTRACT:
+	case IRInstruction::ADD:
+	case IRInstruction::ADC:
+	case IRInstruction::SUB:
+	case IRInstruction::SBC:
+	case IRInstruction::MUL:
+	case IRInstruction::DIV:
+	case IRInstruction::MOD:
+	case IRInstruction::ABS:
+	case IRInstruction::NEG:
+	case IRInstruction::SQRT:
+	case IRInstruction::IS_QNAN:
+	case IRInstruction::IS_SNAN:
+	case IRInstruction::SHL:
+	case IRInstruction::SHR:
+	case IRInstruction::SAR:
+	case IRInstruction::ROR:
+	case IRInstruction::CLZ:
+	case IRInstruction::NOT:
+	case IRInstruction::AND:
+	case IRInstruction::OR:
+	case IRInstruction::XOR:
+	case IRInstruction::CMPEQ:
+	case IRInstruction::CMPNE:
+	case IRInstruction::CMPGT:
+	case IRInstruction::CMPGTE:
+	case IRInstruction::CMPLT:
+	case IRInstruction::CMPLTE:
+	case IRInstruction::SX:
+	case IRInstruction::ZX:
+	case IRInstruction::TRUNC:
+	case IRInstruction::READ_REG:
+	case IRInstruction::WRITE_REG:
+	case IRInstruction::JMP:
+	case IRInstruction::BRANCH:
+	case IRInstruction::ADC_WITH_FLAGS:
+	case IRInstruction::SBC_WITH_FLAGS:
+	case IRInstruction::SET_ZN_FLAGS:
+		return GUEST_REGS_UNTOUCHED;
+
+	case IRInstruction::READ_MEM:
+	case IRInstruction::WRITE_MEM:
+	case IRInstruction::READ_MEM_USER:
+	case IRInstruction::WRITE_MEM_USER:
+	case IRInstruction::ATOMIC_WRITE:
+		return GUEST_REGS_OBSERVED;
+
+	case IRInstruction::RET:
+	case IRInstruction::DISPATCH:
+		return GUEST_REGS_EXIT;
+
+	default:
+		// Helpers, mode switches, device accesses, tracing, and anything
+		// else that calls out of the translation.
+		return GUEST_REGS_CLOBBERED;
+	}
+}
+
+struct reg_range {
+	uint32_t offset;
+	uint32_t size;
+};
+
+static inline bool ranges_overlap(const reg_range& a, const reg_range& b)
+{
+	return a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+}
+
+/*
+ * Forwards guest register values within a block: a READ_REG of a register
+ * whose value the block already holds in a vreg (or as a constant), because
+ * it read or wrote it earlier, becomes a MOV of that value.  A held value is
+ * dropped when its vreg is overwritten, when an overlapping part of the
+ * register file is written, and at anything that may change the register
+ * file behind the translation's back.  Memory accesses only observe the
+ * register file, so values are kept across them.
+ */
 bool BlockCompiler::reg_value_reuse()
 {
-	std::map<IRRegId, uint32_t> ir_regs_to_machine_regs;
-	std::map<uint32_t, IROperand> stored_regs;
-	std::map<uint32_t, IRInstruction*> last_write;
-	std::map<uint32_t, bool> used_entries;
-	
-//	printf("*********** %x\n", pa);
-	
-	for(unsigned int ir_idx = 0; ir_idx < ctx.count(); ++ir_idx) {
+	// How many values are held at once, as each one keeps a vreg alive.
+	const uint32_t max_cached_regs = 4;
+
+	const reg_range pc = { (uint32_t)REG_OFFSET_OF(PC), 4 };
+	const reg_range flags[] = {
+		{ (uint32_t)REG_OFFSET_OF(C), 1 },
+		{ (uint32_t)REG_OFFSET_OF(Z), 1 },
+		{ (uint32_t)REG_OFFSET_OF(N), 1 },
+		{ (uint32_t)REG_OFFSET_OF(V), 1 },
+	};
+
+	struct cached_reg {
+		reg_range range;
+		IROperand value;
+		uint32_t last_use;
+	};
+
+	std::vector<cached_reg> cache;
+	cache.reserve(max_cached_regs);
+
+	auto invalidate = [&](const reg_range& range) {
+		for (uint32_t i = 0; i < cache.size();) {
+			if (ranges_overlap(cache[i].range, range)) {
+				cache[i] = cache.back();
+				cache.pop_back();
+			} else {
+				i++;
+			}
+		}
+	};
+
+	auto insert = [&](const reg_range& range, const IROperand& value, uint32_t now) {
+		invalidate(range);
+
+		if (cache.size() == max_cached_regs) {
+			uint32_t victim = 0;
+			for (uint32_t i = 1; i < cache.size(); i++) {
+				if (cache[i].last_use < cache[victim].last_use) victim = i;
+			}
+
+			cache[victim] = cache.back();
+			cache.pop_back();
+		}
+
+		cache.push_back({ range, value, now });
+	};
+
+	IRBlockId current_block = INVALID_BLOCK_ID;
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
 		IRInstruction *insn = ctx.at(ir_idx);
-		if(insn->ir_block == NOP_BLOCK) continue;
-		
-		uint32_t reg_offset;
-		uint32_t max_num_cached_regs = 4;
-		
-		switch(insn->type) {
-			// If we make a read of a value which is cached, replace the read with a mov of the cached value
-			// If the register is not cached, then add it to the cache
-			case IRInstruction::READ_REG:
-				assert(insn->operands[1].is_vreg());
-				assert(insn->operands[0].is_constant());
-				
-				reg_offset = insn->operands[0].value;
-				
-				// PC offset
-				if(reg_offset == REG_OFFSET_OF(PC)) continue;
-				
-				if(stored_regs.count(reg_offset)) {
-					insn->type = IRInstruction::MOV;
-					insn->operands[0] = stored_regs[reg_offset];
-					used_entries[reg_offset] = true;
-					break;
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		// Blocks can be entered from anywhere, so nothing is known at the
+		// start of one.
+		if (insn->ir_block != current_block) {
+			current_block = insn->ir_block;
+			cache.clear();
+		}
+
+		// Values held in vregs that this instruction overwrites are lost.
+		const struct insn_descriptor *desc = &insn_descriptors[insn->type];
+		for (unsigned int op_idx = 0; op_idx < 6; op_idx++) {
+			const IROperand& op = insn->operands[op_idx];
+			if (!op.is_vreg() || desc->format[op_idx] == 'I') continue;
+
+			for (uint32_t i = 0; i < cache.size();) {
+				if (cache[i].value.is_vreg() && cache[i].value.value == op.value) {
+					cache[i] = cache.back();
+					cache.pop_back();
 				} else {
-					stored_regs[reg_offset] = insn->operands[1];
-					ir_regs_to_machine_regs[insn->operands[1].value] = reg_offset;
-					
-					if(stored_regs.size() > max_num_cached_regs) {
-						uint32_t eliminate_reg = (*stored_regs.begin()).first;
-						
-						for(auto i : used_entries) if(i.second == false) eliminate_reg = i.first;
-						
-						ir_regs_to_machine_regs.erase(stored_regs[eliminate_reg].value);
-						stored_regs.erase(eliminate_reg);
-						last_write.erase(eliminate_reg);
-						used_entries.erase(eliminate_reg);
-					}
+					i++;
 				}
-				break;
+			}
+		}
 
-			// If we store a value to a register, cache the value for next time we use the register
-			case IRInstruction::WRITE_REG:
-				reg_offset = insn->operands[1].value;
-				
-				// PC Offset
-				if(reg_offset == REG_OFFSET_OF(PC)) continue;
-				
-				// If we've previously written to this offset, zap out the old write since this one kills it
-				// We can only do this if the reg is in both caches since otherwise it might have been loaded since 
-				// its last real store
-				if(last_write.count(reg_offset) && stored_regs.count(reg_offset)) {
-					make_instruction_nop(last_write[reg_offset], true);
-					used_entries[reg_offset] = true;
-				}
-				
-				last_write[reg_offset] = insn;
-				stored_regs[reg_offset] = insn->operands[0];
-				if(insn->operands[0].is_vreg()) ir_regs_to_machine_regs[insn->operands[0].value] = reg_offset;
-				
-				// If we've got a lot of cached registers, clear some out to avoid host reg pressure getting too high
-				if(stored_regs.size() > max_num_cached_regs) {
-					uint32_t eliminate_reg = (*stored_regs.begin()).first;
+		switch (insn->type) {
+		case IRInstruction::READ_REG:
+		{
+			const IROperand& offset = insn->operands[0];
+			const IROperand dest = insn->operands[1];
+
+			if (!offset.is_constant()) break;
 
-					for(auto i : used_entries) if(i.second == false) eliminate_reg = i.first;
+			reg_range range = { (uint32_t)offset.value, dest.size };
+			if (ranges_overlap(range, pc)) break;
 
-					ir_regs_to_machine_regs.erase(stored_regs[eliminate_reg].value);
-					last_write.erase(eliminate_reg);
-					used_entries.erase(eliminate_reg);
-					stored_regs.erase(eliminate_reg);
+			bool forwarded = false;
+			for (auto& entry : cache) {
+				if (entry.range.offset == range.offset && entry.range.size == range.size && entry.value.size == dest.size) {
+					entry.last_use = ir_idx;
+
+					*insn = IRInstruction::mov(entry.value, dest);
+					insn->ir_block = current_block;
+					forwarded = true;
+					break;
 				}
-				
+			}
+
+			if (!forwarded) insert(range, dest, ir_idx);
+			break;
+		}
+
+		case IRInstruction::WRITE_REG:
+		{
+			const IROperand value = insn->operands[0];
+			const IROperand& offset = insn->operands[1];
+
+			if (!offset.is_constant()) {
+				cache.clear();
 				break;
-				
-			// If we have any control flow, then ditch the whole cache
-			case IRInstruction::JMP:
-			case IRInstruction::BRANCH:
-			case IRInstruction::RET:
-			case IRInstruction::DISPATCH:
-			case IRInstruction::READ_MEM:
-			case IRInstruction::WRITE_MEM:
-			case IRInstruction::READ_MEM_USER:
-			case IRInstruction::WRITE_MEM_USER:
-			case IRInstruction::WRITE_DEVICE:
-			case IRInstruction::READ_DEVICE:
-			case IRInstruction::CALL:
-				stored_regs.clear();
-				last_write.clear();
-				used_entries.clear();
-				ir_regs_to_machine_regs.clear();
-//				printf("ZAP!\n");
+			}
+
+			reg_range range = { (uint32_t)offset.value, value.size };
+			if (ranges_overlap(range, pc)) break;
+
+			if (value.is_vreg() || value.is_constant()) {
+				insert(range, value, ir_idx);
+			} else {
+				invalidate(range);
+			}
+			break;
+		}
+
+		case IRInstruction::SET_ZN_FLAGS:
+		case IRInstruction::ADC_WITH_FLAGS:
+		case IRInstruction::SBC_WITH_FLAGS:
+			for (auto& flag : flags) invalidate(flag);
+			break;
+
+		default:
+			switch (get_guest_register_effect(insn)) {
+			case GUEST_REGS_CLOBBERED:
+			case GUEST_REGS_EXIT:
+				cache.clear();
 				break;
+
 			default:
-				
-				const struct insn_descriptor *desc = &insn_descriptors[insn->type];
-				
-				// If this instruction writes to a vreg containing a cached register value, then erase that cached 
-				// value
-				for(unsigned int op_idx = 0; op_idx < 6; ++op_idx) {
-					IROperand *op = &(insn->operands[op_idx]);
-					if(op->is_vreg() && desc->format[op_idx] != 'I') {
-						IRRegId vreg = op->value;
-						if(ir_regs_to_machine_regs.count(vreg)) {
-							uint32_t offset = ir_regs_to_machine_regs[vreg];
-							stored_regs.erase(offset);
-							last_write.erase(offset);
-							used_entries.erase(offset);
-							ir_regs_to_machine_regs.erase(vreg);
-						}
-					}
-				}
-				
 				break;
+			}
+			break;
 		}
-		
-//		dump_insn(insn);
-//		printf("\n");
 	}
-	
+
 	return true;
 }
 
-bool BlockCompiler::value_merging() 
+/*
+ * Merges vregs that are copies of one another, e.g.
+ *
+ *   mov v0, v1
+ *   add v1, v2
+ *
+ * becomes "add v0, v2".  A copy is merged only if the MOV is the only
+ * definition of its destination, the source is defined only once, earlier in
+ * the same block, and the destination is only used later in that block.  The
+ * source then holds the same value wherever the destination is used.
+ */
+bool BlockCompiler::value_merging()
 {
-	// Merge vregs. If a vreg is defined by a mov and never modified, replace all uses of the vreg with the source of
-	// the mov. E.g.
-	// mov v0, v1
-	// mov v1, v2
-	// ||
-	// \/
-	// mov v0, v0
-	// mov v0, v2
-	
-	std::vector<IRRegId> merged_vregs (ctx.reg_count(), -1);
-	
-	for(unsigned int ir_idx = 0; ir_idx < ctx.count(); ++ir_idx) {
+	const uint32_t reg_count = ctx.reg_count();
+	const IRRegId unmerged = (IRRegId)-1;
+
+	std::vector<uint32_t> def_count (reg_count, 0), def_idx (reg_count, 0);
+	std::vector<IRBlockId> def_block (reg_count, INVALID_BLOCK_ID);
+	std::vector<bool> local_uses (reg_count, true);
+	std::vector<IRRegId> merged (reg_count, unmerged);
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
 		IRInstruction *insn = ctx.at(ir_idx);
-		
-		// If this is a move of one vreg to another, record this as a candidate for merging
-		if(insn->type == IRInstruction::MOV && insn->operands[0].is_vreg()) {
-			if(merged_vregs[insn->operands[0].value] != -1)
-				merged_vregs[insn->operands[1].value] = merged_vregs[insn->operands[0].value];
-			else
-				merged_vregs[insn->operands[1].value] = insn->operands[0].value;
-		}
-		// If this is not a move, remove any outputs of the instruction from the merge list
-		else {
-			auto &descr = insn_descriptors[insn->type];
-			for(unsigned int op_idx = 0; op_idx < 6; ++op_idx) {
-				if(descr.format[op_idx] == 'O' || descr.format[op_idx] == 'B') {
-					if(insn->operands[op_idx].is_vreg()) {
-						merged_vregs[insn->operands[op_idx].value] = -1;
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		const struct insn_descriptor *desc = &insn_descriptors[insn->type];
+		for (unsigned int op_idx = 0; op_idx < 6; op_idx++) {
+			const IROperand& op = insn->operands[op_idx];
+			if (!op.is_vreg() || (desc->format[op_idx] != 'O' && desc->format[op_idx] != 'B')) continue;
+
+			def_count[op.value]++;
+			def_idx[op.value] = ir_idx;
+			def_block[op.value] = insn->ir_block;
+		}
+	}
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		const struct insn_descriptor *desc = &insn_descriptors[insn->type];
+		for (unsigned int op_idx = 0; op_idx < 6; op_idx++) {
+			const IROperand& op = insn->operands[op_idx];
+			if (!op.is_vreg() || (desc->format[op_idx] != 'I' && desc->format[op_idx] != 'B')) continue;
+
+			if (insn->ir_block != def_block[op.value] || ir_idx <= def_idx[op.value]) {
+				local_uses[op.value] = false;
+			}
+		}
+	}
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK || insn->type != IRInstruction::MOV) continue;
+
+		const IROperand& src = insn->operands[0];
+		const IROperand& dst = insn->operands[1];
+
+		if (!src.is_vreg() || src.size != dst.size || src.value == dst.value) continue;
+		if (def_count[src.value] != 1 || def_count[dst.value] != 1 || !local_uses[dst.value]) continue;
+		if (def_block[src.value] != insn->ir_block || def_idx[src.value] >= ir_idx) continue;
+
+		// The source may itself be a merged copy.
+		IRRegId root = src.value;
+		while (merged[root] != unmerged) root = merged[root];
+
+		merged[dst.value] = root;
+	}
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		for (unsigned int op_idx = 0; op_idx < 6; op_idx++) {
+			IROperand& op = insn->operands[op_idx];
+			if (op.is_vreg() && merged[op.value] != unmerged) op.value = merged[op.value];
+		}
+
+		if (insn->type == IRInstruction::MOV) {
+			const IROperand& src = insn->operands[0];
+			const IROperand& dst = insn->operands[1];
+			if (src.is_vreg() && dst.is_vreg() && src.value == dst.value) make_instruction_nop(insn, true);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Holds the most used guest registers in vregs for the whole translation.
+ * They are loaded in a new entry block, and written back (if they have been
+ * changed) before anything that can see the register file: memory accesses
+ * that may fault, calls out of the translation, and exits.  After a call
+ * they are loaded again, as the callee may have changed them.
+ */
+bool BlockCompiler::promote_guest_registers()
+{
+	struct candidate {
+		candidate() : size(0), uses(0), valid(true), vreg(0) { }
+
+		uint8_t size;
+		uint32_t uses;
+		bool valid;
+		IRRegId vreg;
+	};
+
+	std::map<uint32_t, candidate> candidates;
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
+		if (insn->type != IRInstruction::READ_REG && insn->type != IRInstruction::WRITE_REG) continue;
+
+		bool is_read = insn->type == IRInstruction::READ_REG;
+		const IROperand& offset = is_read ? insn->operands[0] : insn->operands[1];
+		const IROperand& value = is_read ? insn->operands[1] : insn->operands[0];
+
+		// An access through a computed offset could alias any register.
+		if (!offset.is_constant()) return true;
+
+		candidate& c = candidates[offset.value];
+		if (c.uses == 0) c.size = value.size;
+		if (c.size != value.size) c.valid = false;
+		c.uses++;
+	}
+
+	// Registers the lowering also accesses directly can't be promoted.
+	const uint32_t excluded[] = { (uint32_t)REG_OFFSET_OF(PC), (uint32_t)REG_OFFSET_OF(C), (uint32_t)REG_OFFSET_OF(Z), (uint32_t)REG_OFFSET_OF(N), (uint32_t)REG_OFFSET_OF(V), (uint32_t)REG_OFFSET_OF(ISA) };
+
+	std::vector<std::pair<uint32_t, candidate *>> promoted;
+	uint32_t prev_end = 0;
+	candidate *prev = NULL;
+
+	for (auto& entry : candidates) {
+		uint32_t offset = entry.first;
+		candidate& c = entry.second;
+
+		// Accesses of different registers must not overlap.
+		if (prev && prev_end > offset) {
+			prev->valid = false;
+			c.valid = false;
+		}
+
+		for (auto e : excluded) {
+			if (e >= offset && e < offset + c.size) c.valid = false;
+		}
+
+		prev = &c;
+		prev_end = std::max(prev_end, offset + c.size);
+	}
+
+	for (auto& entry : candidates) {
+		if (entry.second.valid && entry.second.uses >= MIN_PROMOTED_GUEST_REG_USES) {
+			promoted.push_back(std::pair<uint32_t, candidate *>(entry.first, &entry.second));
+		}
+	}
+
+	if (promoted.empty()) return true;
+
+	std::sort(promoted.begin(), promoted.end(), [](const std::pair<uint32_t, candidate *>& a, const std::pair<uint32_t, candidate *>& b) { return a.second->uses > b.second->uses; });
+	if (promoted.size() > MAX_PROMOTED_GUEST_REGS) promoted.resize(MAX_PROMOTED_GUEST_REGS);
+
+	for (auto& p : promoted) {
+		p.second->vreg = ctx.alloc_reg(p.second->size);
+	}
+
+	auto promoted_index = [&](const IROperand& offset) -> int {
+		for (unsigned int i = 0; i < promoted.size(); i++) {
+			if (promoted[i].first == offset.value) return i;
+		}
+
+		return -1;
+	};
+
+	// Work out which promoted registers may have been changed, but not yet
+	// written back, on entry to each block.  The IR is sorted, so each block
+	// is a contiguous run of instructions.
+	uint32_t block_count = ctx.block_count();
+	std::vector<int32_t> block_first (block_count, -1), block_last (block_count, -1);
+	std::vector<uint8_t> dirty_in (block_count, 0);
+	IRBlockId entry_block = INVALID_BLOCK_ID;
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction *insn = ctx.at(ir_idx);
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		if (entry_block == INVALID_BLOCK_ID) entry_block = insn->ir_block;
+		if (block_first[insn->ir_block] == -1) block_first[insn->ir_block] = ir_idx;
+		block_last[insn->ir_block] = ir_idx;
+	}
+
+	bool changed;
+	do {
+		changed = false;
+
+		for (uint32_t block = 0; block < block_count; block++) {
+			if (block_first[block] == -1) continue;
+
+			uint8_t dirty = dirty_in[block];
+			for (int32_t ir_idx = block_first[block]; ir_idx <= block_last[block]; ir_idx++) {
+				IRInstruction *insn = ctx.at(ir_idx);
+				if (insn->ir_block == NOP_BLOCK) continue;
+
+				if (get_guest_register_effect(insn) != GUEST_REGS_UNTOUCHED) {
+					dirty = 0;
+				} else if (insn->type == IRInstruction::WRITE_REG) {
+					int index = promoted_index(insn->operands[1]);
+					if (index != -1) dirty |= 1 << index;
+				} else if (insn->type == IRInstruction::JMP || insn->type == IRInstruction::BRANCH) {
+					for (int op_idx = 0; op_idx < 6; op_idx++) {
+						if (!insn->operands[op_idx].is_block()) continue;
+
+						IRBlockId succ = (IRBlockId)insn->operands[op_idx].value;
+						if ((dirty_in[succ] | dirty) != dirty_in[succ]) {
+							dirty_in[succ] |= dirty;
+							changed = true;
+						}
 					}
 				}
 			}
 		}
+	} while (changed);
+
+	// Rewrite the IR, with the blocks renumbered to make room for the new
+	// entry block.
+	std::vector<IRInstruction> promoted_ir;
+	promoted_ir.reserve(ctx.count() + (promoted.size() * 4) + 1);
+
+	for (auto& p : promoted) {
+		promoted_ir.push_back(IRInstruction::ldreg(IROperand::const32(p.first), IROperand::vreg(p.second->vreg, p.second->size)));
+		promoted_ir.back().ir_block = 0;
 	}
-	
-	// Apply current merges
-	for(unsigned int ir_idx = 0; ir_idx < ctx.count(); ++ir_idx) {
+
+	promoted_ir.push_back(IRInstruction::jump(IROperand::block(entry_block + 1)));
+	promoted_ir.back().ir_block = 0;
+
+	IRBlockId current_block = INVALID_BLOCK_ID;
+	uint8_t dirty = 0;
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
+		IRInstruction insn = *ctx.at(ir_idx);
+
+		if (insn.ir_block == NOP_BLOCK) {
+			promoted_ir.push_back(insn);
+			continue;
+		}
+
+		if (insn.ir_block != current_block) {
+			current_block = insn.ir_block;
+			dirty = dirty_in[current_block];
+		}
+
+		IRBlockId block = insn.ir_block + 1;
+		guest_register_effect effect = get_guest_register_effect(&insn);
+
+		if (effect != GUEST_REGS_UNTOUCHED) {
+			for (unsigned int i = 0; i < promoted.size(); i++) {
+				if (!(dirty & (1 << i))) continue;
+
+				promoted_ir.push_back(IRInstruction::streg(IROperand::vreg(promoted[i].second->vreg, promoted[i].second->size), IROperand::const32(promoted[i].first)));
+				promoted_ir.back().ir_block = block;
+			}
+
+			dirty = 0;
+		}
+
+		if (insn.type == IRInstruction::READ_REG) {
+			int index = promoted_index(insn.operands[0]);
+			if (index != -1) {
+				insn = IRInstruction::mov(IROperand::vreg(promoted[index].second->vreg, promoted[index].second->size), insn.operands[1]);
+			}
+		} else if (insn.type == IRInstruction::WRITE_REG) {
+			int index = promoted_index(insn.operands[1]);
+			if (index != -1) {
+				insn = IRInstruction::mov(insn.operands[0], IROperand::vreg(promoted[index].second->vreg, promoted[index].second->size));
+				dirty |= 1 << index;
+			}
+		}
+
+		insn.ir_block = block;
+		for (int op_idx = 0; op_idx < 6; op_idx++) {
+			if (insn.operands[op_idx].is_block()) insn.operands[op_idx].value++;
+		}
+
+		promoted_ir.push_back(insn);
+
+		if (effect == GUEST_REGS_CLOBBERED) {
+			for (auto& p : promoted) {
+				promoted_ir.push_back(IRInstruction::ldreg(IROperand::const32(p.first), IROperand::vreg(p.second->vreg, p.second->size)));
+				promoted_ir.back().ir_block = block;
+			}
+		}
+	}
+
+	ctx.replace_instructions(&promoted_ir[0], promoted_ir.size());
+	ctx.recount_blocks(block_count + 1);
+
+	return true;
+}
+
+/*
+ * Removes writes to the guest register file whose values are overwritten
+ * before anything reads them, along with flag computations that are never
+ * read, and folds together PC increments that nothing observes in between.
+ * The register file must be exact wherever it can be seen from outside the
+ * translation, so all of it is live at exits, calls, and memory accesses that
+ * may fault.  A flag-setting ADC or SBC whose flags are all dead becomes a
+ * plain ADC or SBC.
+ */
+bool BlockCompiler::eliminate_dead_register_writes()
+{
+	const reg_range pc = { (uint32_t)REG_OFFSET_OF(PC), 4 };
+	const reg_range c = { (uint32_t)REG_OFFSET_OF(C), 1 };
+	const reg_range z = { (uint32_t)REG_OFFSET_OF(Z), 1 };
+	const reg_range n = { (uint32_t)REG_OFFSET_OF(N), 1 };
+	const reg_range v = { (uint32_t)REG_OFFSET_OF(V), 1 };
+
+	uint32_t block_count = ctx.block_count();
+	std::vector<int32_t> block_first (block_count, -1), block_last (block_count, -1);
+
+	// Liveness is tracked per byte, over as much of the register file as the
+	// translation accesses.
+	uint32_t file_size = std::max(pc.offset + pc.size, std::max(std::max(c.offset, z.offset), std::max(n.offset, v.offset)) + 1);
+
+	for (unsigned int ir_idx = 0; ir_idx < ctx.count(); ir_idx++) {
 		IRInstruction *insn = ctx.at(ir_idx);
-		for(unsigned int op_idx = 0; op_idx < 6; ++op_idx) {
-			IROperand &op = insn->operands[op_idx];
-			if(op.is_vreg() && merged_vregs[op.value] != -1) op.value = merged_vregs[op.value];
+		if (insn->ir_block == NOP_BLOCK) continue;
+
+		if (block_first[insn->ir_block] == -1) block_first[insn->ir_block] = ir_idx;
+		block_last[insn->ir_block] = ir_idx;
+
+		if (insn->type == IRInstruction::READ_REG && insn->operands[0].is_constant()) {
+			file_size = std::max(file_size, (uint32_t)insn->operands[0].value + insn->operands[1].size);
+		} else if (insn->type == IRInstruction::WRITE_REG && insn->operands[1].is_constant()) {
+			file_size = std::max(file_size, (uint32_t)insn->operands[1].value + insn->operands[0].size);
 		}
-		
-		if(insn->type == IRInstruction::MOV) {
-			IROperand &op0 = insn->operands[0], &op1 = insn->operands[1];
-			if(op0.is_vreg() && op1.is_vreg() && op0.value == op1.value) make_instruction_nop(insn, true);
+	}
+
+	// Moves backwards over an instruction, updating the set of live bytes,
+	// and returns whether it writes the register file and none of what it
+	// writes is live.
+	auto transfer = [&](const IRInstruction *insn, DenseSet& live) -> bool {
+		reg_range writes[4], read = pc;
+		uint32_t nr_writes = 0;
+		bool reads = false, reads_all = false;
+
+		switch (insn->type) {
+		case IRInstruction::READ_REG:
+			if (insn->operands[0].is_constant()) {
+				read.offset = insn->operands[0].value;
+				read.size = insn->operands[1].size;
+				reads = true;
+			} else {
+				reads_all = true;
+			}
+			break;
+
+		case IRInstruction::WRITE_REG:
+			if (insn->operands[1].is_constant()) {
+				writes[nr_writes].offset = insn->operands[1].value;
+				writes[nr_writes++].size = insn->operands[0].size;
+			}
+			break;
+
+		case IRInstruction::INCPC:
+			writes[nr_writes++] = pc;
+			read = pc;
+			reads = true;
+			break;
+
+		case IRInstruction::LDPC:
+			read = pc;
+			reads = true;
+			break;
+
+		case IRInstruction::SET_ZN_FLAGS:
+			writes[nr_writes++] = z;
+			writes[nr_writes++] = n;
+			break;
+
+		case IRInstruction::ADC_WITH_FLAGS:
+		case IRInstruction::SBC_WITH_FLAGS:
+			writes[nr_writes++] = c;
+			writes[nr_writes++] = v;
+			writes[nr_writes++] = z;
+			writes[nr_writes++] = n;
+			break;
+
+		case IRInstruction::BARRIER:
+			break;
+
+		default:
+			if (get_guest_register_effect(insn) != GUEST_REGS_UNTOUCHED) {
+				reads_all = true;
+				break;
+			}
+
+			// Arithmetic can take the PC straight from the register file.
+			for (int op_idx = 0; op_idx < 6; op_idx++) {
+				if (insn->operands[op_idx].is_pc()) {
+					read = pc;
+					reads = true;
+				}
+			}
+			break;
 		}
-		//~ dump_insn(insn);
-		//~ printf("\n");
-	}	
-	
-	//printf("*** after merge:\n");
-	//dump_ir();
+
+		bool dead = nr_writes > 0;
+		for (uint32_t i = 0; i < nr_writes; i++) {
+			for (uint32_t b = writes[i].offset; b < writes[i].offset + writes[i].size; b++) {
+				if (live.get(b)) dead = false;
+			}
+		}
+
+		for (uint32_t i = 0; i < nr_writes; i++) {
+			for (uint32_t b = writes[i].offset; b < writes[i].offset + writes[i].size; b++) {
+				live.clear(b);
+			}
+		}
+
+		if (reads_all) {
+			live.fill();
+		} else if (reads) {
+			for (uint32_t b = read.offset; b < read.offset + read.size; b++) {
+				live.set(b);
+			}
+		}
+
+		return dead;
+	};
+
+	// Fold each PC increment into the next one in its block, unless the PC
+	// is read or written in between.
+	DenseSet pc_reads (file_size);
+
+	for (uint32_t block = 0; block < block_count; block++) {
+		if (block_first[block] == -1) continue;
+
+		IRInstruction *prev_incpc = NULL;
+		for (int32_t ir_idx = block_first[block]; ir_idx <= block_last[block]; ir_idx++) {
+			IRInstruction *insn = ctx.at(ir_idx);
+			if (insn->ir_block == NOP_BLOCK) continue;
+
+			if (insn->type == IRInstruction::INCPC) {
+				if (prev_incpc && prev_incpc->operands[0].is_constant() && insn->operands[0].is_constant()) {
+					insn->operands[0].value += prev_incpc->operands[0].value;
+					make_instruction_nop(prev_incpc, true);
+				}
+
+				prev_incpc = insn;
+				continue;
+			}
+
+			if (insn->type == IRInstruction::WRITE_REG) {
+				const IROperand& offset = insn->operands[1];
+				if (!offset.is_constant() || (offset.value < pc.offset + pc.size && offset.value + insn->operands[0].size > pc.offset)) {
+					prev_incpc = NULL;
+				}
+			}
+
+			pc_reads.clear();
+			transfer(insn, pc_reads);
+
+			for (uint32_t b = pc.offset; b < pc.offset + pc.size; b++) {
+				if (pc_reads.get(b)) prev_incpc = NULL;
+			}
+		}
+	}
+
+	// The bytes that are live when a block is left, through whatever
+	// instruction ends it.
+	std::vector<DenseSet> live_in (block_count, DenseSet(file_size));
+
+	auto live_out = [&](uint32_t block, DenseSet& live) {
+		const IRInstruction *last = ctx.at(block_last[block]);
+
+		live.clear();
+		if (last->type == IRInstruction::JMP) {
+			live.merge(live_in[last->operands[0].value]);
+		} else if (last->type == IRInstruction::BRANCH) {
+			live.merge(live_in[last->operands[1].value]);
+			live.merge(live_in[last->operands[2].value]);
+		} else {
+			live.fill();
+		}
+	};
+
+	DenseSet live (file_size);
+
+	bool changed;
+	do {
+		changed = false;
+
+		for (int32_t block = block_count - 1; block >= 0; block--) {
+			if (block_first[block] == -1) continue;
+
+			live_out(block, live);
+			for (int32_t ir_idx = block_last[block]; ir_idx >= block_first[block]; ir_idx--) {
+				IRInstruction *insn = ctx.at(ir_idx);
+				if (insn->ir_block == NOP_BLOCK) continue;
+
+				transfer(insn, live);
+			}
+
+			changed |= live_in[block].merge(live);
+		}
+	} while (changed);
+
+	for (uint32_t block = 0; block < block_count; block++) {
+		if (block_first[block] == -1) continue;
+
+		live_out(block, live);
+		for (int32_t ir_idx = block_last[block]; ir_idx >= block_first[block]; ir_idx--) {
+			IRInstruction *insn = ctx.at(ir_idx);
+			if (insn->ir_block == NOP_BLOCK) continue;
+
+			if (!transfer(insn, live)) continue;
+
+			switch (insn->type) {
+			case IRInstruction::WRITE_REG:
+			case IRInstruction::INCPC:
+			case IRInstruction::SET_ZN_FLAGS:
+				make_instruction_nop(insn, true);
+				break;
+
+			case IRInstruction::ADC_WITH_FLAGS:
+				insn->type = IRInstruction::ADC;
+				break;
+
+			case IRInstruction::SBC_WITH_FLAGS:
+				insn->type = IRInstruction::SBC;
+				break;
+
+			default:
+				break;
+			}
+		}
+	}
+
 	return true;
 }
@@ -0,0 +1,255 @@
+#include <define.h>
+#include <cpu.h>
+#include <jit/block-interpreter.h>
+#include <x86/encode.h>
+#include <malloc/malloc.h>
+#include <ir-interpreter.h>
+
+extern "C" void cpu_trap(void *cpu);
+extern "C" void cpu_write_device(void *cpu, uint32_t devid, uint32_t reg, uint32_t val);
+extern "C" void cpu_read_device(void *cpu, uint32_t devid, uint32_t reg, uint32_t& val);
+extern "C" void jit_trace(void *cpu, uint8_t opcode, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4);
+
+using namespace captive::arch;
+using namespace captive::arch::jit;
+using namespace captive::arch::x86;
+using namespace captive::shared;
+
+typedef void (*call_fn_0)(CPU *cpu);
+typedef void (*call_fn_1)(CPU *cpu, uint64_t arg0);
+typedef void (*call_fn_2)(CPU *cpu, uint64_t arg0, uint64_t arg1);
+typedef void (*call_fn_3)(CPU *cpu, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+typedef void (*call_fn_4)(CPU *cpu, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3);
+typedef void (*call_fn_5)(CPU *cpu, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4);
+
+namespace {
+	/**
+	 * An interpreted block and its program are data, so they don't take up
+	 * the code cache, which only holds the entry stub.  They are released
+	 * along with the block.
+	 */
+	struct InterpretedBlock
+	{
+		uint32_t *exec_counter;
+		gpa_t pa;
+		uint8_t isa;
+		InterpreterProgram *program;
+	};
+
+	/**
+	 * Gives the interpreter access to the state of the guest, in the same way
+	 * as compiled code.  Guest memory is accessed with the same instruction
+	 * forms that the block compiler emits, so that faults on it are handled
+	 * in the same way, and device accesses can be decoded and emulated.
+	 */
+	class EngineEnvironment
+	{
+	public:
+		EngineEnvironment(CPU& cpu, const InterpretedBlock& blk) : cpu(cpu), blk(blk), regs(cpu.tagged_registers()) { }
+
+		inline uint8_t *registers() { return (uint8_t *)regs.base; }
+
+		inline uint32_t read_pc() { return cpu.read_pc(); }
+		inline void inc_pc(uint32_t amount) { cpu.inc_pc(amount); }
+
+		inline void set_zn_flags(uint8_t z, uint8_t n)
+		{
+			*regs.Z = z;
+			*regs.N = n;
+		}
+
+		inline void set_nzcv_flags(uint8_t n, uint8_t z, uint8_t c, uint8_t v)
+		{
+			*regs.N = n;
+			*regs.Z = z;
+			*regs.C = c;
+			*regs.V = v;
+		}
+
+		inline uint64_t read_mem(uint32_t addr, uint8_t size)
+		{
+			uint64_t value = 0;
+
+			switch (size) {
+			case 1: asm volatile("movb (%%ecx), %%al" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 2: asm volatile("movw (%%ecx), %%ax" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 4: asm volatile("movl (%%ecx), %%eax" : "=a"(value) : "c"(addr) : "memory"); break;
+			case 8: asm volatile("movq (%%ecx), %%rax" : "=a"(value) : "c"(addr) : "memory"); break;
+			}
+
+			return value;
+		}
+
+		inline void write_mem(uint32_t addr, uint8_t size, uint64_t value)
+		{
+			switch (size) {
+			case 1: asm volatile("movb %%al, (%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			case 2: asm volatile("movw %%ax, (%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			case 4: asm volatile("movl %%eax, (%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			case 8: asm volatile("movq %%rax, (%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			}
+		}
+
+		inline uint64_t read_mem_user(uint32_t addr, uint8_t size)
+		{
+			uint64_t value = 0;
+
+			switch (size) {
+			case 1: asm volatile("movb %%gs:(%%ecx), %%al" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 2: asm volatile("movw %%gs:(%%ecx), %%ax" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 4: asm volatile("movl %%gs:(%%ecx), %%eax" : "=a"(value) : "c"(addr) : "memory"); break;
+			case 8: asm volatile("movq %%gs:(%%ecx), %%rax" : "=a"(value) : "c"(addr) : "memory"); break;
+			}
+
+			return value;
+		}
+
+		inline void write_mem_user(uint32_t addr, uint8_t size, uint64_t value)
+		{
+			switch (size) {
+			case 1: asm volatile("movb %%al, %%gs:(%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			case 2: asm volatile("movw %%ax, %%gs:(%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			case 4: asm volatile("movl %%eax, %%gs:(%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			case 8: asm volatile("movq %%rax, %%gs:(%%ecx)" :: "a"(value), "c"(addr) : "memory"); break;
+			}
+		}
+
+		inline void atomic_write(uint32_t addr, uint8_t size, uint64_t value)
+		{
+			switch (size) {
+			case 1: asm volatile("xchgb %%al, (%%ecx)" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 2: asm volatile("xchgw %%ax, (%%ecx)" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 4: asm volatile("xchgl %%eax, (%%ecx)" : "+a"(value) : "c"(addr) : "memory"); break;
+			case 8: asm volatile("xchgq %%rax, (%%ecx)" : "+a"(value) : "c"(addr) : "memory"); break;
+			}
+		}
+
+		inline uint32_t read_device(uint32_t dev, uint32_t reg)
+		{
+			uint32_t value = 0;
+			cpu_read_device(&cpu, dev, reg, value);
+			return value;
+		}
+
+		inline void write_device(uint32_t dev, uint32_t reg, uint32_t value) { cpu_write_device(&cpu, dev, reg, value); }
+
+		inline void call(uint64_t fn, const uint64_t *args, uint8_t arg_count)
+		{
+			switch (arg_count) {
+			case 0: ((call_fn_0)fn)(&cpu); break;
+			case 1: ((call_fn_1)fn)(&cpu, args[0]); break;
+			case 2: ((call_fn_2)fn)(&cpu, args[0], args[1]); break;
+			case 3: ((call_fn_3)fn)(&cpu, args[0], args[1], args[2]); break;
+			case 4: ((call_fn_4)fn)(&cpu, args[0], args[1], args[2], args[3]); break;
+			case 5: ((call_fn_5)fn)(&cpu, args[0], args[1], args[2], args[3], args[4]); break;
+			}
+		}
+
+		inline void trace(uint8_t opcode, const uint64_t *args, uint8_t arg_count)
+		{
+			jit_trace(&cpu, opcode, arg_count > 0 ? args[0] : 0, arg_count > 1 ? args[1] : 0, arg_count > 2 ? args[2] : 0, arg_count > 3 ? args[3] : 0);
+		}
+
+		inline void count_instruction() { cpu.cpu_data().insns_executed++; }
+
+		inline void flush() { asm volatile("int $0x85" :: "c"(1) : "memory"); }
+
+		inline void flush_entry(uint32_t addr)
+		{
+			asm volatile("mov %0, %%r14d\n int $0x85" :: "r"(addr), "c"(4) : "r14", "memory");
+		}
+
+		inline void trap() { cpu_trap(&cpu); }
+
+		inline uint32_t exit()
+		{
+			// Ask for the block to be compiled once it becomes warm, in the
+			// same way as a baseline translation asks to be recompiled.
+			if (++*blk.exec_counter == BLOCK_INTERPRET_THRESHOLD) {
+				cpu.request_tier_up(blk.pa, blk.isa);
+				*blk.exec_counter = 0;
+			}
+
+			return 0;
+		}
+
+	private:
+		CPU& cpu;
+		const InterpretedBlock& blk;
+		const CPU::TaggedRegisters& regs;
+	};
+
+	typedef IRInterpreter<EngineEnvironment> EngineInterpreter;
+}
+
+// The block being interpreted, which is only freed once it has finished if
+// it is released while it runs, e.g. by a helper that invalidates the
+// translations.  It is left behind if the block faults, so it is also
+// finished with when the next block is interpreted.
+static InterpretedBlock *running_block;
+static bool running_block_released;
+
+static void finish_running_block()
+{
+	if (running_block && running_block_released) {
+		malloc::data_alloc.free(running_block);
+	}
+
+	running_block = NULL;
+	running_block_released = false;
+}
+
+/**
+ * The entry stub of an interpreted block jumps here, with the guest registers
+ * in RDI, as they are passed to every translation.
+ */
+extern "C" uint32_t interpret_block(void *registers, InterpretedBlock *blk)
+{
+	CPU *cpu = CPU::get_active_cpu();
+
+	// As in compiled code, leave if the block is running in another ISA from
+	// the one it was decoded in.
+	if (*cpu->tagged_registers().ISA != 0) return 1;
+
+	finish_running_block();
+	running_block = blk;
+
+	EngineEnvironment env(*cpu, *blk);
+	uint32_t result = EngineInterpreter::execute(env, blk->program);
+
+	finish_running_block();
+	return result;
+}
+
+block_txln_fn BlockInterpreter::create(const TranslationContext& ctx, gpa_t pa, uint8_t isa, uint32_t *exec_counter, void *& data)
+{
+	uint32_t program_size = EngineInterpreter::program_size(ctx.get_ir_buffer(), ctx.count(), ctx.reg_count(), ctx.block_count());
+	if (!program_size) return NULL;
+
+	InterpretedBlock *blk = (InterpretedBlock *)malloc::data_alloc.alloc(sizeof(InterpretedBlock) + program_size);
+	if (!blk) return NULL;
+
+	blk->exec_counter = exec_counter;
+	blk->pa = pa;
+	blk->isa = isa;
+	blk->program = EngineInterpreter::predecode(blk + 1, ctx.get_ir_buffer(), ctx.count(), ctx.reg_count(), ctx.block_count());
+
+	// The stub begins with a ten-byte move, so that its entry can be patched
+	// with a jump to the compiled block when it is tiered up.
+	X86Encoder encoder(malloc::code_alloc);
+	encoder.mov((uint64_t)blk, REG_RSI);
+	encoder.mov((uint64_t)&interpret_block, REG_RAX);
+	encoder.jmp(REG_RAX);
+
+	data = blk;
+	return (block_txln_fn)encoder.get_buffer();
+}
+
+void BlockInterpreter::release(void *data)
+{
+	if (data == running_block) {
+		running_block_released = true;
+	} else {
+		malloc::data_alloc.free(data);
+	}
+}
@@ -424,7 +424,10 @@ bool BlockCompiler::verify()
 			break;
 
 		case IRInstruction::RET:
-			CHECK_OPERANDS(0);
+			// A direct exit carries its target and fallthrough PCs, and a call
+			// additionally carries its return address and the translation slot
+			// of the return block.  The target of an indirect call is the PC.
+			ABORT_IF(!has_operands(*insn, 0) && !has_operands(*insn, 2) && !has_operands(*insn, 4), "invalid operand count\n");
 			break;
 			
 		case IRInstruction::DISPATCH:
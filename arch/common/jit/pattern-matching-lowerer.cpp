@@ -1,10 +1,329 @@
 #include <jit/block-compiler.h>
 
+// The longest sequence of IR instructions that a pattern can cover.
+#define MAX_PATTERN_LENGTH 4
+
 using namespace captive::arch::jit;
 using namespace captive::arch::x86;
 using namespace captive::shared;
 
-bool BlockCompiler::peeplower(uint32_t max_stack)
+/**
+ * The patterns below fold address arithmetic into a single base + index *
+ * scale + disp operand, which is used either by a three-operand lea or, when
+ * the address is only used by a guest load, directly by the load.  A load that
+ * is immediately zero- or sign-extended becomes a single movzx or movsx.
+ *
+ * Loads keep a 32-bit address, so that the device-access fault handler can
+ * recognise (by the address-size prefix), decode and rewrite them.  Lowering
+ * cmp+branch into cmp/jcc, and folding immediates into ALU instructions, is
+ * already done by the lowering of the individual instructions.
+ */
+namespace {
+	struct address_form {
+		enum {
+			LEA,
+			LOAD,
+			LOAD_ZX,
+			LOAD_SX,
+		} kind;
+
+		const IROperand *base;
+		const IROperand *index;
+		uint8_t scale;
+		int32_t disp;
+		const IROperand *dest;
+
+		// The width of the value in memory, for loads.
+		uint8_t size;
+	};
+
+	struct lowering_pattern {
+		const char *name;
+		uint32_t length;
+		bool (*match)(IRInstruction **insns, address_form& form);
+	};
+}
+
+static inline bool is_reg(const IROperand& oper)
+{
+	return oper.is_vreg() && oper.is_alloc_reg() && (oper.size == 4 || oper.size == 8);
+}
+
+static inline bool same_reg(const IROperand& a, const IROperand& b)
+{
+	return a.alloc_data == b.alloc_data;
+}
+
+// Whether two operands name the same virtual register, in the same place.
+static inline bool same_vreg(const IROperand& a, const IROperand& b)
+{
+	return a.value == b.value && same_reg(a, b) && a.size == b.size;
+}
+
+static inline bool is_scale_shift(const IROperand& amount)
+{
+	return amount.is_constant() && amount.value >= 1 && amount.value <= 3;
+}
+
+// Whether a constant can be used as a displacement for an operation of the
+// given size.  32-bit operations wrap, so any value will do.
+static inline bool fits_disp(const IROperand& oper, uint8_t size)
+{
+	return size == 4 || (int64_t)oper.value == (int32_t)oper.value;
+}
+
+/**
+ * mov x, t; shl c, t; add b, t  =>  lea (b, x, 1 << c), t
+ */
+static bool match_mov_shl_add(IRInstruction **insns, address_form& form)
+{
+	IRInstruction *mov = insns[0], *shl = insns[1], *add = insns[2];
+
+	if (mov->type != IRInstruction::MOV || shl->type != IRInstruction::SHL || add->type != IRInstruction::ADD) return false;
+
+	const IROperand& x = mov->operands[0];
+	const IROperand& t = mov->operands[1];
+	const IROperand& b = add->operands[0];
+
+	if (!is_reg(x) || !is_reg(t) || !is_reg(b)) return false;
+	if (x.size != t.size || b.size != t.size) return false;
+	if (!is_scale_shift(shl->operands[0])) return false;
+	if (!same_vreg(shl->operands[1], t) || !same_vreg(add->operands[1], t)) return false;
+
+	// The add reads the base after the shift has written t.
+	if (same_reg(b, t)) return false;
+
+	form.kind = address_form::LEA;
+	form.base = &b;
+	form.index = &x;
+	form.scale = 1 << shl->operands[0].value;
+	form.disp = 0;
+	form.dest = &t;
+
+	return true;
+}
+
+/**
+ * shl c, t; add b, t  =>  lea (b, t, 1 << c), t
+ */
+static bool match_shl_add(IRInstruction **insns, address_form& form)
+{
+	IRInstruction *shl = insns[0], *add = insns[1];
+
+	if (shl->type != IRInstruction::SHL || add->type != IRInstruction::ADD) return false;
+
+	const IROperand& t = shl->operands[1];
+	const IROperand& b = add->operands[0];
+
+	if (!is_reg(t) || !is_reg(b) || b.size != t.size) return false;
+	if (!is_scale_shift(shl->operands[0])) return false;
+	if (!same_vreg(add->operands[1], t) || same_reg(b, t)) return false;
+
+	form.kind = address_form::LEA;
+	form.base = &b;
+	form.index = &t;
+	form.scale = 1 << shl->operands[0].value;
+	form.disp = 0;
+	form.dest = &t;
+
+	return true;
+}
+
+/**
+ * mov a, t; add b, t  =>  lea (a, b), t
+ * mov a, t; add $c, t  =>  lea c(a), t
+ * mov $c, t; add b, t  =>  lea c(b), t
+ */
+static bool match_mov_add(IRInstruction **insns, address_form& form)
+{
+	IRInstruction *mov = insns[0], *add = insns[1];
+
+	if (mov->type != IRInstruction::MOV || add->type != IRInstruction::ADD) return false;
+
+	const IROperand& a = mov->operands[0];
+	const IROperand& t = mov->operands[1];
+	const IROperand& b = add->operands[0];
+
+	if (!is_reg(t) || !same_vreg(add->operands[1], t)) return false;
+
+	form.kind = address_form::LEA;
+	form.scale = 0;
+	form.disp = 0;
+	form.dest = &t;
+
+	if (a.is_constant()) {
+		if (!is_reg(b) || b.size != t.size || same_reg(b, t) || !fits_disp(a, t.size)) return false;
+
+		form.base = &b;
+		form.index = NULL;
+		form.disp = (int32_t)a.value;
+		return true;
+	}
+
+	// If the move is a no-op, the add on its own is as good as a lea.
+	if (!is_reg(a) || a.size != t.size || same_reg(a, t)) return false;
+
+	if (b.is_constant()) {
+		if (!fits_disp(b, t.size)) return false;
+
+		form.base = &a;
+		form.index = NULL;
+		form.disp = (int32_t)b.value;
+		return true;
+	}
+
+	// The add reads the second operand after the move has written t.
+	if (!is_reg(b) || b.size != t.size || same_reg(b, t)) return false;
+
+	form.base = &a;
+	form.index = &b;
+	form.scale = 1;
+	return true;
+}
+
+/**
+ * Folds an address computed into a temporary by one of the patterns above into
+ * a guest load from that temporary, i.e.
+ *
+ *   ...; ldmem t, $d, v  =>  mov d(form), v
+ *
+ * The loaded value must land in the same register as t, which shows that t is
+ * not used after the load.
+ */
+static bool fold_into_load(IRInstruction *load, address_form& form)
+{
+	if (load->type != IRInstruction::READ_MEM) return false;
+
+	const IROperand& addr = load->operands[0];
+	const IROperand& disp = load->operands[1];
+	const IROperand& v = load->operands[2];
+
+	if (form.dest->size != 4 || !same_vreg(addr, *form.dest) || !disp.is_constant()) return false;
+	if (!v.is_vreg() || !v.is_alloc_reg() || !same_reg(v, *form.dest)) return false;
+
+	form.kind = address_form::LOAD;
+	form.disp = (int32_t)((uint32_t)form.disp + (uint32_t)disp.value);
+	form.dest = &v;
+	form.size = v.size;
+
+	return true;
+}
+
+/**
+ * mov x, t; shl c, t; add b, t; ldmem t, $d, v  =>  mov d(b, x, 1 << c), v
+ */
+static bool match_mov_shl_add_load(IRInstruction **insns, address_form& form)
+{
+	return match_mov_shl_add(insns, form) && fold_into_load(insns[3], form);
+}
+
+/**
+ * shl c, t; add b, t; ldmem t, $d, v  =>  mov d(b, t, 1 << c), v
+ */
+static bool match_shl_add_load(IRInstruction **insns, address_form& form)
+{
+	return match_shl_add(insns, form) && fold_into_load(insns[2], form);
+}
+
+/**
+ * mov a, t; add b, t; ldmem t, $d, v  =>  mov d(a, b), v
+ * mov a, t; add $c, t; ldmem t, $d, v  =>  mov c+d(a), v
+ */
+static bool match_mov_add_load(IRInstruction **insns, address_form& form)
+{
+	return match_mov_add(insns, form) && fold_into_load(insns[2], form);
+}
+
+/**
+ * ldmem a, $d, v; zx v, w  =>  movzx d(a), w
+ * ldmem a, $d, v; sx v, w  =>  movsx d(a), w
+ */
+static bool match_load_extend(IRInstruction **insns, address_form& form)
+{
+	IRInstruction *load = insns[0], *ext = insns[1];
+
+	if (load->type != IRInstruction::READ_MEM) return false;
+	if (ext->type != IRInstruction::ZX && ext->type != IRInstruction::SX) return false;
+
+	const IROperand& a = load->operands[0];
+	const IROperand& disp = load->operands[1];
+	const IROperand& v = load->operands[2];
+	const IROperand& w = ext->operands[1];
+
+	if (!is_reg(a) || a.size != 4 || !disp.is_constant()) return false;
+	if (!v.is_vreg() || !v.is_alloc_reg() || (v.size != 1 && v.size != 2)) return false;
+	if (!same_vreg(ext->operands[0], v)) return false;
+
+	// As for loads, the narrow value must not be used after the extension.
+	if (!w.is_vreg() || !w.is_alloc_reg() || w.size != 4 || !same_reg(v, w)) return false;
+
+	form.kind = ext->type == IRInstruction::ZX ? address_form::LOAD_ZX : address_form::LOAD_SX;
+	form.base = &a;
+	form.index = NULL;
+	form.scale = 0;
+	form.disp = (int32_t)disp.value;
+	form.dest = &w;
+	form.size = v.size;
+
+	return true;
+}
+
+// Longer patterns come first, so that the most instructions are covered.
+static const lowering_pattern lowering_patterns[] = {
+	{ .name = "mov-shl-add-load", .length = 4, .match = match_mov_shl_add_load },
+	{ .name = "mov-shl-add", .length = 3, .match = match_mov_shl_add },
+	{ .name = "shl-add-load", .length = 3, .match = match_shl_add_load },
+	{ .name = "mov-add-load", .length = 3, .match = match_mov_add_load },
+	{ .name = "shl-add", .length = 2, .match = match_shl_add },
+	{ .name = "mov-add", .length = 2, .match = match_mov_add },
+	{ .name = "load-extend", .length = 2, .match = match_load_extend },
+};
+
+/**
+ * Tries to lower the IR instructions starting at ir_idx with a single pattern,
+ * and returns how many IR instructions (including any NOPs in between) were
+ * covered, or zero if no pattern matched.
+ */
+uint32_t BlockCompiler::peeplower(uint32_t ir_idx)
 {
-	return false;
+	IRInstruction *insns[MAX_PATTERN_LENGTH];
+	uint32_t last_idx[MAX_PATTERN_LENGTH];
+	uint32_t length = 0;
+
+	IRBlockId block = ctx.at(ir_idx)->ir_block;
+
+	// Gather the next few live instructions in this block.
+	for (uint32_t idx = ir_idx; idx < ctx.count() && length < MAX_PATTERN_LENGTH; idx++) {
+		IRInstruction *insn = ctx.at(idx);
+
+		if (insn->ir_block == NOP_BLOCK) continue;
+		if (insn->ir_block != block) break;
+
+		insns[length] = insn;
+		last_idx[length] = idx;
+		length++;
+	}
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(lowering_patterns); i++) {
+		const lowering_pattern& pattern = lowering_patterns[i];
+		address_form form;
+
+		if (pattern.length > length || !pattern.match(insns, form)) continue;
+
+		const X86Register& dest = register_from_operand(form.dest);
+		X86Memory addr = form.index
+			? X86Memory::get(register_from_operand(form.base), form.disp, register_from_operand(form.index), form.scale)
+			: X86Memory::get(register_from_operand(form.base), form.disp);
+
+		switch (form.kind) {
+		case address_form::LEA: encoder.lea(addr, dest); break;
+		case address_form::LOAD: encoder.mov(addr, dest); break;
+		case address_form::LOAD_ZX: encoder.movzx(form.size, addr, dest); break;
+		case address_form::LOAD_SX: encoder.movsx(form.size, addr, dest); break;
+		}
+
+		return last_idx[pattern.length - 1] - ir_idx + 1;
+	}
+
+	return 0;
 }
@@ -2,6 +2,7 @@
 #include <printf.h>
 
 using namespace captive::arch::jit;
+using namespace captive::shared;
 
 TranslationContext::TranslationContext(malloc::Allocator& allocator)
 	: _allocator(allocator), _current_block_id(0), _ir_block_count(0), _ir_reg_count(0), _ir_insns(NULL), _ir_insn_count(0), _ir_insn_buffer_size(0)
@@ -13,3 +14,30 @@ TranslationContext::~TranslationContext()
 {
 	//captive::arch::free(_ir_insns);
 }
+
+uint32_t TranslationContext::packed_size() const
+{
+	uint32_t size = 0;
+
+	for (uint32_t i = 0; i < _ir_insn_count; i++) {
+		if (_ir_insns[i].ir_block != NOP_BLOCK) size += PackedIR::encode(_ir_insns[i], NULL);
+	}
+
+	return size;
+}
+
+uint32_t TranslationContext::pack(malloc::Allocator& allocator, const uint8_t *& ir) const
+{
+	uint32_t size = packed_size();
+
+	uint8_t *buffer = (uint8_t *)allocator.alloc(size);
+	assert(buffer);
+
+	uint32_t offset = 0;
+	for (uint32_t i = 0; i < _ir_insn_count; i++) {
+		if (_ir_insns[i].ir_block != NOP_BLOCK) offset += PackedIR::encode(_ir_insns[i], buffer + offset);
+	}
+
+	ir = buffer;
+	return size;
+}
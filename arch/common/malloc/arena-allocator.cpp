@@ -0,0 +1,108 @@
+#include <malloc/arena-allocator.h>
+#include <malloc/malloc.h>
+#include <printf.h>
+#include <string.h>
+
+using namespace captive::arch::malloc;
+
+namespace captive { namespace arch { namespace malloc {
+ArenaAllocator compile_alloc(data_alloc);
+}}}
+
+#define ARENA_ALIGNMENT		16ULL
+#define ALIGN_ARENA(_size)	(((_size) + (ARENA_ALIGNMENT - 1)) & ~(ARENA_ALIGNMENT - 1))
+
+ArenaAllocator::ArenaAllocator(Allocator& backing) : _backing(backing), _first(NULL), _current(NULL), _next(0), _last(NULL), _active(false)
+{
+}
+
+void ArenaAllocator::reset()
+{
+	_current = _first;
+	_next = _current ? chunk_base(_current) : 0;
+	_last = NULL;
+}
+
+bool ArenaAllocator::contains(const void *p) const
+{
+	for (const Chunk *chunk = _first; chunk; chunk = chunk->next) {
+		if ((uint64_t)p >= chunk_base(chunk) && (uint64_t)p < chunk_end(chunk)) return true;
+	}
+
+	return false;
+}
+
+void *ArenaAllocator::alloc(size_t size)
+{
+	uint64_t total_size = sizeof(AllocationHeader) + ALIGN_ARENA(size);
+
+	// Move on to the next chunk that is big enough, taking a new one from
+	// the backing allocator if there isn't one.
+	while (!_current || _next + total_size > chunk_end(_current)) {
+		Chunk *next = _current ? _current->next : _first;
+
+		if (!next) {
+			uint64_t chunk_size = total_size > ARENA_CHUNK_SIZE ? total_size : ARENA_CHUNK_SIZE;
+
+			next = (Chunk *)_backing.alloc(sizeof(Chunk) + chunk_size);
+			if (!next) {
+				fatal("out of compilation memory\n");
+			}
+
+			next->next = NULL;
+			next->size = chunk_size;
+
+			if (_current) {
+				_current->next = next;
+			} else {
+				_first = next;
+			}
+		}
+
+		_current = next;
+		_next = chunk_base(_current);
+	}
+
+	_last = (AllocationHeader *)_next;
+	_last->size = ALIGN_ARENA(size);
+	_next += total_size;
+
+	return (void *)(_last + 1);
+}
+
+void *ArenaAllocator::realloc(void *p, size_t new_size)
+{
+	if (p == NULL) return alloc(new_size);
+
+	AllocationHeader *hdr = (AllocationHeader *)p - 1;
+	if (new_size <= hdr->size) return p;
+
+	// The most recent allocation can be extended, if its chunk has room.
+	if (hdr == _last) {
+		uint64_t end = (uint64_t)p + ALIGN_ARENA(new_size);
+		if (end <= chunk_end(_current)) {
+			hdr->size = ALIGN_ARENA(new_size);
+			_next = end;
+
+			return p;
+		}
+	}
+
+	void *new_p = alloc(new_size);
+	memcpy(new_p, p, hdr->size);
+
+	return new_p;
+}
+
+void ArenaAllocator::free(void *p)
+{
+	if (p == NULL) return;
+
+	// Only the most recent allocation can be given back.  Everything else is
+	// reclaimed when the arena is reset.
+	AllocationHeader *hdr = (AllocationHeader *)p - 1;
+	if (hdr == _last) {
+		_next = (uint64_t)hdr;
+		_last = NULL;
+	}
+}
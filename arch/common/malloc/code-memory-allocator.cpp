@@ -1,24 +1,83 @@
 #include <malloc/code-memory-allocator.h>
-#include <malloc/data-memory-allocator.h>
+#include <printf.h>
+#include <string.h>
 
 using namespace captive::arch::malloc;
 
 namespace captive { namespace arch { namespace malloc {
 CodeMemoryAllocator code_alloc;
-extern DataMemoryAllocator data_alloc;
 }}}
 
+#define CODE_ALIGNMENT		16ULL
+#define ALIGN_CODE(_size)	(((_size) + (CODE_ALIGNMENT - 1)) & ~(CODE_ALIGNMENT - 1))
+
+CodeMemoryAllocator::CodeMemoryAllocator() : _arena_base(0), _arena_end(0), _next(0), _last(NULL)
+{
+}
+
+void CodeMemoryAllocator::init(void *arena, size_t arena_size)
+{
+	_arena_base = (uint64_t)arena;
+	_arena_end = _arena_base + arena_size;
+
+	reset();
+}
+
+void CodeMemoryAllocator::reset()
+{
+	_next = _arena_base;
+	_last = NULL;
+}
+
 void *CodeMemoryAllocator::alloc(size_t size)
 {
-	return data_alloc.alloc(size);
+	uint64_t total_size = sizeof(AllocationHeader) + ALIGN_CODE(size);
+	if (_next + total_size > _arena_end) {
+		fatal("out of code memory\n");
+	}
+
+	_last = (AllocationHeader *)_next;
+	_last->size = ALIGN_CODE(size);
+	_next += total_size;
+
+	return (void *)(_last + 1);
 }
 
 void *CodeMemoryAllocator::realloc(void *p, size_t new_size)
 {
-	return data_alloc.realloc(p, new_size);
+	if (p == NULL) return alloc(new_size);
+
+	AllocationHeader *hdr = (AllocationHeader *)p - 1;
+	if (new_size <= hdr->size) return p;
+
+	// The most recent allocation can simply be extended.
+	if (hdr == _last) {
+		uint64_t end = (uint64_t)p + ALIGN_CODE(new_size);
+		if (end > _arena_end) {
+			fatal("out of code memory\n");
+		}
+
+		hdr->size = ALIGN_CODE(new_size);
+		_next = end;
+
+		return p;
+	}
+
+	void *new_p = alloc(new_size);
+	memcpy(new_p, p, hdr->size);
+
+	return new_p;
 }
 
 void CodeMemoryAllocator::free(void *p)
 {
-	return data_alloc.free(p);
+	if (p == NULL) return;
+
+	// Only the most recent allocation can be given back.  Everything else is
+	// reclaimed when the arena is reset.
+	AllocationHeader *hdr = (AllocationHeader *)p - 1;
+	if (hdr == _last) {
+		_next = (uint64_t)hdr;
+		_last = NULL;
+	}
 }
@@ -9,7 +9,8 @@ uint64_t Memory::__force_order;
 
 Memory::Memory(uint64_t first_phys_page)
 	: _next_phys_page((pa_t)first_phys_page),
-	_data_base((va_t)0x200000000)
+	_data_base((va_t)0x200000000),
+	_root(CR3)
 {
 	mm = this;
 	//printf("next avail phys page: %x, data area base: %x\n", _next_phys_page, _data_base);
@@ -2,6 +2,7 @@
 #include <cpu.h>
 #include <mm.h>
 #include <printf.h>
+#include <string.h>
 
 using namespace captive::arch;
 
@@ -16,7 +17,25 @@ static struct {
 	gpa_t value;
 } itlb[ITLB_SIZE];
 
-MMU::MMU(CPU& cpu) : _cpu(cpu)
+static void invalidate_itlb()
+{
+	for (int i = 0; i < ITLB_SIZE; i++) {
+		itlb[i].tag = 0;
+	}
+}
+
+#define CR4_PCIDE	(1ULL << 17)
+#define CR3_NOFLUSH	(1ULL << 63)
+
+static bool host_has_pcid()
+{
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+	return !!(ecx & (1 << 17));
+}
+
+MMU::MMU(CPU& cpu) : _cpu(cpu), current_space(&address_spaces[0]), address_space_clock(0), pcid_enabled(false)
 {
 	//printf("mmu: allocating guest pdps\n");
 
@@ -39,11 +58,30 @@ MMU::MMU(CPU& cpu) : _cpu(cpu)
 		pdp->entries[i].allow_user(true);
 	}
 
-	Memory::flush_tlb();
-	
-	for (int i = 0; i < ITLB_SIZE; i++) {
-		itlb[i].tag = 0;
+	// The initial page tables become the first address space, and the others
+	// are built from them when they are first used.
+	for (int i = 0; i < ADDRESS_SPACE_COUNT; i++) {
+		address_spaces[i].valid = false;
+		address_spaces[i].stale = false;
+		address_spaces[i].last_used = 0;
+		address_spaces[i].writable_count = 0;
+		address_spaces[i].writes_disabled = false;
+		address_spaces[i].root = NULL;
+		address_spaces[i].pdp = NULL;
 	}
+
+	address_spaces[0].root = CR3;
+	address_spaces[0].pdp = pdp;
+
+	// The PCID of an address space is its index, and the initial page tables
+	// already run with PCID zero.
+	if (host_has_pcid()) {
+		Memory::write_cr4(Memory::read_cr4() | CR4_PCIDE);
+		pcid_enabled = true;
+	}
+
+	Memory::flush_tlb();
+	invalidate_itlb();
 }
 
 MMU::~MMU()
@@ -144,21 +182,18 @@ void MMU::set_page_dirty(va_t va, bool dirty)
 	pt->dirty(dirty);
 }
 
-uint32_t MMU::page_checksum(va_t va)
+uint64_t MMU::page_checksum(va_t va)
 {
-	uint32_t checksum = 0;
+	uint64_t checksum = 0xcbf29ce484222325ULL;
 	for (int i = 0; i < 0x400; i++) {
-		checksum ^= ((uint32_t *)va)[i];
+		checksum = (checksum ^ ((uint32_t *)va)[i]) * 0x100000001b3ULL;
 	}
 
 	return checksum;
 }
 
-void MMU::invalidate_virtual_mappings()
+void MMU::clear_guest_mappings(page_dir_ptr_t *pdp)
 {
-	page_map_t *pm = (page_map_t *)PHYS_TO_VIRT(CR3);
-	page_dir_ptr_t *pdp = (page_dir_ptr_t *)PHYS_TO_VIRT((pa_t)pm->entries[0].base_address());
-
 	// Clear the present map on the 4G mapping, and re-enable writing.
 	for (int i = 0; i < 4; i++) {
 		pdp->entries[i].present(false);
@@ -170,18 +205,198 @@ void MMU::invalidate_virtual_mappings()
 		pdp->entries[i].present(false);
 		pdp->entries[i].writable(true);
 	}
+}
+
+/**
+ * Returns the page table entry that maps the given address in the guest
+ * mappings of an address space, or NULL if it is not mapped.  Unlike
+ * Memory::get_va_table_entries, this never allocates, and doesn't need the
+ * address space to be active.
+ */
+page_table_entry_t *MMU::lookup_guest_entry(page_dir_ptr_t *pdp, va_t va)
+{
+	page_dir_ptr_entry_t *pdpe = &pdp->entries[((uint64_t)va >> 30) & 0x1ff];
+	if (!pdpe->present() || pdpe->base_address() == 0) return NULL;
+
+	page_dir_entry_t *pde = &((page_dir_t *)PHYS_TO_VIRT((pa_t)pdpe->base_address()))->entries[((uint64_t)va >> 21) & 0x1ff];
+	if (!pde->present() || pde->base_address() == 0) return NULL;
+
+	return &((page_table_t *)PHYS_TO_VIRT((pa_t)pde->base_address()))->entries[((uint64_t)va >> 12) & 0x1ff];
+}
+
+void MMU::create_address_space(AddressSpace& as)
+{
+	page_map_t *base_pm = (page_map_t *)PHYS_TO_VIRT(CR3);
+
+	// The shadow page tables share everything outside the guest mappings with
+	// the initial page tables, and so only need their own PML4 and PDP.
+	Memory::Page root = Memory::alloc_page();
+	Memory::Page pdp = Memory::alloc_page();
+
+	memcpy(root.va, base_pm, 0x1000);
+	memcpy(pdp.va, PHYS_TO_VIRT((pa_t)base_pm->entries[0].base_address()), 0x1000);
+
+	((page_map_t *)root.va)->entries[0].base_address((uint64_t)pdp.pa);
+
+	as.root = root.pa;
+	as.pdp = (page_dir_ptr_t *)pdp.va;
+
+	// Give the 4G mapping and the emulated 4G mapping their own page
+	// directories.
+	for (int i = 0; i < 20; i++) {
+		if (i >= 4 && i < 16) continue;
+
+		as.pdp->entries[i].base_address((uint64_t)Memory::alloc_page().pa);
+		as.pdp->entries[i].flags(0);
+		as.pdp->entries[i].present(false);
+		as.pdp->entries[i].writable(true);
+		as.pdp->entries[i].allow_user(true);
+	}
+}
+
+void MMU::load_address_space(AddressSpace& as)
+{
+	uint64_t cr3 = (uint64_t)as.root;
+
+	if (as.writes_disabled && as.writable_count > WRITABLE_LOG_SIZE) as.stale = true;
+
+	if (pcid_enabled) {
+		cr3 |= (uint64_t)(&as - address_spaces);
+
+		// Keep the TLB entries of the address space, unless they may be out
+		// of date.
+		if (!as.stale) cr3 |= CR3_NOFLUSH;
+	}
+
+	current_space = &as;
+
+	Memory::mm->_root = as.root;
+	Memory::write_cr3((pa_t)cr3);
+
+	// Writes were disabled while the address space was inactive, so drop
+	// the writable entries it may still have.
+	if (!as.stale && as.writes_disabled) {
+		for (uint32_t i = 0; i < as.writable_count; i++) {
+			Memory::flush_page(as.writable_pages[i]);
+		}
+
+		as.writable_count = 0;
+	}
+
+	if (as.stale) as.writable_count = 0;
+
+	as.stale = false;
+	as.writes_disabled = false;
+}
+
+void MMU::note_writable_page(va_t va)
+{
+	if (!pcid_enabled) return;
+
+	AddressSpace& as = *current_space;
+	if (as.writable_count < WRITABLE_LOG_SIZE) {
+		as.writable_pages[as.writable_count] = va;
+	}
 
+	// Counting past the end of the log marks it as overflowed.
+	if (as.writable_count <= WRITABLE_LOG_SIZE) as.writable_count++;
+}
+
+/**
+ * Drops everything that has been derived from the virtual mappings of the
+ * active address space.
+ */
+void MMU::invalidate_current_space()
+{
 	// Flush the TLB
 	Memory::flush_tlb();
+	current_space->writable_count = 0;
 
 	// Notify the CPU to invalidate virtual mappings
 	_cpu.invalidate_virtual_mappings();
 	
-	for (int i = 0; i < ITLB_SIZE; i++) {
-		itlb[i].tag = 0;
+	invalidate_itlb();
+}
+
+void MMU::switch_address_space(uint32_t asid)
+{
+	if (current_space->valid && current_space->asid == asid) return;
+
+	assert(in_kernel_mode());
+
+	AddressSpace *target = NULL, *victim = &address_spaces[0];
+
+	for (int i = 0; i < ADDRESS_SPACE_COUNT; i++) {
+		AddressSpace& as = address_spaces[i];
+
+		if (as.valid && as.asid == asid) {
+			target = &as;
+			break;
+		}
+
+		if (as.last_used < victim->last_used) victim = &as;
+	}
+
+	if (!target) {
+		// Recycle the least recently used address space.  Address spaces
+		// that have never been used are picked first.
+		target = victim;
+
+		if (!target->root) {
+			create_address_space(*target);
+		} else {
+			clear_guest_mappings(target->pdp);
+		}
+
+		target->asid = asid;
+		target->valid = true;
+		target->stale = true;
+	}
+
+	target->last_used = ++address_space_clock;
+	load_address_space(*target);
+
+	// The CPU looks up its translations, and the ITLB, by virtual address, so
+	// these can't be kept across the switch.
+	_cpu.invalidate_virtual_mappings();
+	invalidate_itlb();
+}
+
+void MMU::invalidate_address_space(uint32_t asid)
+{
+	bool invalidate_current = false;
+
+	for (int i = 0; i < ADDRESS_SPACE_COUNT; i++) {
+		AddressSpace& as = address_spaces[i];
+		if (!as.valid || as.asid != asid) continue;
+
+		clear_guest_mappings(as.pdp);
+
+		if (&as == current_space) {
+			invalidate_current = true;
+		} else {
+			as.stale = true;
+		}
+	}
+
+	if (invalidate_current) {
+		invalidate_current_space();
 	}
 }
 
+void MMU::invalidate_virtual_mappings()
+{
+	for (int i = 0; i < ADDRESS_SPACE_COUNT; i++) {
+		AddressSpace& as = address_spaces[i];
+		if (!as.root) continue;
+
+		clear_guest_mappings(as.pdp);
+		if (&as != current_space) as.stale = true;
+	}
+
+	invalidate_current_space();
+}
+
 void MMU::invalidate_virtual_mapping(gva_t va)
 {
 	page_map_entry_t *pm;
@@ -198,6 +413,26 @@ void MMU::invalidate_virtual_mapping(gva_t va)
 	pt->present(false);
 
 	Memory::flush_page((va_t)(uint64_t)(0x400000000ULL | va));
+
+	// The mapping may be global, so drop it from the inactive address spaces
+	// too.  Their TLB entries can't be flushed individually, so the whole of
+	// their PCID is flushed when they are next switched to.
+	for (int i = 0; i < ADDRESS_SPACE_COUNT; i++) {
+		AddressSpace& as = address_spaces[i];
+		if (!as.root || &as == current_space) continue;
+
+		page_table_entry_t *entries[2] = {
+			lookup_guest_entry(as.pdp, (va_t)(uint64_t)va),
+			lookup_guest_entry(as.pdp, (va_t)(uint64_t)(0x400000000ULL | va))
+		};
+
+		for (int j = 0; j < 2; j++) {
+			if (entries[j] && entries[j]->present()) {
+				entries[j]->present(false);
+				as.stale = true;
+			}
+		}
+	}
 	
 	// Notify the CPU to invalidate this virtual mapping
 	_cpu.invalidate_virtual_mapping(va);
@@ -207,17 +442,24 @@ void MMU::invalidate_virtual_mapping(gva_t va)
 
 void MMU::disable_writes()
 {
-	page_map_t *pm = (page_map_t *)PHYS_TO_VIRT(CR3);
-	page_dir_ptr_t *pdp = (page_dir_ptr_t *)PHYS_TO_VIRT((pa_t)pm->entries[0].base_address());
+	for (int i = 0; i < ADDRESS_SPACE_COUNT; i++) {
+		AddressSpace& as = address_spaces[i];
+		if (!as.root) continue;
 
-	// Clear the writable flag on the 4G mapping
-	for (int i = 0; i < 4; i++) {
-		pdp->entries[i].writable(false);
-	}
-	
-	// Clear the writable flag on the emulated 4G mapping
-	for (int i = 16; i < 20; i++) {
-		pdp->entries[i].writable(false);
+		// Clear the writable flag on the 4G mapping
+		for (int j = 0; j < 4; j++) {
+			as.pdp->entries[j].writable(false);
+		}
+		
+		// Clear the writable flag on the emulated 4G mapping
+		for (int j = 16; j < 20; j++) {
+			as.pdp->entries[j].writable(false);
+		}
+
+		// Only the pages that were made writable while the address space
+		// was active can have writable TLB entries under its PCID, so there
+		// is no need to flush all of them.
+		if (&as != current_space) as.writes_disabled = true;
 	}
 
 	// Flush the TLB
@@ -226,6 +468,8 @@ void MMU::disable_writes()
 	} else {
 		asm volatile("int $0x83\n" ::: "rax");
 	}
+
+	current_space->writable_count = 0;
 }
 
 bool MMU::handle_fault(gva_t va, gpa_t& out_pa, const access_info& info, resolution_fault& fault, bool emulate_user)
@@ -365,15 +609,20 @@ bool MMU::handle_fault(gva_t va, gpa_t& out_pa, const access_info& info, resolut
 
 	if (pt->present() && info.is_write() && fault == NONE) {
 		if (clear_if_page_executed(((va_t)(0x100000000ULL | (pt->base_address() & 0xffffffff))))) {
-			cpu().invalidate_translation((pa_t)pt->base_address(), (va_t)(uint64_t)va);
-
 			//printf("PC: %08x, VA: %08x\n", _cpu.read_pc(), (uint32_t)va);
 			if ((_cpu.read_pc() & ~0xfff) == (uint32_t)(va & ~0xfff)) {
+				// The page is modifying itself, so its translations cannot be
+				// kept until the write has happened.
+				cpu().invalidate_translation((pa_t)pt->base_address(), (va_t)(uint64_t)va);
 				fault = SMC_FAULT;
+			} else {
+				cpu().mark_translation_dirty((pa_t)pt->base_address(), (va_t)(uint64_t)va);
 			}
 		}
 	}
 
+	if (pt->present() && pt->writable()) note_writable_page(host_va);
+
 	Memory::flush_page(host_va);
 	return true;
 
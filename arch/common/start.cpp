@@ -112,6 +112,9 @@ extern "C" {
 
 		// Initialise the malloc() memory allocation system.
 		captive::arch::malloc::page_alloc.init(cpu_data->guest_data->heap.base_address, cpu_data->guest_data->heap.size);
+
+		// Set aside the code cache.
+		captive::arch::malloc::code_alloc.init(captive::arch::malloc::page_alloc.alloc_pages(CODE_ARENA_PAGES), CODE_ARENA_SIZE);
 		
 		// Initialise the memory manager.
 		captive::arch::Memory mm(cpu_data->guest_data->next_phys_page);
@@ -4,16 +4,30 @@
 
 void *operator new(size_t size)
 {
+	if (captive::arch::malloc::compile_alloc.active()) {
+		return captive::arch::malloc::compile_alloc.alloc(size);
+	}
+
 	return captive::arch::malloc::data_alloc.alloc(size);
 }
 
 void *operator new[](size_t size)
 {
+	if (captive::arch::malloc::compile_alloc.active()) {
+		return captive::arch::malloc::compile_alloc.calloc(1, size);
+	}
+
 	return captive::arch::malloc::data_alloc.calloc(1, size);
 }
 
 void operator delete(void *p)
 {
+	// Compilation memory is reclaimed all at once, whenever it is freed.
+	if (captive::arch::malloc::compile_alloc.contains(p)) {
+		captive::arch::malloc::compile_alloc.free(p);
+		return;
+	}
+
 	captive::arch::malloc::data_alloc.free(p);
 }
 
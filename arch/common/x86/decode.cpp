@@ -91,12 +91,13 @@ enum X86InstructionPrefixes
 	ADDRESS_SIZE_OVERRIDE = 0x01,
 	OPERAND_SIZE_OVERRIDE = 0x02,
 
-	REX   = 0x3c,
-
 	REX_W = 0x04,
 	REX_R = 0x08,
 	REX_X = 0x10,
 	REX_B = 0x20,
+
+	// Any REX prefix, which changes the meaning of some byte registers.
+	REX   = 0x40,
 };
 
 enum X86OperandTypes
@@ -312,75 +313,75 @@ static bool decode_reg(X86InstructionPrefixes pfx, Operand& oper, uint8_t& size,
 	return true;
 }
 
+static Operand::reg_idx decode_address_reg(X86InstructionPrefixes pfx, bool ext, uint8_t idx)
+{
+	static const Operand::reg_idx regs32[] = {
+		Operand::R_EAX, Operand::R_ECX, Operand::R_EDX, Operand::R_EBX,
+		Operand::R_ESP, Operand::R_EBP, Operand::R_ESI, Operand::R_EDI,
+		Operand::R_R8D, Operand::R_R9D, Operand::R_R10D, Operand::R_R11D,
+		Operand::R_R12D, Operand::R_R13D, Operand::R_R14D, Operand::R_R15D,
+	};
+
+	static const Operand::reg_idx regs64[] = {
+		Operand::R_RAX, Operand::R_RCX, Operand::R_RDX, Operand::R_RBX,
+		Operand::R_RSP, Operand::R_RBP, Operand::R_RSI, Operand::R_RDI,
+		Operand::R_R8, Operand::R_R9, Operand::R_R10, Operand::R_R11,
+		Operand::R_R12, Operand::R_R13, Operand::R_R14, Operand::R_R15,
+	};
+
+	idx = (idx & 7) | (ext ? 8 : 0);
+
+	if (pfx & ADDRESS_SIZE_OVERRIDE) return regs32[idx];
+	else return regs64[idx];
+}
+
 static bool decode_rm(const uint8_t **code, X86InstructionPrefixes pfx, Operand& oper, uint8_t mod, uint8_t rm, X86OperandTypes type)
 {
+	if (mod == 3) return false;
+
+	oper.type = Operand::TYPE_MEMORY;
+	oper.mem.index_reg_idx = Operand::R_Z;
+	oper.mem.scale = 0;
+
+	if (rm == 4) {
+		uint8_t sib = **code;
+		(*code)++;
+
+		uint8_t ss = (sib >> 6) & 3;
+		uint8_t index = (sib >> 3) & 7;
+		uint8_t base = sib & 7;
+
+		// An index of 4 (without REX.X) means there is no index register.
+		if (index != 4 || (pfx & REX_X)) {
+			oper.mem.index_reg_idx = decode_address_reg(pfx, pfx & REX_X, index);
+			oper.mem.scale = 1 << ss;
+		}
+
+		// A base of 5 with no displacement means disp32 with no base register.
+		if (mod == 0 && base == 5) return false;
+
+		oper.mem.base_reg_idx = decode_address_reg(pfx, pfx & REX_B, base);
+	} else {
+		// RIP-relative addressing is never used for guest memory.
+		if (mod == 0 && rm == 5) return false;
+
+		oper.mem.base_reg_idx = decode_address_reg(pfx, pfx & REX_B, rm);
+	}
+
 	switch (mod) {
 	case 0:
-		oper.type = Operand::TYPE_MEMORY;
 		oper.mem.displacement = 0;
-		oper.mem.index_reg_idx = Operand::R_Z;
-		oper.mem.scale = 0;
-
-		if (pfx & REX_B) {
-			switch (rm) {
-			case 0: if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R8D; else oper.mem.base_reg_idx = Operand::R_R8; break;
-			case 1:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R9D; else oper.mem.base_reg_idx = Operand::R_R9; break;
-			case 2:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R10D; else oper.mem.base_reg_idx = Operand::R_R10; break;
-			case 3:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R11D; else oper.mem.base_reg_idx = Operand::R_R11; break;
-			case 4:	return false;
-			case 5:	return false;
-			case 6:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R14D; else oper.mem.base_reg_idx = Operand::R_R14; break;
-			case 7:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R15D; else oper.mem.base_reg_idx = Operand::R_R15; break;
-			}
-		} else {
-			switch (rm) {
-			case 0: if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EAX; else oper.mem.base_reg_idx = Operand::R_RAX; break;
-			case 1:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_ECX; else oper.mem.base_reg_idx = Operand::R_RCX; break;
-			case 2:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EDX; else oper.mem.base_reg_idx = Operand::R_RDX; break;
-			case 3:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EBX; else oper.mem.base_reg_idx = Operand::R_RBX; break;
-			case 4:	return false;
-			case 5:	return false;
-			case 6:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_ESI; else oper.mem.base_reg_idx = Operand::R_RSI; break;
-			case 7:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EDI; else oper.mem.base_reg_idx = Operand::R_RDI; break;
-			}
-		}
-		
 		break;
 
 	case 1:
-		oper.type = Operand::TYPE_MEMORY;
-		oper.mem.displacement = **code;
-		oper.mem.index_reg_idx = Operand::R_Z;
-		oper.mem.scale = 0;
-
+		oper.mem.displacement = (int8_t)**code;
 		(*code)++;
+		break;
 
-		if (pfx & REX_B) {
-			switch (rm) {
-			case 0: if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R8D; else oper.mem.base_reg_idx = Operand::R_R8; break;
-			case 1:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R9D; else oper.mem.base_reg_idx = Operand::R_R9; break;
-			case 2:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R10D; else oper.mem.base_reg_idx = Operand::R_R10; break;
-			case 3:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R11D; else oper.mem.base_reg_idx = Operand::R_R11; break;
-			case 4:	return false;
-			case 5:	return false;
-			case 6:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R14D; else oper.mem.base_reg_idx = Operand::R_R14; break;
-			case 7:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_R15D; else oper.mem.base_reg_idx = Operand::R_R15; break;
-			}
-		} else {
-			switch (rm) {
-			case 0: if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EAX; else oper.mem.base_reg_idx = Operand::R_RAX; break;
-			case 1:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_ECX; else oper.mem.base_reg_idx = Operand::R_RCX; break;
-			case 2:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EDX; else oper.mem.base_reg_idx = Operand::R_RDX; break;
-			case 3:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EBX; else oper.mem.base_reg_idx = Operand::R_RBX; break;
-			case 4:	return false;
-			case 5:	return false;
-			case 6:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_ESI; else oper.mem.base_reg_idx = Operand::R_RSI; break;
-			case 7:	if (pfx & ADDRESS_SIZE_OVERRIDE) oper.mem.base_reg_idx = Operand::R_EDI; else oper.mem.base_reg_idx = Operand::R_RDI; break;
-			}
-		}
-		
+	case 2:
+		oper.mem.displacement = (int32_t)((uint32_t)(*code)[0] | (uint32_t)(*code)[1] << 8 | (uint32_t)(*code)[2] << 16 | (uint32_t)(*code)[3] << 24);
+		(*code) += 4;
 		break;
-	default: return false;
 	}
 
 	return true;
@@ -416,9 +417,9 @@ static bool decode_mov(X86InstructionPrefixes pfx, const uint8_t **code, MemoryI
 	}
 }
 
-static bool decode_movzx_modrm(X86InstructionPrefixes pfx, const uint8_t **code, MemoryInstruction& inst, X86OperandTypes source, X86OperandTypes dest)
+static bool decode_movx_modrm(X86InstructionPrefixes pfx, const uint8_t **code, MemoryInstruction& inst, X86OperandTypes source, X86OperandTypes dest, bool sign_extend)
 {
-	inst.type = MemoryInstruction::I_MOVZX;
+	inst.type = sign_extend ? MemoryInstruction::I_MOVSX : MemoryInstruction::I_MOVZX;
 
 	uint8_t mod, reg, rm;
 	read_modrm(code, mod, reg, rm);
@@ -444,6 +445,7 @@ static bool decode_movzx_modrm(X86InstructionPrefixes pfx, const uint8_t **code,
 static const char *insn_mnemonics[] = {
 	"mov",
 	"movzx",
+	"movsx",
 };
 
 static const char *reg_names[] = {
@@ -486,6 +488,42 @@ static const char *reg_names[] = {
 	"%bpl",
 	"%sil",
 	"%dil",
+
+	"%r8b",
+	"%r9b",
+	"%r10b",
+	"%r11b",
+	"%r12b",
+	"%r13b",
+	"%r14b",
+	"%r15b",
+
+	"%r8w",
+	"%r9w",
+	"%r10w",
+	"%r11w",
+	"%r12w",
+	"%r13w",
+	"%r14w",
+	"%r15w",
+
+	"%r8d",
+	"%r9d",
+	"%r10d",
+	"%r11d",
+	"%r12d",
+	"%r13d",
+	"%r14d",
+	"%r15d",
+
+	"%r8",
+	"%r9",
+	"%r10",
+	"%r11",
+	"%r12",
+	"%r13",
+	"%r14",
+	"%r15",
 };
 
 static void print_operand(Operand& oper)
@@ -499,7 +537,11 @@ static void print_operand(Operand& oper)
 		if (oper.mem.displacement != 0) {
 			printf("%d", oper.mem.displacement);
 		}
-		printf("(%s)", reg_names[oper.mem.base_reg_idx]);
+		if (oper.mem.index_reg_idx != Operand::R_Z) {
+			printf("(%s,%s,%d)", reg_names[oper.mem.base_reg_idx], reg_names[oper.mem.index_reg_idx], oper.mem.scale);
+		} else {
+			printf("(%s)", reg_names[oper.mem.base_reg_idx]);
+		}
 		break;
 
 	case Operand::TYPE_IMMEDIATE:
@@ -532,8 +574,10 @@ bool captive::arch::x86::decode_memory_instruction(const uint8_t *code, MemoryIn
 	case 0x8a: if (!decode_mov(p, &code, inst, O_R_M8, O_R8)) return false; else break;
 	case 0x8b: if (!decode_mov(p, &code, inst, O_R_M16_32_64, O_R16_32_64)) return false; else break;
 	case 0xc7: if (!decode_mov(p, &code, inst, O_IMM16_32, O_R_M16_32_64)) return false; else break;
-	case 0x1b6: if (!decode_movzx_modrm(p, &code, inst, O_R_M8, O_R16_32_64)) return false; else break;
-	case 0x1b7: if (!decode_movzx_modrm(p, &code, inst, O_R_M16, O_R16_32_64)) return false; else break;
+	case 0x1b6: if (!decode_movx_modrm(p, &code, inst, O_R_M8, O_R16_32_64, false)) return false; else break;
+	case 0x1b7: if (!decode_movx_modrm(p, &code, inst, O_R_M16, O_R16_32_64, false)) return false; else break;
+	case 0x1be: if (!decode_movx_modrm(p, &code, inst, O_R_M8, O_R16_32_64, true)) return false; else break;
+	case 0x1bf: if (!decode_movx_modrm(p, &code, inst, O_R_M16, O_R16_32_64, true)) return false; else break;
 	default: printf("x86: unsupported opcode %x\n", opcode); return false;
 	}
 
@@ -554,6 +598,7 @@ void MemoryInstruction::dump()
 	switch (type) {
 	case I_MOV: printf("mov "); break;
 	case I_MOVZX: printf("movzx "); break;
+	case I_MOVSX: printf("movsx "); break;
 	default: printf("???"); break;
 	}
 	
@@ -572,7 +617,10 @@ void Operand::dump()
 	case TYPE_MEMORY: 
 		if (mem.displacement)
 			printf("%d", mem.displacement);
-		printf("(%s)", reg_names[mem.base_reg_idx]);
+		if (mem.index_reg_idx != R_Z)
+			printf("(%s,%s,%d)", reg_names[mem.base_reg_idx], reg_names[mem.index_reg_idx], mem.scale);
+		else
+			printf("(%s)", reg_names[mem.base_reg_idx]);
 		break;
 	}
 }
@@ -120,6 +120,16 @@ void X86Encoder::lea(const X86Memory& addr, const X86Register& dst)
 	encode_opcode_mod_rm(0x8d, dst, addr);
 }
 
+void X86Encoder::lea_rip(uint32_t target_offset, const X86Register& dst)
+{
+	assert(dst.size == 8);
+
+	emit8(dst.hireg ? (REX_W | REX_R) : REX_W);
+	emit8(0x8d);
+	emit8(((dst.raw_index & 7) << 3) | 5);
+	emit32(target_offset - (_write_offset + 4));
+}
+
 void X86Encoder::mov(const X86SegmentRegister& src, const X86Register& dst)
 {
 	encode_opcode_mod_rm(0x8c, src.raw_index, dst);
@@ -252,6 +262,32 @@ void X86Encoder::movsx(const X86Register& src, const X86Register& dst)
 	}
 }
 
+void X86Encoder::movzx(uint8_t size, const X86Memory& src, const X86Register& dst)
+{
+	assert(size < dst.size);
+	assert(size == 1 || size == 2);
+	assert(dst.size == 2 || dst.size == 4 || dst.size == 8);
+
+	if (size == 1) {
+		encode_opcode_mod_rm(0x1b6, dst, src);
+	} else {
+		encode_opcode_mod_rm(0x1b7, dst, src);
+	}
+}
+
+void X86Encoder::movsx(uint8_t size, const X86Memory& src, const X86Register& dst)
+{
+	assert(size < dst.size);
+	assert(size == 1 || size == 2);
+	assert(dst.size == 2 || dst.size == 4 || dst.size == 8);
+
+	if (size == 1) {
+		encode_opcode_mod_rm(0x1be, dst, src);
+	} else {
+		encode_opcode_mod_rm(0x1bf, dst, src);
+	}
+}
+
 void X86Encoder::movq(const X86Register &src, const X86VectorRegister &dst)
 {
 	
@@ -719,13 +755,7 @@ void X86Encoder::add(const X86Register& src, const X86Memory& dst)
 
 void X86Encoder::add(uint32_t val, uint8_t size, const X86Memory& dst)
 {
-	if (val < 127) {
-		encode_opcode_mod_rm(0x83, 0, size, dst);
-		emit8(val);
-	} else {
-		encode_opcode_mod_rm(0x81, 0, size, dst);
-		emit32(val);
-	}
+	encode_arithmetic(0, val, size, dst);
 }
 
 void X86Encoder::add4(uint32_t val, const X86Memory& dst)
@@ -784,13 +814,7 @@ void X86Encoder::sub(uint32_t val, const X86Register& dst)
 
 void X86Encoder::sub(uint32_t val, uint8_t size, const X86Memory& dst)
 {
-	if (val < 127) {
-		encode_opcode_mod_rm(0x83, 5, size, dst);
-		emit8(val);
-	} else {
-		encode_opcode_mod_rm(0x81, 5, size, dst);
-		emit32(val);
-	}
+	encode_arithmetic(5, val, size, dst);
 }
 
 void X86Encoder::mul(const X86Register& src, const X86Register& dst)
@@ -971,6 +995,16 @@ void X86Encoder::jmp_reloc(uint32_t& reloc_offset)
 	emit32(0);
 }
 
+void X86Encoder::chain_slot(uint32_t guard)
+{
+	emit8(0x3d);
+	emit32(guard);
+	emit8(0x75);
+	emit8(5);
+	emit8(0xe9);
+	emit32(0);
+}
+
 void X86Encoder::jcc_reloc(uint8_t v, uint32_t& reloc_offset)
 {
 	emit8(0x0f);
@@ -1156,6 +1190,13 @@ void X86Encoder::encode_mod_reg_rm(const X86Register& reg, const X86Register& rm
 	encode_mod_reg_rm(reg.raw_index, rm);
 }
 
+// Whether two registers are the same general-purpose register, at any width,
+// as memory operands may use either the 32-bit or the 64-bit name.
+static inline bool same_gpr(const X86Register& a, const X86Register& b)
+{
+	return a.size != 0 && b.size != 0 && a.raw_index == b.raw_index && a.hireg == b.hireg;
+}
+
 void X86Encoder::encode_mod_reg_rm(uint8_t mreg, const X86Memory& rm)
 {
 	uint8_t mod, mrm;
@@ -1168,9 +1209,9 @@ void X86Encoder::encode_mod_reg_rm(uint8_t mreg, const X86Memory& rm)
 		mod = 2;
 	}
 
-	if (rm.base == REG_RSP) {
+	if (same_gpr(rm.base, REG_RSP)) {
 		mrm = 4; // Need a SIB byte
-	} else if (rm.base == REG_R12) {
+	} else if (same_gpr(rm.base, REG_R12)) {
 		mrm = 4; // Need a SIB byte
 	} else if (rm.base == REG_RIP) {
 		assert(false); // Need to think about this]
@@ -1182,9 +1223,9 @@ void X86Encoder::encode_mod_reg_rm(uint8_t mreg, const X86Memory& rm)
 		mrm = rm.base.raw_index;
 	}
 
-	if (mod == 0 && rm.base == REG_RBP) {
+	if (mod == 0 && same_gpr(rm.base, REG_RBP)) {
 		mod = 1;
-	} else if (mod == 0 && rm.base == REG_R13) {
+	} else if (mod == 0 && same_gpr(rm.base, REG_R13)) {
 		mod = 1;
 	}
 
@@ -24,6 +24,9 @@ namespace captive {
 
 			uint64_t entrypoint() const { return _entrypoint; }
 
+			// A checksum of the engine library, which identifies the build.
+			uint64_t checksum() const { return _checksum; }
+
 			inline bool lookup_symbol(std::string name, uint64_t& symbol) {
 				auto sym = symbols.find(name);
 				if (sym == symbols.end())
@@ -42,6 +45,7 @@ namespace captive {
 			size_t lib_size;
 
 			uint64_t _entrypoint;
+			uint64_t _checksum;
 
 			std::map<std::string, uint64_t> symbols;
 		};
@@ -26,14 +26,24 @@ namespace captive {
 	namespace hypervisor {
 		class GuestCPUConfiguration {
 		public:
-			explicit GuestCPUConfiguration(devices::irq::CPUIRQController& cpu_irq_controller) : _cpu_irq_controller(cpu_irq_controller) { }
+			explicit GuestCPUConfiguration(devices::irq::CPUIRQController& cpu_irq_controller)
+				: _cpu_irq_controller(cpu_irq_controller), _decode_cache_sets(1024), _decode_cache_ways(4) { }
 
 			bool validate() const;
 
 			devices::irq::CPUIRQController& cpu_irq_controller() const { return _cpu_irq_controller; }
 
+			// The geometry of the engine's cache of decoded instructions.  The
+			// number of sets must be a power of two.
+			inline uint32_t decode_cache_sets() const { return _decode_cache_sets; }
+			inline uint32_t decode_cache_ways() const { return _decode_cache_ways; }
+
+			inline void decode_cache(uint32_t sets, uint32_t ways) { _decode_cache_sets = sets; _decode_cache_ways = ways; }
+
 		private:
 			devices::irq::CPUIRQController& _cpu_irq_controller;
+			uint32_t _decode_cache_sets;
+			uint32_t _decode_cache_ways;
 		};
 
 		class GuestMemoryRegionConfiguration
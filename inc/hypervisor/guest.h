@@ -9,6 +9,7 @@
 #define	GUEST_H
 
 #include <define.h>
+#include <string>
 #include <vector>
 
 #include <hypervisor/config.h>
@@ -57,6 +58,10 @@ namespace captive {
 			inline gpa_t guest_entrypoint() const { return _guest_entrypoint; }
 			inline void guest_entrypoint(gpa_t ep) { _guest_entrypoint = ep; }
 
+			// The file translations are loaded from and saved to, if any.
+			inline const std::string& translation_store_file() const { return _translation_store_file; }
+			inline void translation_store_file(std::string filename) { _translation_store_file = filename; }
+
 			virtual bool resolve_gpa(gpa_t gpa, void*& out_addr) const = 0;
 
 		private:
@@ -65,6 +70,7 @@ namespace captive {
 			platform::Platform& _pfm;
 
 			gpa_t _guest_entrypoint;
+			std::string _translation_store_file;
 		};
 	}
 }
@@ -57,12 +57,15 @@ namespace captive {
 				struct kvm_run *cpu_run_struct;
 				uint32_t cpu_run_struct_size;
 
+				uint32_t compile_stats_dumps;		// Dump requests seen so far
+
 				bool setup_interrupts();
 
 				bool handle_hypercall(uint64_t data, uint64_t arg1, uint64_t arg2);
 				bool handle_device_access(devices::Device *device, uint64_t pa, struct kvm_run& rs);
 
 				void dump_regs();
+				void dump_compile_stats();
 			};
 		}
 	}
@@ -28,7 +28,14 @@ namespace captive {
 		class Device;
 	}
 
+	namespace jit {
+		class RegionJIT;
+		class TranslationStore;
+	}
+
 	namespace hypervisor {
+		class SharedMemory;
+
 		namespace kvm {
 			class KVM;
 			class KVMCpu;
@@ -69,6 +76,10 @@ namespace captive {
 
 				PerGuestData *per_guest_data;
 
+				SharedMemory *shared_memory;
+				jit::RegionJIT *region_jit;
+				jit::TranslationStore *translation_store;
+
 				std::list<vm_mem_region *> vm_mem_region_free;
 				std::list<vm_mem_region *> vm_mem_region_used;
 
@@ -0,0 +1,56 @@
+/*
+ * File:   shared-memory.h
+ * Author: spink
+ *
+ * Created on 21 August 2015, 10:12
+ */
+
+#ifndef SHARED_MEMORY_H
+#define	SHARED_MEMORY_H
+
+#include <define.h>
+#include <mutex>
+#include <map>
+
+namespace captive {
+	namespace hypervisor {
+		class SharedMemory
+		{
+		public:
+			SharedMemory(void *host_base, uint64_t guest_base, uint64_t size);
+			~SharedMemory();
+
+			uint64_t allocate(uint64_t size);
+			uint64_t reallocate(uint64_t addr, uint64_t new_size);
+			void free(uint64_t addr);
+
+			inline bool contains(uint64_t addr) const { return addr >= _guest_base && addr < (_guest_base + _size); }
+
+			inline void *guest_to_host(uint64_t addr) const
+			{
+				if (!contains(addr)) return NULL;
+				return (void *)((uint64_t)_host_base + (addr - _guest_base));
+			}
+
+			template<typename T>
+			inline T *guest_to_host(const T *addr) const { return (T *)guest_to_host((uint64_t)addr); }
+
+			inline uint64_t host_to_guest(const void *ptr) const
+			{
+				return _guest_base + ((uint64_t)ptr - (uint64_t)_host_base);
+			}
+
+		private:
+			std::mutex _lock;
+
+			void *_host_base;
+			uint64_t _guest_base;
+			uint64_t _size;
+
+			std::map<uint64_t, uint64_t> _free_chunks;
+			std::map<uint64_t, uint64_t> _used_chunks;
+		};
+	}
+}
+
+#endif	/* SHARED_MEMORY_H */
@@ -0,0 +1,58 @@
+/*
+ * File:   region-compiler.h
+ * Author: spink
+ *
+ * Created on 21 August 2015, 10:40
+ */
+
+#ifndef REGION_COMPILER_H
+#define	REGION_COMPILER_H
+
+#include <define.h>
+
+namespace captive {
+	namespace shared {
+		struct RegionWorkUnit;
+	}
+
+	namespace engine {
+		class Engine;
+	}
+
+	namespace hypervisor {
+		class SharedMemory;
+	}
+
+	namespace jit {
+		class RegionCompiler
+		{
+		public:
+			RegionCompiler(engine::Engine& engine, hypervisor::SharedMemory& shared_memory);
+			~RegionCompiler();
+
+			bool init();
+
+			/**
+			 * Compiles the IR of every block in the (host-mapped) work unit
+			 * into a single multi-entry function placed in shared memory.  On
+			 * success, the guest address of the function is stored in
+			 * rwu->fn_ptr.
+			 *
+			 * Compilation is abandoned between phases if the engine
+			 * invalidates the work unit, or if latest_generation moves past
+			 * the generation of the work unit.
+			 */
+			bool compile(shared::RegionWorkUnit *rwu, const volatile uint32_t& latest_generation);
+
+		private:
+			static inline bool is_stale(const shared::RegionWorkUnit *rwu, const volatile uint32_t& latest_generation);
+
+			engine::Engine& _engine;
+			hypervisor::SharedMemory& _shared_memory;
+
+			uint64_t _cpu_read_device, _cpu_write_device;
+		};
+	}
+}
+
+#endif	/* REGION_COMPILER_H */
@@ -0,0 +1,82 @@
+/*
+ * File:   region-jit.h
+ * Author: spink
+ *
+ * Created on 21 August 2015, 10:35
+ */
+
+#ifndef REGION_JIT_H
+#define	REGION_JIT_H
+
+#include <define.h>
+#include <shmem.h>
+#include <jit/region-compiler.h>
+#include <util/thread-pool.h>
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace captive {
+	namespace engine {
+		class Engine;
+	}
+
+	namespace hypervisor {
+		class SharedMemory;
+	}
+
+	namespace jit {
+		class RegionJIT
+		{
+		public:
+			RegionJIT(engine::Engine& engine, hypervisor::SharedMemory& shared_memory);
+			~RegionJIT();
+
+			bool init();
+
+			/**
+			 * Queues a region work unit (given by its guest address) for
+			 * compilation, and returns immediately.  When compilation has
+			 * finished, the work unit is handed back to the engine through
+			 * the per-CPU compiled region list.
+			 *
+			 * If a work unit for the same region of the same CPU is still
+			 * waiting in the queue, it is replaced by the new one and handed
+			 * straight back.  If it is already being compiled, it is told to
+			 * give up.
+			 */
+			void compile_region_async(PerCPUData& cpu_data, uint64_t rwu_addr);
+
+		private:
+			struct RegionCompileWork
+			{
+				RegionJIT *owner;
+				PerCPUData *cpu_data;
+				uint64_t rwu_addr;
+				uint32_t region_index;
+				volatile uint32_t latest_generation;
+				bool started;
+			};
+
+			static uint64_t compile_region_action(void *data);
+			static void compile_region_complete(uint64_t result, void *data);
+
+			void hand_back(PerCPUData& cpu_data, uint64_t rwu_addr);
+
+			hypervisor::SharedMemory& _shared_memory;
+
+			// Work that is queued or running, indexed by the CPU it is for
+			// and the region, as each CPU profiles its regions separately.
+			typedef std::pair<PerCPUData *, uint32_t> in_flight_key_t;
+
+			std::mutex _in_flight_lock;
+			std::map<in_flight_key_t, RegionCompileWork *> _in_flight;
+
+			RegionCompiler _compiler;
+			util::ThreadPool _worker_threads;
+		};
+	}
+}
+
+#endif	/* REGION_JIT_H */
@@ -0,0 +1,96 @@
+/*
+ * File:   translation-store.h
+ * Author: spink
+ *
+ * Created on 02 September 2015, 14:20
+ */
+
+#ifndef TRANSLATION_STORE_H
+#define	TRANSLATION_STORE_H
+
+#include <define.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace captive {
+	namespace hypervisor {
+		class SharedMemory;
+	}
+
+	namespace jit {
+		/**
+		 * Keeps the block translations exported by the engine, indexed by
+		 * the content of the page they were translated from, and persists
+		 * them to a file so that later runs can load them instead of
+		 * translating the same code again.
+		 *
+		 * Translations refer to engine code and data directly, so the file
+		 * is only used by the engine build that wrote it.
+		 */
+		class TranslationStore
+		{
+		public:
+			TranslationStore(hypervisor::SharedMemory& shared_memory, std::string filename, uint64_t engine_checksum);
+			~TranslationStore();
+
+			bool load();
+			bool save();
+
+			/**
+			 * Copies the translation record at the given guest address, and
+			 * the content of the page it was made from, into the store,
+			 * replacing any earlier translation of the same block.  Records
+			 * of a different page with the same checksum are dropped.
+			 */
+			void store(uint64_t record_addr, uint64_t content_addr);
+
+			/**
+			 * Returns the guest address of a newly allocated StoredPage, with
+			 * every translation made from a page with the given checksum, or
+			 * zero if there are none.  The engine frees the page.
+			 */
+			uint64_t lookup(uint64_t page_checksum);
+
+		private:
+			struct FileHeader
+			{
+				uint32_t magic;
+				uint32_t version;
+				uint64_t engine_checksum;
+				uint64_t page_count;
+			};
+
+			struct FilePageHeader
+			{
+				uint64_t checksum;
+				uint64_t record_count;
+			};
+
+			bool add_record(const uint8_t *content, const uint8_t *record, uint32_t size);
+
+			hypervisor::SharedMemory& _shared_memory;
+			std::string _filename;
+			uint64_t _engine_checksum;
+
+			// The records of each page, indexed by their block offset, ISA,
+			// and compilation mode.
+			typedef std::map<uint32_t, std::vector<uint8_t>> page_records_t;
+
+			struct Page
+			{
+				std::vector<uint8_t> content;
+				page_records_t records;
+			};
+
+			std::mutex _lock;
+			std::map<uint64_t, Page> _pages;
+			uint64_t _record_count;
+			bool _dirty;
+		};
+	}
+}
+
+#endif	/* TRANSLATION_STORE_H */
@@ -0,0 +1,759 @@
+/*
+ * File:   ir-interpreter.h
+ *
+ * A direct-threaded interpreter for IR, used by the engine to run code that
+ * is not yet worth compiling.  It depends only on the IR definitions, so it
+ * can also be built on the host, to run IR against a reference environment.
+ */
+
+#ifndef IR_INTERPRETER_H
+#define	IR_INTERPRETER_H
+
+#include <shared-jit.h>
+
+namespace captive {
+	namespace shared {
+		/**
+		 * An operation of predecoded IR.  Operands are slots in the value
+		 * array of the program, and branch targets are operation indices.
+		 */
+		struct InterpreterOperation
+		{
+			const void *handler;		// Filled in when the program is linked
+			uint32_t a, b, c;			// Operand slots, or targets
+			uint8_t opcode;
+			uint8_t size;				// Size of the result, or of the access
+			uint8_t source_size;		// Size of the source of an extension
+			uint8_t arg_count;			// Arguments of a call or a trace
+			uint64_t imm;				// Displacement, function or trace opcode
+		};
+
+		/**
+		 * IR predecoded into a dense array of operations, laid out in block
+		 * order.  The value array holds the virtual registers, followed by
+		 * the constants, and the temporaries that hold the PC when an
+		 * instruction reads it.
+		 */
+		struct InterpreterProgram
+		{
+			InterpreterOperation *ops;
+			uint64_t *values;
+			uint32_t *arg_slots;		// Argument slots of calls and traces
+			uint32_t op_count;
+			uint32_t slot_count;
+			bool linked;
+		};
+
+		/**
+		 * Predecodes and runs IR, in the environment given by the template
+		 * parameter, which provides access to guest state:
+		 *
+		 *   uint8_t *registers();
+		 *   uint32_t read_pc();
+		 *   void inc_pc(uint32_t amount);
+		 *   void set_zn_flags(uint8_t z, uint8_t n);
+		 *   void set_nzcv_flags(uint8_t n, uint8_t z, uint8_t c, uint8_t v);
+		 *   uint64_t read_mem(uint32_t addr, uint8_t size);
+		 *   void write_mem(uint32_t addr, uint8_t size, uint64_t value);
+		 *   uint64_t read_mem_user(uint32_t addr, uint8_t size);
+		 *   void write_mem_user(uint32_t addr, uint8_t size, uint64_t value);
+		 *   void atomic_write(uint32_t addr, uint8_t size, uint64_t value);
+		 *   uint32_t read_device(uint32_t dev, uint32_t reg);
+		 *   void write_device(uint32_t dev, uint32_t reg, uint32_t value);
+		 *   void call(uint64_t fn, const uint64_t *args, uint8_t arg_count);
+		 *   void trace(uint8_t opcode, const uint64_t *args, uint8_t arg_count);
+		 *   void count_instruction();
+		 *   void flush();
+		 *   void flush_entry(uint32_t addr);
+		 *   void trap();
+		 *   uint32_t exit();		// Leaves the block, and returns its result
+		 *
+		 * The environment is a template parameter so that its accessors are
+		 * inlined into the handlers.
+		 */
+		template<typename Environment>
+		class IRInterpreter
+		{
+		public:
+			/**
+			 * Returns the size of the buffer needed to predecode the given IR,
+			 * or zero if it contains an instruction that the interpreter does
+			 * not handle, in which case it must be compiled.
+			 */
+			static uint32_t program_size(const IRInstruction *ir, uint32_t count, uint32_t vreg_count, uint32_t block_count)
+			{
+				uint32_t op_count = 1, slot_count = vreg_count, arg_count = 0;
+
+				for (uint32_t i = 0; i < count; i++) {
+					const IRInstruction& insn = ir[i];
+					if (insn.ir_block == NOP_BLOCK) continue;
+
+					if (!measure(insn, op_count, slot_count, arg_count)) return 0;
+				}
+
+				return align(sizeof(InterpreterProgram))
+					+ align(sizeof(InterpreterOperation) * op_count)
+					+ align(sizeof(uint64_t) * slot_count)
+					+ align(sizeof(uint32_t) * arg_count)
+					+ align(sizeof(uint32_t) * block_count * 2);
+			}
+
+			/**
+			 * Predecodes the given IR into a buffer of the size returned by
+			 * program_size.  Execution starts in block zero.
+			 */
+			static InterpreterProgram *predecode(void *buffer, const IRInstruction *ir, uint32_t count, uint32_t vreg_count, uint32_t block_count)
+			{
+				uint32_t op_count = 1, slot_count = vreg_count, arg_count = 0;
+
+				for (uint32_t i = 0; i < count; i++) {
+					if (ir[i].ir_block != NOP_BLOCK) measure(ir[i], op_count, slot_count, arg_count);
+				}
+
+				uint8_t *next = (uint8_t *)buffer;
+
+				InterpreterProgram *program = (InterpreterProgram *)next;
+				next += align(sizeof(InterpreterProgram));
+
+				program->ops = (InterpreterOperation *)next;
+				next += align(sizeof(InterpreterOperation) * op_count);
+
+				program->values = (uint64_t *)next;
+				next += align(sizeof(uint64_t) * slot_count);
+
+				program->arg_slots = (uint32_t *)next;
+				next += align(sizeof(uint32_t) * arg_count);
+
+				uint32_t *block_start = (uint32_t *)next;
+				uint32_t *block_next = block_start + block_count;
+
+				program->op_count = op_count;
+				program->slot_count = vreg_count;
+				program->linked = false;
+
+				// Lay the operations out in block order, keeping the order of
+				// the instructions within each block.  A block that doesn't end
+				// in a jump falls through to the next one, as in compiled code.
+				for (uint32_t block = 0; block < block_count; block++) {
+					block_next[block] = 0;
+				}
+
+				for (uint32_t i = 0; i < count; i++) {
+					if (ir[i].ir_block == NOP_BLOCK) continue;
+
+					uint32_t ops = 0, slots = 0, args = 0;
+					measure(ir[i], ops, slots, args);
+					block_next[ir[i].ir_block] += ops;
+				}
+
+				uint32_t start = 0;
+				for (uint32_t block = 0; block < block_count; block++) {
+					block_start[block] = start;
+					start += block_next[block];
+					block_next[block] = block_start[block];
+				}
+
+				uint32_t next_arg = 0;
+				for (uint32_t i = 0; i < count; i++) {
+					if (ir[i].ir_block == NOP_BLOCK) continue;
+
+					emit(program, ir[i], block_start, block_next[ir[i].ir_block], next_arg);
+				}
+
+				// Running off the end of the last block leaves the block.
+				InterpreterOperation& last = program->ops[op_count - 1];
+				last.opcode = OP_EXIT;
+
+				return program;
+			}
+
+			/**
+			 * Runs a predecoded program from its first operation until it
+			 * leaves the block, and returns the result of the environment's
+			 * exit().
+			 */
+			static uint32_t execute(Environment& env, InterpreterProgram *program)
+			{
+				static const void * const handlers[] = {
+					&&op_mov, &&op_sx,
+					&&op_add, &&op_sub, &&op_mul, &&op_div, &&op_mod,
+					&&op_and, &&op_or, &&op_xor, &&op_not, &&op_neg, &&op_clz,
+					&&op_shl, &&op_shr, &&op_sar, &&op_ror,
+					&&op_cmpeq, &&op_cmpne, &&op_cmpgt, &&op_cmpgte, &&op_cmplt, &&op_cmplte,
+					&&op_adc, &&op_sbc, &&op_adc_with_flags, &&op_sbc_with_flags, &&op_set_zn_flags,
+					&&op_ldpc, &&op_incpc,
+					&&op_read_reg, &&op_write_reg,
+					&&op_read_mem, &&op_write_mem, &&op_read_mem_user, &&op_write_mem_user, &&op_atomic_write,
+					&&op_read_device, &&op_write_device,
+					&&op_call, &&op_trace, &&op_count_instruction,
+					&&op_flush, &&op_flush_entry, &&op_trap,
+					&&op_jmp, &&op_branch, &&op_exit,
+				};
+
+				static_assert(sizeof(handlers) / sizeof(handlers[0]) == OPCODE_COUNT, "interpreter handlers out of date");
+
+				if (__builtin_expect(!program->linked, 0)) {
+					for (uint32_t i = 0; i < program->op_count; i++) {
+						program->ops[i].handler = handlers[program->ops[i].opcode];
+					}
+
+					program->linked = true;
+				}
+
+				uint64_t *v = program->values;
+				uint8_t *regs = env.registers();
+				const InterpreterOperation *ops = program->ops;
+				const InterpreterOperation *op = ops;
+
+#define A v[op->a]
+#define B v[op->b]
+#define C v[op->c]
+#define RESULT(_value) do { C = (_value) & mask(op->size); } while (0)
+#define NEXT() do { op++; goto *op->handler; } while (0)
+
+				goto *op->handler;
+
+			op_mov:		RESULT(A); NEXT();
+			op_sx:		RESULT(sign_extend(A, op->source_size)); NEXT();
+
+			op_add:		RESULT(A + B); NEXT();
+			op_sub:		RESULT(A - B); NEXT();
+			op_mul:		RESULT(A * B); NEXT();
+			op_div:		RESULT(B ? A / B : 0); NEXT();
+			op_mod:		RESULT(B ? A % B : 0); NEXT();
+
+			op_and:		RESULT(A & B); NEXT();
+			op_or:		RESULT(A | B); NEXT();
+			op_xor:		RESULT(A ^ B); NEXT();
+			op_not:		RESULT(~A); NEXT();
+			op_neg:		RESULT(-A); NEXT();
+			op_clz:		RESULT(A ? __builtin_clzll(A) - (64 - (op->source_size * 8)) : op->source_size * 8); NEXT();
+
+			op_shl:		RESULT(A << shift_amount(B, op->size)); NEXT();
+			op_shr:		RESULT(A >> shift_amount(B, op->size)); NEXT();
+			op_sar:		RESULT((int64_t)sign_extend(A, op->size) >> shift_amount(B, op->size)); NEXT();
+			op_ror:
+			{
+				uint32_t bits = op->size * 8;
+				uint32_t amount = shift_amount(B, op->size) % bits;
+
+				RESULT(amount ? (A >> amount) | (A << (bits - amount)) : A);
+				NEXT();
+			}
+
+			op_cmpeq:	C = A == B; NEXT();
+			op_cmpne:	C = A != B; NEXT();
+			op_cmpgt:	C = A > B; NEXT();
+			op_cmpgte:	C = A >= B; NEXT();
+			op_cmplt:	C = A < B; NEXT();
+			op_cmplte:	C = A <= B; NEXT();
+
+			// a is the destination, b the source, and c the carry.  The carry
+			// of a subtraction is the inverse of its borrow.
+			op_adc:		v[op->a] = (A + B + !!C) & mask(op->size); NEXT();
+			op_sbc:		v[op->a] = (A - B - !C) & mask(op->size); NEXT();
+
+			op_adc_with_flags:
+			{
+				uint64_t lhs = A, rhs = B, carry = !!C;
+				uint64_t result = (lhs + rhs + carry) & mask(op->size);
+				uint64_t sign = sign_bit(op->size);
+
+				uint8_t c = op->size == 8 ? (result < lhs || (carry && result == lhs)) : ((lhs + rhs + carry) >> (op->size * 8)) & 1;
+				uint8_t overflow = !!(~(lhs ^ rhs) & (lhs ^ result) & sign);
+
+				v[op->a] = result;
+				env.set_nzcv_flags(!!(result & sign), result == 0, c, overflow);
+				NEXT();
+			}
+
+			op_sbc_with_flags:
+			{
+				uint64_t lhs = A, rhs = B, borrow = !C;
+				uint64_t result = (lhs - rhs - borrow) & mask(op->size);
+				uint64_t sign = sign_bit(op->size);
+
+				uint8_t c = !(rhs > lhs || (borrow && rhs == lhs));
+				uint8_t overflow = !!((lhs ^ rhs) & (lhs ^ result) & sign);
+
+				v[op->a] = result;
+				env.set_nzcv_flags(!!(result & sign), result == 0, c, overflow);
+				NEXT();
+			}
+
+			op_set_zn_flags:
+				env.set_zn_flags(A == 0, !!(A & sign_bit(op->size)));
+				NEXT();
+
+			op_ldpc:	C = env.read_pc(); NEXT();
+			op_incpc:	env.inc_pc(A); NEXT();
+
+			op_read_reg:
+				switch (op->size) {
+				case 1: C = *(uint8_t *)&regs[A]; break;
+				case 2: C = *(uint16_t *)&regs[A]; break;
+				case 4: C = *(uint32_t *)&regs[A]; break;
+				case 8: C = *(uint64_t *)&regs[A]; break;
+				}
+				NEXT();
+
+			op_write_reg:
+				switch (op->size) {
+				case 1: *(uint8_t *)&regs[B] = A; break;
+				case 2: *(uint16_t *)&regs[B] = A; break;
+				case 4: *(uint32_t *)&regs[B] = A; break;
+				case 8: *(uint64_t *)&regs[B] = A; break;
+				}
+				NEXT();
+
+			op_read_mem:		C = env.read_mem((uint32_t)(A + op->imm), op->size); NEXT();
+			op_write_mem:		env.write_mem((uint32_t)(B + op->imm), op->size, A); NEXT();
+			op_read_mem_user:	C = env.read_mem_user((uint32_t)A, op->size); NEXT();
+			op_write_mem_user:	env.write_mem_user((uint32_t)B, op->size, A); NEXT();
+			op_atomic_write:	env.atomic_write((uint32_t)A, op->size, B); NEXT();
+
+			op_read_device:		C = env.read_device(A, B); NEXT();
+			op_write_device:	env.write_device(A, B, C); NEXT();
+
+			op_call:
+			{
+				uint64_t args[5];
+				for (uint8_t i = 0; i < op->arg_count; i++) args[i] = v[program->arg_slots[op->a + i]];
+
+				env.call(op->imm, args, op->arg_count);
+				NEXT();
+			}
+
+			op_trace:
+			{
+				uint64_t args[5];
+				for (uint8_t i = 0; i < op->arg_count; i++) args[i] = v[program->arg_slots[op->a + i]];
+
+				env.trace(op->imm, args, op->arg_count);
+				NEXT();
+			}
+
+			op_count_instruction:	env.count_instruction(); NEXT();
+			op_flush:				env.flush(); NEXT();
+			op_flush_entry:			env.flush_entry(A); NEXT();
+			op_trap:				env.trap(); NEXT();
+
+			op_jmp:
+				op = &ops[op->b];
+				goto *op->handler;
+
+			op_branch:
+				op = &ops[A ? op->b : op->c];
+				goto *op->handler;
+
+			op_exit:
+				return env.exit();
+
+#undef A
+#undef B
+#undef C
+#undef RESULT
+#undef NEXT
+			}
+
+		private:
+			enum InterpreterOpcode
+			{
+				OP_MOV, OP_SX,
+				OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+				OP_AND, OP_OR, OP_XOR, OP_NOT, OP_NEG, OP_CLZ,
+				OP_SHL, OP_SHR, OP_SAR, OP_ROR,
+				OP_CMPEQ, OP_CMPNE, OP_CMPGT, OP_CMPGTE, OP_CMPLT, OP_CMPLTE,
+				OP_ADC, OP_SBC, OP_ADC_WITH_FLAGS, OP_SBC_WITH_FLAGS, OP_SET_ZN_FLAGS,
+				OP_LDPC, OP_INCPC,
+				OP_READ_REG, OP_WRITE_REG,
+				OP_READ_MEM, OP_WRITE_MEM, OP_READ_MEM_USER, OP_WRITE_MEM_USER, OP_ATOMIC_WRITE,
+				OP_READ_DEVICE, OP_WRITE_DEVICE,
+				OP_CALL, OP_TRACE, OP_COUNT_INSTRUCTION,
+				OP_FLUSH, OP_FLUSH_ENTRY, OP_TRAP,
+				OP_JMP, OP_BRANCH, OP_EXIT,
+
+				OPCODE_COUNT
+			};
+
+			static inline uint32_t align(uint32_t size) { return (size + 7) & ~7U; }
+
+			static inline uint64_t mask(uint8_t size) { return size >= 8 ? ~0ULL : (1ULL << (size * 8)) - 1; }
+			static inline uint64_t sign_bit(uint8_t size) { return 1ULL << ((size * 8) - 1); }
+
+			static inline uint64_t sign_extend(uint64_t value, uint8_t size)
+			{
+				uint32_t shift = 64 - (size * 8);
+				return (uint64_t)((int64_t)(value << shift) >> shift);
+			}
+
+			// Shift amounts are masked as they are by x86.
+			static inline uint32_t shift_amount(uint64_t amount, uint8_t size) { return amount & (size == 8 ? 63 : 31); }
+
+			/**
+			 * Counts the operations, value slots and argument slots that an
+			 * instruction needs, and returns false if it can't be interpreted.
+			 */
+			static bool measure(const IRInstruction& insn, uint32_t& op_count, uint32_t& slot_count, uint32_t& arg_count)
+			{
+				switch (insn.type) {
+				case IRInstruction::NOP:
+				case IRInstruction::BARRIER:
+				case IRInstruction::VERIFY:
+				case IRInstruction::SET_CPU_MODE:
+					return true;
+
+				case IRInstruction::CALL:
+				case IRInstruction::TRACE:
+					for (int i = 1; i < 6 && insn.operands[i].is_valid(); i++) arg_count++;
+					break;
+
+				case IRInstruction::MOV:
+				case IRInstruction::TRUNC:
+				case IRInstruction::ZX:
+				case IRInstruction::SX:
+				case IRInstruction::ADD:
+				case IRInstruction::SUB:
+				case IRInstruction::MUL:
+				case IRInstruction::DIV:
+				case IRInstruction::MOD:
+				case IRInstruction::AND:
+				case IRInstruction::OR:
+				case IRInstruction::XOR:
+				case IRInstruction::NOT:
+				case IRInstruction::NEG:
+				case IRInstruction::CLZ:
+				case IRInstruction::SHL:
+				case IRInstruction::SHR:
+				case IRInstruction::SAR:
+				case IRInstruction::ROR:
+				case IRInstruction::CMPEQ:
+				case IRInstruction::CMPNE:
+				case IRInstruction::CMPGT:
+				case IRInstruction::CMPGTE:
+				case IRInstruction::CMPLT:
+				case IRInstruction::CMPLTE:
+				case IRInstruction::ADC:
+				case IRInstruction::SBC:
+				case IRInstruction::ADC_WITH_FLAGS:
+				case IRInstruction::SBC_WITH_FLAGS:
+				case IRInstruction::SET_ZN_FLAGS:
+				case IRInstruction::LDPC:
+				case IRInstruction::INCPC:
+				case IRInstruction::READ_REG:
+				case IRInstruction::WRITE_REG:
+				case IRInstruction::READ_MEM:
+				case IRInstruction::WRITE_MEM:
+				case IRInstruction::READ_MEM_USER:
+				case IRInstruction::WRITE_MEM_USER:
+				case IRInstruction::ATOMIC_WRITE:
+				case IRInstruction::READ_DEVICE:
+				case IRInstruction::WRITE_DEVICE:
+				case IRInstruction::COUNT:
+				case IRInstruction::FLUSH:
+				case IRInstruction::FLUSH_ITLB:
+				case IRInstruction::FLUSH_DTLB:
+				case IRInstruction::FLUSH_ITLB_ENTRY:
+				case IRInstruction::FLUSH_DTLB_ENTRY:
+				case IRInstruction::TRAP:
+				case IRInstruction::JMP:
+				case IRInstruction::BRANCH:
+				case IRInstruction::RET:
+				case IRInstruction::DISPATCH:
+					break;
+
+				default:
+					return false;
+				}
+
+				// The operands of exits are only used to chain compiled code.
+				if (insn.type != IRInstruction::RET && insn.type != IRInstruction::DISPATCH) {
+					for (int i = 0; i < 6; i++) {
+						const IROperand& oper = insn.operands[i];
+
+						if (oper.is_constant()) {
+							slot_count++;
+						} else if (oper.is_pc()) {
+							slot_count++;
+							op_count++;
+						}
+					}
+				}
+
+				op_count++;
+				return true;
+			}
+
+			/**
+			 * Returns the value slot of an operand, adding constants to the
+			 * value array, and loading the PC into a temporary if the operand
+			 * is the PC.
+			 */
+			static uint32_t slot(InterpreterProgram *program, const IROperand& oper, uint32_t& next_op)
+			{
+				switch (oper.type) {
+				case IROperand::VREG:
+					return oper.value;
+
+				case IROperand::PC:
+				{
+					InterpreterOperation& load = program->ops[next_op++];
+					load.opcode = OP_LDPC;
+					load.size = 4;
+					load.c = program->slot_count++;
+					return load.c;
+				}
+
+				default:
+					program->values[program->slot_count] = oper.value & mask(oper.size);
+					return program->slot_count++;
+				}
+			}
+
+			static void emit(InterpreterProgram *program, const IRInstruction& insn, const uint32_t *block_start, uint32_t& next_op, uint32_t& next_arg)
+			{
+				const IROperand *operands = insn.operands;
+				uint32_t a = 0, b = 0, c = 0;
+
+				switch (insn.type) {
+				case IRInstruction::NOP:
+				case IRInstruction::BARRIER:
+				case IRInstruction::VERIFY:
+				case IRInstruction::SET_CPU_MODE:
+					return;
+
+				default:
+					break;
+				}
+
+				// Resolve the operands first, as the PC is loaded by an
+				// operation of its own.
+				if (insn.type != IRInstruction::RET && insn.type != IRInstruction::DISPATCH
+					&& insn.type != IRInstruction::CALL && insn.type != IRInstruction::TRACE
+					&& insn.type != IRInstruction::JMP && insn.type != IRInstruction::BRANCH) {
+					if (operands[0].is_valid()) a = slot(program, operands[0], next_op);
+					if (operands[1].is_valid()) b = slot(program, operands[1], next_op);
+					if (operands[2].is_valid()) c = slot(program, operands[2], next_op);
+				}
+
+				uint32_t first_arg = next_arg;
+				uint8_t arg_count = 0;
+
+				if (insn.type == IRInstruction::CALL || insn.type == IRInstruction::TRACE) {
+					for (int i = 1; i < 6 && operands[i].is_valid(); i++) {
+						uint32_t arg = slot(program, operands[i], next_op);
+						program->arg_slots[next_arg++] = arg;
+						arg_count++;
+					}
+				} else if (insn.type == IRInstruction::BRANCH) {
+					a = slot(program, operands[0], next_op);
+				}
+
+				InterpreterOperation& op = program->ops[next_op];
+				op.a = a;
+				op.b = b;
+				op.c = c;
+				op.size = 0;
+				op.source_size = 0;
+				op.arg_count = 0;
+				op.imm = 0;
+
+				switch (insn.type) {
+				// src, dst
+				case IRInstruction::MOV:
+				case IRInstruction::TRUNC:
+				case IRInstruction::ZX:
+					op.opcode = OP_MOV;
+					op.c = b;
+					op.size = operands[1].size;
+					break;
+
+				case IRInstruction::CLZ:
+					op.opcode = OP_CLZ;
+					op.c = b;
+					op.size = operands[1].size;
+					op.source_size = operands[0].size;
+					break;
+
+				case IRInstruction::SX:
+					op.opcode = OP_SX;
+					op.c = b;
+					op.size = operands[1].size;
+					op.source_size = operands[0].size;
+					break;
+
+				// src, dst => dst = dst op src
+				case IRInstruction::ADD: op.opcode = OP_ADD; goto binary;
+				case IRInstruction::SUB: op.opcode = OP_SUB; goto binary;
+				case IRInstruction::MUL: op.opcode = OP_MUL; goto binary;
+				case IRInstruction::DIV: op.opcode = OP_DIV; goto binary;
+				case IRInstruction::MOD: op.opcode = OP_MOD; goto binary;
+				case IRInstruction::AND: op.opcode = OP_AND; goto binary;
+				case IRInstruction::OR: op.opcode = OP_OR; goto binary;
+				case IRInstruction::XOR: op.opcode = OP_XOR; goto binary;
+				case IRInstruction::SHL: op.opcode = OP_SHL; goto binary;
+				case IRInstruction::SHR: op.opcode = OP_SHR; goto binary;
+				case IRInstruction::SAR: op.opcode = OP_SAR; goto binary;
+				case IRInstruction::ROR: op.opcode = OP_ROR; goto binary;
+				binary:
+					op.a = b;
+					op.b = a;
+					op.c = b;
+					op.size = operands[1].size;
+					break;
+
+				// dst => dst = op dst
+				case IRInstruction::NOT:
+				case IRInstruction::NEG:
+					op.opcode = insn.type == IRInstruction::NOT ? OP_NOT : OP_NEG;
+					op.c = a;
+					op.size = operands[0].size;
+					break;
+
+				// lhs, rhs, dst
+				case IRInstruction::CMPEQ: op.opcode = OP_CMPEQ; break;
+				case IRInstruction::CMPNE: op.opcode = OP_CMPNE; break;
+				case IRInstruction::CMPGT: op.opcode = OP_CMPGT; break;
+				case IRInstruction::CMPGTE: op.opcode = OP_CMPGTE; break;
+				case IRInstruction::CMPLT: op.opcode = OP_CMPLT; break;
+				case IRInstruction::CMPLTE: op.opcode = OP_CMPLTE; break;
+
+				// src, dst, carry => dst = dst op src op carry
+				case IRInstruction::ADC: op.opcode = OP_ADC; goto carry;
+				case IRInstruction::SBC: op.opcode = OP_SBC; goto carry;
+				case IRInstruction::ADC_WITH_FLAGS: op.opcode = OP_ADC_WITH_FLAGS; goto carry;
+				case IRInstruction::SBC_WITH_FLAGS: op.opcode = OP_SBC_WITH_FLAGS; goto carry;
+				carry:
+					op.a = b;
+					op.b = a;
+					op.size = operands[1].size;
+					break;
+
+				case IRInstruction::SET_ZN_FLAGS:
+					op.opcode = OP_SET_ZN_FLAGS;
+					op.size = operands[0].size;
+					break;
+
+				case IRInstruction::LDPC:
+					op.opcode = OP_LDPC;
+					op.c = a;
+					op.size = 4;
+					break;
+
+				case IRInstruction::INCPC:
+					op.opcode = OP_INCPC;
+					break;
+
+				// offset, dst
+				case IRInstruction::READ_REG:
+					op.opcode = OP_READ_REG;
+					op.c = b;
+					op.size = operands[1].size;
+					break;
+
+				// value, offset
+				case IRInstruction::WRITE_REG:
+					op.opcode = OP_WRITE_REG;
+					op.size = operands[0].size;
+					break;
+
+				// offset, disp, dst
+				case IRInstruction::READ_MEM:
+					op.opcode = OP_READ_MEM;
+					op.imm = operands[1].value;
+					op.size = operands[2].size;
+					break;
+
+				// value, disp, offset
+				case IRInstruction::WRITE_MEM:
+					op.opcode = OP_WRITE_MEM;
+					op.b = c;
+					op.imm = operands[1].value;
+					op.size = operands[0].size;
+					break;
+
+				// offset, dst
+				case IRInstruction::READ_MEM_USER:
+					op.opcode = OP_READ_MEM_USER;
+					op.c = b;
+					op.size = operands[1].size;
+					break;
+
+				// value, offset
+				case IRInstruction::WRITE_MEM_USER:
+					op.opcode = OP_WRITE_MEM_USER;
+					op.size = operands[0].size;
+					break;
+
+				// addr, value
+				case IRInstruction::ATOMIC_WRITE:
+					op.opcode = OP_ATOMIC_WRITE;
+					op.size = operands[1].size;
+					break;
+
+				// dev, reg, dst
+				case IRInstruction::READ_DEVICE:
+					op.opcode = OP_READ_DEVICE;
+					op.size = operands[2].size;
+					break;
+
+				// dev, reg, value
+				case IRInstruction::WRITE_DEVICE:
+					op.opcode = OP_WRITE_DEVICE;
+					break;
+
+				case IRInstruction::CALL:
+				case IRInstruction::TRACE:
+					op.opcode = insn.type == IRInstruction::CALL ? OP_CALL : OP_TRACE;
+					op.a = first_arg;
+					op.arg_count = arg_count;
+					op.imm = operands[0].value;
+					break;
+
+				case IRInstruction::COUNT:
+					op.opcode = OP_COUNT_INSTRUCTION;
+					break;
+
+				case IRInstruction::FLUSH:
+				case IRInstruction::FLUSH_ITLB:
+				case IRInstruction::FLUSH_DTLB:
+					op.opcode = OP_FLUSH;
+					break;
+
+				case IRInstruction::FLUSH_ITLB_ENTRY:
+				case IRInstruction::FLUSH_DTLB_ENTRY:
+					op.opcode = OP_FLUSH_ENTRY;
+					break;
+
+				case IRInstruction::TRAP:
+					op.opcode = OP_TRAP;
+					break;
+
+				case IRInstruction::JMP:
+					op.opcode = OP_JMP;
+					op.b = block_start[operands[0].value];
+					break;
+
+				case IRInstruction::BRANCH:
+					op.opcode = OP_BRANCH;
+					op.b = block_start[operands[1].value];
+					op.c = block_start[operands[2].value];
+					break;
+
+				case IRInstruction::RET:
+				case IRInstruction::DISPATCH:
+					op.opcode = OP_EXIT;
+					break;
+
+				default:
+					assert(false);
+					return;
+				}
+
+				next_op++;
+			}
+		};
+	}
+}
+
+#endif	/* IR_INTERPRETER_H */
@@ -24,6 +24,10 @@ namespace captive {
 		typedef uint32_t IRRegId;
 		
 #define INVALID_BLOCK_ID ((IRBlockId)-1)
+
+// IR instructions that have been eliminated by the block compiler are moved
+// into this block.
+#define NOP_BLOCK 0x7fffffff
 		
 		struct IRInstruction;
 		
@@ -33,21 +37,31 @@ namespace captive {
 		struct BlockWorkUnit
 		{
 			uint32_t offset;
-			const IRInstruction *ir;
-			unsigned int ir_count;
+			const uint8_t *ir;			// Packed IR
+			unsigned int ir_size;
 			bool interrupt_check;
 			bool entry_block;
 		};
 		
+		struct RegisterOffsets
+		{
+			uint32_t pc, isa;
+			uint32_t c, z, n, v;
+		};
+		
 		struct RegionWorkUnit
 		{
 			uint32_t region_index;
-			uint32_t valid;
+			uint32_t generation;
+			volatile uint32_t valid;
 			
 			BlockWorkUnit *blocks;
 			unsigned int block_count;
 			
+			RegisterOffsets reg_offsets;
+			
 			void *fn_ptr;
+			RegionWorkUnit *next;
 		};
 		
 		struct RegionImage
@@ -255,6 +269,9 @@ namespace captive {
 
 			static IRInstruction nop() { return IRInstruction(NOP); }
 			static IRInstruction ret() { return IRInstruction(RET); }
+			static IRInstruction ret_direct(const IROperand& target, const IROperand& fallthrough) { assert(target.is_constant() && fallthrough.is_constant()); return IRInstruction(RET, target, fallthrough); }
+			static IRInstruction ret_call(const IROperand& target, const IROperand& return_pc, const IROperand& return_txln) { assert(target.is_constant() && return_pc.is_constant() && return_txln.is_constant()); return IRInstruction(RET, target, IROperand::const32(0), return_pc, return_txln); }
+			static IRInstruction ret_indirect_call(const IROperand& return_pc, const IROperand& return_txln) { assert(return_pc.is_constant() && return_txln.is_constant()); return IRInstruction(RET, IROperand::pc(0), IROperand::const32(0), return_pc, return_txln); }
 			static IRInstruction dispatch(const IROperand& target, const IROperand& fallthrough, const IROperand& target_block, const IROperand& fallthrough_block) { assert(target.is_constant() && fallthrough.is_constant()); return IRInstruction(DISPATCH, target, fallthrough, target_block, fallthrough_block); }
 			static IRInstruction trap() { return IRInstruction(TRAP); }
 			static IRInstruction verify(const IROperand& pc) { return IRInstruction(VERIFY, pc); }
@@ -745,6 +762,302 @@ namespace captive {
 				return IRInstruction(CALL, fn, arg0, arg1, arg2, arg3, arg4);
 			}
 		} __packed;
+
+		/**
+		 * A compact encoding of IR, for IR that is kept after it has been
+		 * compiled: the IR of region blocks, the copy of it handed to the host,
+		 * and the copy stored with a translation.  Each instruction is its
+		 * type, its number of operands and its block, followed by only the
+		 * operands it uses.  Block ids, allocations and operand values are
+		 * variable-length integers, so a typical instruction takes around a
+		 * dozen bytes, rather than the seventy of an IRInstruction.
+		 */
+		struct PackedIR
+		{
+			// The largest encoding of a single instruction.
+			static const uint32_t MAX_INSTRUCTION_SIZE = 2 + 5 + (6 * (1 + 3 + 10));
+
+			/**
+			 * Encodes an instruction into out, and returns the number of bytes
+			 * used.  If out is NULL, only the size is returned.
+			 */
+			static inline uint32_t encode(const IRInstruction& insn, uint8_t *out)
+			{
+				uint8_t operand_count = 6;
+				while (operand_count && !insn.operands[operand_count - 1].is_valid()) operand_count--;
+
+				uint32_t size = 0;
+				size += put_byte(out, size, insn.type);
+				size += put_byte(out, size, operand_count);
+				size += put_varint(out, size, insn.ir_block);
+
+				for (uint8_t i = 0; i < operand_count; i++) {
+					const IROperand& oper = insn.operands[i];
+
+					size += put_byte(out, size, oper.type | (oper.size << 4));
+					size += put_varint(out, size, (oper.alloc_data << 2) | oper.alloc_mode);
+					size += put_varint(out, size, oper.value);
+				}
+
+				return size;
+			}
+
+			/**
+			 * Decodes the instruction at in into insn, and returns where the
+			 * next instruction starts.
+			 */
+			static inline const uint8_t *decode(const uint8_t *in, IRInstruction& insn)
+			{
+				insn.type = (IRInstruction::IRInstructionType)*in++;
+				uint8_t operand_count = *in++;
+				insn.ir_block = (IRBlockId)get_varint(in);
+
+				for (uint8_t i = 0; i < 6; i++) {
+					IROperand& oper = insn.operands[i];
+
+					if (i >= operand_count) {
+						oper = IROperand::none();
+						continue;
+					}
+
+					uint8_t tag = *in++;
+					uint64_t alloc = get_varint(in);
+
+					oper.type = (IROperand::IROperandType)(tag & 0xf);
+					oper.size = tag >> 4;
+					oper.alloc_mode = (IROperand::IRAllocationMode)(alloc & 3);
+					oper.alloc_data = alloc >> 2;
+					oper.value = get_varint(in);
+				}
+
+				return in;
+			}
+
+			/**
+			 * Walks a buffer of packed instructions, decoding each in turn, so
+			 * that code written against IRInstruction can read packed IR:
+			 *
+			 *   for (const IRInstruction& insn : PackedIR::range(ir, ir_size)) ...
+			 */
+			class iterator
+			{
+			public:
+				iterator(const uint8_t *pos, const uint8_t *end) : _pos(pos), _next(pos), _end(end), _insn(IRInstruction::NOP) { advance(); }
+
+				inline const IRInstruction& operator*() const { return _insn; }
+				inline const IRInstruction *operator->() const { return &_insn; }
+
+				inline iterator& operator++() { _pos = _next; advance(); return *this; }
+
+				inline bool operator==(const iterator& other) const { return _pos == other._pos; }
+				inline bool operator!=(const iterator& other) const { return _pos != other._pos; }
+
+			private:
+				const uint8_t *_pos, *_next, *_end;
+				IRInstruction _insn;
+
+				inline void advance() { if (_pos < _end) _next = decode(_pos, _insn); }
+			};
+
+			class range
+			{
+			public:
+				range(const uint8_t *ir, uint32_t size) : _begin(ir), _end(ir + size) { }
+
+				inline iterator begin() const { return iterator(_begin, _end); }
+				inline iterator end() const { return iterator(_end, _end); }
+
+			private:
+				const uint8_t *_begin, *_end;
+			};
+
+		private:
+			static inline uint32_t put_byte(uint8_t *out, uint32_t offset, uint8_t value)
+			{
+				if (out) out[offset] = value;
+				return 1;
+			}
+
+			static inline uint32_t put_varint(uint8_t *out, uint32_t offset, uint64_t value)
+			{
+				uint32_t size = 0;
+
+				do {
+					uint8_t byte = value & 0x7f;
+					value >>= 7;
+
+					if (out) out[offset + size] = byte | (value ? 0x80 : 0);
+					size++;
+				} while (value);
+
+				return size;
+			}
+
+			static inline uint64_t get_varint(const uint8_t *& in)
+			{
+				uint64_t value = 0;
+				uint32_t shift = 0;
+				uint8_t byte;
+
+				do {
+					byte = *in++;
+					value |= (uint64_t)(byte & 0x7f) << shift;
+					shift += 7;
+				} while (byte & 0x80);
+
+				return value;
+			}
+		};
+
+		/**
+		 * A place in stored translation code that refers to another block of
+		 * the same page, and so must be fixed up when the code is loaded.
+		 */
+		struct StoredRelocation
+		{
+			enum StoredRelocationType
+			{
+				REL32_TXLN,			// rel32 jump to the translation of the block
+				ABS64_TXLN_SLOT,	// Address of the translation slot of the block
+				ABS64_EXEC_COUNT,	// Address of the execution counter of the block
+				ABS64_CHAIN_LINKS,	// Address of the exit slot links of the block
+			};
+
+			uint32_t code_offset;
+			uint16_t type;
+			uint16_t target_offset;		// Page offset of the block referred to
+
+			// Returns true if the translation jumps straight into others.
+			static inline bool any_direct_jumps(const StoredRelocation *relocations, uint32_t count)
+			{
+				for (uint32_t r = 0; r < count; r++) {
+					if (relocations[r].type == REL32_TXLN) return true;
+				}
+
+				return false;
+			}
+		};
+
+		/**
+		 * A finished block translation, keyed by the content of the page it
+		 * was translated from, so that it can be reused by a later run.  The
+		 * record is followed by the code, the relocations, and the packed IR, each
+		 * aligned to 8 bytes.
+		 */
+		struct StoredTranslation
+		{
+			uint64_t page_checksum;
+			uint64_t code_granules;
+			uint16_t offset;
+			uint8_t isa;
+			uint8_t mode;
+			uint32_t size;				// Size of the whole record
+			uint32_t code_size;
+			uint32_t relocation_count;
+			uint32_t ir_size;			// Size of the packed IR
+			uint32_t padding;
+
+			static inline uint32_t align(uint32_t size) { return (size + 7) & ~7U; }
+
+			static inline uint32_t record_size(uint32_t code_size, uint32_t relocation_count, uint32_t ir_size)
+			{
+				return sizeof(StoredTranslation) + align(code_size) + align(sizeof(StoredRelocation) * relocation_count) + align(ir_size);
+			}
+
+			inline uint8_t *code() { return (uint8_t *)(this + 1); }
+			inline StoredRelocation *relocations() { return (StoredRelocation *)(code() + align(code_size)); }
+			inline uint8_t *ir() { return (uint8_t *)relocations() + align(sizeof(StoredRelocation) * relocation_count); }
+		};
+
+#define STORED_PAGE_SIZE	0x1000
+
+		/**
+		 * All the stored translations of a page, as handed to the engine by
+		 * the host, together with the content of the page they were made
+		 * from.  The checksum only finds the page, so the engine compares the
+		 * content before using any record.  The records follow the header
+		 * back to back.
+		 */
+		struct StoredPage
+		{
+			uint32_t record_count;
+			uint32_t size;				// Size of the header and all records
+			uint8_t content[STORED_PAGE_SIZE];
+
+			inline StoredTranslation *first() { return (StoredTranslation *)(this + 1); }
+			inline StoredTranslation *next(StoredTranslation *record) { return (StoredTranslation *)((uint8_t *)record + record->size); }
+		};
+
+#define COMPILE_STATS_BUCKETS	32
+
+		/**
+		 * Where the time goes when the engine compiles code, kept by the
+		 * engine in shared memory so that the host can dump it at any time.
+		 * Times are in TSC cycles, and histograms have a bucket for each
+		 * power of two.
+		 */
+		struct CompileStats
+		{
+			enum CompilePhase
+			{
+				TRANSLATE,				// Decoding and generating IR
+				REORDER_BLOCKS,
+				THREAD_JUMPS,
+				DEAD_BLOCKS,
+				MERGE_BLOCKS,
+				CONSTANT_PROP,
+				PEEPHOLE,
+				REG_VALUE_REUSE,
+				VALUE_MERGING,
+				DEAD_REG_WRITES,
+				PROMOTE_GUEST_REGS,
+				SORT,
+				ALLOCATE,
+				POST_ALLOCATE_PEEPHOLE,
+				STACK_TO_REG,
+				LOWER,
+				PREDECODE,				// Preparing IR for the interpreter
+
+				PHASE_COUNT
+			};
+
+			struct PhaseStats
+			{
+				uint64_t runs;
+				uint64_t cycles;
+				uint64_t histogram[COMPILE_STATS_BUCKETS];
+			};
+
+			uint64_t translations;
+			uint64_t baseline_translations;
+			uint64_t interpreted_blocks;	// Blocks handed to the IR interpreter
+			uint64_t ir_in;				// IR instructions generated
+			uint64_t ir_out;			// ... and left to be lowered
+			uint64_t vregs;
+			uint64_t spills;			// Virtual registers that were spilled
+			uint64_t code_bytes;		// Host code emitted
+			uint64_t guest_insns;		// Guest instructions translated by blocks
+			uint64_t ir_bytes;			// Size of the IR generated for them
+			uint64_t packed_ir_bytes;	// ... and once packed
+
+			uint64_t latency_histogram[COMPILE_STATS_BUCKETS];	// Whole compilations
+			PhaseStats phases[PHASE_COUNT];
+
+			static inline uint32_t bucket(uint64_t cycles)
+			{
+				uint32_t log = cycles ? 63 - __builtin_clzll(cycles) : 0;
+				return log < COMPILE_STATS_BUCKETS ? log : COMPILE_STATS_BUCKETS - 1;
+			}
+
+			inline void record_phase(CompilePhase phase, uint64_t cycles)
+			{
+				phases[phase].runs++;
+				phases[phase].cycles += cycles;
+				phases[phase].histogram[bucket(cycles)]++;
+			}
+
+			inline void record_latency(uint64_t cycles) { latency_histogram[bucket(cycles)]++; }
+		};
 	}
 }
 
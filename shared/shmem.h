@@ -9,6 +9,11 @@
 #define	SHMEM_H
 
 namespace captive {
+	namespace shared {
+		struct RegionWorkUnit;
+		struct CompileStats;
+	}
+
 	namespace lock {
 		typedef volatile uint64_t SpinLock;
 
@@ -82,13 +87,28 @@ namespace captive {
 		uint32_t signal_code;		// Incoming signal code
 		uint64_t insns_executed;	// Number of instructions executed
 		uint64_t interrupts_taken;
+
+		uint64_t chain_cache_misses;		// Block chain cache fills for PCs not already cached
+		uint64_t chain_cache_evictions;		// ... of which displaced a valid entry
+		uint64_t code_cache_flushes;		// Times the code cache filled up and was emptied
+		uint64_t decode_cache_hits;			// Instructions found already decoded
+		uint64_t decode_cache_misses;		// ... and decoded again
 		
 		uint32_t execution_mode;	// Mode of execution
 		uint32_t entrypoint;		// Entrypoint of the guest
 
 		bool verbose_enabled;
+		bool translation_store_enabled;	// Export translations for reuse by later runs
+
+		uint32_t decode_cache_sets;		// Geometry of the decode cache
+		uint32_t decode_cache_ways;
 
 		uint32_t device_address;
+
+		lock::SpinLock region_lock;
+		shared::RegionWorkUnit *compiled_regions;	// Region translations waiting to be registered
+
+		shared::CompileStats *compile_stats;		// Kept up to date by the engine, read by the host
 	};
 }
 
@@ -13,7 +13,7 @@ DECLARE_CONTEXT(Engine)
 using namespace captive;
 using namespace captive::engine;
 
-Engine::Engine(std::string libfile) : loaded(false), libfile(libfile), _entrypoint(0)
+Engine::Engine(std::string libfile) : loaded(false), libfile(libfile), _entrypoint(0), _checksum(0)
 {
 
 }
@@ -132,6 +132,11 @@ bool Engine::load()
 		return false;
 	}
 
+	_checksum = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < lib_size; i++) {
+		_checksum = (_checksum ^ lib[i]) * 0x100000001b3ULL;
+	}
+
 	loaded = true;
 	return true;
 }
@@ -13,6 +13,16 @@ bool GuestMemoryRegionConfiguration::validate() const
 
 bool GuestCPUConfiguration::validate() const
 {
+	if (!_decode_cache_sets || (_decode_cache_sets & (_decode_cache_sets - 1))) {
+		ERROR << CONTEXT(Configuration) << "Decode cache set count must be a power of two";
+		return false;
+	}
+
+	if (!_decode_cache_ways) {
+		ERROR << CONTEXT(Configuration) << "Decode cache must have at least one way";
+		return false;
+	}
+
 	return true;
 }
 
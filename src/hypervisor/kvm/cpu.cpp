@@ -2,6 +2,9 @@
 #include <hypervisor/kvm/cpu.h>
 #include <hypervisor/kvm/guest.h>
 #include <hypervisor/kvm/kvm.h>
+#include <hypervisor/shared-memory.h>
+#include <jit/region-jit.h>
+#include <jit/translation-store.h>
 #include <platform/platform.h>
 #include <shared-jit.h>
 
@@ -22,6 +25,14 @@ USE_CONTEXT(CPU);
 
 using namespace captive::hypervisor::kvm;
 
+// Bumped by SIGUSR1, to have every CPU dump its compilation statistics.
+static volatile sig_atomic_t compile_stats_requests;
+
+static void request_compile_stats(int sig)
+{
+	compile_stats_requests++;
+}
+
 KVMCpu::KVMCpu(KVMGuest& owner, const GuestCPUConfiguration& config, int id, int fd, int irqfd, PerCPUData *per_cpu_data)
 	: CPU(owner, config, per_cpu_data),
 	_initialised(false),
@@ -29,7 +40,8 @@ KVMCpu::KVMCpu(KVMGuest& owner, const GuestCPUConfiguration& config, int id, int
 	fd(fd),
 	irqfd(irqfd),
 	cpu_run_struct(NULL),
-	cpu_run_struct_size(0)
+	cpu_run_struct_size(0),
+	compile_stats_dumps(0)
 {
 
 }
@@ -147,8 +159,16 @@ bool KVMCpu::run()
 	regs.rip = kvm_guest.engine().entrypoint();
 	vmioctl(KVM_SET_REGS, &regs);
 
+	compile_stats_dumps = compile_stats_requests;
+	signal(SIGUSR1, request_compile_stats);
+
 	DEBUG << CONTEXT(CPU) << "Running CPU " << id() << ENABLE;
 	do {
+		if (compile_stats_dumps != compile_stats_requests) {
+			compile_stats_dumps = compile_stats_requests;
+			dump_compile_stats();
+		}
+
 		rc = vmioctl(KVM_RUN);
 		if (rc < 0) {
 			if (errno == EINTR) {
@@ -264,6 +284,12 @@ bool KVMCpu::run()
 	} while (run_cpu && !per_cpu_data().halt);
 
 	dump_regs();
+
+	DEBUG << CONTEXT(CPU) << "Block chain cache: misses=" << std::dec << per_cpu_data().chain_cache_misses << ", evictions=" << per_cpu_data().chain_cache_evictions;
+	DEBUG << CONTEXT(CPU) << "Code cache: flushes=" << std::dec << per_cpu_data().code_cache_flushes;
+	DEBUG << CONTEXT(CPU) << "Decode cache: hits=" << std::dec << per_cpu_data().decode_cache_hits << ", misses=" << per_cpu_data().decode_cache_misses;
+
+	dump_compile_stats();
 	
 	return true;
 }
@@ -310,12 +336,51 @@ bool KVMCpu::handle_hypercall(uint64_t data, uint64_t arg1, uint64_t arg2)
 		fgetc(stdin);
 		return true;
 
+	case 10:
+	case 11: {
+		struct kvm_regs regs;
+		vmioctl(KVM_GET_REGS, &regs);
+
+		if (data == 10) {
+			regs.rax = kvm_guest.shared_memory->allocate(arg1);
+		} else {
+			regs.rax = kvm_guest.shared_memory->reallocate(arg1, arg2);
+		}
+
+		vmioctl(KVM_SET_REGS, &regs);
+		return true;
+	}
+
+	case 12:
+		kvm_guest.shared_memory->free(arg1);
+		return true;
+
 	case 13: {
 		std::stringstream cmd;
 		cmd << "addr2line -e arch/arm.arch " << std::hex << arg1;
 		system(cmd.str().c_str());
 		return true;
 	}
+
+	case 14:
+		kvm_guest.region_jit->compile_region_async(per_cpu_data(), arg1);
+		return true;
+
+	case 16:
+		if (kvm_guest.translation_store) {
+			kvm_guest.translation_store->store(arg1, arg2);
+		}
+		return true;
+
+	case 17: {
+		struct kvm_regs regs;
+		vmioctl(KVM_GET_REGS, &regs);
+
+		regs.rax = kvm_guest.translation_store ? kvm_guest.translation_store->lookup(arg1) : 0;
+
+		vmioctl(KVM_SET_REGS, &regs);
+		return true;
+	}
 	
 //	case 15: {
 //		struct kvm_regs regs;
@@ -342,6 +407,76 @@ bool KVMCpu::handle_hypercall(uint64_t data, uint64_t arg1, uint64_t arg2)
 	return false;
 }
 
+static const char *compile_phase_names[] = {
+	"translate",
+	"reorder-blocks",
+	"thread-jumps",
+	"dead-blocks",
+	"merge-blocks",
+	"constant-prop",
+	"peephole",
+	"reg-value-reuse",
+	"value-merging",
+	"dead-reg-writes",
+	"promote-guest-regs",
+	"sort",
+	"allocate",
+	"post-allocate-peephole",
+	"stack-to-reg",
+	"lower",
+	"predecode",
+};
+
+// Lists the non-empty buckets of a histogram, as "<log2 cycles>:<count>".
+static std::string format_histogram(const uint64_t *histogram)
+{
+	std::stringstream str;
+
+	for (int bucket = 0; bucket < COMPILE_STATS_BUCKETS; bucket++) {
+		if (!histogram[bucket]) continue;
+		str << " " << std::dec << bucket << ":" << histogram[bucket];
+	}
+
+	return str.str();
+}
+
+void KVMCpu::dump_compile_stats()
+{
+	static_assert(sizeof(compile_phase_names) / sizeof(compile_phase_names[0]) == shared::CompileStats::PHASE_COUNT, "compile phase names out of date");
+
+	KVMGuest& kvm_guest = (KVMGuest &)owner();
+
+	const shared::CompileStats *stats = kvm_guest.shared_memory->guest_to_host(per_cpu_data().compile_stats);
+	if (!stats) return;
+
+	INFO << CONTEXT(CPU) << "Compilation: translations=" << std::dec << stats->translations
+		<< ", baseline=" << stats->baseline_translations
+		<< ", interpreted=" << stats->interpreted_blocks
+		<< ", ir-in=" << stats->ir_in
+		<< ", ir-out=" << stats->ir_out
+		<< ", vregs=" << stats->vregs
+		<< ", spills=" << stats->spills
+		<< ", code-bytes=" << stats->code_bytes;
+
+	if (stats->guest_insns) {
+		INFO << CONTEXT(CPU) << "IR bytes per guest instruction: unpacked=" << std::dec << (stats->ir_bytes / stats->guest_insns)
+			<< ", packed=" << (stats->packed_ir_bytes / stats->guest_insns);
+	}
+
+	INFO << CONTEXT(CPU) << "Compilation latency (log2 cycles:count):" << format_histogram(stats->latency_histogram);
+
+	for (int phase = 0; phase < shared::CompileStats::PHASE_COUNT; phase++) {
+		const shared::CompileStats::PhaseStats& phase_stats = stats->phases[phase];
+		if (!phase_stats.runs) continue;
+
+		INFO << CONTEXT(CPU) << "  " << compile_phase_names[phase]
+			<< ": runs=" << std::dec << phase_stats.runs
+			<< ", cycles=" << phase_stats.cycles
+			<< ", mean=" << (phase_stats.cycles / phase_stats.runs)
+			<< ", histogram:" << format_histogram(phase_stats.histogram);
+	}
+}
+
 void KVMCpu::dump_regs()
 {
 	struct kvm_regs regs;
@@ -2,11 +2,15 @@
 #include <hypervisor/kvm/guest.h>
 #include <hypervisor/kvm/cpu.h>
 #include <hypervisor/config.h>
+#include <hypervisor/shared-memory.h>
 #include <platform/platform.h>
 #include <loader/loader.h>
 #include <engine/engine.h>
 #include <devices/device.h>
+#include <jit/region-jit.h>
+#include <jit/translation-store.h>
 #include <shmem.h>
+#include <shared-jit.h>
 
 #include <thread>
 #include <pthread.h>
@@ -39,18 +43,39 @@ using namespace captive::hypervisor::kvm;
 
 #define SEGMENT_SIZE			0x100000000ULL
 
+// The upper half of the HEAP segment is shared between the host and the
+// execution engine, e.g. for passing JIT work units and translations.
+#define SHMEM_OFFSET			0x80000000ULL
+#define SHMEM_SIZE				0x80000000ULL
+#define SHMEM_BASE_HVA			(HEAP_BASE_HVA + SHMEM_OFFSET)
+#define SHMEM_BASE_VA			(EE_BASE_GPA + SHMEM_OFFSET)
+
 KVMGuest::KVMGuest(KVM& owner, Engine& engine, platform::Platform& pfm, int fd) 
 	: Guest(owner, engine, pfm),
 		_initialised(false),
 		fd(fd),
 		next_cpu_id(0),
-		next_slot_idx(0)
+		next_slot_idx(0),
+		shared_memory(NULL),
+		region_jit(NULL),
+		translation_store(NULL)
 {
 
 }
 
 KVMGuest::~KVMGuest()
 {
+	if (region_jit)
+		delete region_jit;
+
+	if (translation_store) {
+		translation_store->save();
+		delete translation_store;
+	}
+
+	if (shared_memory)
+		delete shared_memory;
+
 	if (initialised())
 		release_all_guest_memory();
 
@@ -83,6 +108,20 @@ bool KVMGuest::init()
 		return false;
 	
 	engine().install((uint8_t *)EE_BASE_HVA);
+
+	region_jit = new jit::RegionJIT(engine(), *shared_memory);
+	if (!region_jit->init()) {
+		ERROR << CONTEXT(Guest) << "Unable to initialise region JIT";
+		return false;
+	}
+
+	if (!translation_store_file().empty()) {
+		translation_store = new jit::TranslationStore(*shared_memory, translation_store_file(), engine().checksum());
+		if (!translation_store->load()) {
+			ERROR << CONTEXT(Guest) << "Unable to load translation store";
+			return false;
+		}
+	}
 	
 	for (auto core : platform().config().cores) {
 		if (!create_cpu(core)) {
@@ -130,9 +169,28 @@ bool KVMGuest::create_cpu(const GuestCPUConfiguration& config)
 	per_cpu_data->guest_data = per_guest_data;
 	per_cpu_data->insns_executed = 0;
 	per_cpu_data->interrupts_taken = 0;
+	per_cpu_data->chain_cache_misses = 0;
+	per_cpu_data->chain_cache_evictions = 0;
+	per_cpu_data->code_cache_flushes = 0;
+	per_cpu_data->decode_cache_hits = 0;
+	per_cpu_data->decode_cache_misses = 0;
+	per_cpu_data->decode_cache_sets = config.decode_cache_sets();
+	per_cpu_data->decode_cache_ways = config.decode_cache_ways();
 	per_cpu_data->isr = 0;
+
+	lock::spinlock_init(&per_cpu_data->region_lock);
+	per_cpu_data->compiled_regions = NULL;
+
+	// The engine accumulates its compilation statistics in shared memory.
+	uint64_t compile_stats_addr = shared_memory->allocate(sizeof(shared::CompileStats));
+	if (compile_stats_addr) {
+		bzero(shared_memory->guest_to_host(compile_stats_addr), sizeof(shared::CompileStats));
+	}
+
+	per_cpu_data->compile_stats = (shared::CompileStats *)compile_stats_addr;
 	
 	per_cpu_data->verbose_enabled = VERBOSE_ENABLED;
+	per_cpu_data->translation_store_enabled = translation_store != NULL;
 
 	KVMCpu *cpu = new KVMCpu(*this, config, next_cpu_id, cpu_fd, irq_fd, per_cpu_data);
 	if (!cpu->init()) {
@@ -258,6 +316,9 @@ bool KVMGuest::prepare_guest_memory()
 		ERROR << "Unable to allocate HEAP memory";
 		return false;
 	}
+
+	// The engine sees the HEAP segment at the base of its data area.
+	shared_memory = new SharedMemory((void *)SHMEM_BASE_HVA, SHMEM_BASE_VA, SHMEM_SIZE);
 	
 	if (!alloc_guest_memory(EE_BASE_GPA,   SEGMENT_SIZE, 0, (void *)EE_BASE_HVA)) {
 		ERROR << "Unable to allocate EE memory";
@@ -0,0 +1,118 @@
+#include <hypervisor/shared-memory.h>
+#include <captive.h>
+
+#include <string.h>
+
+DECLARE_CONTEXT(SharedMemory);
+
+using namespace captive::hypervisor;
+
+#define CHUNK_ALIGNMENT		64ULL
+#define ALIGN_CHUNK(_size)	(((_size) + (CHUNK_ALIGNMENT - 1)) & ~(CHUNK_ALIGNMENT - 1))
+
+SharedMemory::SharedMemory(void *host_base, uint64_t guest_base, uint64_t size)
+	: _host_base(host_base), _guest_base(guest_base), _size(size)
+{
+	_free_chunks[0] = size;
+}
+
+SharedMemory::~SharedMemory()
+{
+
+}
+
+uint64_t SharedMemory::allocate(uint64_t size)
+{
+	if (size == 0) return 0;
+	size = ALIGN_CHUNK(size);
+
+	std::unique_lock<std::mutex> l(_lock);
+
+	// First-fit search of the free chunk list.
+	for (auto chunk = _free_chunks.begin(); chunk != _free_chunks.end(); ++chunk) {
+		if (chunk->second < size) continue;
+
+		uint64_t offset = chunk->first;
+		uint64_t remaining = chunk->second - size;
+
+		_free_chunks.erase(chunk);
+		if (remaining) {
+			_free_chunks[offset + size] = remaining;
+		}
+
+		_used_chunks[offset] = size;
+		return _guest_base + offset;
+	}
+
+	ERROR << CONTEXT(SharedMemory) << "Out of shared memory, size=" << std::hex << size;
+	return 0;
+}
+
+uint64_t SharedMemory::reallocate(uint64_t addr, uint64_t new_size)
+{
+	if (addr == 0) return allocate(new_size);
+
+	if (new_size == 0) {
+		free(addr);
+		return 0;
+	}
+
+	uint64_t old_size;
+
+	{
+		std::unique_lock<std::mutex> l(_lock);
+
+		auto chunk = _used_chunks.find(addr - _guest_base);
+		if (chunk == _used_chunks.end()) {
+			ERROR << CONTEXT(SharedMemory) << "Attempt to reallocate unknown chunk " << std::hex << addr;
+			return 0;
+		}
+
+		old_size = chunk->second;
+		if (old_size >= new_size) return addr;
+	}
+
+	uint64_t new_addr = allocate(new_size);
+	if (!new_addr) return 0;
+
+	memcpy(guest_to_host(new_addr), guest_to_host(addr), old_size);
+	free(addr);
+
+	return new_addr;
+}
+
+void SharedMemory::free(uint64_t addr)
+{
+	if (addr == 0) return;
+
+	std::unique_lock<std::mutex> l(_lock);
+
+	auto chunk = _used_chunks.find(addr - _guest_base);
+	if (chunk == _used_chunks.end()) {
+		ERROR << CONTEXT(SharedMemory) << "Attempt to free unknown chunk " << std::hex << addr;
+		return;
+	}
+
+	uint64_t offset = chunk->first;
+	uint64_t size = chunk->second;
+	_used_chunks.erase(chunk);
+
+	// Coalesce with the following free chunk.
+	auto next = _free_chunks.find(offset + size);
+	if (next != _free_chunks.end()) {
+		size += next->second;
+		_free_chunks.erase(next);
+	}
+
+	// Coalesce with the preceding free chunk.
+	auto prev = _free_chunks.lower_bound(offset);
+	if (prev != _free_chunks.begin()) {
+		--prev;
+		if (prev->first + prev->second == offset) {
+			prev->second += size;
+			return;
+		}
+	}
+
+	_free_chunks[offset] = size;
+}
@@ -0,0 +1,852 @@
+#include <jit/region-compiler.h>
+#include <hypervisor/shared-memory.h>
+#include <engine/engine.h>
+#include <shared-jit.h>
+#include <captive.h>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Utils.h>
+
+#include <map>
+
+DECLARE_CONTEXT(RegionCompiler);
+
+using namespace captive::jit;
+using namespace captive::shared;
+
+// Layout of the engine's jit_state structure, which is passed as the only
+// argument to a region function.
+#define JIT_STATE_CPU			0
+#define JIT_STATE_REGISTERS		8
+#define JIT_STATE_INSN_COUNTER	40
+#define JIT_STATE_EXIT_CHAIN	48
+
+// Address space used by LLVM to generate GS-relative memory accesses.
+#define GS_ADDRESS_SPACE		256
+
+namespace {
+	/**
+	 * Places every section of a compiled region into a single shared memory
+	 * allocation, and maps each section to its guest address before
+	 * relocations are applied.
+	 */
+	class SharedMemoryManager : public llvm::RTDyldMemoryManager
+	{
+	public:
+		SharedMemoryManager(captive::hypervisor::SharedMemory& shared_memory) : _shared_memory(shared_memory), _base(0), _size(0), _used(0) { }
+
+		~SharedMemoryManager()
+		{
+			if (_base) _shared_memory.free(_base);
+		}
+
+		bool needsToReserveAllocationSpace() override { return true; }
+
+		void reserveAllocationSpace(uintptr_t code_size, uint32_t code_align, uintptr_t ro_size, uint32_t ro_align, uintptr_t rw_size, uint32_t rw_align) override
+		{
+			_size = code_size + code_align + ro_size + ro_align + rw_size + rw_align;
+			_base = _shared_memory.allocate(_size);
+			_used = 0;
+		}
+
+		uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment, unsigned section_id, llvm::StringRef section_name) override
+		{
+			return allocate_section(size, alignment);
+		}
+
+		uint8_t *allocateDataSection(uintptr_t size, unsigned alignment, unsigned section_id, llvm::StringRef section_name, bool read_only) override
+		{
+			return allocate_section(size, alignment);
+		}
+
+		void notifyObjectLoaded(llvm::ExecutionEngine *engine, const llvm::object::ObjectFile& object) override
+		{
+			for (auto section : _sections) {
+				engine->mapSectionAddress(section, _shared_memory.host_to_guest(section));
+			}
+		}
+
+		// The code runs inside the guest, so there is nothing to register
+		// with the host unwinder.
+		void registerEHFrames(uint8_t *addr, uint64_t load_addr, size_t size) override { }
+		void deregisterEHFrames() override { }
+
+		bool finalizeMemory(std::string *error) override { return false; }
+
+		inline uint64_t base() const { return _base; }
+
+		inline uint64_t release()
+		{
+			uint64_t base = _base;
+			_base = 0;
+			return base;
+		}
+
+	private:
+		uint8_t *allocate_section(uintptr_t size, unsigned alignment)
+		{
+			if (!_base) return NULL;
+			if (alignment == 0) alignment = 16;
+
+			uint64_t offset = (_used + (alignment - 1)) & ~((uint64_t)alignment - 1);
+			if (offset + size > _size) return NULL;
+
+			_used = offset + size;
+
+			uint8_t *section = (uint8_t *)_shared_memory.guest_to_host(_base + offset);
+			_sections.push_back(section);
+
+			return section;
+		}
+
+		captive::hypervisor::SharedMemory& _shared_memory;
+		uint64_t _base, _size, _used;
+		std::vector<uint8_t *> _sections;
+	};
+
+	/**
+	 * Lowers the (register allocated) block IR of a region work unit into an
+	 * LLVM function.  Every block is an entry point, selected by the page
+	 * offset of the guest PC.  After each block, control returns to the
+	 * dispatcher, which leaves the function if the PC has left the page.
+	 */
+	class RegionLowering
+	{
+	public:
+		RegionLowering(llvm::LLVMContext& ctx, llvm::Module& module, const RegionWorkUnit& rwu, const captive::hypervisor::SharedMemory& shared_memory, uint64_t cpu_read_device, uint64_t cpu_write_device)
+			: ctx(ctx),
+			module(module),
+			rwu(rwu),
+			shared_memory(shared_memory),
+			cpu_read_device(cpu_read_device),
+			cpu_write_device(cpu_write_device),
+			builder(ctx),
+			fn(NULL)
+		{
+
+		}
+
+		llvm::Function *lower();
+
+	private:
+		llvm::LLVMContext& ctx;
+		llvm::Module& module;
+		const RegionWorkUnit& rwu;
+		const captive::hypervisor::SharedMemory& shared_memory;
+		uint64_t cpu_read_device, cpu_write_device;
+
+		llvm::IRBuilder<> builder;
+		llvm::Function *fn;
+
+		llvm::BasicBlock *entry_block, *dispatch_block, *exit_block;
+		llvm::Value *jit_state, *registers;
+
+		std::map<uint64_t, llvm::Value *> storage;
+		std::map<IRBlockId, llvm::BasicBlock *> blocks;
+
+		bool lower_block(const BlockWorkUnit& bwu, llvm::SwitchInst *dispatcher);
+		bool lower_instruction(const IRInstruction& insn);
+
+		llvm::BasicBlock *get_block(IRBlockId id);
+
+		inline llvm::IntegerType *type_of(uint8_t size) { return llvm::IntegerType::get(ctx, size * 8); }
+
+		llvm::Value *state_field(uint32_t offset, llvm::Type *type);
+		llvm::Value *register_pointer(llvm::Value *offset, llvm::Type *type);
+		llvm::Value *register_pointer(uint32_t offset, llvm::Type *type);
+
+		llvm::Value *operand_storage(const IROperand& oper);
+		llvm::Value *load_operand(const IROperand& oper);
+		void store_operand(const IROperand& oper, llvm::Value *value);
+
+		llvm::Value *zero_extend(llvm::Value *value, llvm::Type *type);
+
+		bool lower_call(const IRInstruction& insn);
+		void lower_flags(llvm::Value *result, llvm::Value *carry, llvm::Value *overflow);
+	};
+}
+
+llvm::Function *RegionLowering::lower()
+{
+	fn = llvm::Function::Create(llvm::FunctionType::get(builder.getInt32Ty(), { builder.getInt8PtrTy() }, false), llvm::GlobalValue::ExternalLinkage, "region", &module);
+	fn->addFnAttr(llvm::Attribute::NoRedZone);
+	fn->addFnAttr(llvm::Attribute::NoUnwind);
+
+	jit_state = fn->arg_begin();
+
+	entry_block = llvm::BasicBlock::Create(ctx, "entry", fn);
+	dispatch_block = llvm::BasicBlock::Create(ctx, "dispatch", fn);
+	exit_block = llvm::BasicBlock::Create(ctx, "exit", fn);
+
+	builder.SetInsertPoint(exit_block);
+	builder.CreateRet(builder.getInt32(0));
+
+	// The region is only valid for the page in which it was entered.
+	builder.SetInsertPoint(entry_block);
+	registers = state_field(JIT_STATE_REGISTERS, builder.getInt8PtrTy());
+	llvm::Value *entry_page = builder.CreateAnd(builder.CreateLoad(builder.getInt32Ty(), register_pointer(rwu.reg_offsets.pc, builder.getInt32Ty())), builder.getInt32(~0xfffU));
+
+	// Dispatch to the block at the current PC, as long as the PC is still
+	// on the same page, and the ISA has not been switched.
+	builder.SetInsertPoint(dispatch_block);
+	llvm::Value *pc = builder.CreateLoad(builder.getInt32Ty(), register_pointer(rwu.reg_offsets.pc, builder.getInt32Ty()));
+	llvm::Value *isa = builder.CreateLoad(builder.getInt8Ty(), register_pointer(rwu.reg_offsets.isa, builder.getInt8Ty()));
+
+	llvm::Value *same_page = builder.CreateICmpEQ(builder.CreateAnd(pc, builder.getInt32(~0xfffU)), entry_page);
+	llvm::Value *same_isa = builder.CreateICmpEQ(isa, builder.getInt8(0));
+
+	llvm::BasicBlock *switch_block = llvm::BasicBlock::Create(ctx, "switch", fn);
+	builder.CreateCondBr(builder.CreateAnd(same_page, same_isa), switch_block, exit_block);
+
+	builder.SetInsertPoint(switch_block);
+	llvm::SwitchInst *dispatcher = builder.CreateSwitch(builder.CreateAnd(pc, builder.getInt32(0xfff)), exit_block, rwu.block_count);
+
+	for (unsigned int i = 0; i < rwu.block_count; i++) {
+		if (!lower_block(rwu.blocks[i], dispatcher)) {
+			return NULL;
+		}
+	}
+
+	// All of the storage slots have been created by now, so the entry
+	// block can be terminated.
+	builder.SetInsertPoint(entry_block);
+	builder.CreateBr(dispatch_block);
+
+	return fn;
+}
+
+bool RegionLowering::lower_block(const BlockWorkUnit& host_bwu, llvm::SwitchInst *dispatcher)
+{
+	const uint8_t *ir = shared_memory.guest_to_host(host_bwu.ir);
+	if (!ir) return false;
+
+	blocks.clear();
+
+	llvm::BasicBlock *block_entry = llvm::BasicBlock::Create(ctx, "", fn);
+	dispatcher->addCase(builder.getInt32(host_bwu.offset), block_entry);
+
+	builder.SetInsertPoint(block_entry);
+
+	// Leave the region if the engine has requested that chaining stops,
+	// e.g. because an interrupt is pending.
+	if (host_bwu.interrupt_check) {
+		llvm::BasicBlock *body = llvm::BasicBlock::Create(ctx, "", fn);
+
+		llvm::Value *exit_chain = state_field(JIT_STATE_EXIT_CHAIN, builder.getInt8Ty());
+		builder.CreateCondBr(builder.CreateICmpNE(exit_chain, builder.getInt8(0)), exit_block, body);
+
+		builder.SetInsertPoint(body);
+	}
+
+	IRBlockId current_block_id = INVALID_BLOCK_ID;
+	for (const IRInstruction& insn : PackedIR::range(ir, host_bwu.ir_size)) {
+		if (insn.ir_block == NOP_BLOCK) continue;
+
+		if (insn.ir_block != current_block_id) {
+			llvm::BasicBlock *next_block = get_block(insn.ir_block);
+
+			if (!builder.GetInsertBlock()->getTerminator()) {
+				builder.CreateBr(next_block);
+			}
+
+			builder.SetInsertPoint(next_block);
+			current_block_id = insn.ir_block;
+		} else if (builder.GetInsertBlock()->getTerminator()) {
+			// Instructions following a terminator in the same block are
+			// unreachable.
+			continue;
+		}
+
+		if (!lower_instruction(insn)) {
+			return false;
+		}
+	}
+
+	if (!builder.GetInsertBlock()->getTerminator()) {
+		builder.CreateBr(dispatch_block);
+	}
+
+	// Any blocks that were referenced but never populated are unreachable.
+	for (auto block : blocks) {
+		if (!block.second->getTerminator()) {
+			builder.SetInsertPoint(block.second);
+			builder.CreateBr(dispatch_block);
+		}
+	}
+
+	return true;
+}
+
+llvm::BasicBlock *RegionLowering::get_block(IRBlockId id)
+{
+	auto block = blocks.find(id);
+	if (block != blocks.end()) return block->second;
+
+	llvm::BasicBlock *new_block = llvm::BasicBlock::Create(ctx, "", fn);
+	blocks[id] = new_block;
+
+	return new_block;
+}
+
+llvm::Value *RegionLowering::state_field(uint32_t offset, llvm::Type *type)
+{
+	llvm::Value *ptr = builder.CreateGEP(builder.getInt8Ty(), jit_state, builder.getInt64(offset));
+	return builder.CreateLoad(type, builder.CreateBitCast(ptr, type->getPointerTo()));
+}
+
+llvm::Value *RegionLowering::register_pointer(llvm::Value *offset, llvm::Type *type)
+{
+	llvm::Value *ptr = builder.CreateGEP(builder.getInt8Ty(), registers, builder.CreateZExt(offset, builder.getInt64Ty()));
+	return builder.CreateBitCast(ptr, type->getPointerTo());
+}
+
+llvm::Value *RegionLowering::register_pointer(uint32_t offset, llvm::Type *type)
+{
+	return register_pointer(builder.getInt32(offset), type);
+}
+
+llvm::Value *RegionLowering::operand_storage(const IROperand& oper)
+{
+	// Storage is keyed on the allocation of the operand, rather than its
+	// virtual register number, as the engine's post-allocation passes may
+	// have merged virtual registers that share an allocation.
+	uint64_t key;
+	if (oper.is_allocated()) {
+		key = ((uint64_t)oper.alloc_mode << 32) | oper.alloc_data;
+	} else {
+		key = (1ULL << 48) | oper.value;
+	}
+
+	auto slot = storage.find(key);
+	if (slot != storage.end()) return slot->second;
+
+	llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+	llvm::Value *new_slot = entry_builder.CreateAlloca(builder.getInt64Ty());
+
+	storage[key] = new_slot;
+	return new_slot;
+}
+
+llvm::Value *RegionLowering::load_operand(const IROperand& oper)
+{
+	switch (oper.type) {
+	case IROperand::CONSTANT:
+		return llvm::ConstantInt::get(type_of(oper.size), oper.value);
+
+	case IROperand::VREG:
+	{
+		llvm::Value *value = builder.CreateLoad(builder.getInt64Ty(), operand_storage(oper));
+		if (oper.size < 8) {
+			value = builder.CreateTrunc(value, type_of(oper.size));
+		}
+
+		return value;
+	}
+
+	case IROperand::PC:
+		return builder.CreateLoad(builder.getInt32Ty(), register_pointer(rwu.reg_offsets.pc, builder.getInt32Ty()));
+
+	default:
+		return NULL;
+	}
+}
+
+void RegionLowering::store_operand(const IROperand& oper, llvm::Value *value)
+{
+	builder.CreateStore(zero_extend(value, builder.getInt64Ty()), operand_storage(oper));
+}
+
+llvm::Value *RegionLowering::zero_extend(llvm::Value *value, llvm::Type *type)
+{
+	if (value->getType() == type) return value;
+	return builder.CreateZExtOrTrunc(value, type);
+}
+
+bool RegionLowering::lower_instruction(const IRInstruction& insn)
+{
+	const IROperand& op0 = insn.operands[0];
+	const IROperand& op1 = insn.operands[1];
+	const IROperand& op2 = insn.operands[2];
+
+	switch (insn.type) {
+	case IRInstruction::NOP:
+	case IRInstruction::BARRIER:
+	case IRInstruction::VERIFY:
+		return true;
+
+	case IRInstruction::COUNT:
+	{
+		llvm::Value *counter = state_field(JIT_STATE_INSN_COUNTER, builder.getInt64Ty()->getPointerTo());
+		builder.CreateStore(builder.CreateAdd(builder.CreateLoad(builder.getInt64Ty(), counter), builder.getInt64(1)), counter);
+		return true;
+	}
+
+	case IRInstruction::MOV:
+	case IRInstruction::TRUNC:
+		store_operand(op1, builder.CreateTrunc(load_operand(op0), type_of(op1.size)));
+		return true;
+
+	case IRInstruction::ZX:
+		store_operand(op1, builder.CreateZExt(load_operand(op0), type_of(op1.size)));
+		return true;
+
+	case IRInstruction::SX:
+		store_operand(op1, builder.CreateSExt(load_operand(op0), type_of(op1.size)));
+		return true;
+
+	case IRInstruction::CMOV:
+	{
+		llvm::Value *cond = builder.CreateICmpNE(load_operand(op0), llvm::ConstantInt::get(type_of(op0.size), 0));
+		store_operand(op2, builder.CreateSelect(cond, load_operand(op1), load_operand(op2)));
+		return true;
+	}
+
+	case IRInstruction::LDPC:
+		store_operand(op0, load_operand(IROperand::pc(0)));
+		return true;
+
+	case IRInstruction::INCPC:
+	{
+		llvm::Value *pc_ptr = register_pointer(rwu.reg_offsets.pc, builder.getInt32Ty());
+		llvm::Value *amount = zero_extend(load_operand(op0), builder.getInt32Ty());
+		builder.CreateStore(builder.CreateAdd(builder.CreateLoad(builder.getInt32Ty(), pc_ptr), amount), pc_ptr);
+		return true;
+	}
+
+	case IRInstruction::ADD:
+	case IRInstruction::SUB:
+	case IRInstruction::MUL:
+	case IRInstruction::DIV:
+	case IRInstruction::MOD:
+	case IRInstruction::AND:
+	case IRInstruction::OR:
+	case IRInstruction::XOR:
+	{
+		llvm::Value *src = zero_extend(load_operand(op0), type_of(op1.size));
+		llvm::Value *dst = load_operand(op1);
+		llvm::Value *result;
+
+		switch (insn.type) {
+		case IRInstruction::ADD: result = builder.CreateAdd(dst, src); break;
+		case IRInstruction::SUB: result = builder.CreateSub(dst, src); break;
+		case IRInstruction::MUL: result = builder.CreateMul(dst, src); break;
+		case IRInstruction::DIV: result = builder.CreateUDiv(dst, src); break;
+		case IRInstruction::MOD: result = builder.CreateURem(dst, src); break;
+		case IRInstruction::AND: result = builder.CreateAnd(dst, src); break;
+		case IRInstruction::OR: result = builder.CreateOr(dst, src); break;
+		case IRInstruction::XOR: result = builder.CreateXor(dst, src); break;
+		default: return false;
+		}
+
+		store_operand(op1, result);
+		return true;
+	}
+
+	case IRInstruction::NOT:
+		store_operand(op0, builder.CreateNot(load_operand(op0)));
+		return true;
+
+	case IRInstruction::SHL:
+	case IRInstruction::SHR:
+	case IRInstruction::SAR:
+	{
+		// Shifts are performed at 64 bits, with the amount masked in the
+		// same way as the x86 shift instructions used by the block compiler.
+		llvm::Value *amount = builder.CreateAnd(zero_extend(load_operand(op0), builder.getInt64Ty()), builder.getInt64(op1.size == 8 ? 63 : 31));
+		llvm::Value *value = load_operand(op1);
+		llvm::Value *result;
+
+		switch (insn.type) {
+		case IRInstruction::SHL: result = builder.CreateShl(builder.CreateZExt(value, builder.getInt64Ty()), amount); break;
+		case IRInstruction::SHR: result = builder.CreateLShr(builder.CreateZExt(value, builder.getInt64Ty()), amount); break;
+		case IRInstruction::SAR: result = builder.CreateAShr(builder.CreateSExt(value, builder.getInt64Ty()), amount); break;
+		default: return false;
+		}
+
+		store_operand(op1, builder.CreateTrunc(result, type_of(op1.size)));
+		return true;
+	}
+
+	case IRInstruction::ROR:
+	{
+		llvm::Value *value = load_operand(op1);
+		llvm::Value *amount = zero_extend(load_operand(op0), value->getType());
+
+		llvm::Function *fshr = llvm::Intrinsic::getDeclaration(&module, llvm::Intrinsic::fshr, { value->getType() });
+		store_operand(op1, builder.CreateCall(fshr, { value, value, amount }));
+		return true;
+	}
+
+	case IRInstruction::CLZ:
+	{
+		llvm::Value *value = load_operand(op0);
+
+		llvm::Function *ctlz = llvm::Intrinsic::getDeclaration(&module, llvm::Intrinsic::ctlz, { value->getType() });
+		store_operand(op1, zero_extend(builder.CreateCall(ctlz, { value, builder.getFalse() }), type_of(op1.size)));
+		return true;
+	}
+
+	case IRInstruction::CMPEQ:
+	case IRInstruction::CMPNE:
+	case IRInstruction::CMPGT:
+	case IRInstruction::CMPGTE:
+	case IRInstruction::CMPLT:
+	case IRInstruction::CMPLTE:
+	{
+		llvm::Value *lhs = load_operand(op0);
+		llvm::Value *rhs = zero_extend(load_operand(op1), lhs->getType());
+		llvm::Value *result;
+
+		switch (insn.type) {
+		case IRInstruction::CMPEQ: result = builder.CreateICmpEQ(lhs, rhs); break;
+		case IRInstruction::CMPNE: result = builder.CreateICmpNE(lhs, rhs); break;
+		case IRInstruction::CMPGT: result = builder.CreateICmpUGT(lhs, rhs); break;
+		case IRInstruction::CMPGTE: result = builder.CreateICmpUGE(lhs, rhs); break;
+		case IRInstruction::CMPLT: result = builder.CreateICmpULT(lhs, rhs); break;
+		case IRInstruction::CMPLTE: result = builder.CreateICmpULE(lhs, rhs); break;
+		default: return false;
+		}
+
+		store_operand(op2, result);
+		return true;
+	}
+
+	case IRInstruction::READ_REG:
+		store_operand(op1, builder.CreateLoad(type_of(op1.size), register_pointer(load_operand(op0), type_of(op1.size))));
+		return true;
+
+	case IRInstruction::WRITE_REG:
+		builder.CreateStore(load_operand(op0), register_pointer(load_operand(op1), type_of(op0.size)));
+		return true;
+
+	case IRInstruction::READ_MEM:
+	{
+		llvm::Value *addr = builder.CreateAdd(builder.CreateZExt(load_operand(op0), builder.getInt64Ty()), builder.CreateSExt(load_operand(op1), builder.getInt64Ty()));
+		llvm::Value *ptr = builder.CreateIntToPtr(addr, type_of(op2.size)->getPointerTo());
+
+		store_operand(op2, builder.CreateLoad(type_of(op2.size), ptr, true));
+		return true;
+	}
+
+	case IRInstruction::WRITE_MEM:
+	{
+		llvm::Value *addr = builder.CreateAdd(builder.CreateZExt(load_operand(op2), builder.getInt64Ty()), builder.CreateSExt(load_operand(op1), builder.getInt64Ty()));
+		llvm::Value *ptr = builder.CreateIntToPtr(addr, type_of(op0.size)->getPointerTo());
+
+		builder.CreateStore(load_operand(op0), ptr, true);
+		return true;
+	}
+
+	case IRInstruction::READ_MEM_USER:
+	{
+		llvm::Value *addr = builder.CreateZExt(load_operand(op0), builder.getInt64Ty());
+		llvm::Value *ptr = builder.CreateIntToPtr(addr, type_of(op1.size)->getPointerTo(GS_ADDRESS_SPACE));
+
+		store_operand(op1, builder.CreateLoad(type_of(op1.size), ptr, true));
+		return true;
+	}
+
+	case IRInstruction::WRITE_MEM_USER:
+	{
+		llvm::Value *addr = builder.CreateZExt(load_operand(op1), builder.getInt64Ty());
+		llvm::Value *ptr = builder.CreateIntToPtr(addr, type_of(op0.size)->getPointerTo(GS_ADDRESS_SPACE));
+
+		builder.CreateStore(load_operand(op0), ptr, true);
+		return true;
+	}
+
+	case IRInstruction::ATOMIC_WRITE:
+	{
+		llvm::Value *addr = builder.CreateZExt(load_operand(op0), builder.getInt64Ty());
+		llvm::Value *ptr = builder.CreateIntToPtr(addr, type_of(op1.size)->getPointerTo());
+
+		store_operand(op1, builder.CreateAtomicRMW(llvm::AtomicRMWInst::Xchg, ptr, load_operand(op1), llvm::MaybeAlign(), llvm::AtomicOrdering::SequentiallyConsistent));
+		return true;
+	}
+
+	case IRInstruction::CALL:
+		return lower_call(insn);
+
+	case IRInstruction::WRITE_DEVICE:
+	{
+		if (!cpu_write_device) return false;
+
+		llvm::FunctionType *type = llvm::FunctionType::get(builder.getVoidTy(), { builder.getInt8PtrTy(), builder.getInt32Ty(), builder.getInt32Ty(), builder.getInt32Ty() }, false);
+		llvm::Value *callee = builder.CreateIntToPtr(builder.getInt64(cpu_write_device), type->getPointerTo());
+
+		builder.CreateCall(type, callee, {
+			state_field(JIT_STATE_CPU, builder.getInt8PtrTy()),
+			zero_extend(load_operand(op0), builder.getInt32Ty()),
+			zero_extend(load_operand(op1), builder.getInt32Ty()),
+			zero_extend(load_operand(op2), builder.getInt32Ty()) });
+		return true;
+	}
+
+	case IRInstruction::READ_DEVICE:
+	{
+		if (!cpu_read_device) return false;
+
+		llvm::Value *data;
+		{
+			llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+			data = entry_builder.CreateAlloca(builder.getInt32Ty());
+		}
+
+		llvm::FunctionType *type = llvm::FunctionType::get(builder.getVoidTy(), { builder.getInt8PtrTy(), builder.getInt32Ty(), builder.getInt32Ty(), builder.getInt32Ty()->getPointerTo() }, false);
+		llvm::Value *callee = builder.CreateIntToPtr(builder.getInt64(cpu_read_device), type->getPointerTo());
+
+		builder.CreateCall(type, callee, {
+			state_field(JIT_STATE_CPU, builder.getInt8PtrTy()),
+			zero_extend(load_operand(op0), builder.getInt32Ty()),
+			zero_extend(load_operand(op1), builder.getInt32Ty()),
+			data });
+
+		store_operand(op2, builder.CreateLoad(builder.getInt32Ty(), data));
+		return true;
+	}
+
+	case IRInstruction::SET_ZN_FLAGS:
+	{
+		llvm::Value *value = load_operand(op0);
+		llvm::Value *zero = llvm::ConstantInt::get(value->getType(), 0);
+
+		builder.CreateStore(builder.CreateZExt(builder.CreateICmpEQ(value, zero), builder.getInt8Ty()), register_pointer(rwu.reg_offsets.z, builder.getInt8Ty()));
+		builder.CreateStore(builder.CreateZExt(builder.CreateICmpSLT(value, zero), builder.getInt8Ty()), register_pointer(rwu.reg_offsets.n, builder.getInt8Ty()));
+		return true;
+	}
+
+	case IRInstruction::ADC:
+	case IRInstruction::ADC_WITH_FLAGS:
+	case IRInstruction::SBC:
+	case IRInstruction::SBC_WITH_FLAGS:
+	{
+		bool is_add = insn.type == IRInstruction::ADC || insn.type == IRInstruction::ADC_WITH_FLAGS;
+		bool with_flags = insn.type == IRInstruction::ADC_WITH_FLAGS || insn.type == IRInstruction::SBC_WITH_FLAGS;
+
+		llvm::IntegerType *type = type_of(op1.size);
+		llvm::IntegerType *wide_type = llvm::IntegerType::get(ctx, op1.size * 16);
+
+		llvm::Value *src = zero_extend(load_operand(op0), type);
+		llvm::Value *dst = load_operand(op1);
+		llvm::Value *carry = builder.CreateICmpNE(load_operand(op2), llvm::ConstantInt::get(type_of(op2.size), 0));
+
+		// For subtraction, the incoming carry flag is an inverted borrow.
+		llvm::Value *carry_in = builder.CreateZExt(is_add ? carry : builder.CreateNot(carry), wide_type);
+
+		llvm::Value *wide_result;
+		if (is_add) {
+			wide_result = builder.CreateAdd(builder.CreateAdd(builder.CreateZExt(dst, wide_type), builder.CreateZExt(src, wide_type)), carry_in);
+		} else {
+			wide_result = builder.CreateSub(builder.CreateSub(builder.CreateZExt(dst, wide_type), builder.CreateZExt(src, wide_type)), carry_in);
+		}
+
+		llvm::Value *result = builder.CreateTrunc(wide_result, type);
+		store_operand(op1, result);
+
+		if (with_flags) {
+			llvm::Value *carry_out = builder.CreateICmpNE(builder.CreateLShr(wide_result, op1.size * 8), llvm::ConstantInt::get(wide_type, 0));
+			if (!is_add) carry_out = builder.CreateNot(carry_out);
+
+			llvm::Value *overflow;
+			if (is_add) {
+				overflow = builder.CreateAnd(builder.CreateXor(dst, result), builder.CreateXor(src, result));
+			} else {
+				overflow = builder.CreateAnd(builder.CreateXor(dst, src), builder.CreateXor(dst, result));
+			}
+
+			lower_flags(result, carry_out, builder.CreateICmpSLT(overflow, llvm::ConstantInt::get(type, 0)));
+		}
+
+		return true;
+	}
+
+	case IRInstruction::JMP:
+		builder.CreateBr(get_block(op0.value));
+		return true;
+
+	case IRInstruction::BRANCH:
+	{
+		llvm::Value *cond = load_operand(op0);
+		cond = builder.CreateICmpNE(cond, llvm::ConstantInt::get(cond->getType(), 0));
+
+		builder.CreateCondBr(cond, get_block(op1.value), get_block(op2.value));
+		return true;
+	}
+
+	case IRInstruction::RET:
+	case IRInstruction::DISPATCH:
+		// The PC has already been updated by the block, so just go back to
+		// the dispatcher.
+		builder.CreateBr(dispatch_block);
+		return true;
+
+	default:
+		DEBUG << CONTEXT(RegionCompiler) << "Unsupported IR instruction " << (uint32_t)insn.type;
+		return false;
+	}
+}
+
+bool RegionLowering::lower_call(const IRInstruction& insn)
+{
+	std::vector<llvm::Type *> param_types;
+	std::vector<llvm::Value *> args;
+
+	param_types.push_back(builder.getInt8PtrTy());
+	args.push_back(state_field(JIT_STATE_CPU, builder.getInt8PtrTy()));
+
+	for (int i = 1; i < 6; i++) {
+		if (!insn.operands[i].is_valid()) break;
+
+		param_types.push_back(builder.getInt64Ty());
+		args.push_back(zero_extend(load_operand(insn.operands[i]), builder.getInt64Ty()));
+	}
+
+	llvm::FunctionType *type = llvm::FunctionType::get(builder.getVoidTy(), param_types, false);
+	llvm::Value *callee = builder.CreateIntToPtr(builder.getInt64(insn.operands[0].value), type->getPointerTo());
+
+	builder.CreateCall(type, callee, args);
+	return true;
+}
+
+void RegionLowering::lower_flags(llvm::Value *result, llvm::Value *carry, llvm::Value *overflow)
+{
+	llvm::Value *zero = llvm::ConstantInt::get(result->getType(), 0);
+
+	builder.CreateStore(builder.CreateZExt(carry, builder.getInt8Ty()), register_pointer(rwu.reg_offsets.c, builder.getInt8Ty()));
+	builder.CreateStore(builder.CreateZExt(overflow, builder.getInt8Ty()), register_pointer(rwu.reg_offsets.v, builder.getInt8Ty()));
+	builder.CreateStore(builder.CreateZExt(builder.CreateICmpEQ(result, zero), builder.getInt8Ty()), register_pointer(rwu.reg_offsets.z, builder.getInt8Ty()));
+	builder.CreateStore(builder.CreateZExt(builder.CreateICmpSLT(result, zero), builder.getInt8Ty()), register_pointer(rwu.reg_offsets.n, builder.getInt8Ty()));
+}
+
+RegionCompiler::RegionCompiler(engine::Engine& engine, hypervisor::SharedMemory& shared_memory)
+	: _engine(engine), _shared_memory(shared_memory), _cpu_read_device(0), _cpu_write_device(0)
+{
+
+}
+
+RegionCompiler::~RegionCompiler()
+{
+
+}
+
+bool RegionCompiler::init()
+{
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+
+	// Device accesses are lowered to calls into the engine, so look up the
+	// helper functions.  If they are not present, regions containing device
+	// accesses will simply not be compiled.
+	if (!_engine.lookup_symbol("cpu_read_device", _cpu_read_device)) {
+		DEBUG << CONTEXT(RegionCompiler) << "Engine does not export cpu_read_device";
+	}
+
+	if (!_engine.lookup_symbol("cpu_write_device", _cpu_write_device)) {
+		DEBUG << CONTEXT(RegionCompiler) << "Engine does not export cpu_write_device";
+	}
+
+	return true;
+}
+
+bool RegionCompiler::is_stale(const shared::RegionWorkUnit *rwu, const volatile uint32_t& latest_generation)
+{
+	return !rwu->valid || rwu->generation != latest_generation;
+}
+
+bool RegionCompiler::compile(shared::RegionWorkUnit *rwu, const volatile uint32_t& latest_generation)
+{
+	rwu->fn_ptr = NULL;
+
+	if (!_shared_memory.guest_to_host(rwu->blocks)) {
+		ERROR << CONTEXT(RegionCompiler) << "Invalid block list in work unit";
+		return false;
+	}
+
+	RegionWorkUnit host_rwu = *rwu;
+	host_rwu.blocks = _shared_memory.guest_to_host(rwu->blocks);
+
+	llvm::LLVMContext ctx;
+	std::unique_ptr<llvm::Module> module(new llvm::Module("region", ctx));
+
+	RegionLowering lowering(ctx, *module, host_rwu, _shared_memory, _cpu_read_device, _cpu_write_device);
+	llvm::Function *fn = lowering.lower();
+	if (!fn) {
+		return false;
+	}
+
+	if (is_stale(rwu, latest_generation)) {
+		return false;
+	}
+
+	if (llvm::verifyFunction(*fn, &llvm::errs())) {
+		ERROR << CONTEXT(RegionCompiler) << "Region " << std::hex << (rwu->region_index << 12) << " failed verification";
+		return false;
+	}
+
+	llvm::legacy::FunctionPassManager fpm(module.get());
+	fpm.add(llvm::createPromoteMemoryToRegisterPass());
+	fpm.add(llvm::createInstructionCombiningPass());
+	fpm.add(llvm::createReassociatePass());
+	fpm.add(llvm::createGVNPass());
+	fpm.add(llvm::createCFGSimplificationPass());
+
+	fpm.doInitialization();
+	fpm.run(*fn);
+	fpm.doFinalization();
+
+	if (is_stale(rwu, latest_generation)) {
+		return false;
+	}
+
+	SharedMemoryManager *memory_manager = new SharedMemoryManager(_shared_memory);
+
+	std::string error;
+	std::unique_ptr<llvm::ExecutionEngine> engine(llvm::EngineBuilder(std::move(module))
+		.setEngineKind(llvm::EngineKind::JIT)
+		.setErrorStr(&error)
+		.setOptLevel(llvm::CodeGenOpt::Aggressive)
+		.setCodeModel(llvm::CodeModel::Large)
+		.setRelocationModel(llvm::Reloc::Static)
+		.setMAttrs(std::vector<std::string> { "-sse", "-sse2", "-mmx" })
+		.setMCJITMemoryManager(std::unique_ptr<llvm::RTDyldMemoryManager>(memory_manager))
+		.create());
+
+	if (!engine) {
+		ERROR << CONTEXT(RegionCompiler) << "Unable to create execution engine: " << error;
+		return false;
+	}
+
+	engine->finalizeObject();
+
+	// Code generation is the most expensive phase, so check once more before
+	// handing over code that is already dead.
+	if (is_stale(rwu, latest_generation)) {
+		return false;
+	}
+
+	uint64_t fn_addr = engine->getFunctionAddress("region");
+
+	// The engine releases region functions by their address, so the
+	// function must be at the start of the allocation.
+	if (fn_addr == 0 || fn_addr != memory_manager->base()) {
+		ERROR << CONTEXT(RegionCompiler) << "Region function was not placed at the start of its allocation";
+		return false;
+	}
+
+	rwu->fn_ptr = (void *)memory_manager->release();
+	return true;
+}
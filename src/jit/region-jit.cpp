@@ -0,0 +1,135 @@
+#include <jit/region-jit.h>
+#include <hypervisor/shared-memory.h>
+#include <shared-jit.h>
+#include <captive.h>
+
+DECLARE_CONTEXT(RegionJIT);
+
+using namespace captive::jit;
+using namespace captive::shared;
+
+RegionJIT::RegionJIT(engine::Engine& engine, hypervisor::SharedMemory& shared_memory)
+	: _shared_memory(shared_memory),
+	_compiler(engine, shared_memory),
+	_worker_threads("region-jit-", 1, 2)
+{
+
+}
+
+RegionJIT::~RegionJIT()
+{
+	_worker_threads.stop();
+}
+
+bool RegionJIT::init()
+{
+	if (!_compiler.init())
+		return false;
+
+	_worker_threads.start();
+	return true;
+}
+
+void RegionJIT::compile_region_async(PerCPUData& cpu_data, uint64_t rwu_addr)
+{
+	RegionWorkUnit *rwu = (RegionWorkUnit *)_shared_memory.guest_to_host(rwu_addr);
+	if (!rwu) {
+		ERROR << CONTEXT(RegionJIT) << "Invalid region work unit " << std::hex << rwu_addr;
+		return;
+	}
+
+	std::unique_lock<std::mutex> l(_in_flight_lock);
+
+	in_flight_key_t key(&cpu_data, rwu->region_index);
+
+	auto in_flight = _in_flight.find(key);
+	if (in_flight != _in_flight.end()) {
+		RegionCompileWork *old_work = in_flight->second;
+
+		// Coalesce with work that has not been picked up yet: the queued
+		// entry compiles the new work unit instead, and the old one goes
+		// back to the engine untouched.
+		if (!old_work->started) {
+			uint64_t stale_rwu_addr = old_work->rwu_addr;
+
+			old_work->rwu_addr = rwu_addr;
+			old_work->latest_generation = rwu->generation;
+			l.unlock();
+
+			hand_back(cpu_data, stale_rwu_addr);
+			return;
+		}
+
+		// Otherwise, the running compilation will notice that it has been
+		// superseded at its next check.
+		old_work->latest_generation = rwu->generation;
+	}
+
+	RegionCompileWork *work = new RegionCompileWork();
+	work->owner = this;
+	work->cpu_data = &cpu_data;
+	work->rwu_addr = rwu_addr;
+	work->region_index = rwu->region_index;
+	work->latest_generation = rwu->generation;
+	work->started = false;
+
+	_in_flight[key] = work;
+	l.unlock();
+
+	_worker_threads.queue_work(compile_region_action, compile_region_complete, work);
+}
+
+uint64_t RegionJIT::compile_region_action(void *data)
+{
+	RegionCompileWork *work = (RegionCompileWork *)data;
+	RegionJIT *owner = work->owner;
+
+	{
+		std::unique_lock<std::mutex> l(owner->_in_flight_lock);
+		work->started = true;
+	}
+
+	RegionWorkUnit *rwu = (RegionWorkUnit *)owner->_shared_memory.guest_to_host(work->rwu_addr);
+
+	if (!owner->_compiler.compile(rwu, work->latest_generation)) {
+		DEBUG << CONTEXT(RegionJIT) << "Region " << std::hex << (rwu->region_index << 12) << " was not compiled";
+		rwu->fn_ptr = NULL;
+	}
+
+	return 1;
+}
+
+void RegionJIT::compile_region_complete(uint64_t result, void *data)
+{
+	RegionCompileWork *work = (RegionCompileWork *)data;
+	RegionJIT *owner = work->owner;
+
+	{
+		std::unique_lock<std::mutex> l(owner->_in_flight_lock);
+
+		auto in_flight = owner->_in_flight.find(in_flight_key_t(work->cpu_data, work->region_index));
+		if (in_flight != owner->_in_flight.end() && in_flight->second == work) {
+			owner->_in_flight.erase(in_flight);
+		}
+	}
+
+	owner->hand_back(*work->cpu_data, work->rwu_addr);
+	delete work;
+}
+
+void RegionJIT::hand_back(PerCPUData& cpu_data, uint64_t rwu_addr)
+{
+	RegionWorkUnit *rwu = (RegionWorkUnit *)_shared_memory.guest_to_host(rwu_addr);
+
+	// Hand the work unit back to the engine, which will pick it up the
+	// next time it checks for pending actions.  The engine owns the work
+	// unit, and frees it whether or not it was compiled.
+	lock::spinlock_acquire(&cpu_data.region_lock);
+	rwu->next = cpu_data.compiled_regions;
+	cpu_data.compiled_regions = (RegionWorkUnit *)rwu_addr;
+	lock::spinlock_release(&cpu_data.region_lock);
+
+	// Don't clobber an action the engine hasn't taken yet: it drains the
+	// compiled regions after handling any action, so one wakeup is enough.
+	__sync_bool_compare_and_swap(&cpu_data.async_action, 0, 5);
+}
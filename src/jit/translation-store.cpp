@@ -0,0 +1,261 @@
+#include <jit/translation-store.h>
+#include <hypervisor/shared-memory.h>
+#include <shared-jit.h>
+#include <captive.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+DECLARE_CONTEXT(TranslationStore);
+
+using namespace captive::jit;
+using namespace captive::shared;
+
+#define STORE_MAGIC				0x53545843		// 'CXTS'
+#define STORE_VERSION			3
+
+// No single block translation comes anywhere near this size, so a record
+// that claims to be larger is corrupt.
+#define MAX_RECORD_SIZE			0x100000
+
+static inline uint32_t record_key(const StoredTranslation *record)
+{
+	return record->offset | (record->isa << 16) | (record->mode << 24);
+}
+
+static bool read_fully(int fd, void *buffer, size_t size)
+{
+	uint8_t *ptr = (uint8_t *)buffer;
+
+	while (size) {
+		ssize_t rc = ::read(fd, ptr, size);
+		if (rc <= 0) return false;
+
+		ptr += rc;
+		size -= rc;
+	}
+
+	return true;
+}
+
+static bool write_fully(int fd, const void *buffer, size_t size)
+{
+	const uint8_t *ptr = (const uint8_t *)buffer;
+
+	while (size) {
+		ssize_t rc = ::write(fd, ptr, size);
+		if (rc <= 0) return false;
+
+		ptr += rc;
+		size -= rc;
+	}
+
+	return true;
+}
+
+TranslationStore::TranslationStore(hypervisor::SharedMemory& shared_memory, std::string filename, uint64_t engine_checksum)
+	: _shared_memory(shared_memory),
+	_filename(filename),
+	_engine_checksum(engine_checksum),
+	_record_count(0),
+	_dirty(false)
+{
+
+}
+
+TranslationStore::~TranslationStore()
+{
+
+}
+
+bool TranslationStore::load()
+{
+	int fd = ::open(_filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		DEBUG << CONTEXT(TranslationStore) << "No translations stored in " << _filename;
+		return true;
+	}
+
+	FileHeader header;
+	if (!read_fully(fd, &header, sizeof(header)) || header.magic != STORE_MAGIC || header.version != STORE_VERSION) {
+		::close(fd);
+
+		ERROR << CONTEXT(TranslationStore) << "Invalid translation store " << _filename;
+		return false;
+	}
+
+	if (header.engine_checksum != _engine_checksum) {
+		::close(fd);
+
+		DEBUG << CONTEXT(TranslationStore) << "Translations in " << _filename << " were made by a different engine, ignoring";
+		return true;
+	}
+
+	std::unique_lock<std::mutex> l(_lock);
+
+	uint8_t content[STORED_PAGE_SIZE];
+	std::vector<uint8_t> record;
+	for (uint64_t i = 0; i < header.page_count; i++) {
+		FilePageHeader page_header;
+		if (!read_fully(fd, &page_header, sizeof(page_header)) || !read_fully(fd, content, sizeof(content))) {
+			::close(fd);
+
+			ERROR << CONTEXT(TranslationStore) << "Truncated translation store " << _filename;
+			return false;
+		}
+
+		for (uint64_t j = 0; j < page_header.record_count; j++) {
+			StoredTranslation record_header;
+			if (!read_fully(fd, &record_header, sizeof(record_header)) || record_header.size < sizeof(record_header) || record_header.size > MAX_RECORD_SIZE || record_header.page_checksum != page_header.checksum) {
+				::close(fd);
+
+				ERROR << CONTEXT(TranslationStore) << "Truncated translation store " << _filename;
+				return false;
+			}
+
+			record.resize(record_header.size);
+			memcpy(record.data(), &record_header, sizeof(record_header));
+
+			if (!read_fully(fd, record.data() + sizeof(record_header), record_header.size - sizeof(record_header)) || !add_record(content, record.data(), record_header.size)) {
+				::close(fd);
+
+				ERROR << CONTEXT(TranslationStore) << "Truncated translation store " << _filename;
+				return false;
+			}
+		}
+	}
+
+	::close(fd);
+
+	_dirty = false;
+
+	DEBUG << CONTEXT(TranslationStore) << "Loaded " << std::dec << _record_count << " translations of " << _pages.size() << " pages from " << _filename;
+	return true;
+}
+
+bool TranslationStore::save()
+{
+	std::unique_lock<std::mutex> l(_lock);
+
+	if (!_dirty) return true;
+
+	// Write a new file, and replace the old one with it only once it is
+	// complete, so that an interrupted save never leaves a corrupt store.
+	std::string temp_filename = _filename + ".tmp";
+
+	int fd = ::open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ERROR << CONTEXT(TranslationStore) << "Unable to create " << temp_filename;
+		return false;
+	}
+
+	FileHeader header;
+	header.magic = STORE_MAGIC;
+	header.version = STORE_VERSION;
+	header.engine_checksum = _engine_checksum;
+	header.page_count = _pages.size();
+
+	bool ok = write_fully(fd, &header, sizeof(header));
+	for (const auto& page : _pages) {
+		FilePageHeader page_header;
+		page_header.checksum = page.first;
+		page_header.record_count = page.second.records.size();
+
+		ok = ok && write_fully(fd, &page_header, sizeof(page_header)) && write_fully(fd, page.second.content.data(), page.second.content.size());
+
+		for (const auto& record : page.second.records) {
+			if (!ok) break;
+			ok = write_fully(fd, record.second.data(), record.second.size());
+		}
+	}
+
+	if (::close(fd) || !ok || rename(temp_filename.c_str(), _filename.c_str())) {
+		unlink(temp_filename.c_str());
+
+		ERROR << CONTEXT(TranslationStore) << "Unable to write translation store " << _filename;
+		return false;
+	}
+
+	_dirty = false;
+
+	DEBUG << CONTEXT(TranslationStore) << "Saved " << std::dec << _record_count << " translations of " << _pages.size() << " pages to " << _filename;
+	return true;
+}
+
+void TranslationStore::store(uint64_t record_addr, uint64_t content_addr)
+{
+	const StoredTranslation *record = (const StoredTranslation *)_shared_memory.guest_to_host(record_addr);
+	if (!record || !_shared_memory.contains(record_addr + record->size - 1)) {
+		ERROR << CONTEXT(TranslationStore) << "Invalid translation record " << std::hex << record_addr;
+		return;
+	}
+
+	const uint8_t *content = (const uint8_t *)_shared_memory.guest_to_host(content_addr);
+	if (!content || !_shared_memory.contains(content_addr + STORED_PAGE_SIZE - 1)) {
+		ERROR << CONTEXT(TranslationStore) << "Invalid page content " << std::hex << content_addr;
+		return;
+	}
+
+	std::unique_lock<std::mutex> l(_lock);
+	add_record(content, (const uint8_t *)record, record->size);
+}
+
+uint64_t TranslationStore::lookup(uint64_t page_checksum)
+{
+	std::unique_lock<std::mutex> l(_lock);
+
+	auto page = _pages.find(page_checksum);
+	if (page == _pages.end()) return 0;
+
+	uint32_t size = sizeof(StoredPage);
+	for (const auto& record : page->second.records) {
+		size += record.second.size();
+	}
+
+	uint64_t page_addr = _shared_memory.allocate(size);
+	if (!page_addr) return 0;
+
+	StoredPage *stored_page = (StoredPage *)_shared_memory.guest_to_host(page_addr);
+	stored_page->record_count = page->second.records.size();
+	stored_page->size = size;
+	memcpy(stored_page->content, page->second.content.data(), STORED_PAGE_SIZE);
+
+	uint8_t *ptr = (uint8_t *)stored_page->first();
+	for (const auto& record : page->second.records) {
+		memcpy(ptr, record.second.data(), record.second.size());
+		ptr += record.second.size();
+	}
+
+	return page_addr;
+}
+
+bool TranslationStore::add_record(const uint8_t *content, const uint8_t *data, uint32_t size)
+{
+	const StoredTranslation *record = (const StoredTranslation *)data;
+	if (size < sizeof(*record) || record->size != size || StoredTranslation::record_size(record->code_size, record->relocation_count, record->ir_size) != size) {
+		return false;
+	}
+
+	// Only one page is kept for each checksum, so the records of another
+	// page that happens to share it are replaced.
+	Page& stored_page = _pages[record->page_checksum];
+	if (stored_page.content.size() != STORED_PAGE_SIZE || memcmp(stored_page.content.data(), content, STORED_PAGE_SIZE)) {
+		_record_count -= stored_page.records.size();
+		stored_page.records.clear();
+		stored_page.content.assign(content, content + STORED_PAGE_SIZE);
+	}
+
+	page_records_t& page = stored_page.records;
+
+	auto existing = page.find(record_key(record));
+	if (existing == page.end()) {
+		_record_count++;
+	}
+
+	page[record_key(record)] = std::vector<uint8_t>(data, data + size);
+	_dirty = true;
+
+	return true;
+}
@@ -42,7 +42,7 @@ int main(int argc, char **argv)
 	captive::logging::configure_logging_contexts();
 
 	if (argc < 5 || argc > 7) {
-		ERROR << "usage: " << argv[0] << " <engine lib> <zimage> <device tree> <root fs>";
+		ERROR << "usage: " << argv[0] << " <engine lib> <zimage> <device tree> <root fs> [translation store]";
 		return 1;
 	}
 
@@ -84,6 +84,11 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	// Translations are reused across runs if a store file is given.
+	if (argc > 5) {
+		guest->translation_store_file(argv[5]);
+	}
+
 	// Initialise the guest
 	if (!guest->init()) {
 		delete guest;
@@ -0,0 +1,631 @@
+/*
+ * File:   differential-test.cpp
+ *
+ * Runs randomly generated IR through the IR interpreter, and through code
+ * compiled from it both by the baseline compiler and by the optimising one,
+ * and checks that all three leave the same register file and guest memory.
+ * The IR is shaped like a frontend's: guest registers are read and written
+ * repeatedly, and values are copied into short-lived vregs before they are
+ * operated on, so that register value reuse and value merging have work to
+ * do.
+ *
+ * Usage: differential-test [first-seed [seed-count]]
+ *
+ * By default, seeds 1 to 50000 are run.  Some miscompilations only show up
+ * in a handful of programs, so a smaller range can easily miss them.
+ */
+
+#include "test.h"
+#include "host.h"
+
+#include <jit/block-compiler.h>
+#include <malloc/malloc.h>
+#include <ir-interpreter.h>
+
+using namespace captive::arch;
+using namespace captive::arch::jit;
+using namespace captive::shared;
+
+extern "C" uint32_t host_block_trampoline(void *registers, block_txln_fn fn);
+
+namespace {
+	// The register file of the guest.  ISA is always zero, as a translation
+	// leaves at once if it is not.
+	struct GuestRegisters
+	{
+		uint32_t r[16];
+		uint32_t pc;
+		uint8_t c, z, n, v, isa;
+		uint8_t pad[3];
+	};
+
+	GuestRegisters layout;
+
+	const CPU::TaggedRegisters tagged_regs = {
+		&layout,
+		&layout.pc, &layout.r[13],
+		&layout.r[14],
+		&layout.c, &layout.z, &layout.n, &layout.v, &layout.isa,
+	};
+
+#define REG_OFFSET_OF(_reg) ((uint32_t)((uint8_t *)&layout._reg - (uint8_t *)&layout))
+
+	// Compiled code addresses guest memory with 32-bit registers, so guest
+	// memory is mapped where guest and host addresses are the same.
+#define GUEST_MEMORY_BASE	0x10000000
+#define GUEST_MEMORY_SIZE	0x10000
+
+	uint8_t *guest_memory;
+	uint8_t initial_memory[GUEST_MEMORY_SIZE];
+	uint8_t expected_memory[GUEST_MEMORY_SIZE];
+
+	class Random
+	{
+	public:
+		Random(uint32_t seed) : state(((uint64_t)seed << 32) | 0x9e3779b9) { }
+
+		uint32_t next()
+		{
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			return (state * 0x2545f4914f6cdd1dULL) >> 32;
+		}
+
+		uint32_t below(uint32_t n) { return next() % n; }
+		bool chance(uint32_t percent) { return below(100) < percent; }
+
+	private:
+		uint64_t state;
+	};
+
+	/**
+	 * Generates a forward-branching region of IR.  The long-lived vregs are
+	 * defined at the start of block zero, which dominates every other block,
+	 * and every other vreg is defined and used in a single block, so nothing
+	 * is read before it is written.
+	 */
+	class ProgramGenerator
+	{
+	public:
+		static const uint32_t max_insns = 1024;
+		static const uint32_t max_vregs = 512;
+
+		IRInstruction *insns;
+		uint8_t vreg_sizes[max_vregs];
+		uint32_t count, vreg_count, block_count;
+
+		ProgramGenerator(uint32_t seed) : count(0), vreg_count(0), block_count(0), rand(seed), block(0), value_count(0)
+		{
+			insns = (IRInstruction *)captive::test::host_alloc.alloc(sizeof(IRInstruction) * max_insns);
+		}
+
+		~ProgramGenerator() { captive::test::host_alloc.free(insns); }
+
+		void generate()
+		{
+			block_count = 2 + rand.below(4);
+
+			for (uint32_t i = 0; i < long_count; i++) {
+				longs[i] = alloc(4);
+				emit(IRInstruction::ldreg(IROperand::const32(gpr_offset()), IROperand::vreg(longs[i], 4)));
+			}
+
+			for (block = 0; block < block_count; block++) {
+				value_count = 0;
+				for (uint32_t i = 0; i < long_count; i++) add_value(longs[i], 4);
+
+				uint32_t ops = 4 + rand.below(16);
+				while (ops-- && count < max_insns - 32 && vreg_count < max_vregs - 16) {
+					emit_operation();
+				}
+
+				emit_terminator();
+			}
+		}
+
+	private:
+		static const uint32_t long_count = 3;
+		static const uint32_t recent_count = 4;
+		static const uint32_t max_values = 128;
+
+		struct Value
+		{
+			IRRegId id;
+			uint8_t size;
+		};
+
+		Random rand;
+		IRBlockId block;
+		IRRegId longs[long_count];
+		Value values[max_values];
+		uint32_t value_count;
+
+		IRRegId alloc(uint8_t size)
+		{
+			vreg_sizes[vreg_count] = size;
+			return vreg_count++;
+		}
+
+		void emit(const IRInstruction& insn)
+		{
+			insns[count] = insn;
+			insns[count].ir_block = block;
+			count++;
+		}
+
+		void add_value(IRRegId id, uint8_t size)
+		{
+			if (value_count == max_values) return;
+
+			values[value_count].id = id;
+			values[value_count].size = size;
+			value_count++;
+		}
+
+		IROperand fresh(uint8_t size)
+		{
+			IRRegId id = alloc(size);
+			add_value(id, size);
+			return IROperand::vreg(id, size);
+		}
+
+		// Most accesses are to a few registers, so that values are reused.
+		uint32_t gpr_offset()
+		{
+			return REG_OFFSET_OF(r[rand.chance(75) ? rand.below(4) : rand.below(16)]);
+		}
+
+		uint32_t flag_offset()
+		{
+			static const uint32_t flags[] = { REG_OFFSET_OF(c), REG_OFFSET_OF(z), REG_OFFSET_OF(n), REG_OFFSET_OF(v) };
+			return flags[rand.below(4)];
+		}
+
+		// An offset to access a register with, that is sometimes only part of
+		// a guest register.
+		uint32_t access_offset(uint8_t size)
+		{
+			switch (size) {
+			case 1: return rand.chance(25) ? flag_offset() : gpr_offset() + rand.below(4);
+			case 2: return gpr_offset() + (rand.below(2) * 2);
+			default: return gpr_offset();
+			}
+		}
+
+		static IROperand constant(uint8_t size, uint32_t value)
+		{
+			switch (size) {
+			case 1: return IROperand::const8(value);
+			case 2: return IROperand::const16(value);
+			default: return IROperand::const32(value);
+			}
+		}
+
+		IROperand random_constant(uint8_t size)
+		{
+			static const uint32_t interesting[] = { 0, 1, 2, 0x7f, 0x80, 0xff, 0x7fff, 0x8000, 0xffff, 0x7fffffff, 0x80000000, 0xffffffff };
+			return constant(size, rand.chance(50) ? interesting[rand.below(ARRAY_SIZE(interesting))] : rand.next());
+		}
+
+		uint8_t random_size()
+		{
+			static const uint8_t sizes[] = { 4, 4, 4, 2, 1 };
+			return sizes[rand.below(ARRAY_SIZE(sizes))];
+		}
+
+		// Whether a value may be used.  Only the most recent temporaries are
+		// used, so that nothing is spilled: the lowering of most instructions
+		// needs its operands in registers.
+		bool usable(uint32_t i, uint8_t size)
+		{
+			return values[i].size == size && (i < long_count || i + recent_count >= value_count);
+		}
+
+		// A value of the given size, which is read from the register file if
+		// the block does not have one.
+		IROperand value(uint8_t size)
+		{
+			uint32_t candidates = 0;
+			for (uint32_t i = 0; i < value_count; i++) {
+				if (usable(i, size)) candidates++;
+			}
+
+			if (candidates == 0) return read_reg(size);
+
+			uint32_t pick = rand.below(candidates);
+			for (uint32_t i = 0; i < value_count; i++) {
+				if (usable(i, size) && pick-- == 0) return IROperand::vreg(values[i].id, size);
+			}
+
+			return IROperand::none();
+		}
+
+		IROperand value_or_constant(uint8_t size)
+		{
+			return rand.chance(30) ? random_constant(size) : value(size);
+		}
+
+		IROperand read_reg(uint8_t size)
+		{
+			IROperand dst = fresh(size);
+			emit(IRInstruction::ldreg(IROperand::const32(access_offset(size)), dst));
+			return dst;
+		}
+
+		IROperand copy(const IROperand& src)
+		{
+			IROperand dst = fresh(src.size);
+			emit(IRInstruction::mov(src, dst));
+			return dst;
+		}
+
+		// An address in guest memory, computed the way a frontend computes a
+		// scaled register offset.
+		IROperand address()
+		{
+			IROperand addr = copy(value(4));
+			emit(IRInstruction::bitwise_and(IROperand::const32(0x3ff), addr));
+			emit(IRInstruction::shl(IROperand::const8(rand.below(4)), addr));
+
+			if (rand.chance(50)) {
+				emit(IRInstruction::add(IROperand::const32(GUEST_MEMORY_BASE), addr));
+			} else {
+				// The base is not used for anything else, as constant_prop
+				// would propagate it into places that can't take a constant.
+				IROperand base = IROperand::vreg(alloc(4), 4);
+				emit(IRInstruction::mov(IROperand::const32(GUEST_MEMORY_BASE), base));
+				emit(IRInstruction::add(base, addr));
+			}
+
+			return addr;
+		}
+
+		IROperand compare(const IROperand& lh, const IROperand& rh)
+		{
+			IROperand dst = fresh(1);
+
+			switch (rand.below(6)) {
+			case 0: emit(IRInstruction::cmpeq(lh, rh, dst)); break;
+			case 1: emit(IRInstruction::cmpne(lh, rh, dst)); break;
+			case 2: emit(IRInstruction::cmplt(lh, rh, dst)); break;
+			case 3: emit(IRInstruction::cmplte(lh, rh, dst)); break;
+			case 4: emit(IRInstruction::cmpgt(lh, rh, dst)); break;
+			default: emit(IRInstruction::cmpgte(lh, rh, dst)); break;
+			}
+
+			return dst;
+		}
+
+		void emit_alu(const IROperand& src, const IROperand& dst)
+		{
+			switch (rand.below(5)) {
+			case 0: emit(IRInstruction::add(src, dst)); break;
+			case 1: emit(IRInstruction::sub(src, dst)); break;
+			case 2: emit(IRInstruction::bitwise_and(src, dst)); break;
+			case 3: emit(IRInstruction::bitwise_or(src, dst)); break;
+			default: emit(IRInstruction::bitwise_xor(src, dst)); break;
+			}
+		}
+
+		void emit_operation()
+		{
+			switch (rand.below(15)) {
+			case 0:
+			case 1:
+				read_reg(random_size());
+				break;
+
+			case 2:
+			case 3:
+			{
+				uint8_t size = random_size();
+				emit(IRInstruction::streg(value_or_constant(size), IROperand::const32(access_offset(size))));
+				break;
+			}
+
+			case 4:
+				copy(value(random_size()));
+				break;
+
+			case 5:
+			{
+				// Overwrite a vreg, which may be a copy of something that is
+				// still live.  Not with a constant, which constant_prop would
+				// propagate into places that can't take one.
+				uint8_t size = random_size();
+				IROperand dst = value(size);
+				emit(IRInstruction::mov(value(size), dst));
+				break;
+			}
+
+			case 6:
+			{
+				uint8_t size = random_size();
+				IROperand src = value_or_constant(size);
+				IROperand dst = copy(value(size));
+				emit_alu(src, dst);
+				break;
+			}
+
+			case 7:
+				// Operate on a long-lived vreg, which is then defined in more
+				// than one place.
+				emit_alu(value_or_constant(4), IROperand::vreg(longs[rand.below(long_count)], 4));
+				break;
+
+			case 8:
+			{
+				IROperand dst = copy(value(4));
+				IROperand amount = IROperand::const8(rand.below(32));
+
+				switch (rand.below(3)) {
+				case 0: emit(IRInstruction::shl(amount, dst)); break;
+				case 1: emit(IRInstruction::shr(amount, dst)); break;
+				default: emit(IRInstruction::sar(amount, dst)); break;
+				}
+				break;
+			}
+
+			case 9:
+			{
+				IROperand result = compare(value(4), value_or_constant(4));
+				if (rand.chance(50)) emit(IRInstruction::zx(result, fresh(4)));
+				break;
+			}
+
+			case 10:
+			{
+				IROperand src = value(rand.chance(50) ? 1 : 2);
+				IROperand dst = fresh(4);
+
+				if (rand.chance(50)) {
+					emit(IRInstruction::zx(src, dst));
+				} else {
+					emit(IRInstruction::sx(src, dst));
+				}
+				break;
+			}
+
+			case 11:
+				emit(IRInstruction::set_zn_flags(value(4)));
+				break;
+
+			case 12:
+			{
+				IROperand carry = fresh(1);
+				emit(IRInstruction::ldreg(IROperand::const32(REG_OFFSET_OF(c)), carry));
+
+				IROperand src = value_or_constant(4);
+				IROperand dst = copy(value(4));
+
+				if (rand.chance(50)) {
+					emit(IRInstruction::adc_with_flags(src, dst, carry));
+				} else {
+					emit(IRInstruction::sbc_with_flags(src, dst, carry));
+				}
+				break;
+			}
+
+			case 13:
+			{
+				IROperand addr = address();
+				IRInstruction load = IRInstruction::ldmem(addr, fresh(random_size()));
+				load.operands[1] = IROperand::const32(rand.below(0x100));
+				emit(load);
+
+				if (load.operands[2].size < 4 && rand.chance(50)) {
+					if (rand.chance(50)) {
+						emit(IRInstruction::zx(load.operands[2], fresh(4)));
+					} else {
+						emit(IRInstruction::sx(load.operands[2], fresh(4)));
+					}
+				}
+				break;
+			}
+
+			default:
+			{
+				IROperand addr = address();
+				IRInstruction store = IRInstruction::stmem(value(random_size()), addr);
+				store.operands[1] = IROperand::const32(rand.below(0x100));
+				emit(store);
+				break;
+			}
+			}
+		}
+
+		void emit_terminator()
+		{
+			uint32_t last = block_count - 1;
+
+			if (block == last) {
+				if (rand.chance(50)) emit(IRInstruction::incpc(IROperand::const32(4)));
+				emit(IRInstruction::ret());
+				return;
+			}
+
+			IRBlockId taken = block + 1 + rand.below(last - block);
+			IRBlockId not_taken = block + 1 + rand.below(last - block);
+
+			if (rand.chance(30)) {
+				emit(IRInstruction::jump(IROperand::block(taken)));
+			} else {
+				IROperand cond = compare(value(4), value_or_constant(4));
+				emit(IRInstruction::branch(cond, IROperand::block(taken), IROperand::block(not_taken)));
+			}
+		}
+	};
+
+	/**
+	 * Gives the interpreter the register file, and guest memory at the
+	 * addresses that compiled code uses.
+	 */
+	class ReferenceEnvironment
+	{
+	public:
+		ReferenceEnvironment(GuestRegisters& regs) : regs(regs) { }
+
+		uint8_t *registers() { return (uint8_t *)&regs; }
+		uint32_t read_pc() { return regs.pc; }
+		void inc_pc(uint32_t amount) { regs.pc += amount; }
+
+		void set_zn_flags(uint8_t z, uint8_t n) { regs.z = z; regs.n = n; }
+		void set_nzcv_flags(uint8_t n, uint8_t z, uint8_t c, uint8_t v) { regs.n = n; regs.z = z; regs.c = c; regs.v = v; }
+
+		uint64_t read_mem(uint32_t addr, uint8_t size)
+		{
+			switch (size) {
+			case 1: return *(uint8_t *)(uint64_t)addr;
+			case 2: return *(uint16_t *)(uint64_t)addr;
+			default: return *(uint32_t *)(uint64_t)addr;
+			}
+		}
+
+		void write_mem(uint32_t addr, uint8_t size, uint64_t value)
+		{
+			switch (size) {
+			case 1: *(uint8_t *)(uint64_t)addr = value; break;
+			case 2: *(uint16_t *)(uint64_t)addr = value; break;
+			default: *(uint32_t *)(uint64_t)addr = value; break;
+			}
+		}
+
+		uint64_t read_mem_user(uint32_t addr, uint8_t size) { unsupported("user memory access"); return 0; }
+		void write_mem_user(uint32_t addr, uint8_t size, uint64_t value) { unsupported("user memory access"); }
+		void atomic_write(uint32_t addr, uint8_t size, uint64_t value) { unsupported("atomic write"); }
+		uint32_t read_device(uint32_t dev, uint32_t reg) { unsupported("device access"); return 0; }
+		void write_device(uint32_t dev, uint32_t reg, uint32_t value) { unsupported("device access"); }
+		void call(uint64_t fn, const uint64_t *args, uint8_t arg_count) { unsupported("call"); }
+		void trace(uint8_t opcode, const uint64_t *args, uint8_t arg_count) { unsupported("trace"); }
+		void count_instruction() { unsupported("instruction count"); }
+		void flush() { unsupported("flush"); }
+		void flush_entry(uint32_t addr) { unsupported("flush"); }
+		void trap() { unsupported("trap"); }
+
+		uint32_t exit() { return 0; }
+
+	private:
+		GuestRegisters& regs;
+
+		static void unsupported(const char *what) { fatal("%s is not generated by the differential test\n", what); }
+	};
+
+	void interpret(const ProgramGenerator& program, GuestRegisters& regs)
+	{
+		typedef IRInterpreter<ReferenceEnvironment> Interpreter;
+
+		uint32_t size = Interpreter::program_size(program.insns, program.count, program.vreg_count, program.block_count);
+		if (!size) fatal("the interpreter can't run the generated IR\n");
+
+		void *buffer = captive::test::host_alloc.alloc(size);
+		InterpreterProgram *predecoded = Interpreter::predecode(buffer, program.insns, program.count, program.vreg_count, program.block_count);
+
+		ReferenceEnvironment env(regs);
+		Interpreter::execute(env, predecoded);
+
+		captive::test::host_alloc.free(buffer);
+	}
+
+	void report_differences(const char *name, uint32_t seed, const GuestRegisters& expected, const GuestRegisters& actual)
+	{
+		for (uint32_t i = 0; i < ARRAY_SIZE(expected.r); i++) {
+			if (expected.r[i] != actual.r[i]) printf("seed %u: %s: r%u is %08x, expected %08x\n", seed, name, i, actual.r[i], expected.r[i]);
+		}
+
+		if (expected.pc != actual.pc) printf("seed %u: %s: pc is %08x, expected %08x\n", seed, name, actual.pc, expected.pc);
+		if (expected.c != actual.c) printf("seed %u: %s: C is %u, expected %u\n", seed, name, actual.c, expected.c);
+		if (expected.z != actual.z) printf("seed %u: %s: Z is %u, expected %u\n", seed, name, actual.z, expected.z);
+		if (expected.n != actual.n) printf("seed %u: %s: N is %u, expected %u\n", seed, name, actual.n, expected.n);
+		if (expected.v != actual.v) printf("seed %u: %s: V is %u, expected %u\n", seed, name, actual.v, expected.v);
+
+		for (uint32_t i = 0; i < GUEST_MEMORY_SIZE; i++) {
+			if (expected_memory[i] != guest_memory[i]) {
+				printf("seed %u: %s: memory at %08x is %02x, expected %02x\n", seed, name, GUEST_MEMORY_BASE + i, guest_memory[i], expected_memory[i]);
+			}
+		}
+	}
+
+	bool check_translation(const char *name, bool baseline, uint32_t seed, const ProgramGenerator& program, const GuestRegisters& initial, const GuestRegisters& expected)
+	{
+		TranslationContext ctx(captive::test::host_alloc);
+
+		for (uint32_t i = 0; i < program.block_count; i++) ctx.alloc_block();
+		for (uint32_t i = 0; i < program.vreg_count; i++) ctx.alloc_reg(program.vreg_sizes[i]);
+		for (uint32_t i = 0; i < program.count; i++) ctx.add_instruction(program.insns[i].ir_block, program.insns[i]);
+
+		BlockCompiler compiler(ctx, 0, tagged_regs);
+
+		block_txln_fn fn;
+		if (!(baseline ? compiler.compile_baseline(fn) : compiler.compile(fn))) {
+			printf("seed %u: %s: unable to compile\n", seed, name);
+			return false;
+		}
+
+		GuestRegisters actual = initial;
+		memcpy(guest_memory, initial_memory, GUEST_MEMORY_SIZE);
+
+		host_block_trampoline(&actual, fn);
+		malloc::code_alloc.free((void *)fn);
+
+		if (memcmp(&actual, &expected, sizeof(actual)) || memcmp(guest_memory, expected_memory, GUEST_MEMORY_SIZE)) {
+			report_differences(name, seed, expected, actual);
+			return false;
+		}
+
+		return true;
+	}
+
+	uint32_t parse_number(const char *text)
+	{
+		uint32_t value = 0;
+		while (*text >= '0' && *text <= '9') value = (value * 10) + (*text++ - '0');
+
+		return value;
+	}
+
+	void run(uint32_t seed)
+	{
+		ProgramGenerator program(seed);
+		program.generate();
+
+		Random rand(~seed);
+
+		GuestRegisters initial;
+		for (uint32_t i = 0; i < ARRAY_SIZE(initial.r); i++) initial.r[i] = rand.next();
+		initial.pc = rand.next() & ~3;
+		initial.c = rand.below(2);
+		initial.z = rand.below(2);
+		initial.n = rand.below(2);
+		initial.v = rand.below(2);
+		initial.isa = 0;
+		memset(initial.pad, 0, sizeof(initial.pad));
+
+		for (uint32_t i = 0; i < GUEST_MEMORY_SIZE; i++) initial_memory[i] = rand.next();
+
+		GuestRegisters expected = initial;
+		memcpy(guest_memory, initial_memory, GUEST_MEMORY_SIZE);
+		interpret(program, expected);
+		memcpy(expected_memory, guest_memory, GUEST_MEMORY_SIZE);
+
+		CHECK(check_translation("baseline", true, seed, program, initial, expected));
+		CHECK(check_translation("optimised", false, seed, program, initial, expected));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	captive::test::init();
+
+	guest_memory = (uint8_t *)host_map(GUEST_MEMORY_BASE, GUEST_MEMORY_SIZE, 0);
+	if (!guest_memory) fatal("unable to map guest memory\n");
+
+	uint32_t first = argc > 1 ? parse_number(argv[1]) : 1;
+	uint32_t seeds = argc > 2 ? parse_number(argv[2]) : 50000;
+
+	for (uint32_t seed = first; seed < first + seeds; seed++) {
+		run(seed);
+	}
+
+	return captive::test::finish("differential-test");
+}
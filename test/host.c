@@ -0,0 +1,42 @@
+#include "host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+int host_vprintf(const char *fmt, va_list args)
+{
+	return vprintf(fmt, args);
+}
+
+void host_exit(int code)
+{
+	fflush(stdout);
+	exit(code);
+}
+
+void *host_malloc(unsigned long size)
+{
+	return malloc(size);
+}
+
+void *host_realloc(void *p, unsigned long size)
+{
+	return realloc(p, size);
+}
+
+void host_free(void *p)
+{
+	free(p);
+}
+
+void *host_map(unsigned long addr, unsigned long size, int exec)
+{
+	int prot = PROT_READ | PROT_WRITE | (exec ? PROT_EXEC : 0);
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | (addr ? MAP_FIXED_NOREPLACE : 0);
+
+	void *p = mmap((void *)addr, size, prot, flags, -1, 0);
+	if (p == MAP_FAILED || (addr && p != (void *)addr)) return NULL;
+
+	return p;
+}
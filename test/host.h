@@ -0,0 +1,33 @@
+/*
+ * File:   host.h
+ *
+ * The parts of the host C library that the hosted tests need.  The tests are
+ * built against the engine's own headers, which cannot be mixed with the
+ * host's, so these are wrapped by host.c and only use plain C types.
+ */
+
+#ifndef HOST_H
+#define	HOST_H
+
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int host_vprintf(const char *fmt, va_list args);
+void host_exit(int code) __attribute__((noreturn));
+
+void *host_malloc(unsigned long size);
+void *host_realloc(void *p, unsigned long size);
+void host_free(void *p);
+
+// Maps zeroed memory, at the given address if it is non-zero, and executable
+// if requested.  Returns NULL if the memory cannot be mapped.
+void *host_map(unsigned long addr, unsigned long size, int exec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* HOST_H */
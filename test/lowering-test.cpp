@@ -0,0 +1,282 @@
+/*
+ * File:   lowering-test.cpp
+ *
+ * Checks the code that each pattern of the pattern-matching lowerer emits,
+ * and that the device-access fault handler can decode the guest loads it
+ * produces.
+ */
+
+#include "test.h"
+
+#include <jit/block-compiler.h>
+#include <x86/decode.h>
+
+using namespace captive::arch;
+using namespace captive::arch::jit;
+using namespace captive::shared;
+
+namespace captive { namespace arch { namespace jit {
+	class BlockCompilerTest
+	{
+	public:
+		static uint32_t peeplower(BlockCompiler& compiler, uint32_t ir_idx) { return compiler.peeplower(ir_idx); }
+		static x86::X86Encoder& encoder(BlockCompiler& compiler) { return compiler.encoder; }
+	};
+} } }
+
+// The register numbers handed out by the allocator, in the order that the
+// block compiler assigns them to host registers.
+enum {
+	HOST_RAX,
+	HOST_RBX,
+	HOST_RDX,
+	HOST_RSI,
+	HOST_R8,
+	HOST_R9,
+	HOST_R10,
+	HOST_R11,
+	HOST_R13,
+};
+
+static IROperand reg(IRRegId id, uint8_t size, uint16_t host)
+{
+	IROperand oper = IROperand::vreg(id, size);
+	oper.allocate(IROperand::ALLOCATED_REG, host);
+	return oper;
+}
+
+static IRInstruction ldmem(const IROperand& offset, int32_t disp, const IROperand& dst)
+{
+	IRInstruction insn = IRInstruction::ldmem(offset, dst);
+	insn.operands[1] = IROperand::const32(disp);
+	return insn;
+}
+
+/**
+ * Lowers the given (already allocated) IR with the pattern-matching lowerer,
+ * and checks how many instructions were covered, and the bytes emitted.
+ */
+static void check_lowering(const char *name, const IRInstruction *insns, uint32_t count, uint32_t covered, const uint8_t *expected, uint32_t expected_size)
+{
+	TranslationContext ctx(captive::test::host_alloc);
+	ctx.current_block(ctx.alloc_block());
+
+	for (uint32_t i = 0; i < count; i++) {
+		ctx.add_instruction(insns[i]);
+	}
+
+	CPU::TaggedRegisters tagged_regs = { };
+	BlockCompiler compiler(ctx, 0, tagged_regs);
+
+	uint32_t lowered = BlockCompilerTest::peeplower(compiler, 0);
+	x86::X86Encoder& encoder = BlockCompilerTest::encoder(compiler);
+
+	bool match = lowered == covered && encoder.get_buffer_size() == expected_size;
+	for (uint32_t i = 0; match && i < expected_size; i++) {
+		match = encoder.get_buffer()[i] == expected[i];
+	}
+
+	if (!match) {
+		printf("%s: covered %u instruction(s), expected %u\n", name, lowered, covered);
+
+		printf("%s: emitted ", name);
+		for (uint32_t i = 0; i < encoder.get_buffer_size(); i++) printf("%02x ", encoder.get_buffer()[i]);
+		printf("\n%s: expected ", name);
+		for (uint32_t i = 0; i < expected_size; i++) printf("%02x ", expected[i]);
+		printf("\n");
+	}
+
+	CHECK(match);
+}
+
+#define CHECK_LOWERING(_name, _insns, _covered, ...) do { \
+	static const uint8_t expected[] = { __VA_ARGS__ }; \
+	check_lowering(_name, _insns, ARRAY_SIZE(_insns), _covered, expected, sizeof(expected)); \
+} while (0)
+
+#define CHECK_NOT_LOWERED(_name, _insns) check_lowering(_name, _insns, ARRAY_SIZE(_insns), 0, NULL, 0)
+
+static void test_mov_shl_add()
+{
+	IRInstruction insns[] = {
+		IRInstruction::mov(reg(1, 4, HOST_RBX), reg(2, 4, HOST_RAX)),
+		IRInstruction::shl(IROperand::const8(2), reg(2, 4, HOST_RAX)),
+		IRInstruction::add(reg(3, 4, HOST_RDX), reg(2, 4, HOST_RAX)),
+	};
+
+	// lea (%edx,%ebx,4),%eax
+	CHECK_LOWERING("mov-shl-add", insns, 3, 0x67, 0x8d, 0x04, 0x9a);
+}
+
+static void test_shl_add()
+{
+	IRInstruction insns[] = {
+		IRInstruction::shl(IROperand::const8(3), reg(1, 4, HOST_R8)),
+		IRInstruction::add(reg(2, 4, HOST_RSI), reg(1, 4, HOST_R8)),
+	};
+
+	// lea (%esi,%r8d,8),%r8d
+	CHECK_LOWERING("shl-add", insns, 2, 0x67, 0x46, 0x8d, 0x04, 0xc6);
+}
+
+static void test_mov_add()
+{
+	IRInstruction insns[] = {
+		IRInstruction::mov(reg(1, 4, HOST_RDX), reg(2, 4, HOST_RAX)),
+		IRInstruction::add(IROperand::const32(0x10), reg(2, 4, HOST_RAX)),
+	};
+
+	// lea 0x10(%edx),%eax
+	CHECK_LOWERING("mov-add", insns, 2, 0x67, 0x8d, 0x42, 0x10);
+}
+
+static void test_mov_shl_add_load()
+{
+	IRInstruction insns[] = {
+		IRInstruction::mov(reg(1, 4, HOST_RBX), reg(2, 4, HOST_RAX)),
+		IRInstruction::shl(IROperand::const8(2), reg(2, 4, HOST_RAX)),
+		IRInstruction::add(reg(3, 4, HOST_RDX), reg(2, 4, HOST_RAX)),
+		ldmem(reg(2, 4, HOST_RAX), 8, reg(4, 4, HOST_RAX)),
+	};
+
+	// mov 0x8(%edx,%ebx,4),%eax
+	CHECK_LOWERING("mov-shl-add-load", insns, 4, 0x67, 0x8b, 0x44, 0x9a, 0x08);
+}
+
+static void test_shl_add_load()
+{
+	IRInstruction insns[] = {
+		IRInstruction::shl(IROperand::const8(1), reg(1, 4, HOST_RAX)),
+		IRInstruction::add(reg(2, 4, HOST_R8), reg(1, 4, HOST_RAX)),
+		ldmem(reg(1, 4, HOST_RAX), 0, reg(3, 4, HOST_RAX)),
+	};
+
+	// mov (%r8d,%eax,2),%eax
+	CHECK_LOWERING("shl-add-load", insns, 3, 0x67, 0x41, 0x8b, 0x04, 0x40);
+}
+
+static void test_mov_add_load()
+{
+	IRInstruction insns[] = {
+		IRInstruction::mov(reg(1, 4, HOST_RSI), reg(2, 4, HOST_RAX)),
+		IRInstruction::add(IROperand::const32(0x100), reg(2, 4, HOST_RAX)),
+		ldmem(reg(2, 4, HOST_RAX), 4, reg(3, 1, HOST_RAX)),
+	};
+
+	// mov 0x104(%esi),%al
+	CHECK_LOWERING("mov-add-load", insns, 3, 0x67, 0x8a, 0x86, 0x04, 0x01, 0x00, 0x00);
+}
+
+static void test_load_zx()
+{
+	IRInstruction insns[] = {
+		ldmem(reg(1, 4, HOST_RDX), -4, reg(2, 1, HOST_RAX)),
+		IRInstruction::zx(reg(2, 1, HOST_RAX), reg(3, 4, HOST_RAX)),
+	};
+
+	// movzbl -0x4(%edx),%eax
+	CHECK_LOWERING("load-zx", insns, 2, 0x67, 0x0f, 0xb6, 0x42, 0xfc);
+}
+
+static void test_load_sx()
+{
+	IRInstruction insns[] = {
+		ldmem(reg(1, 4, HOST_R13), 0, reg(2, 2, HOST_RBX)),
+		IRInstruction::sx(reg(2, 2, HOST_RBX), reg(3, 4, HOST_RBX)),
+	};
+
+	// movswl 0x0(%r13d),%ebx
+	CHECK_LOWERING("load-sx", insns, 2, 0x67, 0x41, 0x0f, 0xbf, 0x5d, 0x00);
+}
+
+static void test_live_address_not_folded()
+{
+	// The address is still in %eax after the load, so only the address
+	// computation is folded.
+	IRInstruction insns[] = {
+		IRInstruction::mov(reg(1, 4, HOST_RBX), reg(2, 4, HOST_RAX)),
+		IRInstruction::shl(IROperand::const8(2), reg(2, 4, HOST_RAX)),
+		IRInstruction::add(reg(3, 4, HOST_RDX), reg(2, 4, HOST_RAX)),
+		ldmem(reg(2, 4, HOST_RAX), 0, reg(4, 4, HOST_RSI)),
+	};
+
+	// lea (%edx,%ebx,4),%eax
+	CHECK_LOWERING("live-address", insns, 3, 0x67, 0x8d, 0x04, 0x9a);
+}
+
+static void test_live_narrow_value_not_extended()
+{
+	// The loaded byte is still in %al after the extension.
+	IRInstruction insns[] = {
+		ldmem(reg(1, 4, HOST_RDX), 0, reg(2, 1, HOST_RAX)),
+		IRInstruction::zx(reg(2, 1, HOST_RAX), reg(3, 4, HOST_RBX)),
+	};
+
+	CHECK_NOT_LOWERED("live-narrow-value", insns);
+}
+
+static void check_decode(const char *name, const uint8_t *code, int type, uint8_t length, uint8_t data_size,
+	x86::Operand::reg_idx base, x86::Operand::reg_idx index, uint8_t scale, int32_t disp, x86::Operand::reg_idx dest)
+{
+	x86::MemoryInstruction inst;
+
+	if (!x86::decode_memory_instruction(code, inst)) {
+		printf("%s: unable to decode\n", name);
+		CHECK(false);
+		return;
+	}
+
+	CHECK((int)inst.type == type);
+	CHECK(inst.length == length);
+	CHECK(inst.data_size == data_size);
+	CHECK(inst.Source.type == x86::Operand::TYPE_MEMORY);
+	CHECK(inst.Source.mem.base_reg_idx == base);
+	CHECK(inst.Source.mem.index_reg_idx == index);
+	CHECK(inst.Source.mem.scale == scale);
+	CHECK(inst.Source.mem.displacement == disp);
+	CHECK(inst.Dest.type == x86::Operand::TYPE_REGISTER);
+	CHECK(inst.Dest.reg == dest);
+}
+
+/**
+ * The loads emitted above must be decodable by the device-access fault
+ * handler, including when their address-size prefix has been rewritten.
+ */
+static void test_decode_loads()
+{
+	static const uint8_t sib_disp8[] = { 0x67, 0x8b, 0x44, 0x9a, 0x08 };
+	static const uint8_t sib_hireg[] = { 0x67, 0x41, 0x8b, 0x04, 0x40 };
+	static const uint8_t disp32[] = { 0x67, 0x8a, 0x86, 0x04, 0x01, 0x00, 0x00 };
+	static const uint8_t movzx_rewritten[] = { 0xc4, 0x0f, 0xb6, 0x42, 0xfc };
+	static const uint8_t movsx_r13[] = { 0x67, 0x41, 0x0f, 0xbf, 0x5d, 0x00 };
+
+	check_decode("sib-disp8", sib_disp8, x86::MemoryInstruction::I_MOV, 5, 4,
+		x86::Operand::R_EDX, x86::Operand::R_EBX, 4, 8, x86::Operand::R_EAX);
+	check_decode("sib-hireg", sib_hireg, x86::MemoryInstruction::I_MOV, 5, 4,
+		x86::Operand::R_R8D, x86::Operand::R_EAX, 2, 0, x86::Operand::R_EAX);
+	check_decode("disp32", disp32, x86::MemoryInstruction::I_MOV, 7, 1,
+		x86::Operand::R_ESI, x86::Operand::R_Z, 0, 0x104, x86::Operand::R_AL);
+	check_decode("movzx", movzx_rewritten, x86::MemoryInstruction::I_MOVZX, 5, 1,
+		x86::Operand::R_EDX, x86::Operand::R_Z, 0, -4, x86::Operand::R_EAX);
+	check_decode("movsx", movsx_r13, x86::MemoryInstruction::I_MOVSX, 6, 2,
+		x86::Operand::R_R13D, x86::Operand::R_Z, 0, 0, x86::Operand::R_EBX);
+}
+
+int main()
+{
+	captive::test::init();
+
+	test_mov_shl_add();
+	test_shl_add();
+	test_mov_add();
+	test_mov_shl_add_load();
+	test_shl_add_load();
+	test_mov_add_load();
+	test_load_zx();
+	test_load_sx();
+	test_live_address_not_folded();
+	test_live_narrow_value_not_extended();
+	test_decode_loads();
+
+	return captive::test::finish("lowering-test");
+}
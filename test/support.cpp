@@ -0,0 +1,114 @@
+#include "test.h"
+#include "host.h"
+
+#include <malloc/malloc.h>
+
+using namespace captive::arch;
+
+extern "C" void cpu_set_mode(void *cpu, uint8_t mode)
+{
+	fatal("cpu_set_mode is not supported by the hosted tests\n");
+}
+
+extern "C" void cpu_write_device(void *cpu, uint32_t devid, uint32_t reg, uint32_t val)
+{
+	fatal("cpu_write_device is not supported by the hosted tests\n");
+}
+
+extern "C" void cpu_read_device(void *cpu, uint32_t devid, uint32_t reg, uint32_t& val)
+{
+	fatal("cpu_read_device is not supported by the hosted tests\n");
+}
+
+extern "C" void jit_trace(void *cpu, uint8_t opcode, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4)
+{
+	fatal("jit_trace is not supported by the hosted tests\n");
+}
+
+// The engine's heap, which backs malloc::data_alloc, is the host heap.
+extern "C" void *dlmalloc(size_t size)
+{
+	return host_malloc(size);
+}
+
+extern "C" void *dlrealloc(void *p, size_t size)
+{
+	return host_realloc(p, size);
+}
+
+extern "C" void dlfree(void *p)
+{
+	host_free(p);
+}
+
+int printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	int rc = host_vprintf(fmt, args);
+	va_end(args);
+
+	return rc;
+}
+
+int fatal(const char *fmt, ...)
+{
+	va_list args;
+
+	printf("fatal: ");
+
+	va_start(args, fmt);
+	host_vprintf(fmt, args);
+	va_end(args);
+
+	host_exit(2);
+}
+
+void __assertion_failure(const char *filename, int lineno, const char *expression)
+{
+	printf("assertion failed: %s:%d: %s\n", filename, lineno, expression);
+	host_exit(2);
+}
+
+namespace {
+	class HostAllocator : public malloc::Allocator
+	{
+	public:
+		void *alloc(size_t size) override { return host_malloc(size); }
+		void *realloc(void *p, size_t new_size) override { return host_realloc(p, new_size); }
+		void free(void *p) override { host_free(p); }
+	};
+
+	HostAllocator host_allocator;
+	uint32_t failures;
+}
+
+malloc::Allocator& captive::test::host_alloc = host_allocator;
+
+#define HOSTED_CODE_ARENA_SIZE	0x100000
+
+void captive::test::init()
+{
+	void *arena = host_map(0, HOSTED_CODE_ARENA_SIZE, 1);
+	if (!arena) fatal("unable to map the code arena\n");
+
+	malloc::code_alloc.init(arena, HOSTED_CODE_ARENA_SIZE);
+}
+
+void captive::test::fail(const char *file, int line, const char *expr)
+{
+	printf("%s:%d: check failed: %s\n", file, line, expr);
+	failures++;
+}
+
+int captive::test::finish(const char *name)
+{
+	if (failures) {
+		printf("%s: %u check(s) failed\n", name, failures);
+		return 1;
+	}
+
+	printf("%s: ok\n", name);
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * File:   test.h
+ *
+ * Support for the hosted tests, which build parts of the engine for the host
+ * and run them as ordinary programs.
+ */
+
+#ifndef TEST_H
+#define	TEST_H
+
+#include <define.h>
+#include <printf.h>
+#include <malloc/allocator.h>
+
+namespace captive {
+	namespace test {
+		// An allocator backed by the host heap.
+		extern arch::malloc::Allocator& host_alloc;
+
+		// Maps the code arena, which must be done before anything is compiled.
+		void init();
+
+		// Records a failed check, and reports it.
+		void fail(const char *file, int line, const char *expr);
+
+		// Prints a summary of the run, and returns the exit status of the test.
+		int finish(const char *name);
+	}
+}
+
+#define CHECK(_expr) do { if (!(_expr)) captive::test::fail(__FILE__, __LINE__, #_expr); } while (0)
+
+#endif	/* TEST_H */